@@ -0,0 +1,95 @@
+#pragma once
+#ifndef AABB_H_
+#define AABB_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <limits>
+
+//! Axis-aligned bounding box. A default constructed box is empty and grows with expand().
+template<typename T>
+class Aabb
+{
+public:
+    Aabb()
+        : minimum(std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity()),
+        maximum(-std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity())
+    {}
+    Aabb(const Point3<T>& a, const Point3<T>& b) : minimum(a), maximum(b) {}
+
+    bool empty() const { return minimum.x > maximum.x || minimum.y > maximum.y || minimum.z > maximum.z; }
+
+    void expand(const Point3<T>& p)
+    {
+        minimum.set(std::min(minimum.x, p.x), std::min(minimum.y, p.y), std::min(minimum.z, p.z));
+        maximum.set(std::max(maximum.x, p.x), std::max(maximum.y, p.y), std::max(maximum.z, p.z));
+    }
+
+    void expand(const Aabb& b)
+    {
+        minimum.set(std::min(minimum.x, b.minimum.x), std::min(minimum.y, b.minimum.y), std::min(minimum.z, b.minimum.z));
+        maximum.set(std::max(maximum.x, b.maximum.x), std::max(maximum.y, b.maximum.y), std::max(maximum.z, b.maximum.z));
+    }
+
+    Point3<T> center() const { return (minimum + maximum) * static_cast<T>(0.5); }
+    Vector3<T> extent() const { return maximum - minimum; }
+
+    T surface_area() const
+    {
+        if (empty()) return 0;
+        const Vector3<T> e = extent();
+        return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    int longest_axis() const
+    {
+        const Vector3<T> e = extent();
+        if (e.x >= e.y && e.x >= e.z) return 0;
+        return e.y >= e.z ? 1 : 2;
+    }
+
+    //! Slab test with the reciprocal direction precomputed by the caller.
+    bool hit(const Point3<T>& origin, const Vector3<T>& inv_direction, T t_min, T t_max) const
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            T t0 = (minimum[a] - origin[a]) * inv_direction[a];
+            T t1 = (maximum[a] - origin[a]) * inv_direction[a];
+            if (t0 > t1) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) return false;
+        }
+        return true;
+    }
+
+    //! Like hit, but narrows [t_min, t_max] to the part of the ray inside the box.
+    bool clip(const Point3<T>& origin, const Vector3<T>& inv_direction, T& t_min, T& t_max) const
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            T t0 = (minimum[a] - origin[a]) * inv_direction[a];
+            T t1 = (maximum[a] - origin[a]) * inv_direction[a];
+            if (t0 > t1) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) return false;
+        }
+        return true;
+    }
+
+    bool hit(const Ray<T>& r, T t_min, T t_max) const
+    {
+        const Vector3<T> d = r.direction();
+        return hit(r.origin(), Vector3<T>(1 / d.x, 1 / d.y, 1 / d.z), t_min, t_max);
+    }
+
+public:
+    Point3<T> minimum;
+    Point3<T> maximum;
+};
+
+#endif
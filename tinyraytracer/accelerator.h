@@ -0,0 +1,21 @@
+#pragma once
+#ifndef ACCELERATOR_H_
+#define ACCELERATOR_H_
+
+#include "hittable.h"
+
+#include <cstddef>
+
+//! A spatial index over a primitive set. The renderer only sees the Hittable, so the structures can
+//! be swapped for one another; see accelerator_factory.h for building one by name.
+template<typename T>
+class Accelerator : public Hittable<T>
+{
+public:
+    virtual const char* name() const = 0;
+
+    //! Bytes of the index itself, not counting the primitives it is built over.
+    virtual size_t memory_bytes() const = 0;
+};
+
+#endif
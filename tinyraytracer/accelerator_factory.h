@@ -0,0 +1,158 @@
+// this file holds building an acceleration structure by name, and picking one from the shape of
+// the scene when asked for "auto"
+
+#pragma once
+#ifndef ACCELERATOR_FACTORY_H_
+#define ACCELERATOR_FACTORY_H_
+
+#include "accelerator.h"
+#include "hittable_list.h"
+#include "sphere_set.h"
+#include "bvh.h"
+#include "bvh_builder.h"
+#include "wide_bvh.h"
+#include "grid.h"
+#include "kd_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class accelerator_kind { bvh, bvh4, grid, kd_tree, automatic };
+
+//! Accepts bvh, bvh4, grid, kdtree and auto.
+inline bool parse_accelerator_kind(const std::string& name, accelerator_kind& kind)
+{
+    if (name == "bvh") kind = accelerator_kind::bvh;
+    else if (name == "bvh4") kind = accelerator_kind::bvh4;
+    else if (name == "grid") kind = accelerator_kind::grid;
+    else if (name == "kdtree") kind = accelerator_kind::kd_tree;
+    else if (name == "auto") kind = accelerator_kind::automatic;
+    else return false;
+    return true;
+}
+
+//! What choose_accelerator looks at.
+struct scene_statistics
+{
+    size_t primitives = 0;
+    size_t oversized = 0;       // primitives a grid would keep aside, see Uniform_grid
+    double dispersion = 0;      // variance over mean of primitives per cell: 1 when spread at random, more when clustered
+};
+
+//! Drops the centers of the primitives, leaving the oversized ones out, into a grid of about two per
+//! cell and measures how unevenly they fill it.
+template<typename T, typename Primitives>
+scene_statistics gather_statistics(const Primitives& prims, T oversize_factor = 16)
+{
+    scene_statistics stats;
+    stats.primitives = prims.size();
+
+    std::vector<T> sizes;
+    const T limit = oversize_limit(prims, oversize_factor, sizes);
+    Aabb<T> box;
+    for (size_t k = 0; k < prims.size(); ++k)
+    {
+        if (sizes[k] > limit) ++stats.oversized;
+        else box.expand(prims.centroid(k));
+    }
+    const size_t gridded = stats.primitives - stats.oversized;
+    if (gridded < 2) return stats;
+
+    // Axes the centers do not spread along get one cell.
+    const Vector3<T> extent = box.extent();
+    int spread_axes = 0;
+    T spread_volume = 1;
+    for (int a = 0; a < 3; ++a)
+    {
+        if (extent[a] <= 0) continue;
+        ++spread_axes;
+        spread_volume *= extent[a];
+    }
+    if (spread_axes == 0) return stats;
+    const T cells_per_unit = std::pow(static_cast<T>(gridded) / 2 / spread_volume, T(1) / spread_axes);
+
+    int resolution[3];
+    for (int a = 0; a < 3; ++a)
+        resolution[a] = extent[a] > 0 ? std::min(std::max(static_cast<int>(std::ceil(extent[a] * cells_per_unit)), 1), 256) : 1;
+    std::vector<std::uint32_t> counts(static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2], 0);
+    for (size_t k = 0; k < prims.size(); ++k)
+    {
+        if (sizes[k] > limit) continue;
+        const Point3<T> c = prims.centroid(k);
+        size_t index = 0;
+        for (int a = 2; a >= 0; --a)
+        {
+            const int cell = extent[a] > 0 ? static_cast<int>((c[a] - box.minimum[a]) / extent[a] * resolution[a]) : 0;
+            index = index * resolution[a] + std::min(std::max(cell, 0), resolution[a] - 1);
+        }
+        ++counts[index];
+    }
+
+    const double mean = static_cast<double>(gridded) / counts.size();
+    double variance = 0;
+    for (std::uint32_t count : counts) variance += (count - mean) * (count - mean);
+    variance /= counts.size();
+    stats.dispersion = variance / mean;
+    return stats;
+}
+
+//! An even spread of primitives suits the grid, which walks straight to the cells a ray crosses. A
+//! clustered scene would leave a grid mostly empty cells around a few crowded ones, so it gets a BVH:
+//! the binary one while the scene is small, and the BVH4 once its smaller, wider nodes pay off, which
+//! was around 50000 spheres in --bvh-benchmark.
+inline accelerator_kind choose_accelerator(const scene_statistics& stats)
+{
+    if (stats.primitives >= 64 && stats.dispersion < 2) return accelerator_kind::grid;
+    return stats.primitives >= 50000 ? accelerator_kind::bvh4 : accelerator_kind::bvh;
+}
+
+inline const char* accelerator_name(accelerator_kind kind)
+{
+    switch (kind)
+    {
+    case accelerator_kind::bvh: return "bvh";
+    case accelerator_kind::bvh4: return "bvh4";
+    case accelerator_kind::grid: return "grid";
+    case accelerator_kind::kd_tree: return "kdtree";
+    default: return "auto";
+    }
+}
+
+template<typename T>
+std::unique_ptr<Accelerator<T>> make_accelerator(accelerator_kind kind, Sphere_set<T> spheres)
+{
+    if (kind == accelerator_kind::automatic) kind = choose_accelerator(gather_statistics<T>(spheres));
+
+    switch (kind)
+    {
+    case accelerator_kind::grid:
+        return std::unique_ptr<Accelerator<T>>(new Uniform_grid<T>(std::move(spheres)));
+    case accelerator_kind::kd_tree:
+        return std::unique_ptr<Accelerator<T>>(new Kd_tree<T>(std::move(spheres)));
+    case accelerator_kind::bvh4:
+    {
+        const Bvh<T> binary = Parallel_bvh_builder<T>().build(std::move(spheres));
+        return std::unique_ptr<Accelerator<T>>(new Wide_bvh<T>(binary));
+    }
+    default:
+        return std::unique_ptr<Accelerator<T>>(new Bvh<T>(Parallel_bvh_builder<T>().build(std::move(spheres))));
+    }
+}
+
+//! The spheres of a list under one accelerator, with the other objects beside it as they were.
+template<typename T>
+Hittable_list<T> accelerate(const Hittable_list<T>& list, accelerator_kind kind)
+{
+    Sphere_set<T> spheres;
+    Hittable_list<T> accelerated;
+    for_each_sphere(list,
+        [&](const Point3<T>& center, T radius, const shared_ptr<Material<T>>& m) { spheres.add(center, radius, m); },
+        [&](const shared_ptr<Hittable<T>>& object) { accelerated.add(object); });
+    if (spheres.size() > 0) accelerated.add(shared_ptr<Hittable<T>>(make_accelerator(kind, std::move(spheres))));
+    return accelerated;
+}
+
+#endif
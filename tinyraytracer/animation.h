@@ -0,0 +1,172 @@
+// this file holds the animation mode: a scene whose keyframed spheres move between frames with
+// the BVH refitted rather than rebuilt, and a frame loop that encodes one frame while rendering the next
+
+#pragma once
+#ifndef ANIMATION_H_
+#define ANIMATION_H_
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "bvh.h"
+#include "bvh_builder.h"
+#include "camera.h"
+#include "render_job.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+
+//! The spheres of a list, keyframed or not, in one Bvh that follows them through time. Other objects
+//! are kept in a list beside it and do not move.
+template<typename T>
+class Animated_scene : public Hittable<T>
+{
+public:
+    //! The tree is rebuilt once refitting has made its SAH cost rebuild_threshold times what it was
+    //! after the last build.
+    explicit Animated_scene(const Hittable_list<T>& world, T rebuild_threshold = T(1.3))
+        : rebuild_threshold(rebuild_threshold)
+    {
+        Sphere_set<T> spheres;
+        for (const auto& object : world.objects)
+        {
+            if (auto s = std::dynamic_pointer_cast<Sphere<T>>(object))
+            {
+                spheres.add(s->center, s->radius, s->mat_ptr, s->motion);
+            }
+            else if (auto set = std::dynamic_pointer_cast<Sphere_set<T>>(object))
+            {
+                for (size_t k = 0; k < set->size(); ++k)
+                    spheres.add(set->centroid(k), set->radii[k], set->materials[k], set->animated() ? set->tracks[k] : nullptr);
+            }
+            else
+            {
+                others.add(object);
+            }
+        }
+        rebuild(std::move(spheres));
+    }
+
+    //! Moves the keyframed spheres to where they are at time and updates the tree.
+    void set_time(T time)
+    {
+        Sphere_set<T>& spheres = bvh->primitives();
+        if (!spheres.animated()) return;
+
+        spheres.set_time(time);
+        bvh->refit();
+        ++refits;
+        if (bvh->sah_cost() > rebuild_threshold * built_cost) rebuild(std::move(spheres));
+    }
+
+    size_t refit_count() const { return refits; }
+    size_t rebuild_count() const { return rebuilds; }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        bool hit_anything = bvh->intersect(r, t_min, t_max, candidate);
+        if (others.intersect(r, t_min, hit_anything ? candidate.t : t_max, candidate)) hit_anything = true;
+        return hit_anything;
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        return bvh->occluded(r, t_min, t_max) || others.occluded(r, t_min, t_max);
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        bvh->memory_blocks(f);
+        others.memory_blocks(f);
+    }
+
+private:
+    void rebuild(Sphere_set<T> spheres)
+    {
+        bvh.reset(new Bvh<T>(builder.build(std::move(spheres))));
+        built_cost = bvh->sah_cost();
+        ++rebuilds;
+    }
+
+private:
+    T rebuild_threshold;
+    Parallel_bvh_builder<T> builder;
+    std::unique_ptr<Bvh<T>> bvh;
+    Hittable_list<T> others;
+    T built_cost = 0;
+    size_t refits = 0;
+    size_t rebuilds = 0;
+};
+
+struct animation_settings
+{
+    int frame_count = 500;
+    double start_time = 0;
+    double end_time = 1;
+};
+
+//! Wall clock time of an animation, split by what the frame loop was doing.
+struct animation_report
+{
+    int frames = 0;
+    double seconds = 0;
+    double update_seconds = 0;      // moving spheres, refits and rebuilds
+    double render_seconds = 0;
+    double encode_wait_seconds = 0; // waiting for the previous frame's encoding to finish
+    size_t refits = 0;
+    size_t rebuilds = 0;
+
+    double frames_per_minute() const { return seconds > 0 ? 60 * frames / seconds : 0; }
+};
+
+//! Renders frame_count frames at evenly spaced times. Each finished frame is handed to encode on a
+//! separate thread while the next one renders; encode(frame, image) may take as long as a render
+//! before it holds the loop up. The integrator must refer to scene.
+template<typename T>
+animation_report render_animation(Animated_scene<T>& scene, const typename Render_job<T>::integrator& radiance,
+    const std::function<Camera<T>(T)>& camera_at, const render_settings& settings, const animation_settings& animation,
+    const std::function<void(int, const Framebuffer<T>&)>& encode)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point t) { return std::chrono::duration<double>(clock::now() - t).count(); };
+
+    animation_report report;
+    const size_t refits_before = scene.refit_count(), rebuilds_before = scene.rebuild_count();
+    const clock::time_point start = clock::now();
+
+    std::future<void> encoding;
+    for (int frame = 0; frame < animation.frame_count; ++frame)
+    {
+        const T time = static_cast<T>(animation.frame_count > 1
+            ? animation.start_time + (animation.end_time - animation.start_time) * frame / (animation.frame_count - 1)
+            : animation.start_time);
+
+        clock::time_point phase = clock::now();
+        scene.set_time(time);
+        report.update_seconds += seconds_since(phase);
+
+        phase = clock::now();
+        auto job = Render_job<T>::start(radiance, camera_at(time), settings);
+        job->wait();
+        Framebuffer<T> image = job->snapshot();
+        report.render_seconds += seconds_since(phase);
+
+        phase = clock::now();
+        if (encoding.valid()) encoding.get();
+        report.encode_wait_seconds += seconds_since(phase);
+
+        encoding = std::async(std::launch::async, [&encode, frame](Framebuffer<T> image) { encode(frame, image); }, std::move(image));
+        ++report.frames;
+    }
+    if (encoding.valid()) encoding.get();
+
+    report.seconds = seconds_since(start);
+    report.refits = scene.refit_count() - refits_before;
+    report.rebuilds = scene.rebuild_count() - rebuilds_before;
+    return report;
+}
+
+#endif
@@ -0,0 +1,780 @@
+// this file holds the measurement modes main() can run instead of rendering an image
+
+#pragma once
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "ray_query.h"
+#include "sphere_set.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "bvh_builder.h"
+#include "accelerator_factory.h"
+#include "triangle_mesh.h"
+#include "mesh_io.h"
+#include "instance.h"
+#include "transform.h"
+#include "vector3_lanes.h"
+#include "camera.h"
+#include "integrator.h"
+#include "static_scene.h"
+#include "render_job.h"
+#include "concurrency.h"
+#include "tile_dependencies.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+template<typename F>
+double seconds_of(F&& f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//! Fires random rays from inside the scene's bounding region through the batched query API
+//! and reports closest-hit and occlusion throughput.
+inline void run_query_benchmark(const Hittable_list<double>& world, size_t ray_count, std::ostream& report)
+{
+    Ray_query_scene<double> scene(world);
+
+    std::vector<Point3D> origins(ray_count);
+    std::vector<Vector3D> directions(ray_count);
+    std::vector<double> t_min(ray_count, 0.0001), t_max(ray_count, INF_DOUBLE);
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        origins[k] = Point3D(random_generate(-12.0, 12.0), random_generate(0.0, 3.0), random_generate(-12.0, 12.0));
+        directions[k] = random_unit_vector<double>();
+    }
+    const ray_batch<double> rays{ origins.data(), directions.data(), t_min.data(), t_max.data(), ray_count };
+
+    std::vector<query_hit<double>> hits(ray_count);
+    std::unique_ptr<bool[]> occluded(new bool[ray_count]);
+
+    const double closest_seconds = seconds_of([&] { scene.closest_hit(rays, hits.data()); });
+    const double occluded_seconds = seconds_of([&] { scene.occluded(rays, occluded.get()); });
+
+    size_t hit_count = 0, occluded_count = 0;
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        hit_count += hits[k].primitive_id >= 0;
+        occluded_count += occluded[k];
+    }
+
+    report << "primitives: " << scene.primitive_count() << ", materials: " << scene.material_count() << '\n'
+        << "closest hit: " << ray_count / closest_seconds / 1e6 << " Mrays/s, " << hit_count << " hits\n"
+        << "occlusion:   " << ray_count / occluded_seconds / 1e6 << " Mrays/s, " << occluded_count << " occluded\n";
+}
+
+//! Builds every accelerator over the spheres of world and fires the same random rays from inside the
+//! scene's region through each. Reports build time, memory and closest-hit and occlusion throughput,
+//! how many rays disagree with the binary BVH, and which structure "auto" would pick.
+inline void run_accelerator_benchmark(const Hittable_list<double>& world, size_t ray_count, std::ostream& report)
+{
+    Sphere_set<double> spheres;
+    for_each_sphere(world,
+        [&](const Point3D& center, double radius, const shared_ptr<Material<double>>& m) { spheres.add(center, radius, m); },
+        [](const shared_ptr<Hittable<double>>&) {});
+
+    std::vector<Ray<double>> rays(ray_count);
+    std::vector<double> shadow_t_max(ray_count);
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        const Point3D origin(random_generate(-12.0, 12.0), random_generate(0.0, 3.0), random_generate(-12.0, 12.0));
+        rays[k] = Ray<double>(origin, random_unit_vector<double>());
+        shadow_t_max[k] = random_generate(0.0, 4.0);
+    }
+
+    const scene_statistics stats = gather_statistics<double>(spheres);
+    report << "spheres: " << stats.primitives << " (" << stats.oversized << " oversized), dispersion " << stats.dispersion
+        << ", auto picks " << accelerator_name(choose_accelerator(stats)) << ", rays: " << ray_count << '\n';
+
+    std::vector<double> reference_t;
+    std::vector<char> reference_occluded;
+    for (accelerator_kind kind : { accelerator_kind::bvh, accelerator_kind::bvh4, accelerator_kind::grid, accelerator_kind::kd_tree })
+    {
+        std::unique_ptr<Accelerator<double>> accel;
+        const double build_seconds = seconds_of([&] { accel = make_accelerator(kind, spheres); });
+
+        std::vector<double> t(ray_count);
+        std::vector<char> occluded(ray_count);
+        const double closest_seconds = seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                        {
+                            hit_candidate<double> candidate;
+                            t[k] = accel->intersect(rays[k], 0.0001, INF_DOUBLE, candidate) ? candidate.t : -1;
+                        }
+                    });
+            });
+        const double occluded_seconds = seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                            occluded[k] = accel->occluded(rays[k], 0.0001, shadow_t_max[k]);
+                    });
+            });
+
+        if (reference_t.empty())
+        {
+            reference_t = t;
+            reference_occluded = occluded;
+        }
+        size_t mismatches = 0;
+        for (size_t k = 0; k < ray_count; ++k)
+            if (occluded[k] != reference_occluded[k] || std::fabs(t[k] - reference_t[k]) > 1e-9 * (1 + std::fabs(t[k]))) ++mismatches;
+
+        report << accel->name() << ": build " << build_seconds << "s, " << accel->memory_bytes() / 1024.0 << " KiB ("
+            << static_cast<double>(accel->memory_bytes()) / std::max<size_t>(stats.primitives, 1) << " bytes/primitive), closest hit "
+            << ray_count / closest_seconds / 1e6 << " Mrays/s, occlusion " << ray_count / occluded_seconds / 1e6 << " Mrays/s, "
+            << mismatches << " mismatches\n";
+    }
+}
+
+//! Loads a mesh, builds the binary BVH and the BVH4 over it and fires random rays at it from around
+//! its bounds. Reports load and build times, memory per triangle and closest-hit and occlusion throughput.
+inline void run_mesh_benchmark(const std::string& path, size_t ray_count, std::ostream& report)
+{
+    Triangle_mesh<double> mesh;
+    const double load_seconds = seconds_of([&] { mesh = load_mesh<double>(path, make_shared<Lambertian<double>>(ColorD(0.5, 0.5, 0.5))); });
+    const size_t triangles = mesh.size();
+    report << path << ": " << triangles << " triangles, " << mesh.vertex_count() << " vertices, loaded in " << load_seconds << "s, "
+        << static_cast<double>(mesh.memory_bytes()) / std::max<size_t>(triangles, 1) << " bytes/triangle\n";
+    if (triangles == 0) return;
+
+    Parallel_bvh_builder<double, Triangle_mesh<double>> builder;
+    std::unique_ptr<Bvh<double, Triangle_mesh<double>>> binary;
+    std::unique_ptr<Wide_bvh<double, Triangle_mesh<double>>> wide;
+    const double binary_build = seconds_of([&] { binary.reset(new Bvh<double, Triangle_mesh<double>>(builder.build(std::move(mesh)))); });
+    const double wide_build = seconds_of([&] { wide.reset(new Wide_bvh<double, Triangle_mesh<double>>(*binary)); });
+
+    Aabb<double> box;
+    binary->bounding_box(box);
+    const Point3D middle = box.center();
+    const double radius = box.extent().norm();
+    std::vector<Ray<double>> rays(ray_count);
+    std::vector<double> shadow_t_max(ray_count);
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        const Point3D origin = middle + radius * random_unit_vector<double>();
+        const Point3D target(random_generate(box.minimum.x, box.maximum.x), random_generate(box.minimum.y, box.maximum.y),
+            random_generate(box.minimum.z, box.maximum.z));
+        rays[k] = Ray<double>(origin, (target - origin).normalized());
+        shadow_t_max[k] = random_generate(0.0, 2 * radius);
+    }
+
+    std::vector<double> reference_t;
+    auto trace = [&](const Accelerator<double>& accel, double build_seconds)
+    {
+        std::vector<double> t(ray_count);
+        const double closest_seconds = seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                        {
+                            hit_candidate<double> candidate;
+                            t[k] = accel.intersect(rays[k], 0.0001, INF_DOUBLE, candidate) ? candidate.t : -1;
+                        }
+                    });
+            });
+        size_t occluded = 0;
+        const double occluded_seconds = seconds_of([&]
+            {
+                occluded = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, ray_count, 256), size_t(0),
+                    [&](const tbb::blocked_range<size_t>& range, size_t count)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k) count += accel.occluded(rays[k], 0.0001, shadow_t_max[k]);
+                        return count;
+                    }, std::plus<size_t>());
+            });
+
+        if (reference_t.empty()) reference_t = t;
+        size_t hits = 0, mismatches = 0;
+        for (size_t k = 0; k < ray_count; ++k)
+        {
+            hits += t[k] >= 0;
+            if (std::fabs(t[k] - reference_t[k]) > 1e-9 * (1 + std::fabs(t[k]))) ++mismatches;
+        }
+        report << accel.name() << ": build " << build_seconds << "s, " << static_cast<double>(accel.memory_bytes()) / triangles
+            << " bytes/triangle, closest hit " << ray_count / closest_seconds / 1e6 << " Mrays/s (" << hits << " hits), occlusion "
+            << ray_count / occluded_seconds / 1e6 << " Mrays/s (" << occluded << " occluded), " << mismatches << " mismatches\n";
+    };
+    trace(*binary, binary_build);
+    trace(*wide, wide_build);
+}
+
+//! Builds the binary BVH on one thread and with the parallel builder, and the quantized BVH4, over
+//! sphere_count random spheres filling a cube. Reports build times, node memory per primitive, SAH
+//! cost and closest-hit and occlusion throughput of each.
+inline void run_bvh_benchmark(size_t sphere_count, size_t ray_count, std::ostream& report)
+{
+    // About one sphere per 8 units of volume, so rays cross many boxes before they hit.
+    const double half_side = std::cbrt(static_cast<double>(sphere_count)) + 1;
+    auto material = make_shared<Lambertian<double>>(ColorD(0.5, 0.5, 0.5));
+    Hittable_list<double> world;
+    world.objects.reserve(sphere_count);
+    for (size_t k = 0; k < sphere_count; ++k)
+    {
+        const Point3D center(random_generate(-half_side, half_side), random_generate(-half_side, half_side), random_generate(-half_side, half_side));
+        world.add(make_shared<Sphere<double>>(center, random_generate(0.1, 0.5), material));
+    }
+
+    std::vector<Ray<double>> rays(ray_count);
+    std::vector<double> shadow_t_max(ray_count);
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        const Point3D origin(random_generate(-half_side, half_side), random_generate(-half_side, half_side), random_generate(-half_side, half_side));
+        rays[k] = Ray<double>(origin, random_unit_vector<double>());
+        shadow_t_max[k] = random_generate(0.0, 4.0);
+    }
+
+    std::unique_ptr<Bvh<double>> binary, parallel;
+    std::unique_ptr<Wide_bvh<double>> wide;
+    const double binary_build = seconds_of([&]
+        {
+            Sphere_set<double> spheres;
+            for_each_sphere(world,
+                [&](const Point3D& center, double radius, const shared_ptr<Material<double>>& m) { spheres.add(center, radius, m); },
+                [](const shared_ptr<Hittable<double>>&) {});
+            binary.reset(new Bvh<double>(std::move(spheres)));
+        });
+    const double wide_build = seconds_of([&] { wide.reset(new Wide_bvh<double>(*binary)); });
+    Parallel_bvh_builder<double> builder;
+    parallel.reset(new Bvh<double>(builder.build(world)));
+    const bvh_build_stats& stats = builder.last_stats();
+
+    struct traced
+    {
+        std::vector<hit_candidate<double>> hits;
+        std::vector<char> hit, occluded;
+        double closest_seconds, occluded_seconds;
+    };
+    auto trace = [&](const Hittable<double>& accel)
+    {
+        traced result{ std::vector<hit_candidate<double>>(ray_count), std::vector<char>(ray_count), std::vector<char>(ray_count), 0, 0 };
+        result.closest_seconds = seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                            result.hit[k] = accel.intersect(rays[k], 0.0001, INF_DOUBLE, result.hits[k]);
+                    });
+            });
+        result.occluded_seconds = seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                            result.occluded[k] = accel.occluded(rays[k], 0.0001, shadow_t_max[k]);
+                    });
+            });
+        return result;
+    };
+    const traced binary_result = trace(*binary);
+    const traced wide_result = trace(*wide);
+    const traced parallel_result = trace(*parallel);
+
+    // Leaves made of different spheres may round a hit differently in the last bits.
+    auto mismatches = [&](const traced& a, const traced& b)
+    {
+        size_t count = 0;
+        for (size_t k = 0; k < ray_count; ++k)
+        {
+            if (a.hit[k] != b.hit[k] || a.occluded[k] != b.occluded[k] ||
+                (a.hit[k] && std::fabs(a.hits[k].t - b.hits[k].t) > 1e-9 * (1 + a.hits[k].t)))
+                ++count;
+        }
+        return count;
+    };
+
+    auto line = [&](const char* name, double build_seconds, size_t nodes, size_t bytes, const traced& result)
+    {
+        report << name << ": build " << build_seconds << "s, " << nodes << " nodes, "
+            << static_cast<double>(bytes) / sphere_count << " bytes/primitive, closest hit "
+            << ray_count / result.closest_seconds / 1e6 << " Mrays/s, occlusion " << ray_count / result.occluded_seconds / 1e6 << " Mrays/s\n";
+    };
+    report << "spheres: " << sphere_count << ", rays: " << ray_count << '\n';
+    line("binary BVH", binary_build, binary->node_count(), binary->memory_bytes(), binary_result);
+    line("BVH4 (8-bit)", wide_build, wide->node_count(), wide->memory_bytes(), wide_result);
+    line("parallel binary BVH", stats.total_seconds, parallel->node_count(), parallel->memory_bytes(), parallel_result);
+    report << "parallel build on " << stats.threads << " threads: gather " << stats.gather_seconds << "s, morton "
+        << stats.morton_seconds << "s, sort " << stats.sort_seconds << "s, LBVH " << stats.upper_seconds << "s ("
+        << stats.upper_nodes << " nodes), SAH subtrees " << stats.subtree_seconds << "s (" << stats.subtrees << ")\n"
+        << "SAH cost: binary " << binary->sah_cost() << ", parallel " << parallel->sah_cost() << '\n'
+        << "mismatched rays: BVH4 " << mismatches(binary_result, wide_result) << ", parallel " << mismatches(binary_result, parallel_result) << '\n';
+}
+
+//! Places copies of one cluster of spheres with random rotations and scales, once as instances of a
+//! shared BVH under a top-level BVH and once flattened into a single BVH over every copied sphere.
+//! Reports the memory, build time and closest-hit throughput of both, and how long rebuilding the
+//! top level takes after every instance has moved.
+inline void run_instancing_benchmark(size_t copies, size_t ray_count, std::ostream& report)
+{
+    const size_t cluster_size = 1000;
+    auto material = make_shared<Lambertian<double>>(ColorD(0.5, 0.5, 0.5));
+    Sphere_set<double> cluster;
+    while (cluster.size() < cluster_size)
+    {
+        const Point3D p(random_generate(-1.0, 1.0), random_generate(-1.0, 1.0), random_generate(-1.0, 1.0));
+        if (p.norm_squared() <= 1) cluster.add(p, random_generate(0.03, 0.08), material);
+    }
+
+    const int side = static_cast<int>(std::ceil(std::cbrt(static_cast<double>(copies))));
+    const double spacing = 3;
+    std::vector<Affine_transform<double>> placements(copies);
+    std::vector<double> scales(copies);
+    for (size_t k = 0; k < copies; ++k)
+    {
+        const Vector3D cell(static_cast<double>(k % side), static_cast<double>(k / side % side), static_cast<double>(k / side / side));
+        scales[k] = random_generate(0.5, 1.4);
+        placements[k] = Affine_transform<double>::translation(spacing * cell)
+            * Affine_transform<double>::rotation(random_unit_vector<double>(), random_generate(0.0, 360.0))
+            * Affine_transform<double>::scaling(scales[k]);
+    }
+
+    Parallel_bvh_builder<double> builder;
+    shared_ptr<Bvh<double>> shared_cluster;
+    Top_level_bvh<double> instanced;
+    const double bottom_seconds = seconds_of([&] { shared_cluster = make_shared<Bvh<double>>(builder.build(cluster)); });
+    for (size_t k = 0; k < copies; ++k) instanced.add(make_shared<Instance<double>>(shared_cluster, placements[k]));
+    const double top_seconds = seconds_of([&] { instanced.build(); });
+
+    std::unique_ptr<Bvh<double>> flat;
+    const double flat_seconds = seconds_of([&]
+        {
+            Sphere_set<double> spheres;
+            for (size_t k = 0; k < copies; ++k)
+                for (size_t j = 0; j < cluster.size(); ++j)
+                    spheres.add(placements[k].point(cluster.centroid(j)), cluster.radii[j] * scales[k], material);
+            flat.reset(new Bvh<double>(builder.build(std::move(spheres))));
+        });
+
+    const size_t unique_bytes = shared_cluster->memory_bytes() + shared_cluster->primitives().memory_bytes();
+    const size_t instanced_bytes = unique_bytes + instanced.memory_bytes();
+    const size_t flat_bytes = flat->memory_bytes() + flat->primitives().memory_bytes();
+
+    const double extent = spacing * side;
+    std::vector<Ray<double>> rays(ray_count);
+    for (size_t k = 0; k < ray_count; ++k)
+    {
+        const Point3D origin(random_generate(-1.0, extent), random_generate(-1.0, extent), random_generate(-1.0, extent));
+        rays[k] = Ray<double>(origin, random_unit_vector<double>());
+    }
+
+    std::vector<double> instanced_t(ray_count), flat_t(ray_count);
+    auto trace = [&](const Hittable<double>& world, std::vector<double>& t)
+    {
+        return seconds_of([&]
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, ray_count, 256), [&](const tbb::blocked_range<size_t>& range)
+                    {
+                        for (size_t k = range.begin(); k != range.end(); ++k)
+                        {
+                            hit_candidate<double> candidate;
+                            t[k] = world.intersect(rays[k], 0.0001, INF_DOUBLE, candidate) ? candidate.t : -1;
+                        }
+                    });
+            });
+    };
+    const double instanced_trace = trace(instanced, instanced_t);
+    const double flat_trace = trace(*flat, flat_t);
+
+    // The two sides round transformed spheres differently, so compare distances loosely.
+    size_t mismatches = 0;
+    for (size_t k = 0; k < ray_count; ++k)
+        if (std::fabs(instanced_t[k] - flat_t[k]) > 1e-6 * (1 + std::fabs(flat_t[k]))) ++mismatches;
+
+    for (size_t k = 0; k < copies; ++k)
+        instanced.instance(k).set_transform(Affine_transform<double>::rotation(Vector3D(0, 1, 0), 10) * placements[k]);
+    const double rebuild_seconds = seconds_of([&] { instanced.build(); });
+
+    report << copies << " copies of " << cluster_size << " spheres, " << ray_count << " rays\n"
+        << "instanced: " << instanced_bytes / 1048576.0 << " MiB (" << unique_bytes / 1048576.0 << " MiB shared), build bottom "
+        << bottom_seconds << "s + top " << top_seconds << "s, closest hit " << ray_count / instanced_trace / 1e6 << " Mrays/s\n"
+        << "flattened: " << flat_bytes / 1048576.0 << " MiB, build " << flat_seconds << "s, closest hit "
+        << ray_count / flat_trace / 1e6 << " Mrays/s\n"
+        << "top level rebuild after moving every instance: " << rebuild_seconds << "s\n"
+        << "mismatched rays: " << mismatches << '\n';
+}
+
+//! Traces samples camera rays through ray_color on one thread: against the scene's objects in a plain
+//! list, which spends its time in Sphere::intersect and the virtual calls around it, against the same
+//! spheres copied into a Static_sphere_scene, and against the structure the image would be rendered
+//! with. Reports the layout Vector3 has in this build with the sizes it gives Ray, Camera and Sphere,
+//! and camera samples per second; build once with and once without TRT_ALIGNED_VECTOR3 to compare
+//! the layouts.
+inline void run_ray_color_benchmark(const Hittable_list<double>& scene, const Hittable<double>& target, const Camera<double>& cam,
+    int max_depth, const background_fn<double>& background, size_t samples, std::ostream& report)
+{
+    report << "layout " << vector3_layout_name() << ": Vector3<float> " << sizeof(Vector3F) << " bytes (align " << alignof(Vector3F)
+        << "), Vector3<double> " << sizeof(Vector3D) << " bytes (align " << alignof(Vector3D) << "), Ray<double> "
+        << sizeof(Ray<double>) << ", Camera<double> " << sizeof(Camera<double>) << ", Sphere<double> " << sizeof(Sphere<double>) << '\n';
+
+    std::vector<double> s(samples), t(samples);
+    for (size_t k = 0; k < samples; ++k)
+    {
+        s[k] = random_generate<double>();
+        t[k] = random_generate<double>();
+    }
+
+    auto trace = [&](const char* name, const auto& world, size_t count) {
+        ColorD sum;
+        const double seconds = seconds_of([&] {
+            for (size_t k = 0; k < count; ++k) sum += ray_color(cam.get_ray(s[k], t[k]), world, max_depth, background);
+        });
+        report << name << ": " << count << " samples, " << count / seconds / 1e6 << " Msamples/s, mean radiance "
+            << sum.x / count << ' ' << sum.y / count << ' ' << sum.z / count << '\n';
+        return seconds;
+    };
+    // The lists test every object per ray, so they get a tenth of the samples.
+    const size_t list_samples = std::max<size_t>(samples / 10, 1);
+    const double dynamic_seconds = trace("sphere list", scene, list_samples);
+    try {
+        const Static_sphere_scene<double> fixed = make_static_scene(scene);
+        const double static_seconds = trace("static scene", fixed, list_samples);
+        report << "static scene speedup over the list: " << dynamic_seconds / static_seconds << "x\n";
+    }
+    catch (const std::runtime_error& e) {
+        report << e.what() << '\n';
+    }
+    trace("render target", target, samples);
+}
+
+//! Renders the same image with 1, 2, 4, ... threads up to the most the concurrency settings allow,
+//! on their CPUs and NUMA setting, and reports time, speedup over one thread and parallel efficiency.
+//! On a machine with several NUMA nodes the full thread count is also run the other way round,
+//! with and without per-node arenas, the scene interleaved over the nodes in the NUMA-aware runs.
+inline void run_scaling_benchmark(const Render_job<double>::integrator& radiance, const Hittable<double>& target,
+    const Camera<double>& cam, render_settings settings, const concurrency_settings& concurrency, std::ostream& report)
+{
+    const int max_threads = concurrency.threads > 0 ? concurrency.threads
+        : concurrency.cpus.empty() ? tbb::this_task_arena::max_concurrency() : static_cast<int>(concurrency.cpus.size());
+    const size_t nodes = numa_topology().size();
+    report << settings.image_width << "x" << settings.image_height << " at " << settings.samples_per_pixel << " spp, "
+        << nodes << " NUMA node" << (nodes > 1 ? "s" : "") << ", up to " << max_threads << " threads\n";
+
+    auto render = [&](const concurrency_settings& c) {
+        const Render_arenas arenas(c);
+        size_t scene_bytes = 0, interleaved = 0;
+        if (arenas.numa_aware())
+            target.memory_blocks([&](const void* data, size_t bytes) {
+                scene_bytes += bytes;
+                if (arenas.interleave(data, bytes)) interleaved += bytes;
+            });
+        settings.arenas = &arenas;
+        size_t placed = 0;
+        const double seconds = seconds_of([&] {
+            auto job = Render_job<double>::start(radiance, cam, settings);
+            job->wait();
+            placed = job->numa_placed_bytes();
+        });
+        arenas.describe(report);
+        if (arenas.numa_aware())
+            report << ", " << interleaved / (1024.0 * 1024.0) << " of " << scene_bytes / (1024.0 * 1024.0) << " MiB of scene interleaved, "
+                << placed / (1024.0 * 1024.0) << " MiB of framebuffer placed";
+        return seconds;
+    };
+
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2) counts.push_back(n);
+    counts.push_back(max_threads);
+
+    const double samples = static_cast<double>(settings.image_width) * settings.image_height * settings.samples_per_pixel;
+    double single = 0;
+    for (int n : counts)
+    {
+        concurrency_settings c = concurrency;
+        c.threads = n;
+        const double seconds = render(c);
+        if (n == 1) single = seconds;
+        report << ": " << seconds << "s, " << samples / seconds / 1e6 << " Msamples/s, speedup " << single / seconds
+            << "x, efficiency " << 100 * single / seconds / n << "%\n";
+    }
+    if (nodes > 1)
+    {
+        concurrency_settings c = concurrency;
+        c.threads = max_threads;
+        c.numa = !concurrency.numa;
+        const double seconds = render(c);
+        report << ": " << seconds << "s, speedup " << single / seconds << "x (NUMA-aware " << (c.numa ? "on" : "off") << ")\n";
+    }
+}
+
+//! Renders the spheres of the scene under a BVH with dependency tracking, then edits one sphere at a
+//! time, from one that covers a few tiles to the ground under everything, and renders again only the
+//! tiles each edit can change, each time starting from the image before the edit. The time per
+//! re-rendered pixel should stay close to the full render's, i.e. the time follows the edited area.
+inline void run_edit_benchmark(const Hittable_list<double>& scene, const Camera<double>& cam, render_settings settings,
+    const background_fn<double>& background, std::ostream& report)
+{
+    Sphere_set<double> set;
+    for_each_sphere(scene,
+        [&](const Point3<double>& center, double radius, const shared_ptr<Material<double>>& m) { set.add(center, radius, m); },
+        [](const shared_ptr<Hittable<double>>&) {});
+    Bvh<double> bvh = Parallel_bvh_builder<double>().build(std::move(set));
+    Sphere_set<double>& spheres = bvh.primitives();
+    const Tracked_hittable<double> tracked(bvh);
+    Tile_dependencies dependencies(settings.image_width, settings.image_height, settings.tile_size);
+    const int tile_count = dependencies.tile_count();
+    const double pixels = static_cast<double>(settings.image_width) * settings.image_height;
+    report << settings.image_width << "x" << settings.image_height << " at " << settings.samples_per_pixel << " spp, "
+        << spheres.size() << " spheres, " << tile_count << " tiles\n";
+
+    const double untracked = seconds_of([&] {
+        Render_job<double>::start([&](const Ray<double>& r, int depth) { return ray_color(r, bvh, depth, background); }, cam, settings)->wait();
+    });
+    const Render_job<double>::integrator radiance = [&](const Ray<double>& r, int depth) { return ray_color(r, tracked, depth, background); };
+    settings.dependencies = &dependencies;
+    Framebuffer<double> image;
+    const double full = seconds_of([&] {
+        auto job = Render_job<double>::start(radiance, cam, settings);
+        job->wait();
+        image = job->snapshot();
+    });
+    report << "Full render: " << full << "s, " << untracked << "s without tracking (" << std::showpos << 100 * (full / untracked - 1)
+        << std::noshowpos << "%), filters " << dependencies.memory_bytes() / 1024.0 << " KiB, " << 100 * dependencies.fill() << "% of bits set\n";
+
+    // The small spheres in view covering the fewest and the most tiles, a big diffuse one and the ground.
+    const size_t none = spheres.size();
+    size_t fewest = none, most = none, big = none, ground = none;
+    int fewest_tiles = tile_count + 1, most_tiles = 0;
+    for (size_t k = 0; k < spheres.size(); ++k)
+    {
+        if (spheres.radii[k] > 100) ground = k;
+        else if (spheres.radii[k] > 0.8 && std::dynamic_pointer_cast<Lambertian<double>>(spheres.materials[k])) big = k;
+        else if (spheres.radii[k] < 0.3)
+        {
+            double s, t;
+            if (!cam.project(spheres.centroid(k), s, t) || s < 0 || s > 1 || t < 0 || t > 1) continue;
+            std::vector<char> covered;
+            dependencies.mark_tiles_covering(cam, spheres.bounds(k), 0, covered);
+            const int n = static_cast<int>(std::count(covered.begin(), covered.end(), 1));
+            if (n < fewest_tiles) { fewest = k; fewest_tiles = n; }
+            if (n > most_tiles) { most = k; most_tiles = n; }
+        }
+    }
+
+    struct sphere_edit
+    {
+        const char* name;
+        size_t sphere;
+        Vector3<double> offset;
+        shared_ptr<Material<double>> material;
+    };
+    const std::vector<sphere_edit> edits = {
+        { "recolor a far small sphere", fewest, Vector3<double>(0, 0, 0), make_shared<Lambertian<double>>(Color<double>(0.9, 0.1, 0.1)) },
+        { "move a near small sphere", most, Vector3<double>(0, 0, 0.5), nullptr },
+        { "recolor a big sphere", big, Vector3<double>(0, 0, 0), make_shared<Lambertian<double>>(Color<double>(0.1, 0.5, 0.8)) },
+        { "recolor the ground", ground, Vector3<double>(0, 0, 0), make_shared<Lambertian<double>>(Color<double>(0.6, 0.5, 0.4)) },
+    };
+    for (const sphere_edit& edit : edits)
+    {
+        if (edit.sphere == none) continue;
+        const size_t k = edit.sphere;
+        std::vector<char> dirty;
+        dependencies.mark_tiles_seeing({ primitive_key(hit_candidate<double>{ 0, &spheres, k, nullptr }) }, dirty);
+        spheres.set(k, spheres.centroid(k) + edit.offset, spheres.radii[k], edit.material ? edit.material : spheres.materials[k]);
+        if (!edit.offset.is_similar(Vector3<double>::zero()))
+        {
+            bvh.refit();
+            dependencies.mark_tiles_covering(cam, spheres.bounds(k), 1, dirty);
+        }
+
+        double dirty_pixels = 0;
+        for (int tile = 0; tile < tile_count; ++tile)
+        {
+            if (!dirty[tile]) continue;
+            const int x = tile % dependencies.tiles_across() * settings.tile_size, y = tile / dependencies.tiles_across() * settings.tile_size;
+            dirty_pixels += (std::min(x + settings.tile_size, settings.image_width) - x) * (std::min(y + settings.tile_size, settings.image_height) - y);
+        }
+        const double seconds = seconds_of([&] {
+            auto job = Render_job<double>::rerender(radiance, cam, settings, std::move(image), dirty);
+            job->wait();
+            image = job->snapshot();
+        });
+        report << edit.name << ": " << std::count(dirty.begin(), dirty.end(), 1) << " of " << tile_count << " tiles, "
+            << 100 * dirty_pixels / pixels << "% of the pixels, " << seconds << "s, " << 100 * seconds / full
+            << "% of the full render, " << (dirty_pixels > 0 ? seconds / dirty_pixels / (full / pixels) : 0) << "x its time per pixel\n";
+    }
+}
+
+//! Vectors as three component arrays, the layout Vector3_lanes loads from.
+template<typename T>
+struct vector_columns
+{
+    explicit vector_columns(size_t n) : x(n), y(n), z(n) {}
+
+    std::vector<T> x, y, z;
+};
+
+// Where the lane benchmark puts a result: a vector fills all three columns, a value only x.
+template<typename T>
+inline void store_result(const Vector3<T>& v, vector_columns<T>& out, size_t k)
+{
+    out.x[k] = v.x;
+    out.y[k] = v.y;
+    out.z[k] = v.z;
+}
+
+template<typename T>
+inline void store_result(T s, vector_columns<T>& out, size_t k)
+{
+    out.x[k] = s;
+}
+
+template<typename P>
+inline void store_result(const Vector3_lanes<P>& v, vector_columns<typename P::value_type>& out, size_t k)
+{
+    v.store(out.x.data() + k, out.y.data() + k, out.z.data() + k);
+}
+
+template<typename P>
+inline void store_result(const P& s, vector_columns<typename P::value_type>& out, size_t k)
+{
+    s.store(out.x.data() + k);
+}
+
+//! Runs op on every pair of vectors of a and b, V::lanes pairs at a time.
+template<typename V, typename Op>
+inline void apply_lanes(const vector_columns<typename V::value_type>& a, const vector_columns<typename V::value_type>& b,
+    vector_columns<typename V::value_type>& out, Op op)
+{
+    for (size_t k = 0; k + V::lanes <= out.x.size(); k += V::lanes)
+        store_result(op(V::load(&a.x[k], &a.y[k], &a.z[k]), V::load(&b.x[k], &b.y[k], &b.z[k])), out, k);
+}
+
+#if defined(TRT_X86)
+template<typename V, typename Op>
+TRT_TARGET("sse4.2") TRT_FLATTEN
+void apply_lanes_sse42(const vector_columns<typename V::value_type>& a, const vector_columns<typename V::value_type>& b,
+    vector_columns<typename V::value_type>& out, Op op)
+{
+    apply_lanes<V>(a, b, out, op);
+}
+
+template<typename V, typename Op>
+TRT_TARGET("avx2,fma") TRT_FLATTEN
+void apply_lanes_avx2(const vector_columns<typename V::value_type>& a, const vector_columns<typename V::value_type>& b,
+    vector_columns<typename V::value_type>& out, Op op)
+{
+    apply_lanes<V>(a, b, out, op);
+}
+
+template<typename V, typename Op>
+TRT_TARGET("avx512f") TRT_FLATTEN
+void apply_lanes_avx512(const vector_columns<typename V::value_type>& a, const vector_columns<typename V::value_type>& b,
+    vector_columns<typename V::value_type>& out, Op op)
+{
+    apply_lanes<V>(a, b, out, op);
+}
+#endif
+
+//! Times op over count vector pairs with Vector<T, 3> stored one after another, then with every
+//! lane type the CPU runs, in nanoseconds per pair. The largest difference from the Vector<T, 3>
+//! results is reported with each; fused multiply-adds make them differ in the last bits.
+template<typename T, typename Op>
+void time_lanes_operation(const char* name, const std::vector<Vector3<T>>& a, const std::vector<Vector3<T>>& b, size_t passes,
+    std::ostream& report, Op op)
+{
+    const size_t count = a.size();
+    vector_columns<T> a_columns(count), b_columns(count), expected(count), out(count);
+    for (size_t k = 0; k < count; ++k)
+    {
+        store_result(a[k], a_columns, k);
+        store_result(b[k], b_columns, k);
+    }
+
+    const double scalar_seconds = seconds_of([&]
+        {
+            for (size_t pass = 0; pass < passes; ++pass)
+                for (size_t k = 0; k < count; ++k) store_result(op(a[k], b[k]), expected, k);
+        });
+    const double nanoseconds = 1e9 / (static_cast<double>(passes) * count);
+    report << std::setw(11) << std::left << name << std::right << std::setw(8) << scalar_seconds * nanoseconds;
+
+    auto column = [&](auto run)
+    {
+        const double seconds = seconds_of([&] { for (size_t pass = 0; pass < passes; ++pass) run(); });
+        T difference = 0;
+        for (size_t k = 0; k < count; ++k)
+        {
+            difference = std::max(difference, std::fabs(out.x[k] - expected.x[k]));
+            difference = std::max(difference, std::fabs(out.y[k] - expected.y[k]));
+            difference = std::max(difference, std::fabs(out.z[k] - expected.z[k]));
+        }
+        report << std::setw(8) << seconds * nanoseconds << " x" << std::setw(4) << std::left << scalar_seconds / seconds
+            << std::right << " (" << std::setw(7) << difference << ")";
+    };
+    column([&] { apply_lanes<Vector3_lanes<generic_lanes<T, 4>>>(a_columns, b_columns, out, op); });
+#if defined(TRT_X86)
+    if (active_isa() >= isa_level::sse42)
+        column([&] { apply_lanes_sse42<Vector3_lanes<typename native_lanes<T, isa_level::sse42>::type>>(a_columns, b_columns, out, op); });
+    if (active_isa() >= isa_level::avx2)
+        column([&] { apply_lanes_avx2<Vector3_lanes<typename native_lanes<T, isa_level::avx2>::type>>(a_columns, b_columns, out, op); });
+    if (active_isa() >= isa_level::avx512)
+        column([&] { apply_lanes_avx512<Vector3_lanes<typename native_lanes<T, isa_level::avx512>::type>>(a_columns, b_columns, out, op); });
+#endif
+    report << '\n';
+}
+
+//! Times each operation of Vector<T, 3> against the same code on Vector3_lanes at every level.
+template<typename T>
+void run_lanes_benchmark_for(const char* type_name, size_t count, std::ostream& report)
+{
+    count = std::max<size_t>((count + 15) / 16 * 16, 16);
+    std::vector<Vector3<T>> a(count), b(count);
+    for (size_t k = 0; k < count; ++k)
+    {
+        a[k] = random_unit_vector<T>() * random_generate<T>(1, 2);
+        b[k] = random_unit_vector<T>();
+    }
+    const size_t passes = std::max<size_t>(50000000 / count, 1);
+    const T eta = static_cast<T>(1 / 1.5);
+
+    report << type_name << ", " << count << " vectors, ns per vector, speedup and largest difference from Vector<T, 3>\n"
+        << std::setw(11) << std::left << "operation" << std::right << std::setw(8) << "scalar" << std::setw(25) << "generic x4";
+#if defined(TRT_X86)
+    const isa_level levels[3] = { isa_level::sse42, isa_level::avx2, isa_level::avx512 };
+    const size_t widths[3] = { native_lanes<T, isa_level::sse42>::type::lanes, native_lanes<T, isa_level::avx2>::type::lanes,
+        native_lanes<T, isa_level::avx512>::type::lanes };
+    for (int l = 0; l < 3; ++l)
+        if (active_isa() >= levels[l]) report << std::setw(25) << std::string(isa_name(levels[l])) + " x" + std::to_string(widths[l]);
+#endif
+    report << '\n' << std::setprecision(3);
+
+    time_lanes_operation<T>("add", a, b, passes, report, [](auto u, auto v) { return u + v; });
+    time_lanes_operation<T>("dot", a, b, passes, report, [](auto u, auto v) { return u.dot(v); });
+    time_lanes_operation<T>("cross", a, b, passes, report, [](auto u, auto v) { return u.cross(v); });
+    time_lanes_operation<T>("norm_sq", a, b, passes, report, [](auto u, auto) { return u.norm_squared(); });
+    time_lanes_operation<T>("normalized", a, b, passes, report, [](auto u, auto) { return u.normalized(); });
+    time_lanes_operation<T>("reflect", a, b, passes, report, [](auto u, auto v) { return u.reflect(v); });
+    time_lanes_operation<T>("refract", a, b, passes, report, [eta](auto u, auto v) { return u.refract(v, eta); });
+    time_lanes_operation<T>("select", a, b, passes, report, [](auto u, auto v) { return select(u.x < v.x, u, v); });
+    report << '\n';
+}
+
+inline void run_lanes_benchmark(size_t count, std::ostream& report)
+{
+    run_lanes_benchmark_for<float>("float", count, report);
+    run_lanes_benchmark_for<double>("double", count, report);
+}
+
+#endif
@@ -0,0 +1,341 @@
+#pragma once
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "hittable.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+//! A node of a flattened binary BVH in depth first order. An interior node's first child follows it
+//! directly and offset is its second child; a leaf holds the primitives [offset, offset + count).
+template<typename T>
+struct bvh_node
+{
+    Aabb<T> bounds;
+    std::uint32_t offset;
+    std::uint16_t count;    // 0 for interior nodes
+    std::uint8_t axis;      // split axis of an interior node
+};
+
+//! Depth from which Sah_builder stops splitting by cost and halves its ranges instead. Halving
+//! reaches a leaf within 32 more levels, item ranges being indexed by 32 bits, so no tree is deeper
+//! than bvh_max_depth and a traversal stack of bvh_stack_size entries never overflows.
+constexpr int bvh_sah_depth = 64;
+constexpr int bvh_max_depth = bvh_sah_depth + 32;
+constexpr int bvh_stack_size = bvh_max_depth + 1;
+
+//! A primitive as the builders see it.
+template<typename T>
+struct bvh_build_item
+{
+    Aabb<T> bounds;
+    Point3<T> centroid;
+    size_t index;       // into the primitive set before reordering
+};
+
+//! Top-down binned SAH build of the items [begin, end) into a flattened node array. Only that range
+//! of items is reordered, so disjoint ranges can be built by separate builders at the same time.
+//! Leaf offsets index the item array; the second child offsets index nodes.
+template<typename T>
+class Sah_builder
+{
+public:
+    static constexpr int bin_count = 16;
+
+    Sah_builder(std::vector<bvh_node<T>>& nodes, std::vector<bvh_build_item<T>>& items, int max_leaf_size)
+        : nodes(nodes), items(items), max_leaf_size(std::max(1, std::min(max_leaf_size, 16)))
+    {}
+
+    //! Appends the subtree over items [begin, end) and returns the index of its root, which sits
+    //! depth levels below the root of the whole tree.
+    std::uint32_t build(size_t begin, size_t end, int depth = 0)
+    {
+        const std::uint32_t index = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        Aabb<T> bounds, centroid_bounds;
+        for (size_t k = begin; k < end; ++k)
+        {
+            bounds.expand(items[k].bounds);
+            centroid_bounds.expand(items[k].centroid);
+        }
+        nodes[index].bounds = bounds;
+
+        const size_t count = end - begin;
+        const int axis = centroid_bounds.longest_axis();
+        const T axis_min = centroid_bounds.minimum[axis];
+        const T axis_extent = centroid_bounds.maximum[axis] - axis_min;
+
+        auto make_leaf = [&]
+        {
+            nodes[index].offset = static_cast<std::uint32_t>(begin);
+            nodes[index].count = static_cast<std::uint16_t>(count);
+            nodes[index].axis = 0;
+            return index;
+        };
+
+        if (count <= 1 || axis_extent <= 0 || depth >= bvh_sah_depth)
+        {
+            if (count <= static_cast<size_t>(max_leaf_size)) return make_leaf();
+            // All centroids coincide, or the tree is as deep as it may get by cost: halve the range.
+            return split(begin, begin + count / 2, end, axis, index, depth);
+        }
+
+        // Binned SAH over the centroid extent of the longest axis.
+        struct bin { Aabb<T> bounds; size_t count = 0; };
+        bin bins[bin_count];
+        const T to_bin = bin_count / axis_extent;
+        auto bin_of = [&](const bvh_build_item<T>& item)
+        {
+            const int b = static_cast<int>((item.centroid[axis] - axis_min) * to_bin);
+            return std::min(std::max(b, 0), bin_count - 1);
+        };
+        for (size_t k = begin; k < end; ++k)
+        {
+            bin& b = bins[bin_of(items[k])];
+            b.bounds.expand(items[k].bounds);
+            ++b.count;
+        }
+
+        // Sweep from the right for the area and count of everything after each bin, then from the
+        // left for the SAH cost of splitting after bin s (area times primitives on either side).
+        T right_area[bin_count];
+        size_t right_count[bin_count];
+        Aabb<T> accumulated;
+        size_t accumulated_count = 0;
+        for (int s = bin_count - 1; s > 0; --s)
+        {
+            accumulated.expand(bins[s].bounds);
+            accumulated_count += bins[s].count;
+            right_area[s] = accumulated.surface_area();
+            right_count[s] = accumulated_count;
+        }
+
+        int best_split = -1;
+        T best_cost = std::numeric_limits<T>::max();
+        accumulated = Aabb<T>();
+        accumulated_count = 0;
+        for (int s = 0; s < bin_count - 1; ++s)
+        {
+            accumulated.expand(bins[s].bounds);
+            accumulated_count += bins[s].count;
+            if (accumulated_count == 0 || right_count[s + 1] == 0) continue;
+            const T cost = accumulated.surface_area() * accumulated_count + right_area[s + 1] * right_count[s + 1];
+            if (cost < best_cost) { best_cost = cost; best_split = s; }
+        }
+
+        const T leaf_cost = bounds.surface_area() * count;
+        const T traversal_cost = bounds.surface_area();
+        if (count <= static_cast<size_t>(max_leaf_size) && (best_split < 0 || traversal_cost + best_cost >= leaf_cost))
+            return make_leaf();
+
+        size_t middle;
+        if (best_split >= 0)
+        {
+            auto first_right = std::partition(items.begin() + begin, items.begin() + end,
+                [&](const bvh_build_item<T>& item) { return bin_of(item) <= best_split; });
+            middle = static_cast<size_t>(first_right - items.begin());
+        }
+        else
+        {
+            middle = begin + count / 2;
+            std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+                [&](const bvh_build_item<T>& a, const bvh_build_item<T>& b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+        return split(begin, middle, end, axis, index, depth);
+    }
+
+private:
+    std::uint32_t split(size_t begin, size_t middle, size_t end, int axis, std::uint32_t index, int depth)
+    {
+        build(begin, middle, depth + 1);
+        const std::uint32_t second = build(middle, end, depth + 1);
+        nodes[index].offset = second;
+        nodes[index].count = 0;
+        nodes[index].axis = static_cast<std::uint8_t>(axis);
+        return index;
+    }
+
+private:
+    std::vector<bvh_node<T>>& nodes;
+    std::vector<bvh_build_item<T>>& items;
+    const int max_leaf_size;
+};
+
+//! Binary bounding volume hierarchy over a set of primitives, built with binned SAH.
+//! Primitives supplies size, bounds, centroid, intersect_range, occluded_range and permute,
+//! as Sphere_set does; it is reordered so that every leaf covers a contiguous range of it.
+template<typename T, typename Primitives = Sphere_set<T>>
+class Bvh : public Accelerator<T>
+{
+public:
+    explicit Bvh(Primitives primitives, int max_leaf_size = 4)
+        : prims(std::move(primitives))
+    {
+        const size_t n = prims.size();
+        if (n == 0) return;
+
+        std::vector<bvh_build_item<T>> items(n);
+        for (size_t k = 0; k < n; ++k)
+            items[k] = bvh_build_item<T>{ prims.bounds(k), prims.centroid(k), k };
+
+        nodes.reserve(2 * n / std::max(max_leaf_size, 1) + 1);
+        Sah_builder<T>(nodes, items, max_leaf_size).build(0, n);
+
+        std::vector<size_t> order(n);
+        for (size_t k = 0; k < n; ++k) order[k] = items[k].index;
+        prims.permute(order);
+    }
+
+    //! Adopts nodes made by another builder; primitives must already be in leaf order.
+    Bvh(Primitives primitives, std::vector<bvh_node<T>> nodes)
+        : prims(std::move(primitives)), nodes(std::move(nodes))
+    {}
+
+    const Primitives& primitives() const { return prims; }
+    const std::vector<bvh_node<T>>& node_array() const { return nodes; }
+
+    //! The primitives may be moved in place, as long as refit() follows before the next query.
+    Primitives& primitives() { return prims; }
+
+    //! Recomputes every box from the primitives' current bounds, keeping the tree as it was built.
+    //! Cheap, but the tree degrades as primitives drift away from where they were when it was built.
+    void refit()
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size(), 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                {
+                    bvh_node<T>& node = nodes[i];
+                    if (node.count == 0) continue;
+                    node.bounds = Aabb<T>();
+                    for (size_t k = node.offset; k < node.offset + node.count; ++k) node.bounds.expand(prims.bounds(k));
+                }
+            });
+        // Children come after their parent, so a backwards pass sees them refitted first.
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            bvh_node<T>& node = nodes[i];
+            if (node.count > 0) continue;
+            node.bounds = nodes[i + 1].bounds;
+            node.bounds.expand(nodes[node.offset].bounds);
+        }
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+    virtual const char* name() const override { return "binary BVH"; }
+    virtual size_t memory_bytes() const override { return nodes.size() * sizeof(bvh_node<T>); }
+
+    //! Expected cost of a random ray under the surface area heuristic, charging one unit per interior
+    //! node entered and one per primitive of a leaf. Lower is better for trees over the same primitives.
+    T sah_cost() const
+    {
+        if (nodes.empty()) return 0;
+        const T root_area = nodes[0].bounds.surface_area();
+        if (root_area <= 0) return static_cast<T>(nodes[0].count);
+        T cost = 0;
+        for (const bvh_node<T>& node : nodes)
+            cost += node.bounds.surface_area() / root_area * (node.count > 0 ? node.count : 1);
+        return cost;
+    }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        if (nodes.empty()) return false;
+
+        const Vector3<T> inv_dir(1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z);
+        const bool dir_is_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+        std::uint32_t stack[bvh_stack_size];
+        int top = 0;
+        std::uint32_t current = 0;
+        bool hit_anything = false;
+        while (true)
+        {
+            const bvh_node<T>& node = nodes[current];
+            if (node.bounds.hit(r.orig, inv_dir, t_min, t_max))
+            {
+                if (node.count > 0)
+                {
+                    if (prims.intersect_range(node.offset, node.count, r, t_min, t_max, candidate))
+                    {
+                        hit_anything = true;
+                        t_max = candidate.t;
+                    }
+                    if (top == 0) break;
+                    current = stack[--top];
+                }
+                else if (dir_is_neg[node.axis])
+                {
+                    stack[top++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[top++] = node.offset;
+                    current = current + 1;
+                }
+            }
+            else
+            {
+                if (top == 0) break;
+                current = stack[--top];
+            }
+        }
+        return hit_anything;
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        if (nodes.empty()) return false;
+        box = nodes[0].bounds;
+        return true;
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        f(nodes.data(), nodes.size() * sizeof(bvh_node<T>));
+        prims.memory_blocks(f);
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        if (nodes.empty()) return false;
+
+        const Vector3<T> inv_dir(1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z);
+
+        std::uint32_t stack[bvh_stack_size];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const std::uint32_t current = stack[--top];
+            const bvh_node<T>& node = nodes[current];
+            if (!node.bounds.hit(r.orig, inv_dir, t_min, t_max)) continue;
+
+            if (node.count > 0)
+            {
+                if (prims.occluded_range(node.offset, node.count, r, t_min, t_max)) return true;
+            }
+            else
+            {
+                stack[top++] = node.offset;
+                stack[top++] = current + 1;
+            }
+        }
+        return false;
+    }
+
+private:
+    Primitives prims;
+    std::vector<bvh_node<T>> nodes;
+};
+
+#endif
@@ -0,0 +1,364 @@
+// this file holds the parallel BVH build: Morton codes and a parallel radix sort put the primitives
+// in order along a space filling curve, LBVH splits the top of the tree on the code bits, and the
+// subtrees below are built with binned SAH, all of them at once
+
+#pragma once
+#ifndef BVH_BUILDER_H_
+#define BVH_BUILDER_H_
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_arena.h>
+
+//! Where the time of one parallel build went, in seconds, and the shape of its upper levels.
+struct bvh_build_stats
+{
+    int threads = 0;
+    double gather_seconds = 0;      // collecting the primitives and their bounds
+    double morton_seconds = 0;
+    double sort_seconds = 0;        // radix sort and reordering the primitives to match
+    double upper_seconds = 0;       // LBVH levels
+    double subtree_seconds = 0;     // SAH subtrees, stitched into one node array
+    double total_seconds = 0;
+    size_t upper_nodes = 0;
+    size_t subtrees = 0;
+};
+
+//! Spreads the low 21 bits of v apart, leaving two zero bits between neighbours.
+inline std::uint64_t expand_bits_21(std::uint64_t v)
+{
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8) & 0x100F00F00F00F00Full;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+//! 63 bit Morton code of a point on a 2^21 grid per axis; bit 3i + 2 comes from x, 3i + 1 from y, 3i from z.
+inline std::uint64_t morton_code(std::uint64_t x, std::uint64_t y, std::uint64_t z)
+{
+    return expand_bits_21(x) << 2 | expand_bits_21(y) << 1 | expand_bits_21(z);
+}
+
+//! Stable LSD radix sort of keys, carrying values along, eight bits per pass over the low key_bits.
+//! Each pass counts digits per block in parallel, turns the counts into per block offsets and then
+//! scatters every block in parallel. Passes where all keys share a digit are skipped.
+inline void parallel_radix_sort(std::vector<std::uint64_t>& keys, std::vector<std::uint32_t>& values, int key_bits)
+{
+    const size_t n = keys.size();
+    if (n < 2) return;
+
+    const size_t threads = static_cast<size_t>(tbb::this_task_arena::max_concurrency());
+    const size_t block_size = std::max<size_t>(16384, n / (4 * threads) + 1);
+    const size_t block_count = (n + block_size - 1) / block_size;
+
+    std::vector<std::uint64_t> key_buffer(n);
+    std::vector<std::uint32_t> value_buffer(n);
+    std::vector<size_t> offsets(block_count * 256);
+
+    for (int shift = 0; shift < key_bits; shift += 8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        tbb::parallel_for(size_t(0), block_count, [&](size_t b)
+            {
+                size_t* counts = &offsets[b * 256];
+                const size_t end = std::min(n, (b + 1) * block_size);
+                for (size_t k = b * block_size; k < end; ++k) ++counts[(keys[k] >> shift) & 0xFF];
+            });
+
+        // Digit d of block b starts after every smaller digit and after digit d of earlier blocks.
+        size_t sum = 0;
+        bool one_digit = false;
+        for (size_t d = 0; d < 256; ++d)
+        {
+            size_t digit_total = 0;
+            for (size_t b = 0; b < block_count; ++b)
+            {
+                const size_t count = offsets[b * 256 + d];
+                offsets[b * 256 + d] = sum;
+                sum += count;
+                digit_total += count;
+            }
+            one_digit = one_digit || digit_total == n;
+        }
+        if (one_digit) continue;
+
+        tbb::parallel_for(size_t(0), block_count, [&](size_t b)
+            {
+                size_t* next = &offsets[b * 256];
+                const size_t end = std::min(n, (b + 1) * block_size);
+                for (size_t k = b * block_size; k < end; ++k)
+                {
+                    const size_t position = next[(keys[k] >> shift) & 0xFF]++;
+                    key_buffer[position] = keys[k];
+                    value_buffer[position] = values[k];
+                }
+            });
+        keys.swap(key_buffer);
+        values.swap(value_buffer);
+    }
+}
+
+//! Builds a Bvh on all cores. The primitives are sorted along a Morton curve, the levels above
+//! ranges of subtree_size primitives are split on the highest differing code bit (LBVH), and each
+//! of those ranges is then built with binned SAH as a separate task. The result only depends on
+//! the input, not on the number of threads.
+template<typename T, typename Primitives = Sphere_set<T>>
+class Parallel_bvh_builder
+{
+public:
+    explicit Parallel_bvh_builder(int max_leaf_size = 4, size_t subtree_size = 2048)
+        : max_leaf_size(max_leaf_size), subtree_size(std::max<size_t>(subtree_size, 2))
+    {}
+
+    Bvh<T, Primitives> build(Primitives prims)
+    {
+        stats = bvh_build_stats();
+        return build_from(std::move(prims), clock::now());
+    }
+
+    //! Collects the spheres of the list in parallel and builds over them. Only spheres are supported.
+    Bvh<T, Primitives> build(const Hittable_list<T>& list)
+    {
+        stats = bvh_build_stats();
+        const clock::time_point start = clock::now();
+
+        const auto& objects = list.objects;
+        std::vector<size_t> first(objects.size() + 1, 0);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, objects.size(), 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    if (dynamic_cast<const Sphere<T>*>(objects[k].get())) first[k + 1] = 1;
+                    else if (auto set = dynamic_cast<const Sphere_set<T>*>(objects[k].get())) first[k + 1] = set->size();
+                    else throw std::invalid_argument("the parallel BVH builder supports only spheres");
+                }
+            });
+        for (size_t k = 0; k < objects.size(); ++k) first[k + 1] += first[k];
+
+        Primitives spheres;
+        spheres.resize(first.back());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, objects.size(), 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    if (auto s = dynamic_cast<const Sphere<T>*>(objects[k].get()))
+                    {
+                        spheres.set(first[k], s->center, s->radius, s->mat_ptr);
+                    }
+                    else
+                    {
+                        auto set = static_cast<const Sphere_set<T>*>(objects[k].get());
+                        for (size_t j = 0; j < set->size(); ++j)
+                            spheres.set(first[k] + j, set->centroid(j), set->radii[j], set->materials[j]);
+                    }
+                }
+            });
+        stats.gather_seconds = seconds_since(start);
+        return build_from(std::move(spheres), start);
+    }
+
+    //! Timings of the last build.
+    const bvh_build_stats& last_stats() const { return stats; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr std::uint64_t grid_max = (1u << 21) - 1;
+
+    static double seconds_since(clock::time_point t) { return std::chrono::duration<double>(clock::now() - t).count(); }
+
+    Bvh<T, Primitives> build_from(Primitives prims, clock::time_point start)
+    {
+        stats.threads = tbb::this_task_arena::max_concurrency();
+
+        const size_t n = prims.size();
+        if (n == 0) return Bvh<T, Primitives>(std::move(prims), std::vector<bvh_node<T>>());
+
+        clock::time_point phase = clock::now();
+        items.resize(n);
+        const Aabb<T> centroid_bounds = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, n, 4096), Aabb<T>(),
+            [&](const tbb::blocked_range<size_t>& range, Aabb<T> box)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    items[k] = bvh_build_item<T>{ prims.bounds(k), prims.centroid(k), k };
+                    box.expand(items[k].centroid);
+                }
+                return box;
+            },
+            [](Aabb<T> a, const Aabb<T>& b) { a.expand(b); return a; });
+        stats.gather_seconds += seconds_since(phase);
+
+        phase = clock::now();
+        codes.resize(n);
+        std::vector<std::uint32_t> order(n);
+        T to_grid[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            const T extent = centroid_bounds.maximum[a] - centroid_bounds.minimum[a];
+            to_grid[a] = extent > 0 ? static_cast<T>(grid_max) / extent : 0;
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    std::uint64_t q[3];
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        const T x = (items[k].centroid[a] - centroid_bounds.minimum[a]) * to_grid[a];
+                        q[a] = static_cast<std::uint64_t>(std::min(std::max(x, T(0)), static_cast<T>(grid_max)));
+                    }
+                    codes[k] = morton_code(q[0], q[1], q[2]);
+                    order[k] = static_cast<std::uint32_t>(k);
+                }
+            });
+        stats.morton_seconds = seconds_since(phase);
+
+        phase = clock::now();
+        parallel_radix_sort(codes, order, 63);
+        std::vector<bvh_build_item<T>> sorted(n);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k) sorted[k] = items[order[k]];
+            });
+        items.swap(sorted);
+        stats.sort_seconds = seconds_since(phase);
+
+        phase = clock::now();
+        upper.clear();
+        subtree_count = 0;
+        split_upper(0, n);
+        stats.upper_nodes = upper.size() - subtree_count;
+        stats.subtrees = subtree_count;
+        stats.upper_seconds = seconds_since(phase);
+
+        phase = clock::now();
+        std::vector<bvh_node<T>> nodes = build_subtrees();
+        stats.subtree_seconds = seconds_since(phase);
+
+        phase = clock::now();
+        std::vector<size_t> leaf_order(n);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 4096), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k) leaf_order[k] = items[k].index;
+            });
+        prims.permute(leaf_order);
+        stats.sort_seconds += seconds_since(phase);
+
+        items = std::vector<bvh_build_item<T>>();
+        codes = std::vector<std::uint64_t>();
+        stats.total_seconds = seconds_since(start);
+        return Bvh<T, Primitives>(std::move(prims), std::move(nodes));
+    }
+
+    //! A node of the LBVH levels: either split on a code bit into two upper nodes, or the root of a
+    //! subtree over items [begin, end). Stored in depth first order, like the final node array.
+    struct upper_node
+    {
+        size_t begin, end;
+        int depth;
+        size_t second = 0;
+        int axis = 0;
+        bool subtree = false;
+    };
+
+    // Every split takes a lower code bit than its parent, so these levels are at most 63 deep.
+    void split_upper(size_t begin, size_t end, int depth = 0)
+    {
+        const size_t index = upper.size();
+        upper.push_back(upper_node{ begin, end, depth });
+        if (end - begin <= subtree_size || codes[begin] == codes[end - 1])
+        {
+            upper[index].subtree = true;
+            ++subtree_count;
+            return;
+        }
+
+        // The codes are sorted, so the range splits where its highest differing bit turns on.
+        const std::uint64_t differing = codes[begin] ^ codes[end - 1];
+        int bit = 63;
+        while (!(differing >> bit & 1)) --bit;
+        const size_t middle = static_cast<size_t>(std::partition_point(codes.begin() + begin, codes.begin() + end,
+            [bit](std::uint64_t code) { return !(code >> bit & 1); }) - codes.begin());
+
+        upper[index].axis = 2 - bit % 3;
+        split_upper(begin, middle, depth + 1);
+        upper[index].second = upper.size();
+        split_upper(middle, end, depth + 1);
+    }
+
+    std::vector<bvh_node<T>> build_subtrees()
+    {
+        std::vector<size_t> roots;
+        for (size_t i = 0; i < upper.size(); ++i)
+            if (upper[i].subtree) roots.push_back(i);
+
+        std::vector<std::vector<bvh_node<T>>> subtrees(roots.size());
+        tbb::parallel_for(size_t(0), roots.size(), [&](size_t s)
+            {
+                const upper_node& u = upper[roots[s]];
+                subtrees[s].reserve(2 * (u.end - u.begin) / std::max(max_leaf_size, 1) + 1);
+                Sah_builder<T>(subtrees[s], items, max_leaf_size).build(u.begin, u.end, u.depth);
+            });
+
+        // Upper nodes and subtrees keep their depth first order, so every subtree lands in one piece.
+        std::vector<size_t> base(upper.size());
+        size_t total = 0;
+        for (size_t i = 0, s = 0; i < upper.size(); ++i)
+        {
+            base[i] = total;
+            total += upper[i].subtree ? subtrees[s++].size() : 1;
+        }
+
+        std::vector<bvh_node<T>> nodes(total);
+        tbb::parallel_for(size_t(0), roots.size(), [&](size_t s)
+            {
+                const size_t offset = base[roots[s]];
+                for (size_t k = 0; k < subtrees[s].size(); ++k)
+                {
+                    bvh_node<T> node = subtrees[s][k];
+                    if (node.count == 0) node.offset += static_cast<std::uint32_t>(offset);
+                    nodes[offset + k] = node;
+                }
+            });
+
+        // Children follow their parent in the upper array, so one backwards pass fills in the bounds.
+        for (size_t i = upper.size(); i-- > 0;)
+        {
+            if (upper[i].subtree) continue;
+            bvh_node<T>& node = nodes[base[i]];
+            node.bounds = nodes[base[i + 1]].bounds;
+            node.bounds.expand(nodes[base[upper[i].second]].bounds);
+            node.offset = static_cast<std::uint32_t>(base[upper[i].second]);
+            node.count = 0;
+            node.axis = static_cast<std::uint8_t>(upper[i].axis);
+        }
+        return nodes;
+    }
+
+private:
+    int max_leaf_size;
+    size_t subtree_size;
+    bvh_build_stats stats;
+
+    std::vector<bvh_build_item<T>> items;
+    std::vector<std::uint64_t> codes;
+    std::vector<upper_node> upper;
+    size_t subtree_count = 0;
+};
+
+#endif
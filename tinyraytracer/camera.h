@@ -37,6 +37,23 @@ public:
         return Ray<T>(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset);
     }
 
+    //! True without a lens: every ray through a point of the image is then the same.
+    bool is_pinhole() const { return lens_radius == 0; }
+
+    //! Where the ray through the lens center to p crosses the image, as the s and t get_ray takes.
+    //! Returns false for points level with or behind the camera.
+    bool project(const Point3<T>& p, T& s, T& t) const
+    {
+        const Vector3<T> to_plane = lower_left_corner + horizontal / 2 + vertical / 2 - origin;
+        const Vector3<T> d = p - origin;
+        const T depth = d.dot(to_plane);
+        if (depth <= 0) return false;
+        const Vector3<T> q = d * (to_plane.dot(to_plane) / depth) - (lower_left_corner - origin);
+        s = q.dot(horizontal) / horizontal.dot(horizontal);
+        t = q.dot(vertical) / vertical.dot(vertical);
+        return true;
+    }
+
 private:
     Point3<T> origin;
     Point3<T> lower_left_corner;
@@ -3,8 +3,18 @@
 #define COLOR_H_
 
 #include "vector3.h"
+#include "simd_kernels.h"
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
+
+//! Rec. 709 luminance of a linear color.
+template<typename T>
+inline T luminance(const Color<T>& c)
+{
+    return static_cast<T>(0.2126) * c.x + static_cast<T>(0.7152) * c.y + static_cast<T>(0.0722) * c.z;
+}
 
 template<typename T>
 void write_color(std::ostream& out, Color<T> pixel_color, std::size_t samples_per_pixel) {
@@ -24,4 +34,23 @@ void write_color(std::ostream& out, Color<T> pixel_color, std::size_t samples_pe
         << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 }
 
+//! Writes a run of pixels, each divided by its own sample count, through the dispatched tonemap kernel.
+template<typename T>
+void write_colors(std::ostream& out, const Color<T>* pixel_colors, const std::size_t* samples, std::size_t count) {
+    std::vector<double> values(3 * count), scales(3 * count);
+    std::vector<int> mapped(3 * count);
+    for (std::size_t k = 0; k < count; ++k) {
+        const double scale = 1.0 / std::max<std::size_t>(samples[k], 1);
+        for (int c = 0; c < 3; ++c) {
+            values[3 * k + c] = pixel_colors[k][c];
+            scales[3 * k + c] = scale;
+        }
+    }
+
+    simd().tonemap(values.data(), scales.data(), values.size(), mapped.data());
+
+    for (std::size_t k = 0; k < count; ++k)
+        out << mapped[3 * k] << ' ' << mapped[3 * k + 1] << ' ' << mapped[3 * k + 2] << '\n';
+}
+
 #endif
\ No newline at end of file
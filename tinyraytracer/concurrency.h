@@ -0,0 +1,381 @@
+// this file holds control over where rendering runs: how many threads, on which cores, and on which
+// NUMA node the memory they work on lives
+
+#pragma once
+#ifndef CONCURRENCY_H_
+#define CONCURRENCY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//! Parses a list of logical CPU numbers as Linux writes them, e.g. "0-7,16-23". Throws
+//! std::runtime_error on anything else.
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    size_t at = 0;
+    while (at < list.size())
+    {
+        size_t end = list.find(',', at);
+        if (end == std::string::npos) end = list.size();
+        const std::string item = list.substr(at, end - at);
+        at = end + 1;
+        if (item.empty() || item == "\n") continue;
+
+        const size_t dash = item.find('-');
+        int first = -1, last = -1;
+        if (item.find_first_not_of("0123456789-\n") == std::string::npos && dash != 0 && dash + 1 != item.size())
+        {
+            first = std::atoi(item.c_str());
+            last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+        }
+        if (first < 0 || last < first)
+            throw std::runtime_error("bad CPU list entry \"" + item + "\"");
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+//! The CPUs the process may run on.
+inline std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#if defined(_WIN32)
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        for (int cpu = 0; cpu < static_cast<int>(8 * sizeof(DWORD_PTR)); ++cpu)
+            if (process_mask >> cpu & 1) cpus.push_back(cpu);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+#endif
+    if (cpus.empty())
+        for (int cpu = 0; cpu < static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)); ++cpu) cpus.push_back(cpu);
+    return cpus;
+}
+
+//! A NUMA node: the memory attached to one socket (or part of one) and the CPUs next to it.
+struct numa_node
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+//! The machine's NUMA nodes. Where the OS tells nothing, one node holding every allowed CPU.
+inline std::vector<numa_node> numa_topology()
+{
+    std::vector<numa_node> nodes;
+#if defined(_WIN32)
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest))
+        for (USHORT node = 0; node <= highest; ++node)
+        {
+            GROUP_AFFINITY affinity;
+            if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+            numa_node n{ static_cast<int>(node), {} };
+            for (int bit = 0; bit < static_cast<int>(8 * sizeof(KAFFINITY)); ++bit)
+                if (affinity.Mask >> bit & 1) n.cpus.push_back(affinity.Group * 64 + bit);
+            if (!n.cpus.empty()) nodes.push_back(n);
+        }
+#elif defined(__linux__)
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if (online && std::getline(online, list))
+    {
+        try {
+            for (int node : parse_cpu_list(list))
+            {
+                std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string cpus;
+                if (!cpulist || !std::getline(cpulist, cpus)) continue;
+                numa_node n{ node, parse_cpu_list(cpus) };
+                if (!n.cpus.empty()) nodes.push_back(n);
+            }
+        }
+        catch (const std::runtime_error&) {
+            nodes.clear();
+        }
+    }
+#endif
+    if (nodes.empty()) nodes.push_back(numa_node{ 0, allowed_cpus() });
+    return nodes;
+}
+
+//! Restricts the calling thread to cpus. Returns false where that is not possible; on Windows a
+//! thread can only be pinned within one processor group, the group of the first CPU.
+inline bool pin_current_thread(const std::vector<int>& cpus)
+{
+    if (cpus.empty()) return false;
+#if defined(_WIN32)
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = static_cast<WORD>(cpus.front() / 64);
+    for (int cpu : cpus)
+        if (cpu / 64 == affinity.Group) affinity.Mask |= KAFFINITY(1) << (cpu % 64);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+//! Moves the pages [data, data + bytes) lies on to the given NUMA nodes, or interleaves them page by
+//! page when there are several, and keeps new pages of the range there. The range is widened to whole
+//! pages, so a buffer that does not start or end on a page boundary takes the neighbours sharing its
+//! first and last page along. Linux only, through mbind so that libnuma is not needed. When the kernel
+//! will not move the pages the policy is still set for pages touched later; returns false when even
+//! that is refused, and elsewhere, and the memory stays where first touch put it. Windows can only
+//! choose a node when memory is allocated (VirtualAllocExNuma), not move what containers already hold.
+inline bool place_memory(const void* data, size_t bytes, const std::vector<int>& nodes)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    if (nodes.empty() || bytes == 0) return false;
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) return false;
+    const std::uintptr_t page = static_cast<std::uintptr_t>(page_size);
+    const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(data) / page * page;
+    const std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(data) + bytes + page - 1) / page * page;
+
+    const int bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(static_cast<size_t>(*std::max_element(nodes.begin(), nodes.end())) / bits + 1, 0);
+    for (int node : nodes) mask[node / bits] |= 1ul << (node % bits);
+
+    // From <numaif.h>: MPOL_PREFERRED, MPOL_INTERLEAVE and MPOL_MF_MOVE.
+    const int mode = nodes.size() == 1 ? 1 : 3;
+    const unsigned move_pages = 1u << 1;
+    auto bind = [&](unsigned flags) {
+        return syscall(SYS_mbind, begin, end - begin, mode, mask.data(), mask.size() * bits + 1, flags) == 0;
+    };
+    return bind(move_pages) || bind(0);
+#else
+    (void)data; (void)bytes; (void)nodes;
+    return false;
+#endif
+}
+
+//! Pins the threads that enter one task_arena: each arena slot to one CPU of the list when
+//! one_per_thread, else every thread to the whole list. A thread that leaves the arena gets the
+//! process's CPUs back, since TBB may move it to another arena next.
+class Affinity_observer : public tbb::task_scheduler_observer
+{
+public:
+    Affinity_observer(tbb::task_arena& arena, std::vector<int> cpus, bool one_per_thread)
+        : tbb::task_scheduler_observer(arena), cpus(std::move(cpus)), one_per_thread(one_per_thread), released(allowed_cpus())
+    {
+        observe(true);
+    }
+
+    ~Affinity_observer() { observe(false); }
+
+    void on_scheduler_entry(bool) override
+    {
+        if (!one_per_thread) pin_current_thread(cpus);
+        else
+        {
+            const int slot = std::max(tbb::this_task_arena::current_thread_index(), 0);
+            pin_current_thread({ cpus[static_cast<size_t>(slot) % cpus.size()] });
+        }
+    }
+
+    void on_scheduler_exit(bool) override { pin_current_thread(released); }
+
+private:
+    const std::vector<int> cpus;
+    const bool one_per_thread;
+    const std::vector<int> released;
+};
+
+//! How rendering may use the machine. Zero threads and no CPUs mean all the process may use.
+struct concurrency_settings
+{
+    int threads = 0;
+
+    //! CPUs to run on. When given, every rendering thread is pinned to one of them.
+    std::vector<int> cpus;
+
+    //! One arena per NUMA node, each rendering its own part of the image into memory on that node.
+    bool numa = false;
+};
+
+//! The task arenas a render runs in: one per NUMA node when settings.numa asks for it and the
+//! machine has several, else a single one. Threads are shared out between the nodes in proportion
+//! to their usable CPUs. While it exists it also caps every other parallel algorithm in the program
+//! (BVH builds, mesh loading) at the chosen thread count.
+class Render_arenas
+{
+public:
+    explicit Render_arenas(const concurrency_settings& settings)
+    {
+        std::vector<int> usable = allowed_cpus();
+        if (!settings.cpus.empty())
+        {
+            std::vector<int> chosen;
+            std::set_intersection(settings.cpus.begin(), settings.cpus.end(), usable.begin(), usable.end(), std::back_inserter(chosen));
+            if (chosen.empty()) throw std::runtime_error("none of the requested CPUs is available to the process");
+            usable = chosen;
+        }
+        total_threads = settings.threads > 0 ? settings.threads
+            : settings.cpus.empty() ? tbb::this_task_arena::max_concurrency() : static_cast<int>(usable.size());
+        limit.reset(new tbb::global_control(tbb::global_control::max_allowed_parallelism, static_cast<size_t>(total_threads)));
+
+        std::vector<numa_node> nodes;
+        if (settings.numa)
+            for (numa_node node : numa_topology())
+            {
+                std::vector<int> cpus;
+                std::set_intersection(node.cpus.begin(), node.cpus.end(), usable.begin(), usable.end(), std::back_inserter(cpus));
+                if (!cpus.empty()) nodes.push_back(numa_node{ node.id, cpus });
+            }
+        if (nodes.size() <= 1) nodes.assign(1, numa_node{ nodes.empty() ? -1 : nodes[0].id, usable });
+        while (nodes.size() > static_cast<size_t>(total_threads)) nodes.pop_back();
+        numa = nodes.size() > 1;
+
+        // One thread per node, and the rest by largest remainder: every node gets the whole part of
+        // its share by CPU count, and the threads left over go to the largest fractional parts.
+        size_t cpu_count = 0;
+        for (const numa_node& node : nodes) cpu_count += node.cpus.size();
+        const size_t spare = static_cast<size_t>(total_threads) - nodes.size();
+        std::vector<int> shares(nodes.size(), 1);
+        std::vector<size_t> remainders(nodes.size());
+        size_t left = spare;
+        for (size_t k = 0; k < nodes.size(); ++k)
+        {
+            shares[k] += static_cast<int>(spare * nodes[k].cpus.size() / cpu_count);
+            remainders[k] = spare * nodes[k].cpus.size() % cpu_count;
+            left -= shares[k] - 1;
+        }
+        std::vector<size_t> order(nodes.size());
+        for (size_t k = 0; k < order.size(); ++k) order[k] = k;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return remainders[a] > remainders[b]; });
+        for (size_t k = 0; k < left; ++k) ++shares[order[k]];
+
+        const bool pin = numa || !settings.cpus.empty();
+        for (size_t k = 0; k < nodes.size(); ++k)
+        {
+            std::unique_ptr<group> g(new group);
+            g->node = nodes[k].id;
+            g->cpus = nodes[k].cpus;
+            g->threads = shares[k];
+            g->arena.reset(new tbb::task_arena(shares[k]));
+            g->arena->initialize();
+            if (pin) g->observer.reset(new Affinity_observer(*g->arena, g->cpus, !settings.cpus.empty()));
+            groups.push_back(std::move(g));
+        }
+    }
+
+    //! Number of arenas, one per NUMA node in use.
+    size_t size() const { return groups.size(); }
+    int threads() const { return total_threads; }
+    int threads(size_t k) const { return groups[k]->threads; }
+    bool numa_aware() const { return numa; }
+
+    //! Runs f() inside arena k, on the calling thread and that arena's workers.
+    template<typename F>
+    void execute(size_t k, F&& f) const { groups[k]->arena->execute(std::forward<F>(f)); }
+
+    //! Runs f(k) inside every arena k at once and returns when all have returned. The calling
+    //! thread takes arena 0, a helper thread joins each of the others.
+    template<typename F>
+    void run_all(F&& f) const
+    {
+        std::vector<std::exception_ptr> errors(groups.size());
+        std::vector<std::thread> helpers;
+        for (size_t k = 1; k < groups.size(); ++k)
+            helpers.emplace_back([&, k] {
+                try { execute(k, [&] { f(k); }); }
+                catch (...) { errors[k] = std::current_exception(); }
+            });
+        try { execute(0, [&] { f(size_t(0)); }); }
+        catch (...) { errors[0] = std::current_exception(); }
+        for (std::thread& helper : helpers) helper.join();
+        for (const std::exception_ptr& error : errors)
+            if (error) std::rethrow_exception(error);
+    }
+
+    //! Moves memory that arena k works on to its node. Does nothing unless NUMA-aware.
+    bool place(const void* data, size_t bytes, size_t k) const
+    {
+        return numa && place_memory(data, bytes, { groups[k]->node });
+    }
+
+    //! Interleaves memory every arena reads, such as the scene, over all nodes in use, so that
+    //! no node's memory controller serves all the others. Does nothing unless NUMA-aware.
+    bool interleave(const void* data, size_t bytes) const
+    {
+        std::vector<int> nodes;
+        for (const auto& g : groups) nodes.push_back(g->node);
+        return numa && place_memory(data, bytes, nodes);
+    }
+
+    void describe(std::ostream& out) const
+    {
+        out << total_threads << " threads";
+        for (const auto& g : groups)
+        {
+            out << (numa ? ", node " + std::to_string(g->node) + ": " : ": ") << g->threads << " on CPUs ";
+            for (size_t c = 0; c < g->cpus.size(); ++c)
+            {
+                size_t run = c;
+                while (run + 1 < g->cpus.size() && g->cpus[run + 1] == g->cpus[run] + 1) ++run;
+                out << (c ? "," : "") << g->cpus[c];
+                if (run > c) out << '-' << g->cpus[run];
+                c = run;
+            }
+            if (!g->observer) out << " (unpinned)";
+        }
+    }
+
+private:
+    struct group
+    {
+        int node;
+        std::vector<int> cpus;
+        int threads;
+        std::unique_ptr<tbb::task_arena> arena;
+        std::unique_ptr<Affinity_observer> observer;    // declared after the arena, so destroyed before it
+    };
+
+    std::unique_ptr<tbb::global_control> limit;
+    std::vector<std::unique_ptr<group>> groups;
+    int total_threads = 0;
+    bool numa = false;
+};
+
+#endif
@@ -0,0 +1,309 @@
+// this file holds the convergence harness: renders at increasing time budgets compared with a
+// high sample count reference by relMSE, PSNR and SSIM, written out as CSV and as an SVG plot
+
+#pragma once
+#ifndef CONVERGENCE_H_
+#define CONVERGENCE_H_
+
+#include "utilities.h"
+#include "render_job.h"
+#include "environment.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//! The image a framebuffer holds, every pixel divided by its own sample count, row 0 at the top.
+template<typename T>
+float_image resolve(const Framebuffer<T>& framebuffer)
+{
+    float_image image;
+    image.width = framebuffer.width;
+    image.height = framebuffer.height;
+    image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+    for (int j = 0; j < image.height; ++j)
+    {
+        for (int i = 0; i < image.width; ++i)
+        {
+            const T scale = T(1) / std::max<size_t>(framebuffer.samples_at(i, j), 1);
+            const Color<T>& c = framebuffer.color_at(i, j);
+            float* out = &image.rgb[(static_cast<size_t>(image.height - 1 - j) * image.width + i) * 3];
+            for (int k = 0; k < 3; ++k) out[k] = static_cast<float>(c[k] * scale);
+        }
+    }
+    return image;
+}
+
+//! How far an image is from the reference.
+struct image_error
+{
+    double rel_mse = 0;     // mean of (x - r)^2 / (r^2 + 0.01) over pixels and channels, on linear radiance
+    double psnr = 0;        // in dB, on the displayed values: gamma 2, clamped to [0, 1]
+    double ssim = 0;        // mean structural similarity of displayed luminance, 11x11 Gaussian window
+};
+
+//! The value write_color shows for a linear channel.
+inline double display_value(float v)
+{
+    return std::sqrt(clamp(static_cast<double>(v), 0.0, 1.0));
+}
+
+//! Separable Gaussian blur with sigma 1.5 and radius 5, clamping at the borders; the SSIM window.
+inline std::vector<double> ssim_blur(const std::vector<double>& in, int width, int height)
+{
+    double weights[11], total = 0;
+    for (int k = -5; k <= 5; ++k) total += weights[k + 5] = std::exp(-k * k / (2 * 1.5 * 1.5));
+    for (double& w : weights) w /= total;
+
+    std::vector<double> rows(in.size()), out(in.size());
+    for (int j = 0; j < height; ++j)
+        for (int i = 0; i < width; ++i)
+        {
+            double sum = 0;
+            for (int k = -5; k <= 5; ++k) sum += weights[k + 5] * in[static_cast<size_t>(j) * width + clamp(i + k, 0, width - 1)];
+            rows[static_cast<size_t>(j) * width + i] = sum;
+        }
+    for (int j = 0; j < height; ++j)
+        for (int i = 0; i < width; ++i)
+        {
+            double sum = 0;
+            for (int k = -5; k <= 5; ++k) sum += weights[k + 5] * rows[static_cast<size_t>(clamp(j + k, 0, height - 1)) * width + i];
+            out[static_cast<size_t>(j) * width + i] = sum;
+        }
+    return out;
+}
+
+//! Compares image with reference, which must have the same size.
+inline image_error compare_images(const float_image& image, const float_image& reference)
+{
+    if (image.width != reference.width || image.height != reference.height)
+        throw std::runtime_error("reference is " + std::to_string(reference.width) + "x" + std::to_string(reference.height)
+            + ", image is " + std::to_string(image.width) + "x" + std::to_string(image.height));
+
+    const size_t pixels = static_cast<size_t>(image.width) * image.height;
+    image_error error;
+    double squared_display = 0;
+    std::vector<double> x(pixels), y(pixels);
+    for (size_t p = 0; p < pixels; ++p)
+    {
+        double lx = 0, ly = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            const double v = image.rgb[3 * p + k], r = reference.rgb[3 * p + k];
+            error.rel_mse += (v - r) * (v - r) / (r * r + 0.01);
+            const double dv = display_value(image.rgb[3 * p + k]), dr = display_value(reference.rgb[3 * p + k]);
+            squared_display += (dv - dr) * (dv - dr);
+            static const double weight[3] = { 0.2126, 0.7152, 0.0722 };
+            lx += weight[k] * dv;
+            ly += weight[k] * dr;
+        }
+        x[p] = lx;
+        y[p] = ly;
+    }
+    error.rel_mse /= 3.0 * pixels;
+    const double mse = squared_display / (3.0 * pixels);
+    error.psnr = mse > 0 ? 10 * std::log10(1 / mse) : std::numeric_limits<double>::infinity();
+
+    // SSIM (Wang et al. 2004) with the usual constants for values in [0, 1].
+    std::vector<double> xx(pixels), yy(pixels), xy(pixels);
+    for (size_t p = 0; p < pixels; ++p)
+    {
+        xx[p] = x[p] * x[p];
+        yy[p] = y[p] * y[p];
+        xy[p] = x[p] * y[p];
+    }
+    const std::vector<double> mx = ssim_blur(x, image.width, image.height), my = ssim_blur(y, image.width, image.height);
+    const std::vector<double> sxx = ssim_blur(xx, image.width, image.height), syy = ssim_blur(yy, image.width, image.height);
+    const std::vector<double> sxy = ssim_blur(xy, image.width, image.height);
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    for (size_t p = 0; p < pixels; ++p)
+    {
+        const double vx = sxx[p] - mx[p] * mx[p], vy = syy[p] - my[p] * my[p], cxy = sxy[p] - mx[p] * my[p];
+        error.ssim += (2 * mx[p] * my[p] + c1) * (2 * cxy + c2) / ((mx[p] * mx[p] + my[p] * my[p] + c1) * (vx + vy + c2));
+    }
+    error.ssim /= pixels;
+    return error;
+}
+
+//! A way of rendering to compare: starts a job for the given settings, which carry the time budget.
+struct convergence_strategy
+{
+    std::string name;
+    std::function<std::unique_ptr<Render_job<double>>(const render_settings&)> start;
+};
+
+//! One render of the harness.
+struct convergence_point
+{
+    std::string strategy;
+    double budget_seconds = 0;
+    double seconds = 0;         // wall-clock time the render actually took
+    size_t samples = 0;
+    image_error error;
+};
+
+//! Renders with every strategy at every budget, each render started afresh with settings and that
+//! time budget, and compares the results with reference. on_point is called after every render.
+inline std::vector<convergence_point> run_convergence(const std::vector<convergence_strategy>& strategies,
+    const render_settings& settings, const std::vector<double>& budgets, const float_image& reference,
+    const std::function<void(const convergence_point&)>& on_point = nullptr)
+{
+    std::vector<convergence_point> points;
+    for (const convergence_strategy& strategy : strategies)
+    {
+        for (double budget : budgets)
+        {
+            render_settings timed = settings;
+            timed.time_budget_seconds = budget;
+
+            convergence_point point;
+            point.strategy = strategy.name;
+            point.budget_seconds = budget;
+            const auto start = std::chrono::steady_clock::now();
+            auto job = strategy.start(timed);
+            job->wait();
+            point.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            point.samples = job->progress().samples_done;
+            point.error = compare_images(resolve(job->snapshot()), reference);
+
+            points.push_back(point);
+            if (on_point) on_point(point);
+        }
+    }
+    return points;
+}
+
+inline void write_convergence_csv(std::ostream& out, const std::vector<convergence_point>& points)
+{
+    out << "strategy,budget_seconds,seconds,samples,rel_mse,psnr_db,ssim\n";
+    out << std::setprecision(6);
+    for (const convergence_point& p : points)
+        out << p.strategy << ',' << p.budget_seconds << ',' << p.seconds << ',' << p.samples << ','
+            << p.error.rel_mse << ',' << p.error.psnr << ',' << p.error.ssim << '\n';
+}
+
+//! text with the characters XML gives a meaning replaced by their entities.
+inline std::string xml_escaped(const std::string& text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        switch (c)
+        {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+//! Three plots side by side, relMSE, PSNR and SSIM against seconds, one line per strategy. Time and
+//! relMSE are on log scales, where Monte Carlo error falls along a line of slope -1.
+inline void write_convergence_svg(std::ostream& out, const std::vector<convergence_point>& points, const std::string& title)
+{
+    static const char* colors[] = { "#1f77b4", "#d62728", "#2ca02c", "#ff7f0e", "#9467bd", "#8c564b", "#e377c2", "#17becf" };
+    auto label = [](double v) { std::ostringstream text; text << std::setprecision(3) << v; return text.str(); };
+    const double plot_w = 300, plot_h = 220, margin_l = 60, margin_t = 40, gap = 80;
+
+    std::vector<std::string> strategies;
+    double t_min = std::numeric_limits<double>::max(), t_max = 0;
+    for (const convergence_point& p : points)
+    {
+        if (std::find(strategies.begin(), strategies.end(), p.strategy) == strategies.end()) strategies.push_back(p.strategy);
+        t_min = std::min(t_min, p.seconds);
+        t_max = std::max(t_max, p.seconds);
+    }
+    if (points.empty()) t_min = t_max = 1;
+    const double x0 = std::floor(std::log10(t_min)), x1 = std::max(std::ceil(std::log10(t_max)), x0 + 1);
+
+    struct metric
+    {
+        const char* name;
+        bool log_scale;
+        std::function<double(const image_error&)> value;
+    };
+    const metric metrics[3] = {
+        { "relMSE", true, [](const image_error& e) { return e.rel_mse; } },
+        { "PSNR (dB)", false, [](const image_error& e) { return e.psnr; } },
+        { "SSIM", false, [](const image_error& e) { return e.ssim; } },
+    };
+
+    const double width = margin_l + 3 * plot_w + 2 * gap + 20;
+    const double height = margin_t + plot_h + 50 + 20 * static_cast<double>(strategies.size());
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height
+        << "\" font-family=\"sans-serif\" font-size=\"11\">\n"
+        << "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n"
+        << "<text x=\"" << margin_l << "\" y=\"20\" font-size=\"14\">" << xml_escaped(title) << "</text>\n";
+
+    for (int m = 0; m < 3; ++m)
+    {
+        const metric& mt = metrics[m];
+        auto scaled = [&](double v) { return mt.log_scale ? std::log10(std::max(v, 1e-12)) : v; };
+        double y0 = std::numeric_limits<double>::max(), y1 = -y0;
+        for (const convergence_point& p : points)
+        {
+            const double v = mt.value(p.error);
+            if (!std::isfinite(v)) continue;
+            y0 = std::min(y0, scaled(v));
+            y1 = std::max(y1, scaled(v));
+        }
+        if (y0 > y1) y0 = y1 = 0;
+        if (mt.log_scale) { y0 = std::floor(y0); y1 = std::max(std::ceil(y1), y0 + 1); }
+        else { const double pad = std::max((y1 - y0) * 0.1, 1e-3); y0 -= pad; y1 += pad; }
+
+        const double left = margin_l + m * (plot_w + gap), top = margin_t;
+        auto px = [&](double seconds) { return left + (std::log10(seconds) - x0) / (x1 - x0) * plot_w; };
+        auto py = [&](double v) { return top + plot_h - (scaled(v) - y0) / (y1 - y0) * plot_h; };
+
+        out << "<g>\n<rect x=\"" << left << "\" y=\"" << top << "\" width=\"" << plot_w << "\" height=\"" << plot_h
+            << "\" fill=\"none\" stroke=\"black\"/>\n"
+            << "<text x=\"" << left + plot_w / 2 << "\" y=\"" << top - 6 << "\" text-anchor=\"middle\">" << mt.name << "</text>\n"
+            << "<text x=\"" << left + plot_w / 2 << "\" y=\"" << top + plot_h + 32 << "\" text-anchor=\"middle\">seconds</text>\n";
+        for (double d = x0; d <= x1 + 1e-9; ++d)
+            out << "<text x=\"" << px(std::pow(10.0, d)) << "\" y=\"" << top + plot_h + 15 << "\" text-anchor=\"middle\">"
+                << label(std::pow(10.0, d)) << "</text>\n";
+        for (int k = 0; k <= 4; ++k)
+        {
+            const double s = y0 + (y1 - y0) * k / 4;
+            const double y = top + plot_h - plot_h * k / 4;
+            out << "<line x1=\"" << left << "\" x2=\"" << left + plot_w << "\" y1=\"" << y << "\" y2=\"" << y
+                << "\" stroke=\"#ddd\"/>\n<text x=\"" << left - 4 << "\" y=\"" << y + 4 << "\" text-anchor=\"end\">"
+                << label(mt.log_scale ? std::pow(10.0, s) : s) << "</text>\n";
+        }
+        for (size_t s = 0; s < strategies.size(); ++s)
+        {
+            const char* color = colors[s % 8];
+            out << "<polyline fill=\"none\" stroke=\"" << color << "\" stroke-width=\"2\" points=\"";
+            for (const convergence_point& p : points)
+                if (p.strategy == strategies[s] && std::isfinite(mt.value(p.error)))
+                    out << px(p.seconds) << ',' << py(mt.value(p.error)) << ' ';
+            out << "\"/>\n";
+            for (const convergence_point& p : points)
+                if (p.strategy == strategies[s] && std::isfinite(mt.value(p.error)))
+                    out << "<circle cx=\"" << px(p.seconds) << "\" cy=\"" << py(mt.value(p.error)) << "\" r=\"3\" fill=\"" << color << "\"/>\n";
+        }
+        out << "</g>\n";
+    }
+
+    for (size_t s = 0; s < strategies.size(); ++s)
+    {
+        const double y = margin_t + plot_h + 55 + 20 * static_cast<double>(s);
+        out << "<rect x=\"" << margin_l << "\" y=\"" << y - 9 << "\" width=\"12\" height=\"12\" fill=\"" << colors[s % 8] << "\"/>\n"
+            << "<text x=\"" << margin_l + 18 << "\" y=\"" << y + 1 << "\">" << xml_escaped(strategies[s]) << "</text>\n";
+    }
+    out << "</svg>\n";
+}
+
+#endif
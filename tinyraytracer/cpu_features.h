@@ -0,0 +1,129 @@
+// this file detects the instruction sets the running CPU supports, so that the SIMD kernels
+// can be picked at startup instead of at compile time
+
+#pragma once
+#ifndef CPU_FEATURES_H_
+#define CPU_FEATURES_H_
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TRT_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC lets every function use any intrinsic, GCC and Clang need the target named per function.
+#if defined(TRT_X86) && !defined(_MSC_VER)
+#define TRT_TARGET(isa) __attribute__((target(isa)))
+#else
+#define TRT_TARGET(isa)
+#endif
+
+// Lane types wrap intrinsics in functions built for one instruction set each, which GCC and Clang
+// will not inline into callers built for another. A kernel marked TRT_FLATTEN inlines everything it
+// calls, so code written once over the lane types becomes straight-line code for the kernel's target.
+#if defined(TRT_X86) && !defined(_MSC_VER)
+#define TRT_FLATTEN __attribute__((flatten))
+#else
+#define TRT_FLATTEN
+#endif
+
+//! Instruction set levels the kernels are built for, in increasing order.
+enum class isa_level { generic = 0, sse42 = 1, avx2 = 2, avx512 = 3 };
+
+inline const char* isa_name(isa_level level)
+{
+    switch (level) {
+    case isa_level::sse42: return "sse4.2";
+    case isa_level::avx2: return "avx2";
+    case isa_level::avx512: return "avx512";
+    default: return "generic";
+    }
+}
+
+#if defined(TRT_X86)
+inline void cpuid(int leaf, int subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    for (int i = 0; i < 4; ++i) regs[i] = static_cast<unsigned>(r[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+//! Register state the OS saves on context switches (XCR0).
+inline unsigned long long xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (static_cast<unsigned long long>(hi) << 32) | lo;
+#endif
+}
+#endif
+
+//! Highest level both the CPU and the OS support.
+inline isa_level detect_isa()
+{
+#if defined(TRT_X86)
+    unsigned regs[4];
+    cpuid(0, 0, regs);
+    const unsigned max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    const unsigned ecx1 = regs[2];
+    const bool sse42 = (ecx1 & (1u << 19)) && (ecx1 & (1u << 20));
+    if (!sse42) return isa_level::generic;
+
+    const bool osxsave = (ecx1 & (1u << 27)) != 0;
+    const bool avx = (ecx1 & (1u << 28)) != 0;
+    const bool fma = (ecx1 & (1u << 12)) != 0;
+    if (!osxsave || !avx || !fma || max_leaf < 7) return isa_level::sse42;
+
+    const unsigned long long xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) return isa_level::sse42;
+
+    cpuid(7, 0, regs);
+    const bool avx2 = (regs[1] & (1u << 5)) != 0;
+    const bool avx512f = (regs[1] & (1u << 16)) != 0;
+    if (!avx2) return isa_level::sse42;
+    if (!avx512f || (xcr0 & 0xe6) != 0xe6) return isa_level::avx2;
+    return isa_level::avx512;
+#else
+    return isa_level::generic;
+#endif
+}
+
+//! The level the kernels run at: the detected one, unless the TINYRAYTRACER_ISA environment
+//! variable (generic, sse4.2, avx2 or avx512) asks for a lower one.
+inline isa_level active_isa()
+{
+    static const isa_level level = [] {
+        const isa_level detected = detect_isa();
+        const char* requested = std::getenv("TINYRAYTRACER_ISA");
+        if (!requested) return detected;
+
+        for (int l = 0; l <= static_cast<int>(isa_level::avx512); ++l)
+        {
+            if (std::strcmp(requested, isa_name(static_cast<isa_level>(l))) != 0) continue;
+            if (l <= static_cast<int>(detected)) return static_cast<isa_level>(l);
+            std::cerr << "TINYRAYTRACER_ISA=" << requested << " is not supported here, using " << isa_name(detected) << '\n';
+            return detected;
+        }
+        std::cerr << "unknown TINYRAYTRACER_ISA=" << requested << ", using " << isa_name(detected) << '\n';
+        return detected;
+    }();
+    return level;
+}
+
+#endif
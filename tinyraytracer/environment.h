@@ -0,0 +1,359 @@
+// this file holds the HDR environment light: an equirectangular image around the scene that is
+// importance sampled by luminance through marginal/conditional CDF tables
+
+#pragma once
+#ifndef ENVIRONMENT_H_
+#define ENVIRONMENT_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+//! Linear RGB float image, row 0 at the top.
+struct float_image
+{
+    int width = 0;
+    int height = 0;
+    std::vector<float> rgb;
+};
+
+//! Throws unless width x height is a size an image file can sensibly have, so that a corrupt
+//! header cannot ask for an allocation of any size.
+inline void check_image_size(int width, int height, const char* format)
+{
+    const long long max_pixels = 1ll << 28;
+    if (width <= 0 || height <= 0 || static_cast<long long>(width) * height > max_pixels)
+        throw std::runtime_error(std::string("invalid ") + format + " image size " + std::to_string(width) + "x" + std::to_string(height));
+}
+
+//! Reads a Portable Float Map (PF, either byte order).
+inline float_image load_pfm(std::istream& in)
+{
+    std::string magic;
+    float_image image;
+    double scale;
+    in >> magic >> image.width >> image.height >> scale;
+    in.get();
+    if (!in || magic != "PF")
+        throw std::runtime_error("not an RGB PFM image");
+    check_image_size(image.width, image.height, "PFM");
+
+    image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+    std::vector<float> row(static_cast<size_t>(image.width) * 3);
+    const uint32_t probe = 1;
+    const bool host_little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    const bool swap = (scale < 0) != host_little;
+
+    // PFM stores the bottom row first.
+    for (int j = image.height - 1; j >= 0; --j)
+    {
+        in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float));
+        if (!in) throw std::runtime_error("truncated PFM image");
+        if (swap)
+        {
+            for (float& v : row)
+            {
+                unsigned char* b = reinterpret_cast<unsigned char*>(&v);
+                std::swap(b[0], b[3]);
+                std::swap(b[1], b[2]);
+            }
+        }
+        std::copy(row.begin(), row.end(), image.rgb.begin() + static_cast<size_t>(j) * row.size());
+    }
+    return image;
+}
+
+//! Writes a Portable Float Map in the byte order of the host.
+inline void write_pfm(std::ostream& out, const float_image& image)
+{
+    const uint32_t probe = 1;
+    const bool host_little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    out << "PF\n" << image.width << ' ' << image.height << '\n' << (host_little ? "-1.0" : "1.0") << '\n';
+    const size_t row = static_cast<size_t>(image.width) * 3;
+    for (int j = image.height - 1; j >= 0; --j)
+        out.write(reinterpret_cast<const char*>(image.rgb.data() + static_cast<size_t>(j) * row), row * sizeof(float));
+}
+
+//! Reads a Radiance RGBE (.hdr) image, flat or with the run-length encoded scanlines.
+inline float_image load_hdr(std::istream& in)
+{
+    std::string line;
+    std::getline(in, line);
+    if (line.compare(0, 2, "#?") != 0) throw std::runtime_error("not a Radiance HDR image");
+    while (std::getline(in, line) && !line.empty())
+    {
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+            throw std::runtime_error("unsupported HDR format " + line);
+    }
+
+    float_image image;
+    std::getline(in, line);
+    char y_axis[3] = {}, x_axis[3] = {};
+    if (std::sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &image.height, x_axis, &image.width) != 4 ||
+        std::strcmp(y_axis, "-Y") != 0 || std::strcmp(x_axis, "+X") != 0)
+        throw std::runtime_error("unsupported HDR orientation " + line);
+    check_image_size(image.width, image.height, "HDR");
+
+    image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+    std::vector<unsigned char> rgbe(static_cast<size_t>(image.width) * 4);
+    for (int j = 0; j < image.height; ++j)
+    {
+        unsigned char head[4];
+        in.read(reinterpret_cast<char*>(head), 4);
+        if (!in) throw std::runtime_error("truncated HDR image");
+
+        if (image.width >= 8 && image.width < 32768 && head[0] == 2 && head[1] == 2 && (head[2] << 8 | head[3]) == image.width)
+        {
+            // Each of the four channels is stored separately as runs and literals.
+            for (int c = 0; c < 4; ++c)
+            {
+                for (int i = 0; i < image.width; )
+                {
+                    int count = in.get();
+                    if (!in) throw std::runtime_error("truncated HDR image");
+                    const bool run = count > 128;
+                    if (run) count -= 128;
+                    // An empty run would never advance i; one past the row would write past it.
+                    if (count == 0 || count > image.width - i) throw std::runtime_error("invalid HDR run");
+                    if (run)
+                    {
+                        const int value = in.get();
+                        for (; count-- > 0; ++i) rgbe[4 * i + c] = static_cast<unsigned char>(value);
+                    }
+                    else
+                    {
+                        for (; count-- > 0; ++i) rgbe[4 * i + c] = static_cast<unsigned char>(in.get());
+                    }
+                    if (!in) throw std::runtime_error("truncated HDR image");
+                }
+            }
+        }
+        else
+        {
+            std::copy(head, head + 4, rgbe.begin());
+            in.read(reinterpret_cast<char*>(rgbe.data() + 4), rgbe.size() - 4);
+            if (!in) throw std::runtime_error("truncated HDR image");
+        }
+
+        for (int i = 0; i < image.width; ++i)
+        {
+            const unsigned char* p = &rgbe[4 * i];
+            const float f = p[3] ? std::ldexp(1.0f, p[3] - (128 + 8)) : 0.0f;
+            float* out = &image.rgb[(static_cast<size_t>(j) * image.width + i) * 3];
+            out[0] = p[0] * f;
+            out[1] = p[1] * f;
+            out[2] = p[2] * f;
+        }
+    }
+    return image;
+}
+
+inline float_image load_float_image(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("cannot open " + path);
+    const std::string extension = path.substr(path.find_last_of('.') + 1);
+    if (extension == "pfm" || extension == "PFM") return load_pfm(in);
+    return load_hdr(in);
+}
+
+//! 64-bit FNV-1a hash, used to key cached sampling tables to the file they were built from.
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < size; ++k)
+    {
+        hash ^= bytes[k];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+//! An infinitely distant light given by an equirectangular image. +y is up, the top image row
+//! looks straight up and the left edge looks along -x.
+template<typename T>
+class Environment_light
+{
+public:
+    //! Loads the image and its sampling tables, from \p cache_dir when tables built from a file
+    //! of the same path, size and modification time are there, otherwise building them and
+    //! writing them to the cache. An empty cache_dir disables caching.
+    explicit Environment_light(const std::string& path, const std::string& cache_dir = "")
+        : image(load_float_image(path))
+    {
+        // Hashing the pixels would cost about as much as building the tables again.
+        struct stat file = {};
+        stat(path.c_str(), &file);
+        const int64_t size = file.st_size, modified = file.st_mtime;
+        uint64_t hash = fnv1a(path.data(), path.size());
+        hash = fnv1a(&size, sizeof(size), hash);
+        hash = fnv1a(&modified, sizeof(modified), hash);
+
+        std::string cache_path;
+        if (!cache_dir.empty())
+        {
+            std::ostringstream name;
+            name << cache_dir << "/envmap-" << std::hex << hash << ".cdf";
+            cache_path = name.str();
+            if (load_tables(cache_path, hash)) return;
+        }
+
+        build_tables();
+        if (!cache_path.empty()) save_tables(cache_path, hash);
+    }
+
+    int width() const { return image.width; }
+    int height() const { return image.height; }
+
+    //! Radiance arriving from direction (need not be unit length).
+    Color<T> radiance(const Vector3<T>& direction) const
+    {
+        int i, j;
+        pixel_of(direction.normalized(), i, j);
+        const float* p = &image.rgb[(static_cast<size_t>(j) * image.width + i) * 3];
+        return Color<T>(p[0], p[1], p[2]);
+    }
+
+    //! Picks a unit direction with density proportional to luminance; pdf is per solid angle.
+    Vector3<T> sample(T& pdf) const
+    {
+        const T u1 = random_generate<T>(), u2 = random_generate<T>();
+
+        const int j = segment(marginal_cdf.data(), image.height, u1);
+        const T dv = (u1 - marginal_cdf[j]) / std::max<T>(marginal_cdf[j + 1] - marginal_cdf[j], std::numeric_limits<T>::min());
+        const T* row_cdf = &conditional_cdf[static_cast<size_t>(j) * (image.width + 1)];
+        const int i = segment(row_cdf, image.width, u2);
+        const T du = (u2 - row_cdf[i]) / std::max<T>(row_cdf[i + 1] - row_cdf[i], std::numeric_limits<T>::min());
+
+        const T theta = pi<T>() * (j + dv) / image.height;
+        const T phi = 2 * pi<T>() * (i + du) / image.width - pi<T>();
+        const T sin_theta = std::sin(theta);
+        pdf = sin_theta > 0 ? pixel_pdf(i, j) / (2 * pi<T>() * pi<T>() * sin_theta) : 0;
+        return Vector3<T>(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+    }
+
+    //! Solid-angle density with which sample() returns direction.
+    T pdf(const Vector3<T>& direction) const
+    {
+        const Vector3<T> d = direction.normalized();
+        const T sin_theta = std::sqrt(std::fmax(T(0), 1 - d.y * d.y));
+        if (sin_theta <= 0) return 0;
+        int i, j;
+        pixel_of(d, i, j);
+        return pixel_pdf(i, j) / (2 * pi<T>() * pi<T>() * sin_theta);
+    }
+
+private:
+    void pixel_of(const Vector3<T>& d, int& i, int& j) const
+    {
+        const T theta = std::acos(clamp<T>(d.y, -1, 1));
+        const T phi = std::atan2(d.z, d.x) + pi<T>();
+        i = std::min(static_cast<int>(phi / (2 * pi<T>()) * image.width), image.width - 1);
+        j = std::min(static_cast<int>(theta / pi<T>() * image.height), image.height - 1);
+    }
+
+    //! Density over the unit square of the (u, v) image coordinates inside pixel (i, j).
+    T pixel_pdf(int i, int j) const
+    {
+        return total > 0 ? weight[static_cast<size_t>(j) * image.width + i] / total : 0;
+    }
+
+    //! Index k with cdf[k] <= u < cdf[k + 1], skipping zero-width segments.
+    static int segment(const T* cdf, int n, T u)
+    {
+        const int k = static_cast<int>(std::upper_bound(cdf, cdf + n + 1, u) - cdf) - 1;
+        return clamp(k, 0, n - 1);
+    }
+
+    // Pixels are weighted by luminance times sin(theta) so that rows near the poles, which cover
+    // less solid angle, are picked less often.
+    void build_tables()
+    {
+        const int w = image.width, h = image.height;
+        weight.resize(static_cast<size_t>(w) * h);
+        conditional_cdf.assign(static_cast<size_t>(w + 1) * h, 0);
+        marginal_cdf.assign(h + 1, 0);
+
+        std::vector<T> row_sum(h, 0);
+        for (int j = 0; j < h; ++j)
+        {
+            const T sin_theta = std::sin(pi<T>() * (j + T(0.5)) / h);
+            T* cdf = &conditional_cdf[static_cast<size_t>(j) * (w + 1)];
+            for (int i = 0; i < w; ++i)
+            {
+                const float* p = &image.rgb[(static_cast<size_t>(j) * w + i) * 3];
+                const T f = luminance(Color<T>(p[0], p[1], p[2])) * sin_theta;
+                weight[static_cast<size_t>(j) * w + i] = f;
+                cdf[i + 1] = cdf[i] + f;
+            }
+            row_sum[j] = cdf[w];
+            for (int i = 1; i <= w; ++i)
+                cdf[i] = row_sum[j] > 0 ? cdf[i] / row_sum[j] : static_cast<T>(i) / w;
+            marginal_cdf[j + 1] = marginal_cdf[j] + row_sum[j];
+        }
+
+        // Mean weight, the normalization of the piecewise constant density over [0,1]^2.
+        total = marginal_cdf[h] / (static_cast<T>(w) * h);
+        for (int j = 1; j <= h; ++j)
+            marginal_cdf[j] = marginal_cdf[h] > 0 ? marginal_cdf[j] / marginal_cdf[h] : static_cast<T>(j) / h;
+    }
+
+    bool load_tables(const std::string& path, uint64_t hash)
+    {
+        std::ifstream in(path, std::ios::binary);
+        uint64_t stored_hash = 0;
+        uint32_t value_size = 0;
+        int32_t width = 0, height = 0;
+        in.read(reinterpret_cast<char*>(&stored_hash), sizeof(stored_hash));
+        in.read(reinterpret_cast<char*>(&value_size), sizeof(value_size));
+        in.read(reinterpret_cast<char*>(&width), sizeof(width));
+        in.read(reinterpret_cast<char*>(&height), sizeof(height));
+        if (!in || stored_hash != hash || value_size != sizeof(T) || width != image.width || height != image.height) return false;
+
+        weight.resize(static_cast<size_t>(image.width) * image.height);
+        conditional_cdf.resize(static_cast<size_t>(image.width + 1) * image.height);
+        marginal_cdf.resize(image.height + 1);
+        in.read(reinterpret_cast<char*>(&total), sizeof(T));
+        in.read(reinterpret_cast<char*>(weight.data()), weight.size() * sizeof(T));
+        in.read(reinterpret_cast<char*>(conditional_cdf.data()), conditional_cdf.size() * sizeof(T));
+        in.read(reinterpret_cast<char*>(marginal_cdf.data()), marginal_cdf.size() * sizeof(T));
+        return static_cast<bool>(in);
+    }
+
+    void save_tables(const std::string& path, uint64_t hash) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        const uint32_t value_size = sizeof(T);
+        const int32_t width = image.width, height = image.height;
+        out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+        out.write(reinterpret_cast<const char*>(&value_size), sizeof(value_size));
+        out.write(reinterpret_cast<const char*>(&width), sizeof(width));
+        out.write(reinterpret_cast<const char*>(&height), sizeof(height));
+        out.write(reinterpret_cast<const char*>(&total), sizeof(T));
+        out.write(reinterpret_cast<const char*>(weight.data()), weight.size() * sizeof(T));
+        out.write(reinterpret_cast<const char*>(conditional_cdf.data()), conditional_cdf.size() * sizeof(T));
+        out.write(reinterpret_cast<const char*>(marginal_cdf.data()), marginal_cdf.size() * sizeof(T));
+    }
+
+private:
+    float_image image;
+    std::vector<T> weight;
+    std::vector<T> conditional_cdf; // height rows of width + 1 entries
+    std::vector<T> marginal_cdf;    // height + 1 entries
+    T total = 0;
+};
+
+#endif
@@ -0,0 +1,98 @@
+// this file holds the least recently used cache that keeps pieces of out-of-core geometry resident
+// within a memory budget
+
+#pragma once
+#ifndef GEOMETRY_CACHE_H_
+#define GEOMETRY_CACHE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+//! What a Geometry_cache has done so far.
+struct geometry_cache_stats
+{
+    size_t requests = 0;
+    size_t loads = 0;           // requests that missed and loaded the piece
+    size_t evictions = 0;
+    size_t bytes_loaded = 0;
+    size_t peak_bytes = 0;      // most bytes resident at once
+};
+
+//! Pieces of geometry by number, loaded on first use and dropped least recently used first once the
+//! bytes they take pass the budget. Pieces are handed out through shared pointers, so one that is
+//! evicted while a caller still uses it lives until that caller lets go. Not thread safe: one thread
+//! asks for the pieces and may hand them to others.
+template<typename Piece>
+class Geometry_cache
+{
+public:
+    explicit Geometry_cache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    size_t budget_bytes() const { return budget; }
+    size_t resident_bytes() const { return used; }
+    const geometry_cache_stats& stats() const { return counters; }
+
+    bool contains(std::uint32_t key) const { return entries.count(key) != 0; }
+
+    //! The piece key, calling load(key) for it when it is not resident. load returns the piece and
+    //! the bytes it takes. The new piece is kept even if it alone is over the budget.
+    template<typename Load>
+    std::shared_ptr<const Piece> get(std::uint32_t key, Load&& load)
+    {
+        ++counters.requests;
+        auto found = entries.find(key);
+        if (found != entries.end())
+        {
+            order.splice(order.begin(), order, found->second.position);
+            return found->second.piece;
+        }
+
+        size_t bytes = 0;
+        std::shared_ptr<const Piece> piece = load(key, bytes);
+        ++counters.loads;
+        counters.bytes_loaded += bytes;
+
+        while (!order.empty() && used + bytes > budget) evict(order.back());
+        order.push_front(key);
+        entries.emplace(key, entry{ piece, bytes, order.begin() });
+        used += bytes;
+        counters.peak_bytes = std::max(counters.peak_bytes, used);
+        return piece;
+    }
+
+    void clear()
+    {
+        entries.clear();
+        order.clear();
+        used = 0;
+    }
+
+private:
+    struct entry
+    {
+        std::shared_ptr<const Piece> piece;
+        size_t bytes;
+        std::list<std::uint32_t>::iterator position;
+    };
+
+    void evict(std::uint32_t key)
+    {
+        auto found = entries.find(key);
+        used -= found->second.bytes;
+        order.erase(found->second.position);
+        entries.erase(found);
+        ++counters.evictions;
+    }
+
+private:
+    size_t budget;
+    size_t used = 0;
+    std::list<std::uint32_t> order;     // most recently used first
+    std::unordered_map<std::uint32_t, entry> entries;
+    geometry_cache_stats counters;
+};
+
+#endif
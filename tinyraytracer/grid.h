@@ -0,0 +1,264 @@
+// this file holds the uniform grid: primitives binned into equal cells, and rays walked through the
+// cells they cross in order with a 3D-DDA
+
+#pragma once
+#ifndef GRID_H_
+#define GRID_H_
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+//! Fills sizes with the longest box side of every primitive and returns the size above which a
+//! primitive counts as oversized: factor times the median.
+template<typename T, typename Primitives>
+T oversize_limit(const Primitives& prims, T factor, std::vector<T>& sizes)
+{
+    const size_t n = prims.size();
+    sizes.resize(n);
+    for (size_t k = 0; k < n; ++k)
+    {
+        const Vector3<T> e = prims.bounds(k).extent();
+        sizes[k] = std::max(e.x, std::max(e.y, e.z));
+    }
+    if (n == 0) return std::numeric_limits<T>::infinity();
+
+    std::vector<T> sorted(sizes);
+    std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+    return sorted[n / 2] > 0 ? factor * sorted[n / 2] : std::numeric_limits<T>::infinity();
+}
+
+//! Uniform grid over a set of primitives with the same interface Bvh uses. Every cell lists the
+//! primitives whose boxes overlap it, so a primitive may be listed in several cells. Suits primitives
+//! of similar size spread evenly through the scene; clusters leave most cells empty and a few full.
+template<typename T, typename Primitives = Sphere_set<T>>
+class Uniform_grid : public Accelerator<T>
+{
+public:
+    static constexpr int max_resolution = 1024;
+
+    //! Sizes the cells for about cells_per_primitive cells per primitive. Primitives more than
+    //! oversize_factor times the median size, such as a ground sphere, would stretch the grid and fill
+    //! most of its cells, so they are kept out of it and tested by every ray instead.
+    explicit Uniform_grid(Primitives primitives, T cells_per_primitive = 2, T oversize_factor = 16)
+        : prims(std::move(primitives))
+    {
+        const size_t n = prims.size();
+        if (n == 0) return;
+
+        std::vector<T> sizes;
+        const T limit = oversize_limit(prims, oversize_factor, sizes);
+
+        size_t gridded = 0;
+        for (size_t k = 0; k < n; ++k)
+        {
+            if (sizes[k] > limit)
+            {
+                oversized.push_back(static_cast<std::uint32_t>(k));
+                continue;
+            }
+            bounds.expand(prims.bounds(k));
+            ++gridded;
+        }
+        if (gridded == 0) return;
+
+        // A flat scene still needs cells of some thickness.
+        const Vector3<T> e = bounds.extent();
+        const T largest = std::max(e.x, std::max(e.y, e.z));
+        const T pad = largest > 0 ? largest * static_cast<T>(1e-3) : T(1);
+        for (int a = 0; a < 3; ++a)
+        {
+            if (e[a] > 0) continue;
+            bounds.minimum[a] -= pad;
+            bounds.maximum[a] += pad;
+        }
+
+        const Vector3<T> extent = bounds.extent();
+        const T volume = extent.x * extent.y * extent.z;
+        const T cells_per_unit = std::cbrt(cells_per_primitive * gridded / volume);
+        for (int a = 0; a < 3; ++a)
+        {
+            resolution[a] = std::min(std::max(static_cast<int>(std::ceil(extent[a] * cells_per_unit)), 1), max_resolution);
+            cell_size[a] = extent[a] / resolution[a];
+            inv_cell_size[a] = resolution[a] / extent[a];
+        }
+
+        // Count the primitives of every cell, turn the counts into offsets, then fill the cells.
+        const size_t cells = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+        cell_start.assign(cells + 1, 0);
+        auto for_each_cell = [&](size_t k, auto&& f)
+        {
+            const Aabb<T> box = prims.bounds(k);
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = cell_of(box.minimum[a], a);
+                hi[a] = cell_of(box.maximum[a], a);
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x) f(cell_index(x, y, z));
+        };
+        for (size_t k = 0; k < n; ++k)
+            if (sizes[k] <= limit) for_each_cell(k, [&](size_t c) { ++cell_start[c + 1]; });
+        for (size_t c = 0; c < cells; ++c) cell_start[c + 1] += cell_start[c];
+
+        references.resize(cell_start[cells]);
+        std::vector<std::uint32_t> cursor(cell_start.begin(), cell_start.end() - 1);
+        for (size_t k = 0; k < n; ++k)
+            if (sizes[k] <= limit) for_each_cell(k, [&](size_t c) { references[cursor[c]++] = static_cast<std::uint32_t>(k); });
+    }
+
+    const Primitives& primitives() const { return prims; }
+
+    size_t cell_count() const { return cell_start.empty() ? 0 : cell_start.size() - 1; }
+    size_t reference_count() const { return references.size(); }
+
+    virtual const char* name() const override { return "uniform grid"; }
+
+    virtual size_t memory_bytes() const override
+    {
+        return (cell_start.size() + references.size() + oversized.size()) * sizeof(std::uint32_t);
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        for (const std::vector<std::uint32_t>* array : { &cell_start, &references, &oversized })
+            f(array->data(), array->size() * sizeof(std::uint32_t));
+        prims.memory_blocks(f);
+    }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        bool hit_anything = false;
+        for (std::uint32_t k : oversized)
+        {
+            if (prims.intersect_range(k, 1, r, t_min, t_max, candidate))
+            {
+                hit_anything = true;
+                t_max = candidate.t;
+            }
+        }
+
+        walk(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t last, T cell_exit)
+            {
+                for (std::uint32_t i = first; i < last; ++i)
+                {
+                    if (prims.intersect_range(references[i], 1, r, t_min, t_max, candidate))
+                    {
+                        hit_anything = true;
+                        t_max = candidate.t;
+                    }
+                }
+                // Anything in the cells further on lies beyond cell_exit.
+                return t_max > cell_exit;
+            });
+        return hit_anything;
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        for (std::uint32_t k : oversized)
+            if (prims.occluded_range(k, 1, r, t_min, t_max)) return true;
+
+        bool blocked = false;
+        walk(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t last, T)
+            {
+                for (std::uint32_t i = first; i < last && !blocked; ++i)
+                    blocked = prims.occluded_range(references[i], 1, r, t_min, t_max);
+                return !blocked;
+            });
+        return blocked;
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = bounds;
+        for (std::uint32_t k : oversized) box.expand(prims.bounds(k));
+        return !box.empty();
+    }
+
+private:
+    int cell_of(T x, int axis) const
+    {
+        const int c = static_cast<int>((x - bounds.minimum[axis]) * inv_cell_size[axis]);
+        return std::min(std::max(c, 0), resolution[axis] - 1);
+    }
+
+    size_t cell_index(int x, int y, int z) const
+    {
+        return (static_cast<size_t>(z) * resolution[1] + y) * resolution[0] + x;
+    }
+
+    //! Visits the cells the ray crosses within [t_min, t_max] in order, calling
+    //! visit(first reference, end reference, t where the ray leaves the cell) until it returns false.
+    //! t_max may shrink while the walk goes on.
+    template<typename F>
+    void walk(const Ray<T>& r, T t_min, T& t_max, F&& visit) const
+    {
+        if (cell_start.empty()) return;
+
+        const Vector3<T> inv_dir(1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z);
+        T t_enter = t_min, t_exit = t_max;
+        if (!bounds.clip(r.orig, inv_dir, t_enter, t_exit)) return;
+
+        // Amanatides and Woo: per axis, the t of the next cell boundary and the t between boundaries.
+        const Point3<T> start = r.at(t_enter);
+        int cell[3], step[3], end[3];
+        T next[3], delta[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            cell[a] = cell_of(start[a], a);
+            if (r.dir[a] > 0)
+            {
+                step[a] = 1;
+                end[a] = resolution[a];
+                next[a] = (bounds.minimum[a] + (cell[a] + 1) * cell_size[a] - r.orig[a]) * inv_dir[a];
+                delta[a] = cell_size[a] * inv_dir[a];
+            }
+            else if (r.dir[a] < 0)
+            {
+                step[a] = -1;
+                end[a] = -1;
+                next[a] = (bounds.minimum[a] + cell[a] * cell_size[a] - r.orig[a]) * inv_dir[a];
+                delta[a] = -cell_size[a] * inv_dir[a];
+            }
+            else
+            {
+                step[a] = 0;
+                end[a] = -1;
+                next[a] = std::numeric_limits<T>::infinity();
+                delta[a] = 0;
+            }
+        }
+
+        while (true)
+        {
+            const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            const size_t c = cell_index(cell[0], cell[1], cell[2]);
+            if (!visit(cell_start[c], cell_start[c + 1], next[axis])) return;
+            if (next[axis] > t_max) return;
+
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis]) return;
+            next[axis] += delta[axis];
+        }
+    }
+
+private:
+    Primitives prims;
+    Aabb<T> bounds;
+    int resolution[3] = { 0, 0, 0 };
+    T cell_size[3], inv_cell_size[3];
+    std::vector<std::uint32_t> cell_start;      // cell c lists references [cell_start[c], cell_start[c + 1])
+    std::vector<std::uint32_t> references;
+    std::vector<std::uint32_t> oversized;       // primitives tested by every ray
+};
+
+#endif
@@ -3,11 +3,18 @@
 #define HITTABLE_H_
 
 #include "ray.h"
+#include "aabb.h"
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <stdexcept>
 
 using std::shared_ptr;
 using std::make_shared;
 
+//! Receives one contiguous block of memory: its start and its size in bytes.
+using memory_block_fn = std::function<void(const void*, size_t)>;
+
 template<typename T>
 class Material;
 
@@ -28,11 +35,61 @@ struct hit_record
     }
 };
 
+template<typename T>
+class Hittable;
+
+//! What the closest-hit search keeps per candidate: the distance and the primitive that was hit.
+//! object is the leaf that owns the primitive and builds its hit_record in finalize.
+template<typename T>
+struct hit_candidate
+{
+    T t;
+    const Hittable<T>* object;
+    size_t primitive;
+    const Hittable<T>* inner;   // set by Instance only: the object inside it that was hit
+};
+
 template<typename T>
 class Hittable 
 {
 public:
-    virtual bool hit(const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const = 0;
+    virtual ~Hittable() = default;
+
+    //! Finds the nearest intersection within [t_min, t_max]. On success overwrites candidate and
+    //! returns true; no shading data is computed.
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const = 0;
+
+    //! Builds the full hit_record for a candidate this object reported from intersect. Objects
+    //! that only forward to others never name themselves in a candidate and keep this default,
+    //! which throws, since reaching it means a leaf left its own finalize out.
+    virtual void finalize(const Ray<T>& /*r*/, const hit_candidate<T>& /*candidate*/, hit_record<T>& /*rec*/) const
+    {
+        throw std::runtime_error("finalize called on an object that reports no candidates of its own");
+    }
+
+    //! Closest hit with its shading data, which is computed once for the winning primitive only.
+    virtual bool hit(const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const
+    {
+        hit_candidate<T> candidate;
+        if (!intersect(r, t_min, t_max, candidate)) return false;
+        candidate.object->finalize(r, candidate, rec);
+        return true;
+    }
+
+    //! Returns true if anything lies on the ray within [t_min, t_max]. Unlike hit it may stop at
+    //! the first intersection found; this default just falls back to intersect.
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const
+    {
+        hit_candidate<T> candidate;
+        return intersect(r, t_min, t_max, candidate);
+    }
+
+    //! Box around everything the object can hit. Returns false if the object has no finite bounds.
+    virtual bool bounding_box(Aabb<T>& /*box*/) const { return false; }
+
+    //! Calls f on every large array the object reads while tracing, its own and those of the
+    //! objects inside it, so that the caller can decide where that memory lives (see concurrency.h).
+    virtual void memory_blocks(const memory_block_fn& /*f*/) const {}
 };
 
 #endif
\ No newline at end of file
@@ -17,25 +17,48 @@ public:
     void clear() { objects.clear(); }
     void add(shared_ptr<Hittable<T>> object) { objects.push_back(object); }
 
-    virtual bool hit(
-        const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const override
+    virtual bool intersect(
+        const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
     {
-        hit_record<T> temp_rec;
         bool hit_anything = false;
         auto closest_so_far = t_max;
 
         for (const auto& object : objects) {
-            if (object->hit(r, t_min, closest_so_far, temp_rec))
+            if (object->intersect(r, t_min, closest_so_far, candidate))
             {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = candidate.t;
             }
         }
 
         return hit_anything;
     }
 
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        for (const auto& object : objects) {
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = Aabb<T>();
+        for (const auto& object : objects) {
+            Aabb<T> object_box;
+            if (!object->bounding_box(object_box)) return false;
+            box.expand(object_box);
+        }
+        return !objects.empty();
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        for (const auto& object : objects) object->memory_blocks(f);
+    }
+
 public:
     std::vector<shared_ptr<Hittable<T>>> objects;
 };
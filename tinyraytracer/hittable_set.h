@@ -0,0 +1,70 @@
+#pragma once
+#ifndef HITTABLE_SET_H_
+#define HITTABLE_SET_H_
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <vector>
+
+//! Arbitrary bounded objects as a primitive set for Bvh, for instance the instances of a top level.
+//! Every object must report a bounding_box.
+template<typename T>
+class Hittable_set
+{
+public:
+    Hittable_set() {}
+
+    void add(shared_ptr<Hittable<T>> object) { objects.push_back(std::move(object)); }
+
+    size_t size() const { return objects.size(); }
+
+    void resize(size_t n) { objects.resize(n); }
+
+    Aabb<T> bounds(size_t k) const
+    {
+        Aabb<T> box;
+        objects[k]->bounding_box(box);
+        return box;
+    }
+
+    Point3<T> centroid(size_t k) const { return bounds(k).center(); }
+
+    bool intersect_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const
+    {
+        bool hit_anything = false;
+        for (size_t k = first; k < first + count; ++k)
+        {
+            if (objects[k]->intersect(r, t_min, t_max, candidate))
+            {
+                hit_anything = true;
+                t_max = candidate.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    bool occluded_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max) const
+    {
+        for (size_t k = first; k < first + count; ++k)
+            if (objects[k]->occluded(r, t_min, t_max)) return true;
+        return false;
+    }
+
+    void permute(const std::vector<size_t>& order)
+    {
+        std::vector<shared_ptr<Hittable<T>>> sorted(objects.size());
+        for (size_t k = 0; k < order.size(); ++k) sorted[k] = std::move(objects[order[k]]);
+        objects.swap(sorted);
+    }
+
+    void memory_blocks(const memory_block_fn& f) const
+    {
+        for (const auto& object : objects) object->memory_blocks(f);
+    }
+
+public:
+    std::vector<shared_ptr<Hittable<T>>> objects;
+};
+
+#endif
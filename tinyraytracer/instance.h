@@ -0,0 +1,143 @@
+// this file holds object instancing: an Instance places a shared bottom-level object in the world
+// through an affine transform, and Top_level_bvh is the hierarchy over many instances
+
+#pragma once
+#ifndef INSTANCE_H_
+#define INSTANCE_H_
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_set.h"
+#include "transform.h"
+#include "bvh.h"
+#include "bvh_builder.h"
+
+#include <memory>
+#include <vector>
+
+//! A copy of object placed by object_to_world. The object is shared, not copied, so any number of
+//! instances cost the memory of one. Rays are carried into object space instead of the geometry
+//! into world space; the direction is not renormalized, so distances t are the same in both.
+//! Instances may not be nested: the object must not itself contain an Instance.
+template<typename T>
+class Instance : public Hittable<T>
+{
+public:
+    Instance(shared_ptr<const Hittable<T>> object, const Affine_transform<T>& object_to_world)
+        : object(std::move(object))
+    {
+        this->object->bounding_box(object_bounds);
+        set_transform(object_to_world);
+    }
+
+    void set_transform(const Affine_transform<T>& object_to_world)
+    {
+        to_world = object_to_world;
+        to_object = object_to_world.inverse();
+        world_bounds = to_world.bounds(object_bounds);
+    }
+
+    const Affine_transform<T>& transform() const { return to_world; }
+    const Hittable<T>& shared_object() const { return *object; }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        if (!object->intersect(local_ray(r), t_min, t_max, candidate)) return false;
+        candidate.inner = candidate.object;
+        candidate.object = this;
+        return true;
+    }
+
+    virtual void finalize(const Ray<T>& r, const hit_candidate<T>& candidate, hit_record<T>& rec) const override
+    {
+        hit_candidate<T> inner = candidate;
+        inner.object = candidate.inner;
+        candidate.inner->finalize(local_ray(r), inner, rec);
+
+        // A linear map keeps the sign of normal . direction, so front_face holds as it is.
+        rec.p = r.at(candidate.t);
+        rec.normal = to_object.transposed_vector(rec.normal).normalized();
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        return object->occluded(local_ray(r), t_min, t_max);
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = world_bounds;
+        return !world_bounds.empty();
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override { object->memory_blocks(f); }
+
+private:
+    Ray<T> local_ray(const Ray<T>& r) const { return Ray<T>(to_object.point(r.orig), to_object.vector(r.dir)); }
+
+private:
+    shared_ptr<const Hittable<T>> object;
+    Affine_transform<T> to_world, to_object;
+    Aabb<T> object_bounds, world_bounds;
+};
+
+//! Top level of a two-level hierarchy: a Bvh over instances, each pointing at a shared bottom-level
+//! structure. Moving instances only needs build() again, which touches one box per instance.
+template<typename T>
+class Top_level_bvh : public Hittable<T>
+{
+public:
+    Top_level_bvh() : builder(1) {}
+
+    size_t add(shared_ptr<Instance<T>> instance)
+    {
+        instances.push_back(std::move(instance));
+        return instances.size() - 1;
+    }
+
+    size_t size() const { return instances.size(); }
+
+    //! Call build() after changing transforms and before tracing again.
+    Instance<T>& instance(size_t index) { return *instances[index]; }
+
+    //! Builds the hierarchy over the instances where they are now; the shared objects are untouched.
+    void build()
+    {
+        Hittable_set<T> set;
+        set.objects.assign(instances.begin(), instances.end());
+        bvh.reset(new Bvh<T, Hittable_set<T>>(builder.build(std::move(set))));
+    }
+
+    //! Memory of the top level itself: its nodes and the instances, not the objects they share.
+    size_t memory_bytes() const
+    {
+        return (bvh ? bvh->memory_bytes() : 0) + instances.size() * (sizeof(Instance<T>) + sizeof(shared_ptr<Hittable<T>>));
+    }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        return bvh && bvh->intersect(r, t_min, t_max, candidate);
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        return bvh && bvh->occluded(r, t_min, t_max);
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        return bvh && bvh->bounding_box(box);
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        if (bvh) bvh->memory_blocks(f);
+    }
+
+private:
+    std::vector<shared_ptr<Instance<T>>> instances;
+    Parallel_bvh_builder<T, Hittable_set<T>> builder;
+    std::unique_ptr<Bvh<T, Hittable_set<T>>> bvh;
+};
+
+#endif
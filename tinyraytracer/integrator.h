@@ -0,0 +1,129 @@
+#pragma once
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "lights.h"
+
+#include <functional>
+
+//! The default background: a white to blue gradient over the ray's height.
+template<typename T>
+Color<T> sky_background(const Ray<T>& r)
+{
+    Vector3<T> unit_direction = r.direction().normalized();
+    auto t = 0.5 * (unit_direction.y + 1.0);
+    return (1.0 - t) * Color<T>(1.0, 1.0, 1.0) + t * Color<T>(0.5, 0.7, 1.0);
+}
+
+template<typename T>
+Color<T> black_background(const Ray<T>& /*r*/)
+{
+    return Color<T>::zero();
+}
+
+//! Radiance of rays that leave the scene.
+template<typename T>
+using background_fn = std::function<Color<T>(const Ray<T>&)>;
+
+template<typename T>
+Color<T> ray_color(const Ray<T>& r, const Hittable<T>& world, int depth,
+    const background_fn<T>& background = &sky_background<T>);
+
+//! Radiance along r given where it first hits the world: what ray_color returns after its search.
+//! Path splitting calls it several times for one hit to continue several paths from it.
+template<typename T>
+Color<T> ray_color_from_hit(const Ray<T>& r, const hit_record<T>& rec, const Hittable<T>& world, int depth,
+    const background_fn<T>& background)
+{
+    Ray<T> scattered;
+    Color<T> attenuation;
+    Color<T> emitted = rec.mat_ptr->emitted(rec);
+    if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        return emitted + attenuation * ray_color(scattered, world, depth - 1, background);
+    return emitted;
+}
+
+template<typename T>
+Color<T> ray_color(const Ray<T>& r, const Hittable<T>& world, int depth,
+    const background_fn<T>& background)
+{
+    if (depth <= 0) return Color<T>::zero();
+
+    hit_record<T> rec;
+    if (world.hit(r, 0.0001, MAX_DOUBLE, rec))
+        return ray_color_from_hit(r, rec, world, depth, background);
+    return background(r);
+}
+
+//! Power heuristic with beta = 2 for combining two sampling strategies.
+template<typename T>
+inline T power_heuristic(T pdf, T other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+//! Path tracer that samples a light at every diffuse bounce (next event estimation) and weights it
+//! against hitting the same light by BSDF sampling with multiple importance sampling.
+template<typename T>
+Color<T> ray_color_nee(const Ray<T>& r_in, const Hittable<T>& world, const Light_list<T>& lights, int depth,
+    const background_fn<T>& background = &sky_background<T>)
+{
+    Color<T> radiance(0, 0, 0);
+    Color<T> throughput(1, 1, 1);
+    Ray<T> r = r_in;
+
+    // Solid-angle density of the last bounce if it was diffuse, 0 after the camera or a delta lobe.
+    T bsdf_pdf = 0;
+    Point3<T> last_p;
+
+    for (int bounce = 0; bounce < depth; ++bounce)
+    {
+        hit_record<T> rec;
+        if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) {
+            const T weight = bsdf_pdf > 0 && lights.has_environment()
+                ? power_heuristic(bsdf_pdf, lights.environment_pdf(r.direction())) : T(1);
+            radiance += weight * (throughput * background(r));
+            break;
+        }
+
+        const Material<T>& material = *rec.mat_ptr;
+        if (material.is_emissive())
+        {
+            T weight = 1;
+            if (bsdf_pdf > 0)
+            {
+                const ptrdiff_t light = lights.find(rec.p);
+                if (light >= 0) weight = power_heuristic(bsdf_pdf, lights.pdf(last_p, light));
+            }
+            radiance += weight * (throughput * material.emitted(rec));
+        }
+
+        if (material.is_diffuse() && !lights.empty())
+        {
+            light_sample<T> ls;
+            if (lights.sample(rec.p, ls) && ls.direction.dot(rec.normal) > 0 &&
+                !world.occluded(Ray<T>(rec.p, ls.direction), 0.0001, ls.distance - 0.0001))
+            {
+                const T weight = power_heuristic(ls.pdf, material.pdf(rec, ls.direction));
+                radiance += (weight / ls.pdf) * (throughput * material.eval(rec, ls.direction) * ls.emitted);
+            }
+        }
+
+        Ray<T> scattered;
+        Color<T> attenuation;
+        if (!material.scatter(r, rec, attenuation, scattered)) break;
+
+        throughput = throughput * attenuation;
+        bsdf_pdf = material.is_diffuse() ? material.pdf(rec, scattered.direction().normalized()) : 0;
+        last_p = rec.p;
+        r = scattered;
+    }
+    return radiance;
+}
+
+#endif
@@ -0,0 +1,309 @@
+// this file holds the k-d tree: space split by axis-aligned planes chosen with binned SAH, with
+// primitives that straddle a plane listed on both sides, traversed front to back
+
+#pragma once
+#ifndef KD_TREE_H_
+#define KD_TREE_H_
+
+#include "aabb.h"
+#include "accelerator.h"
+#include "sphere_set.h"
+#include "grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+//! Eight bytes per node. An interior node's child below the plane follows it directly; bits holds the
+//! split axis in its low two bits and the index of the child above the plane in the rest. A leaf has 3
+//! in the low bits, its primitive count in the rest, and lists references [first, first + count).
+struct kd_node
+{
+    union
+    {
+        float split;
+        std::uint32_t first;
+    };
+    std::uint32_t bits;
+
+    bool leaf() const { return (bits & 3) == 3; }
+    int axis() const { return static_cast<int>(bits & 3); }
+    std::uint32_t above() const { return bits >> 2; }
+    std::uint32_t count() const { return bits >> 2; }
+};
+static_assert(sizeof(kd_node) == 8, "a k-d tree node should take eight bytes");
+
+//! k-d tree over a set of primitives with the same interface Bvh uses. Unlike a BVH its cells do not
+//! overlap, so traversal can stop at the first cell with a hit, at the price of listing primitives in
+//! every leaf they reach into.
+template<typename T, typename Primitives = Sphere_set<T>>
+class Kd_tree : public Accelerator<T>
+{
+public:
+    static constexpr int bin_count = 32;
+    static constexpr int max_stack = 64;
+
+    //! Primitives more than oversize_factor times the median size are tested by every ray instead.
+    explicit Kd_tree(Primitives primitives, int max_leaf_size = 4, T oversize_factor = 16)
+        : prims(std::move(primitives)), max_leaf_size(std::max(max_leaf_size, 1))
+    {
+        const size_t n = prims.size();
+        if (n == 0) return;
+
+        // As in Uniform_grid, a few huge primitives would reach into nearly every leaf.
+        std::vector<T> sizes;
+        const T limit = oversize_limit(prims, oversize_factor, sizes);
+        std::vector<Aabb<T>> boxes(n);
+        std::vector<std::uint32_t> all;
+        all.reserve(n);
+        for (size_t k = 0; k < n; ++k)
+        {
+            if (sizes[k] > limit)
+            {
+                oversized.push_back(static_cast<std::uint32_t>(k));
+                continue;
+            }
+            boxes[k] = prims.bounds(k);
+            bounds.expand(boxes[k]);
+            all.push_back(static_cast<std::uint32_t>(k));
+        }
+        if (all.empty()) return;
+
+        const int max_depth = std::min(static_cast<int>(8 + 1.3 * std::log2(static_cast<double>(all.size()))), max_stack - 1);
+        build(boxes, all, bounds, max_depth, 0);
+    }
+
+    const Primitives& primitives() const { return prims; }
+
+    size_t node_count() const { return nodes.size(); }
+    size_t reference_count() const { return references.size(); }
+
+    virtual const char* name() const override { return "k-d tree"; }
+
+    virtual size_t memory_bytes() const override
+    {
+        return nodes.size() * sizeof(kd_node) + (references.size() + oversized.size()) * sizeof(std::uint32_t);
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        f(nodes.data(), nodes.size() * sizeof(kd_node));
+        f(references.data(), references.size() * sizeof(std::uint32_t));
+        f(oversized.data(), oversized.size() * sizeof(std::uint32_t));
+        prims.memory_blocks(f);
+    }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        bool hit_anything = false;
+        for (std::uint32_t k : oversized)
+        {
+            if (prims.intersect_range(k, 1, r, t_min, t_max, candidate))
+            {
+                hit_anything = true;
+                t_max = candidate.t;
+            }
+        }
+
+        traverse(r, t_min, t_max, [&](const kd_node& leaf)
+            {
+                for (std::uint32_t i = leaf.first; i < leaf.first + leaf.count(); ++i)
+                {
+                    if (prims.intersect_range(references[i], 1, r, t_min, t_max, candidate))
+                    {
+                        hit_anything = true;
+                        t_max = candidate.t;
+                    }
+                }
+                return true;
+            });
+        return hit_anything;
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        for (std::uint32_t k : oversized)
+            if (prims.occluded_range(k, 1, r, t_min, t_max)) return true;
+
+        bool blocked = false;
+        traverse(r, t_min, t_max, [&](const kd_node& leaf)
+            {
+                for (std::uint32_t i = leaf.first; i < leaf.first + leaf.count() && !blocked; ++i)
+                    blocked = prims.occluded_range(references[i], 1, r, t_min, t_max);
+                return !blocked;
+            });
+        return blocked;
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = bounds;
+        for (std::uint32_t k : oversized) box.expand(prims.bounds(k));
+        return !box.empty();
+    }
+
+private:
+    // Relative costs of stepping through a node and of testing a primitive, and the discount for a
+    // split that cuts off empty space.
+    static constexpr T traversal_cost = 1;
+    static constexpr T intersection_cost = 20;
+    static constexpr T empty_bonus = static_cast<T>(0.5);
+
+    void build(const std::vector<Aabb<T>>& boxes, std::vector<std::uint32_t>& list, const Aabb<T>& node_bounds, int depth, int bad_refines)
+    {
+        const std::uint32_t index = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+        const size_t count = list.size();
+
+        auto make_leaf = [&]
+        {
+            nodes[index].first = static_cast<std::uint32_t>(references.size());
+            nodes[index].bits = static_cast<std::uint32_t>(count) << 2 | 3;
+            references.insert(references.end(), list.begin(), list.end());
+        };
+        if (count <= static_cast<size_t>(max_leaf_size) || depth == 0) return make_leaf();
+
+        // Binned SAH: a primitive starts in the bin of its minimum and ends in the bin of its maximum,
+        // so the planes between bins see every primitive that starts before them on the lower side
+        // and every one that ends after them on the upper side.
+        const Vector3<T> extent = node_bounds.extent();
+        const T total_area = node_bounds.surface_area();
+        const T leaf_cost = intersection_cost * count;
+        T best_cost = std::numeric_limits<T>::infinity();
+        int best_axis = -1;
+        float best_split = 0;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0) continue;
+            size_t starts[bin_count] = {}, ends[bin_count] = {};
+            const T to_bin = bin_count / extent[axis];
+            auto bin_of = [&](T x)
+            {
+                const int b = static_cast<int>((x - node_bounds.minimum[axis]) * to_bin);
+                return std::min(std::max(b, 0), bin_count - 1);
+            };
+            for (std::uint32_t k : list)
+            {
+                ++starts[bin_of(boxes[k].minimum[axis])];
+                ++ends[bin_of(boxes[k].maximum[axis])];
+            }
+
+            const int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+            const T cap = 2 * extent[other0] * extent[other1];
+            const T side = 2 * (extent[other0] + extent[other1]);
+            size_t below = 0, ended = 0;
+            for (int b = 1; b < bin_count; ++b)
+            {
+                below += starts[b - 1];
+                ended += ends[b - 1];
+                const size_t above = count - ended;
+                const float split = static_cast<float>(node_bounds.minimum[axis] + extent[axis] * b / bin_count);
+                const T plane = static_cast<T>(split);
+                if (plane <= node_bounds.minimum[axis] || plane >= node_bounds.maximum[axis]) continue;
+
+                const T area_below = cap + side * (plane - node_bounds.minimum[axis]);
+                const T area_above = cap + side * (node_bounds.maximum[axis] - plane);
+                const T bonus = below == 0 || above == 0 ? empty_bonus : T(0);
+                const T cost = traversal_cost + intersection_cost * (1 - bonus) * (area_below * below + area_above * above) / total_area;
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = split;
+                }
+            }
+        }
+
+        // Give up on a branch that keeps costing more than a leaf would.
+        if (best_axis < 0) return make_leaf();
+        if (best_cost > leaf_cost) ++bad_refines;
+        if ((best_cost > 4 * leaf_cost && count < 16) || bad_refines == 3) return make_leaf();
+
+        const T plane = static_cast<T>(best_split);
+        std::vector<std::uint32_t> below_list, above_list;
+        for (std::uint32_t k : list)
+        {
+            if (boxes[k].minimum[best_axis] < plane || boxes[k].maximum[best_axis] <= plane) below_list.push_back(k);
+            if (boxes[k].maximum[best_axis] > plane) above_list.push_back(k);
+        }
+        std::vector<std::uint32_t>().swap(list);
+
+        Aabb<T> below_bounds = node_bounds, above_bounds = node_bounds;
+        below_bounds.maximum[best_axis] = plane;
+        above_bounds.minimum[best_axis] = plane;
+
+        build(boxes, below_list, below_bounds, depth - 1, bad_refines);
+        const std::uint32_t above = static_cast<std::uint32_t>(nodes.size());
+        build(boxes, above_list, above_bounds, depth - 1, bad_refines);
+        nodes[index].split = best_split;
+        nodes[index].bits = above << 2 | static_cast<std::uint32_t>(best_axis);
+    }
+
+    //! Visits the leaves the ray crosses within [t_min, t_max] front to back, calling visit(leaf)
+    //! until it returns false. Stops early once t_max, which visit may lower, falls short of the next leaf.
+    template<typename F>
+    void traverse(const Ray<T>& r, T t_min, T& t_max, F&& visit) const
+    {
+        if (nodes.empty()) return;
+
+        const Vector3<T> inv_dir(1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z);
+        T node_min = t_min, node_max = t_max;
+        if (!bounds.clip(r.orig, inv_dir, node_min, node_max)) return;
+
+        struct pending { std::uint32_t node; T t_min, t_max; };
+        pending stack[max_stack];
+        int top = 0;
+        std::uint32_t current = 0;
+        while (true)
+        {
+            if (t_max < node_min) return;
+
+            const kd_node& node = nodes[current];
+            if (node.leaf())
+            {
+                if (!visit(node)) return;
+                if (top == 0) return;
+                --top;
+                current = stack[top].node;
+                node_min = stack[top].t_min;
+                node_max = stack[top].t_max;
+                continue;
+            }
+
+            const int axis = node.axis();
+            const T plane = static_cast<T>(node.split);
+            const T t_plane = (plane - r.orig[axis]) * inv_dir[axis];
+            const bool below_first = r.orig[axis] < plane || (r.orig[axis] == plane && r.dir[axis] <= 0);
+            const std::uint32_t first = below_first ? current + 1 : node.above();
+            const std::uint32_t second = below_first ? node.above() : current + 1;
+
+            if (t_plane > node_max || t_plane <= 0)
+            {
+                current = first;
+            }
+            else if (t_plane < node_min)
+            {
+                current = second;
+            }
+            else
+            {
+                stack[top++] = pending{ second, t_plane, node_max };
+                current = first;
+                node_max = t_plane;
+            }
+        }
+    }
+
+private:
+    Primitives prims;
+    int max_leaf_size;
+    Aabb<T> bounds;
+    std::vector<kd_node> nodes;
+    std::vector<std::uint32_t> references;
+    std::vector<std::uint32_t> oversized;       // primitives tested by every ray
+};
+
+#endif
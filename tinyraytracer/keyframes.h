@@ -0,0 +1,54 @@
+#pragma once
+#ifndef KEYFRAMES_H_
+#define KEYFRAMES_H_
+
+#include "vector3.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+template<typename T>
+struct keyframe
+{
+    T time;
+    Point3<T> position;
+};
+
+//! A position over time, interpolated linearly between keyframes and held before the first and after the last.
+template<typename T>
+class Keyframe_track
+{
+public:
+    Keyframe_track() {}
+
+    //! Keys may be added in any order.
+    Keyframe_track& add(T time, const Point3<T>& position)
+    {
+        const auto after = std::upper_bound(keys.begin(), keys.end(), time,
+            [](T t, const keyframe<T>& key) { return t < key.time; });
+        keys.insert(after, keyframe<T>{ time, position });
+        return *this;
+    }
+
+    bool empty() const { return keys.empty(); }
+
+    //! Throws on a track without keys, which has no position at any time.
+    Point3<T> at(T time) const
+    {
+        if (keys.empty()) throw std::runtime_error("keyframe track has no keys");
+        if (time <= keys.front().time) return keys.front().position;
+        if (time >= keys.back().time) return keys.back().position;
+
+        const auto next = std::upper_bound(keys.begin(), keys.end(), time,
+            [](T t, const keyframe<T>& key) { return t < key.time; });
+        const auto previous = next - 1;
+        const T u = (time - previous->time) / (next->time - previous->time);
+        return previous->position + u * (next->position - previous->position);
+    }
+
+public:
+    std::vector<keyframe<T>> keys;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#pragma once
+#ifndef LIGHTS_H_
+#define LIGHTS_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere_set.h"
+#include "environment.h"
+
+#include <cmath>
+#include <vector>
+
+//! A direction towards a light picked by Light_list::sample.
+template<typename T>
+struct light_sample
+{
+    Vector3<T> direction;   // unit vector
+    T distance;             // along direction to the light's surface, infinite for the environment
+    T pdf;                  // solid-angle density, including the choice of light
+    Color<T> emitted;
+};
+
+//! The emissive spheres of a scene, sampled over the solid angle they subtend (next event estimation),
+//! and optionally an environment light sampled through its luminance tables.
+template<typename T>
+class Light_list
+{
+public:
+    struct sphere_light
+    {
+        Point3<T> center;
+        T radius;
+        shared_ptr<Material<T>> material;
+    };
+
+    Light_list() {}
+
+    explicit Light_list(const Hittable_list<T>& world)
+    {
+        for_each_sphere(world,
+            [&](const Point3<T>& center, T radius, const shared_ptr<Material<T>>& m)
+            {
+                if (m->is_emissive()) lights.push_back(sphere_light{ center, radius, m });
+            },
+            [](const shared_ptr<Hittable<T>>&) {});
+    }
+
+    //! The environment is not owned and must outlive the list. The integrator's background
+    //! should return the same radiance, so that escaping rays are weighted against it.
+    void set_environment(const Environment_light<T>* env) { environment = env; }
+
+    bool has_environment() const { return environment != nullptr; }
+
+    bool empty() const { return lights.empty() && !environment; }
+    size_t size() const { return lights.size() + (environment ? 1 : 0); }
+
+    //! Picks a light uniformly. For a sphere the direction is uniform inside the cone it subtends
+    //! from p, for the environment it follows the image's luminance.
+    //! Returns false if p lies inside the chosen light.
+    bool sample(const Point3<T>& p, light_sample<T>& s) const
+    {
+        const size_t index = std::min(static_cast<size_t>(random_generate<T>() * size()), size() - 1);
+        if (index == lights.size())
+        {
+            T pdf;
+            s.direction = environment->sample(pdf);
+            s.distance = std::numeric_limits<T>::infinity();
+            s.pdf = pdf / size();
+            s.emitted = environment->radiance(s.direction);
+            return pdf > 0;
+        }
+
+        const sphere_light& light = lights[index];
+
+        const Vector3<T> to_center = light.center - p;
+        const T distance_squared = to_center.norm_squared();
+        if (distance_squared <= light.radius * light.radius) return false;
+
+        const T distance = std::sqrt(distance_squared);
+        const T cos_theta_max = std::sqrt(1 - light.radius * light.radius / distance_squared);
+        const T cos_theta = 1 + random_generate<T>() * (cos_theta_max - 1);
+        const T sin_theta = std::sqrt(std::fmax(T(0), 1 - cos_theta * cos_theta));
+        const T phi = 2 * pi<T>() * random_generate<T>();
+
+        // Orthonormal basis around the axis to the light's center.
+        const Vector3<T> w = to_center / distance;
+        const Vector3<T> a = std::fabs(w.x) > T(0.9) ? Vector3<T>(0, 1, 0) : Vector3<T>(1, 0, 0);
+        const Vector3<T> v = w.cross(a).normalized();
+        const Vector3<T> u = w.cross(v);
+
+        s.direction = (std::cos(phi) * sin_theta) * u + (std::sin(phi) * sin_theta) * v + cos_theta * w;
+        s.distance = distance * cos_theta - std::sqrt(std::fmax(T(0), light.radius * light.radius - distance_squared * sin_theta * sin_theta));
+        s.pdf = cone_pdf(cos_theta_max) / size();
+
+        hit_record<T> rec;
+        rec.p = p + s.distance * s.direction;
+        rec.set_face_normal(Ray<T>(p, s.direction), (rec.p - light.center) / light.radius);
+        s.emitted = light.material->emitted(rec);
+        return true;
+    }
+
+    //! Density with which sample() picks a direction from p that lands on light index.
+    T pdf(const Point3<T>& p, size_t index) const
+    {
+        const sphere_light& light = lights[index];
+        const T distance_squared = (light.center - p).norm_squared();
+        if (distance_squared <= light.radius * light.radius) return 0;
+        return cone_pdf(std::sqrt(1 - light.radius * light.radius / distance_squared)) / size();
+    }
+
+    //! Density with which sample() picks direction from the environment.
+    T environment_pdf(const Vector3<T>& direction) const
+    {
+        return environment ? environment->pdf(direction) / size() : 0;
+    }
+
+    //! Index of the light whose surface q lies on, or -1.
+    ptrdiff_t find(const Point3<T>& q) const
+    {
+        ptrdiff_t closest = -1;
+        T best = std::numeric_limits<T>::max();
+        for (size_t k = 0; k < lights.size(); ++k)
+        {
+            const T off_surface = std::fabs((q - lights[k].center).norm() - lights[k].radius);
+            if (off_surface < best) { best = off_surface; closest = static_cast<ptrdiff_t>(k); }
+        }
+        return closest >= 0 && best < T(1e-3) * (1 + lights[closest].radius) ? closest : -1;
+    }
+
+public:
+    std::vector<sphere_light> lights;
+
+private:
+    const Environment_light<T>* environment = nullptr;
+
+    static T cone_pdf(T cos_theta_max) { return 1 / (2 * pi<T>() * (1 - cos_theta_max)); }
+};
+
+#endif
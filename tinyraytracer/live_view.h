@@ -0,0 +1,448 @@
+// this file holds the live view: the render's accumulation buffer published tile by tile into shared
+// memory for other processes to watch, and a local socket through which they can move the camera
+
+#pragma once
+#ifndef LIVE_VIEW_H_
+#define LIVE_VIEW_H_
+
+#include "utilities.h"
+#include "color.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+template<typename T>
+class Framebuffer;
+
+//! A named block of memory other processes can map: POSIX shared memory (shm_open), or a
+//! pagefile-backed file mapping on Windows. The creator removes the name when it is destroyed.
+class Shared_memory
+{
+public:
+    //! Creates the segment, replacing any left over under the same name.
+    static Shared_memory create(const std::string& name, size_t bytes) { return Shared_memory(name, bytes, true); }
+
+    //! Maps an existing segment read-only.
+    static Shared_memory open(const std::string& name) { return Shared_memory(name, 0, false); }
+
+    Shared_memory(Shared_memory&& other) noexcept
+        : name(std::move(other.name)), owner(other.owner), view(other.view), bytes(other.bytes)
+#if defined(_WIN32)
+        , mapping(other.mapping)
+#endif
+    {
+        other.view = nullptr;
+        other.owner = false;
+#if defined(_WIN32)
+        other.mapping = nullptr;
+#endif
+    }
+
+    ~Shared_memory()
+    {
+#if defined(_WIN32)
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+#else
+        if (view) munmap(view, bytes);
+        if (owner) shm_unlink(name.c_str());
+#endif
+    }
+
+    Shared_memory(const Shared_memory&) = delete;
+    Shared_memory& operator=(const Shared_memory&) = delete;
+
+    void* data() const { return view; }
+    size_t size() const { return bytes; }
+
+private:
+    Shared_memory(const std::string& segment, size_t size, bool create)
+        : bytes(size)
+    {
+#if defined(_WIN32)
+        name = "Local\\" + segment;
+        if (create)
+        {
+            mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                static_cast<DWORD>(static_cast<std::uint64_t>(bytes) >> 32), static_cast<DWORD>(bytes), name.c_str());
+            if (mapping) view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+        }
+        else
+        {
+            mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+            if (mapping) view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            MEMORY_BASIC_INFORMATION info;
+            if (view && VirtualQuery(view, &info, sizeof(info))) bytes = info.RegionSize;
+        }
+        if (!view)
+        {
+            if (mapping) CloseHandle(mapping);
+            mapping = nullptr;
+            throw std::runtime_error("cannot " + std::string(create ? "create" : "open") + " shared memory " + segment);
+        }
+#else
+        name = segment.empty() || segment[0] != '/' ? "/" + segment : segment;
+        if (create) shm_unlink(name.c_str());
+        const int descriptor = shm_open(name.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDONLY, 0644);
+        if (descriptor < 0)
+            throw std::runtime_error("cannot " + std::string(create ? "create" : "open") + " shared memory " + name);
+        struct stat status;
+        const bool sized = create ? ftruncate(descriptor, static_cast<off_t>(bytes)) == 0
+            : fstat(descriptor, &status) == 0 && (bytes = static_cast<size_t>(status.st_size)) > 0;
+        if (sized) view = mmap(nullptr, bytes, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, descriptor, 0);
+        close(descriptor);
+        if (!sized || view == MAP_FAILED)
+        {
+            view = nullptr;
+            if (create) shm_unlink(name.c_str());
+            throw std::runtime_error("cannot map shared memory " + name);
+        }
+        owner = create;
+#endif
+    }
+
+private:
+    std::string name;
+    bool owner = false;
+    void* view = nullptr;
+    size_t bytes = 0;
+#if defined(_WIN32)
+    HANDLE mapping = nullptr;
+#endif
+};
+
+// Layout of the segment: a live_header, one live_tile per tile in row-major tile order, then the
+// pixels as float RGB, rows from the bottom as in Framebuffer, each already divided by its samples.
+// The atomics are lock-free and so work across processes.
+
+struct live_header
+{
+    char magic[8];
+    std::uint32_t width, height, tile_size, tiles_x, tiles_y, reserved;
+    std::atomic<std::uint64_t> generation;      // camera changes so far
+    std::atomic<std::uint64_t> samples_done;    // since the last camera change
+};
+
+//! A seqlock per tile: odd while the writer is inside, advanced by two for every publish, so a
+//! reader that sees it changed also knows the tile is dirty.
+struct live_tile
+{
+    std::atomic<std::uint32_t> sequence;
+    std::atomic<std::uint32_t> generation;      // low bits of the generation the pixels belong to
+};
+
+static_assert(sizeof(std::atomic<std::uint64_t>) == 8 && sizeof(live_tile) == 8, "live view atomics must be plain words");
+
+static const char live_magic[8] = { 'T', 'R', 'T', 'L', 'I', 'V', 'E', '1' };
+
+inline size_t live_segment_bytes(int width, int height, int tiles)
+{
+    return sizeof(live_header) + tiles * sizeof(live_tile) + static_cast<size_t>(width) * height * 3 * sizeof(float);
+}
+
+//! The writing side. Render_job publishes every tile it merges (see render_settings::live); the
+//! writer never waits for readers, who retry a tile whose sequence moved while they copied it.
+class Live_framebuffer
+{
+public:
+    Live_framebuffer(const std::string& name, int width, int height, int tile_size)
+        : tiles_x((width + tile_size - 1) / tile_size), tiles_y((height + tile_size - 1) / tile_size),
+        memory(Shared_memory::create(name, live_segment_bytes(width, height, tiles_x * tiles_y)))
+    {
+        header = new (memory.data()) live_header();
+        header->width = width;
+        header->height = height;
+        header->tile_size = tile_size;
+        header->tiles_x = tiles_x;
+        header->tiles_y = tiles_y;
+        header->generation.store(0);
+        header->samples_done.store(0);
+        tiles = reinterpret_cast<live_tile*>(header + 1);
+        for (int t = 0; t < tiles_x * tiles_y; ++t)
+        {
+            new (tiles + t) live_tile();
+            tiles[t].sequence.store(0);
+            tiles[t].generation.store(0);
+        }
+        pixels = reinterpret_cast<float*>(tiles + tiles_x * tiles_y);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header->magic, live_magic, sizeof(live_magic));
+    }
+
+    //! Starts a new generation: the pixels readers see are the old camera's until each tile is
+    //! published again, which they can tell from its generation.
+    void restart()
+    {
+        header->samples_done.store(0, std::memory_order_relaxed);
+        header->generation.fetch_add(1, std::memory_order_release);
+        restarted_at = std::chrono::steady_clock::now();
+        first_tile_seconds.store(-1, std::memory_order_relaxed);
+    }
+
+    std::uint64_t generation() const { return header->generation.load(std::memory_order_relaxed); }
+
+    //! Seconds from the last restart to the first tile of the new generation, negative until then.
+    double restart_latency() const { return first_tile_seconds.load(std::memory_order_relaxed); }
+
+    //! Copies the mean colors of tile (tile_x, tile_y), given row by row as r, g, b floats, into the
+    //! segment and counts samples more done. Tiles are only written by one thread at a time.
+    void publish_tile(int tile_x, int tile_y, const float* rgb, size_t samples)
+    {
+        const int width = static_cast<int>(header->width), size = static_cast<int>(header->tile_size);
+        const int i0 = tile_x * size, i1 = std::min(i0 + size, width);
+        const int j0 = tile_y * size, j1 = std::min(j0 + size, static_cast<int>(header->height));
+        const std::uint32_t generation = static_cast<std::uint32_t>(header->generation.load(std::memory_order_relaxed));
+
+        live_tile& tile = tiles[tile_y * tiles_x + tile_x];
+        const std::uint32_t sequence = tile.sequence.load(std::memory_order_relaxed);
+        tile.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        const size_t row = static_cast<size_t>(i1 - i0) * 3;
+        for (int j = j0; j < j1; ++j, rgb += row)
+            std::copy(rgb, rgb + row, pixels + (static_cast<size_t>(j) * width + i0) * 3);
+        tile.generation.store(generation, std::memory_order_relaxed);
+        tile.sequence.store(sequence + 2, std::memory_order_release);
+        header->samples_done.fetch_add(samples, std::memory_order_relaxed);
+
+        if (first_tile_seconds.load(std::memory_order_relaxed) < 0)
+            first_tile_seconds.store(std::chrono::duration<double>(std::chrono::steady_clock::now() - restarted_at).count(),
+                std::memory_order_relaxed);
+    }
+
+private:
+    int tiles_x, tiles_y;
+    Shared_memory memory;
+    live_header* header = nullptr;
+    live_tile* tiles = nullptr;
+    float* pixels = nullptr;
+    std::chrono::steady_clock::time_point restarted_at = std::chrono::steady_clock::now();
+    std::atomic<double> first_tile_seconds{ -1 };
+};
+
+//! The reading side, for viewers and the snapshot tool: keeps its own copy of the image and brings
+//! over only the tiles published since it last looked.
+class Live_framebuffer_reader
+{
+public:
+    explicit Live_framebuffer_reader(const std::string& name)
+        : memory(Shared_memory::open(name))
+    {
+        header = static_cast<const live_header*>(memory.data());
+        if (memory.size() < sizeof(live_header) || std::memcmp(header->magic, live_magic, sizeof(live_magic)) != 0 ||
+            memory.size() < live_segment_bytes(header->width, header->height, header->tiles_x * header->tiles_y))
+            throw std::runtime_error("shared memory " + name + " holds no live view");
+        tiles = reinterpret_cast<const live_tile*>(header + 1);
+        pixels = reinterpret_cast<const float*>(tiles + header->tiles_x * header->tiles_y);
+        image.assign(static_cast<size_t>(header->width) * header->height * 3, 0.0f);
+        seen.assign(header->tiles_x * header->tiles_y, 0);
+        tile_generation.assign(seen.size(), 0);
+    }
+
+    int width() const { return static_cast<int>(header->width); }
+    int height() const { return static_cast<int>(header->height); }
+    std::uint64_t generation() const { return header->generation.load(std::memory_order_acquire); }
+    std::uint64_t samples_done() const { return header->samples_done.load(std::memory_order_relaxed); }
+
+    //! Copies every tile whose sequence moved since the last call and returns how many there were.
+    size_t update()
+    {
+        size_t copied = 0;
+        const int size = static_cast<int>(header->tile_size);
+        for (int t = 0; t < static_cast<int>(seen.size()); ++t)
+        {
+            const live_tile& tile = tiles[t];
+            if (tile.sequence.load(std::memory_order_relaxed) == seen[t]) continue;
+
+            const int i0 = t % header->tiles_x * size, i1 = std::min(i0 + size, width());
+            const int j0 = t / header->tiles_x * size, j1 = std::min(j0 + size, height());
+            std::uint32_t before, after;
+            do
+            {
+                while ((before = tile.sequence.load(std::memory_order_acquire)) & 1) std::this_thread::yield();
+                for (int j = j0; j < j1; ++j)
+                {
+                    const size_t offset = (static_cast<size_t>(j) * width() + i0) * 3;
+                    std::memcpy(&image[offset], pixels + offset, static_cast<size_t>(i1 - i0) * 3 * sizeof(float));
+                }
+                tile_generation[t] = tile.generation.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                after = tile.sequence.load(std::memory_order_relaxed);
+            } while (before != after);
+            seen[t] = after;
+            ++copied;
+        }
+        return copied;
+    }
+
+    //! Tiles of the copy that show the current generation, i.e. the current camera.
+    size_t current_tiles() const
+    {
+        const std::uint32_t current = static_cast<std::uint32_t>(generation());
+        return static_cast<size_t>(std::count(tile_generation.begin(), tile_generation.end(), current));
+    }
+
+    size_t tile_count() const { return seen.size(); }
+
+    //! Writes the copy as plain PPM, tonemapped as Framebuffer::write_ppm does.
+    void write_ppm(std::ostream& out) const
+    {
+        out << "P3\n" << width() << ' ' << height() << "\n255\n";
+        std::vector<Color<double>> row(width());
+        const std::vector<size_t> ones(width(), 1);
+        for (int j = height() - 1; j >= 0; --j)
+        {
+            const float* p = &image[static_cast<size_t>(j) * width() * 3];
+            for (int i = 0; i < width(); ++i, p += 3) row[i] = Color<double>(p[0], p[1], p[2]);
+            write_colors(out, row.data(), ones.data(), row.size());
+        }
+    }
+
+private:
+    Shared_memory memory;
+    const live_header* header = nullptr;
+    const live_tile* tiles = nullptr;
+    const float* pixels = nullptr;
+    std::vector<float> image;
+    std::vector<std::uint32_t> seen;
+    std::vector<std::uint32_t> tile_generation;
+};
+
+//! A local stream socket (a Unix domain socket; AF_UNIX on Windows 10 and later too) that accepts
+//! any number of clients and hands out what they send one line at a time. Never blocks.
+class Command_socket
+{
+public:
+    explicit Command_socket(const std::string& socket_path)
+        : path(socket_path)
+    {
+#if defined(_WIN32)
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) throw std::runtime_error("cannot start Winsock");
+#endif
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("socket path too long: " + path);
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        remove_path();
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == invalid_socket || bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listener, 4) != 0 || !make_nonblocking(listener))
+        {
+            close_socket(listener);
+            throw std::runtime_error("cannot listen on " + path);
+        }
+    }
+
+    ~Command_socket()
+    {
+        for (const client& c : clients) close_socket(c.handle);
+        close_socket(listener);
+        remove_path();
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+    }
+
+    Command_socket(const Command_socket&) = delete;
+    Command_socket& operator=(const Command_socket&) = delete;
+
+    //! Takes the next complete line any client has sent, without its newline. False if none yet.
+    bool next_line(std::string& line)
+    {
+        for (socket_handle accepted; (accepted = accept(listener, nullptr, nullptr)) != invalid_socket;)
+            if (make_nonblocking(accepted)) clients.push_back(client{ accepted, std::string() });
+            else close_socket(accepted);
+
+        for (size_t k = 0; k < clients.size();)
+        {
+            client& c = clients[k];
+            char buffer[512];
+            bool open = true;
+            for (;;)
+            {
+                const auto n = recv(c.handle, buffer, sizeof(buffer), 0);
+                if (n > 0) c.pending.append(buffer, static_cast<size_t>(n));
+                else
+                {
+                    open = n < 0 && would_block();
+                    break;
+                }
+            }
+            const size_t end = c.pending.find('\n');
+            if (end != std::string::npos)
+            {
+                line = c.pending.substr(0, end);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                c.pending.erase(0, end + 1);
+                return true;
+            }
+            if (open) ++k;
+            else
+            {
+                close_socket(c.handle);
+                clients.erase(clients.begin() + k);
+            }
+        }
+        return false;
+    }
+
+private:
+#if defined(_WIN32)
+    using socket_handle = SOCKET;
+    static constexpr socket_handle invalid_socket = INVALID_SOCKET;
+    static void close_socket(socket_handle s) { if (s != INVALID_SOCKET) closesocket(s); }
+    static bool make_nonblocking(socket_handle s) { u_long on = 1; return ioctlsocket(s, FIONBIO, &on) == 0; }
+    static bool would_block() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+    void remove_path() const { DeleteFileA(path.c_str()); }
+#else
+    using socket_handle = int;
+    static constexpr socket_handle invalid_socket = -1;
+    static void close_socket(socket_handle s) { if (s >= 0) close(s); }
+    static bool make_nonblocking(socket_handle s) { return fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == 0; }
+    static bool would_block() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+    void remove_path() const { unlink(path.c_str()); }
+#endif
+
+    struct client
+    {
+        socket_handle handle;
+        std::string pending;
+    };
+
+    std::string path;
+    socket_handle listener = invalid_socket;
+    std::vector<client> clients;
+};
+
+#endif
@@ -10,27 +10,32 @@
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
+#include "integrator.h"
+#include "render_job.h"
+#include "sphere_set.h"
+#include "benchmark.h"
+#include "bvh.h"
+#include "accelerator_factory.h"
+#include "mesh_io.h"
+#include "out_of_core.h"
+#include "instance.h"
+#include "wide_bvh.h"
+#include "lights.h"
+#include "environment.h"
+#include "animation.h"
+#include "static_scene.h"
+#include "convergence.h"
+#include "concurrency.h"
+#include "preview.h"
+#include "live_view.h"
 #include <ctime>
-#include <tbb/parallel_for.h>
-
-
-template<typename T>
-Color<T> ray_color(const Ray<T>& r, const Hittable<T>& world, int depth) 
-{
-    if (depth <= 0) return Color<T>::zero();
-
-    hit_record<T> rec;
-    if (world.hit(r, 0.0001, MAX_DOUBLE, rec)) {
-        Ray<T> scattered;
-        Color<T> attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth - 1);
-        return Color<T>(0, 0, 0);
-    }
-    Vector3<T> unit_direction = r.direction().normalized();
-    auto t = 0.5 * (unit_direction.y + 1.0);
-    return (1.0 - t) * Color<T>(1.0, 1.0, 1.0) + t * Color<T>(0.5, 0.7, 1.0);
-}
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <thread>
 
 
 Hittable_list<double> random_scene() 
@@ -82,21 +87,350 @@ Hittable_list<double> random_scene()
     return world;
 }
 
-int main() 
+// random_scene() at night, lit only by a few small glowing spheres.
+Hittable_list<double> small_lights_scene()
+{
+    Hittable_list<double> world = random_scene();
+
+    auto light = make_shared<Diffuse_light<double>>(ColorD(40, 36, 30));
+    world.add(make_shared<Sphere<double>>(Point3D(2, 2.5, 1.5), 0.15, light));
+    world.add(make_shared<Sphere<double>>(Point3D(-3, 2.2, -1), 0.15, light));
+    world.add(make_shared<Sphere<double>>(Point3D(5, 1.8, -2), 0.1, light));
+    world.add(make_shared<Sphere<double>>(Point3D(0, 2.4, 3), 0.12, light));
+    world.add(make_shared<Sphere<double>>(Point3D(-6, 1.5, 2), 0.1, light));
+
+    return world;
+}
+
+// The ground of random_scene() with a dozen dense clumps of tiny spheres on it instead of the even field.
+Hittable_list<double> clusters_scene()
+{
+    Hittable_list<double> world;
+
+    auto ground_material = make_shared<Lambertian<double>>(ColorD(0.5, 0.5, 0.5));
+    world.add(make_shared<Sphere<double>>(Point3D(0, -1000, 0), 1000, ground_material));
+
+    for (int c = 0; c < 12; c++) {
+        const Point3D middle(random_generate(-10.0, 10.0), random_generate(0.5, 2.5), random_generate(-10.0, 10.0));
+        auto material = make_shared<Lambertian<double>>(ColorD::random() * ColorD::random());
+        for (int k = 0; k < 400; k++) {
+            const Point3D center = middle + random_generate(0.0, 0.5) * random_unit_vector<double>();
+            world.add(make_shared<Sphere<double>>(center, random_generate(0.02, 0.05), material));
+        }
+    }
+
+    return world;
+}
+
+// Loads a mesh under a BVH4 and stands it on the ground in front of the big spheres, scaled to fit a box of side size.
+shared_ptr<Hittable<double>> placed_mesh(const std::string& path, double size)
+{
+    auto material = make_shared<Metal<double>>(ColorD(0.8, 0.6, 0.4), 0.1);
+    const Bvh<double, Triangle_mesh<double>> binary = Parallel_bvh_builder<double, Triangle_mesh<double>>().build(load_mesh<double>(path, material));
+    auto mesh = make_shared<Wide_bvh<double, Triangle_mesh<double>>>(binary);
+
+    Aabb<double> box;
+    mesh->bounding_box(box);
+    const Vector3D extent = box.extent();
+    const double scale = size / std::max(extent.x, std::max(extent.y, extent.z));
+    const Point3D bottom(box.center().x, box.minimum.y, box.center().z);
+    const auto placement = Affine_transform<double>::translation(Vector3D(2.5, 0, 1.5))
+        * Affine_transform<double>::scaling(scale) * Affine_transform<double>::translation(-bottom);
+    return make_shared<Instance<double>>(mesh, placement);
+}
+
+// Materials of the point cloud below: the ground from low to high, then stone and a polished boulder.
+std::vector<shared_ptr<Material<double>>> point_cloud_materials()
+{
+    return {
+        make_shared<Lambertian<double>>(ColorD(0.20, 0.35, 0.15)),
+        make_shared<Lambertian<double>>(ColorD(0.30, 0.45, 0.18)),
+        make_shared<Lambertian<double>>(ColorD(0.45, 0.42, 0.25)),
+        make_shared<Lambertian<double>>(ColorD(0.50, 0.40, 0.30)),
+        make_shared<Lambertian<double>>(ColorD(0.80, 0.80, 0.82)),
+        make_shared<Lambertian<double>>(ColorD(0.55, 0.52, 0.50)),
+        make_shared<Metal<double>>(ColorD(0.7, 0.6, 0.5), 0.05),
+    };
+}
+
+// A scanned hillside as a point cloud of count spheres: small spheres strewn over a rolling height field
+// and over the shells of three boulders where random_scene() has its big spheres, written as a chunk file.
+void write_point_cloud(const std::string& path, size_t count)
+{
+    auto height = [](double x, double z) { return 0.6 * std::sin(0.5 * x) * std::cos(0.4 * z) + 0.25 * std::sin(1.3 * x + 0.7 * z) - 0.3; };
+    const Point3D boulders[3] = { Point3D(0, 1, 0), Point3D(-4, 1, 0), Point3D(4, 1, 0) };
+    const double ground_area = 24.0 * 24.0, boulder_area = 3 * 4 * pi<double>();
+
+    // Equal density everywhere, with neighbours just overlapping.
+    const double spacing = std::sqrt((ground_area + boulder_area) / std::max<size_t>(count, 1));
+    const float radius = static_cast<float>(0.9 * spacing);
+    const size_t on_ground = static_cast<size_t>(count * ground_area / (ground_area + boulder_area));
+
+    std::vector<chunk_sphere> spheres(count);
+    for (size_t k = 0; k < count; ++k) {
+        Point3D p;
+        std::uint32_t material;
+        if (k < on_ground) {
+            const double x = random_generate(-12.0, 12.0), z = random_generate(-12.0, 12.0);
+            p = Point3D(x, height(x, z), z);
+            material = static_cast<std::uint32_t>(clamp(static_cast<int>((p.y + 1.2) * 2.2), 0, 4));
+        }
+        else {
+            const size_t b = (k - on_ground) % 3;
+            p = boulders[b] + random_unit_vector<double>();
+            material = b == 2 ? 6 : 5;
+        }
+        spheres[k] = chunk_sphere{ { static_cast<float>(p.x), static_cast<float>(p.y), static_cast<float>(p.z) }, radius, material };
+    }
+    write_chunked_spheres(path, std::move(spheres), 4096, 7);
+}
+
+// Sets the small spheres bouncing: each hops a few times over the animation's time span [0, 1].
+void add_bounces(Hittable_list<double>& world)
+{
+    for (const auto& object : world.objects) {
+        auto sphere = std::dynamic_pointer_cast<Sphere<double>>(object);
+        if (!sphere || sphere->radius > 0.3 || sphere->mat_ptr->is_emissive()) continue;
+
+        auto track = make_shared<Keyframe_track<double>>();
+        const double height = random_generate(0.2, 0.8);
+        const double phase = random_generate<double>();
+        const int hops = 4;
+        for (int k = -1; k <= 2 * hops + 1; ++k) {
+            const double time = (k + phase) / (2 * hops);
+            track->add(time, sphere->center + Vector3D(0, k % 2 ? height : 0, 0));
+        }
+        sphere->motion = track;
+    }
+}
+
+int main(int argc, char* argv[]) 
 {
     auto start = clock();
 
 
     // Image
 
+    render_settings settings;
     const auto aspect_ratio = 3.0 / 2.0;
-    const int image_width = 1200;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 500;
-    const int max_depth = 50;
+    settings.image_width = 1200;
+    settings.samples_per_pixel = 500;
+    settings.max_depth = 50;
+    std::string sample_map_path;
+    size_t query_benchmark_rays = 0;
+    size_t bvh_benchmark_spheres = 0;
+    size_t lanes_benchmark_vectors = 0;
+    size_t instancing_benchmark_copies = 0;
+    size_t accelerator_benchmark_rays = 0;
+    size_t ray_color_benchmark_samples = 0;
+    std::string accelerator_name;
+    std::string mesh_path, mesh_benchmark_path;
+    std::string out_of_core_path;
+    size_t point_cloud_spheres = 0;
+    size_t geometry_budget_mib = 256;
+    std::string scene_name = "random";
+    std::string integrator_name = "path";
+    std::string dispatch_name = "virtual";
+    double aperture = 0.1;
+    std::string environment_path, environment_cache;
+    int animation_frames = 0;
+    std::string frame_prefix = "frame_";
+    std::string convergence_budgets, reference_path;
+    int reference_spp = 1024;
+    std::string convergence_strategies = "path,nee";
+    std::string convergence_prefix = "convergence";
+    concurrency_settings concurrency;
+    int scaling_benchmark_spp = 0;
+    int edit_benchmark_spp = 0;
+    std::string preview_name, tier_name = "final";
+    preview_settings<double> preview;
+    std::string live_name, live_socket, live_snapshot_name;
+
+    // Options: --width <pixels>, --spp <samples>, --time-budget <seconds>, --sample-map <file.pgm>,
+    //          --query-benchmark <rays>, --bvh-benchmark <spheres>, --lanes-benchmark <vectors>, --ray-color-benchmark <samples>,
+    //          --instancing-benchmark <copies>, --accel-benchmark <rays>, --accel bvh|bvh4|grid|kdtree|auto,
+    //          --scene random|lights|clusters, --mesh <file.obj|file.ply>, --mesh-benchmark <file>, --integrator path|nee,
+    //          --out-of-core <chunk file>, --point-cloud <spheres>, --geometry-budget <MiB>,
+    //          --dispatch virtual|static, --aperture <diameter>, --split <paths>, --split-grid <side>,
+    //          --environment <file.hdr|file.pfm>, --environment-cache <directory>,
+    //          --animate <frames>, --frame-prefix <path prefix>,
+    //          --convergence <seconds,...>, --reference <file.pfm>, --reference-spp <samples>,
+    //          --strategies <path|nee|split<paths>,...>, --convergence-out <path prefix>,
+    //          --threads <count>, --cpus <list>, --numa on|off, --scaling-benchmark <samples>,
+    //          --preview albedo|normal|depth|ao|direct, --ao-samples <rays>, --ao-radius <distance>, --tier final|preview,
+    //          --live <shared memory name>, --live-socket <socket path>, --live-snapshot <shared memory name>,
+    //          --edit-benchmark <samples>
+    bool width_set = false, samples_set = false;
+    for (int a = 1; a < argc; ++a) {
+        const std::string arg = argv[a];
+        if (a + 1 >= argc) {
+            std::cerr << "missing value for " << arg << '\n';
+            return 1;
+        }
+        width_set = width_set || arg == "--width";
+        samples_set = samples_set || arg == "--spp" || arg == "--time-budget";
+        if (arg == "--width") settings.image_width = std::atoi(argv[++a]);
+        else if (arg == "--spp") settings.samples_per_pixel = std::atoi(argv[++a]);
+        else if (arg == "--time-budget") settings.time_budget_seconds = std::atof(argv[++a]);
+        else if (arg == "--sample-map") sample_map_path = argv[++a];
+        else if (arg == "--query-benchmark") query_benchmark_rays = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--bvh-benchmark") bvh_benchmark_spheres = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--lanes-benchmark") lanes_benchmark_vectors = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--ray-color-benchmark") ray_color_benchmark_samples = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--instancing-benchmark") instancing_benchmark_copies = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--accel-benchmark") accelerator_benchmark_rays = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--accel") accelerator_name = argv[++a];
+        else if (arg == "--mesh") mesh_path = argv[++a];
+        else if (arg == "--mesh-benchmark") mesh_benchmark_path = argv[++a];
+        else if (arg == "--scene") scene_name = argv[++a];
+        else if (arg == "--out-of-core") out_of_core_path = argv[++a];
+        else if (arg == "--point-cloud") point_cloud_spheres = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--geometry-budget") geometry_budget_mib = std::strtoull(argv[++a], nullptr, 10);
+        else if (arg == "--integrator") integrator_name = argv[++a];
+        else if (arg == "--dispatch") dispatch_name = argv[++a];
+        else if (arg == "--aperture") aperture = std::atof(argv[++a]);
+        else if (arg == "--split") settings.split_factor = std::atoi(argv[++a]);
+        else if (arg == "--split-grid") settings.split_grid = std::atoi(argv[++a]);
+        else if (arg == "--environment") environment_path = argv[++a];
+        else if (arg == "--environment-cache") environment_cache = argv[++a];
+        else if (arg == "--animate") animation_frames = std::atoi(argv[++a]);
+        else if (arg == "--frame-prefix") frame_prefix = argv[++a];
+        else if (arg == "--convergence") convergence_budgets = argv[++a];
+        else if (arg == "--reference") reference_path = argv[++a];
+        else if (arg == "--reference-spp") reference_spp = std::atoi(argv[++a]);
+        else if (arg == "--strategies") convergence_strategies = argv[++a];
+        else if (arg == "--convergence-out") convergence_prefix = argv[++a];
+        else if (arg == "--threads") concurrency.threads = std::atoi(argv[++a]);
+        else if (arg == "--cpus") concurrency.cpus = parse_cpu_list(argv[++a]);
+        else if (arg == "--numa") concurrency.numa = std::string(argv[++a]) == "on";
+        else if (arg == "--scaling-benchmark") scaling_benchmark_spp = std::atoi(argv[++a]);
+        else if (arg == "--edit-benchmark") edit_benchmark_spp = std::atoi(argv[++a]);
+        else if (arg == "--preview") preview_name = argv[++a];
+        else if (arg == "--ao-samples") preview.ao_samples = std::atoi(argv[++a]);
+        else if (arg == "--ao-radius") preview.ao_radius = std::atof(argv[++a]);
+        else if (arg == "--tier") tier_name = argv[++a];
+        else if (arg == "--live") live_name = argv[++a];
+        else if (arg == "--live-socket") live_socket = argv[++a];
+        else if (arg == "--live-snapshot") live_snapshot_name = argv[++a];
+        else {
+            std::cerr << "unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+    // The preview tier: a small image rendered by a preview integrator until a 80 ms deadline, over a
+    // binary BVH, which traces these short paths faster than BVH4 here; each part can still be chosen by hand.
+    if (tier_name == "preview") {
+        if (!width_set) settings.image_width = 300;
+        if (!samples_set) settings.time_budget_seconds = 0.08;
+        if (preview_name.empty()) preview_name = "direct";
+        if (accelerator_name.empty()) accelerator_name = "bvh";
+    }
+    else if (tier_name != "final") {
+        std::cerr << "unknown tier " << tier_name << '\n';
+        return 1;
+    }
+    preview_mode preview_kind = preview_mode::direct;
+    if (!preview_name.empty() && !parse_preview_mode(preview_name, preview_kind)) {
+        std::cerr << "unknown preview " << preview_name << '\n';
+        return 1;
+    }
+    settings.image_height = static_cast<int>(settings.image_width / aspect_ratio);
+
+    // Made before anything runs in parallel, so that the thread cap covers BVH builds and loading too.
+    // The scaling benchmark makes its own for every thread count instead.
+    std::unique_ptr<Render_arenas> arenas;
+    if (scaling_benchmark_spp == 0 && (concurrency.threads > 0 || !concurrency.cpus.empty() || concurrency.numa)) {
+        arenas.reset(new Render_arenas(concurrency));
+        settings.arenas = arenas.get();
+        std::cerr << "Rendering with ";
+        arenas->describe(std::cerr);
+        std::cerr << '\n';
+    }
+
+    // The snapshot tool: copies what a live render has published so far, without touching the render.
+    if (!live_snapshot_name.empty()) {
+        try {
+            Live_framebuffer_reader reader(live_snapshot_name);
+            reader.update();
+            reader.write_ppm(std::cout);
+            std::cerr << "camera " << reader.generation() << ", " << reader.current_tiles() << " of " << reader.tile_count()
+                << " tiles show it, " << reader.samples_done() << " samples since it was set\n";
+        }
+        catch (const std::runtime_error& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    if (bvh_benchmark_spheres > 0) {
+        run_bvh_benchmark(bvh_benchmark_spheres, 1000000, std::cerr);
+        return 0;
+    }
+    if (lanes_benchmark_vectors > 0) {
+        run_lanes_benchmark(lanes_benchmark_vectors, std::cerr);
+        return 0;
+    }
+    if (!mesh_benchmark_path.empty()) {
+        run_mesh_benchmark(mesh_benchmark_path, 1000000, std::cerr);
+        return 0;
+    }
+    if (instancing_benchmark_copies > 0) {
+        run_instancing_benchmark(instancing_benchmark_copies, 1000000, std::cerr);
+        return 0;
+    }
 
     // World
-    auto world = random_scene();
+    auto scene = scene_name == "lights" ? small_lights_scene() : scene_name == "clusters" ? clusters_scene() : random_scene();
+    if (!mesh_path.empty()) scene.add(placed_mesh(mesh_path, 1.6));
+    std::unique_ptr<Animated_scene<double>> animated;
+    if (animation_frames > 0) {
+        add_bounces(scene);
+        animated.reset(new Animated_scene<double>(scene));
+    }
+    auto world = pack_spheres(scene);
+    Hittable_list<double> accelerated;
+    if (!accelerator_name.empty()) {
+        accelerator_kind kind;
+        if (!parse_accelerator_kind(accelerator_name, kind)) {
+            std::cerr << "unknown accelerator " << accelerator_name << '\n';
+            return 1;
+        }
+        accelerated = accelerate(scene, kind);
+    }
+    const Hittable<double>& untracked = animated ? static_cast<const Hittable<double>&>(*animated)
+        : accelerated.objects.empty() ? static_cast<const Hittable<double>&>(world) : accelerated;
+    // Live mode traces the scene through a Tracked_hittable, so that every tile records the spheres its
+    // paths hit and a sphere edit renders again only the tiles it can change.
+    const Tracked_hittable<double> tracked(untracked);
+    const Hittable<double>& target = live_name.empty() ? untracked : tracked;
+    background_fn<double> background = scene_name == "lights" ? &black_background<double> : &sky_background<double>;
+    Light_list<double> lights(world);
+
+    std::unique_ptr<Environment_light<double>> environment;
+    if (!environment_path.empty()) {
+        environment.reset(new Environment_light<double>(environment_path, environment_cache));
+        background = [&environment](const Ray<double>& r) { return environment->radiance(r.direction()); };
+        lights.set_environment(environment.get());
+    }
+
+    if (arenas && arenas->numa_aware()) {
+        size_t bytes = 0, placed = 0;
+        target.memory_blocks([&](const void* data, size_t size) {
+            bytes += size;
+            if (arenas->interleave(data, size)) placed += size;
+        });
+        std::cerr << "Scene: " << placed / (1024.0 * 1024.0) << " of " << bytes / (1024.0 * 1024.0) << " MiB interleaved over the nodes\n";
+    }
+
+    if (query_benchmark_rays > 0) {
+        run_query_benchmark(world, query_benchmark_rays, std::cerr);
+        return 0;
+    }
+    if (accelerator_benchmark_rays > 0) {
+        run_accelerator_benchmark(world, accelerator_benchmark_rays, std::cerr);
+        return 0;
+    }
 
     // Camera
 
@@ -104,36 +438,346 @@ int main()
     Point3D lookat(0, 0, 0);
     Vector3D v_up(0, 1, 0);
     auto dist_to_focus = 10.0;
-    auto aperture = 0.1;
 
     Camera<double> cam(lookfrom, lookat, v_up, 20, aspect_ratio, aperture, dist_to_focus);
 
+    if (ray_color_benchmark_samples > 0) {
+        run_ray_color_benchmark(scene, target, cam, settings.max_depth, background, ray_color_benchmark_samples, std::cerr);
+        return 0;
+    }
+
+    if (!out_of_core_path.empty()) {
+        if (point_cloud_spheres > 0) write_point_cloud(out_of_core_path, point_cloud_spheres);
+        Out_of_core_scene<double> points(out_of_core_path, point_cloud_materials(), geometry_budget_mib << 20);
+        Framebuffer<double> image;
+        const double seconds = seconds_of([&] { image = render_out_of_core(points, cam, settings, background); });
+        image.write_ppm(std::cout);
+
+        const geometry_cache_stats& cache = points.cache_stats();
+        const streaming_stats& streamed = points.stats();
+        const double mib = 1024.0 * 1024.0;
+        std::cerr << points.sphere_count() << " spheres in " << points.chunk_count() << " chunks, " << points.file_bytes() / mib
+            << " MiB on disk, " << points.top_level_bytes() / 1024.0 << " KiB always resident\n"
+            << "budget " << points.budget_bytes() / mib << " MiB, peak " << cache.peak_bytes / mib << " MiB resident; "
+            << cache.loads << " chunk loads (" << cache.bytes_loaded / mib << " MiB), " << cache.evictions << " evictions, "
+            << cache.requests << " requests\n"
+            << streamed.rays << " rays in " << streamed.batches << " batches, " << streamed.passes << " chunk passes, "
+            << static_cast<double>(streamed.chunk_tests) / std::max<size_t>(streamed.rays, 1) << " chunks tested per ray\n"
+            << "time " << seconds << "s\n";
+        return 0;
+    }
+
     // Render
 
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-
-        tbb::parallel_for(tbb::blocked_range<size_t>(0, image_width), [&](const tbb::blocked_range<size_t>& r) 
-            {
-            for (int i = r.begin(); i != r.end(); ++i) 
-            {
-                Color<double> pixel_color(0, 0, 0);
-                for (int s = 0; s < samples_per_pixel; ++s) {
-                    auto u = (i + random_generate<double>()) / (image_width - 1);
-                    auto v = (j + random_generate<double>()) / (image_height - 1);
-                    Ray<double> r = cam.get_ray(u, v);
-                    pixel_color += ray_color(r, world, max_depth);
-                }
-                write_color(std::cout, pixel_color, samples_per_pixel);
+    Render_job<double>::integrator radiance;
+    Static_sphere_scene<double> fixed;
+    if (dispatch_name == "static") {
+        if (integrator_name != "path" || !preview_name.empty() || animated || !accelerator_name.empty() || !mesh_path.empty()) {
+            std::cerr << "--dispatch static renders spheres only, with the path integrator and no --accel or --animate\n";
+            return 1;
+        }
+        fixed = make_static_scene(scene);
+        radiance = [&](const Ray<double>& r, int depth) { return ray_color(r, fixed, depth, background); };
+    }
+    else if (!preview_name.empty())
+        radiance = make_preview_integrator(preview_kind, target, lights, background, preview);
+    else if (integrator_name == "nee")
+        radiance = [&](const Ray<double>& r, int depth) { return ray_color_nee(r, target, lights, depth, background); };
+    else
+        radiance = [&](const Ray<double>& r, int depth) { return ray_color(r, target, depth, background); };
+
+    auto report_progress = [](const render_progress& p)
+        {
+            std::cerr << "\rProgress: " << static_cast<int>(100 * p.fraction()) << "%, ETA: "
+                << static_cast<int>(p.eta_seconds) << "s " << std::flush;
+        };
+    if (!convergence_budgets.empty()) {
+        if (animated) {
+            std::cerr << "--convergence renders a still image, not with --animate\n";
+            return 1;
+        }
+        auto split_list = [](const std::string& list) {
+            std::vector<std::string> items;
+            std::stringstream in(list);
+            for (std::string item; std::getline(in, item, ',');)
+                if (!item.empty()) items.push_back(item);
+            return items;
+        };
+        std::vector<double> budgets;
+        for (const std::string& item : split_list(convergence_budgets)) {
+            budgets.push_back(std::atof(item.c_str()));
+            if (!(budgets.back() > 0)) {
+                std::cerr << "--convergence budgets must be positive seconds, not " << item << '\n';
+                return 1;
             }
+        }
+        if (budgets.empty()) {
+            std::cerr << "--convergence needs at least one budget\n";
+            return 1;
+        }
+
+        // The reference: loaded when the file exists, else rendered with the chosen integrator and saved there.
+        float_image reference;
+        if (!reference_path.empty() && std::ifstream(reference_path, std::ios::binary))
+            reference = load_float_image(reference_path);
+        else {
+            render_settings reference_settings = settings;
+            reference_settings.samples_per_pixel = reference_spp;
+            reference_settings.time_budget_seconds = 0;
+            std::cerr << "Rendering the reference at " << reference_spp << " spp\n";
+            auto job = Render_job<double>::start(radiance, cam, reference_settings, report_progress);
+            job->wait();
+            reference = resolve(job->snapshot());
+            if (!reference_path.empty()) {
+                std::ofstream out(reference_path, std::ios::binary);
+                write_pfm(out, reference);
+            }
+            std::cerr << '\n';
+        }
+
+        std::vector<convergence_strategy> strategies;
+        for (const std::string& name : split_list(convergence_strategies)) {
+            convergence_strategy strategy{ name, nullptr };
+            if (name == "path")
+                strategy.start = [&](const render_settings& s) {
+                    return Render_job<double>::start([&](const Ray<double>& r, int depth) { return ray_color(r, target, depth, background); }, cam, s);
+                };
+            else if (name == "nee")
+                strategy.start = [&](const render_settings& s) {
+                    return Render_job<double>::start([&](const Ray<double>& r, int depth) { return ray_color_nee(r, target, lights, depth, background); }, cam, s);
+                };
+            else if (name.compare(0, 5, "split") == 0 && std::atoi(name.c_str() + 5) > 1) {
+                const int paths = std::atoi(name.c_str() + 5);
+                strategy.start = [&, paths](const render_settings& s) {
+                    render_settings split = s;
+                    split.split_factor = paths;
+                    return Render_job<double>::start_split(target, background, cam, split);
+                };
+            }
+            else {
+                std::cerr << "unknown strategy " << name << '\n';
+                return 1;
+            }
+            strategies.push_back(strategy);
+        }
+
+        const std::vector<convergence_point> points = run_convergence(strategies, settings, budgets, reference,
+            [](const convergence_point& p) {
+                std::cerr << p.strategy << " " << p.budget_seconds << "s: " << p.samples << " samples, relMSE " << p.error.rel_mse
+                    << ", PSNR " << p.error.psnr << " dB, SSIM " << p.error.ssim << '\n';
             });
+        std::ofstream csv(convergence_prefix + ".csv");
+        write_convergence_csv(csv, points);
+        std::ofstream svg(convergence_prefix + ".svg");
+        write_convergence_svg(svg, points, "Error against " + (reference_path.empty() ? std::to_string(reference_spp) + " spp reference" : reference_path));
+        std::cerr << "Wrote " << convergence_prefix << ".csv and " << convergence_prefix << ".svg\n";
+        return 0;
+    }
+
+    if (scaling_benchmark_spp > 0) {
+        render_settings fixed_samples = settings;
+        fixed_samples.samples_per_pixel = scaling_benchmark_spp;
+        fixed_samples.time_budget_seconds = 0;
+        run_scaling_benchmark(radiance, target, cam, fixed_samples, concurrency, std::cerr);
+        return 0;
+    }
+    if (edit_benchmark_spp > 0) {
+        render_settings fixed_samples = settings;
+        fixed_samples.samples_per_pixel = edit_benchmark_spp;
+        fixed_samples.time_budget_seconds = 0;
+        run_edit_benchmark(scene, cam, fixed_samples, background, std::cerr);
+        return 0;
+    }
+
+    if (animated) {
+        // One turn of the camera around the scene over the whole animation.
+        auto camera_at = [&](double time) {
+            const double angle = 2 * pi<double>() * time;
+            const Point3D from(lookfrom.x * std::cos(angle) - lookfrom.z * std::sin(angle), lookfrom.y,
+                lookfrom.x * std::sin(angle) + lookfrom.z * std::cos(angle));
+            return Camera<double>(from, lookat, v_up, 20, aspect_ratio, aperture, dist_to_focus);
+        };
+        auto encode = [&](int frame, const Framebuffer<double>& image) {
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d", frame);
+            std::ofstream out(frame_prefix + number + ".ppm");
+            image.write_ppm(out);
+            std::cerr << "\rFrame " << frame + 1 << '/' << animation_frames << ' ' << std::flush;
+        };
+
+        animation_settings animation;
+        animation.frame_count = animation_frames;
+        const animation_report report = render_animation<double>(*animated, radiance, camera_at, settings, animation, encode);
+
+        std::cerr << "\n" << report.frames << " frames in " << report.seconds << "s, " << report.frames_per_minute() << " frames per minute\n"
+            << "scene updates " << report.update_seconds << "s (" << report.refits << " refits, " << report.rebuilds << " rebuilds), rendering "
+            << report.render_seconds << "s, waiting for encoding " << report.encode_wait_seconds << "s\n";
+        return 0;
+    }
+
+    const bool splitting = settings.split_factor > 1;
+    if (splitting && (integrator_name != "path" || dispatch_name == "static" || !preview_name.empty())) {
+        std::cerr << "--split works with the path integrator and virtual dispatch only\n";
+        return 1;
+    }
+    // Live mode: every tile is published to shared memory as it is merged. A line "camera fx fy fz
+    // ax ay az [vfov [aperture]]" on the socket moves the camera and restarts accumulation, "quit" ends.
+    // "color i j r g b" gives the sphere seen at pixel (i, j) of the image a diffuse color and "move i j
+    // dx dy dz" moves it; both render again only the tiles the edit can change, see Render_job::rerender.
+    if (!live_name.empty()) {
+        Live_framebuffer live(live_name, settings.image_width, settings.image_height, settings.tile_size);
+        settings.live = &live;
+        std::unique_ptr<Command_socket> commands;
+        if (!live_socket.empty()) commands.reset(new Command_socket(live_socket));
+        std::cerr << "Publishing to shared memory " << live_name << (commands ? ", taking commands on " + live_socket : "") << '\n';
+
+        // The spheres edits change: the packed set, or the one under a binary BVH, which a move refits.
+        // The other accelerators, animated scenes and static dispatch keep spheres of their own.
+        Sphere_set<double>* editable = nullptr;
+        Bvh<double>* editable_bvh = nullptr;
+        if (!animated && dispatch_name != "static") {
+            for (const auto& object : (accelerated.objects.empty() ? world : accelerated).objects) {
+                if (auto bvh = dynamic_cast<Bvh<double>*>(object.get())) {
+                    editable_bvh = bvh;
+                    editable = &bvh->primitives();
+                }
+                else if (auto set = dynamic_cast<Sphere_set<double>*>(object.get())) editable = set;
+            }
+        }
+        Tile_dependencies dependencies(settings.image_width, settings.image_height, settings.tile_size);
+        if (editable && commands) settings.dependencies = &dependencies;
+        Camera<double> live_cam = cam;
+
+        // Index in the editable set of the sphere seen through the middle of pixel (i, j), counted from the
+        // top left like the image, or -1 if that is none of them or a light, which Light_list keeps a copy of.
+        auto sphere_at = [&](int i, int j) -> ptrdiff_t {
+            const Ray<double> r = live_cam.get_ray((i + 0.5) / (settings.image_width - 1),
+                (settings.image_height - 1 - j + 0.5) / (settings.image_height - 1));
+            hit_candidate<double> candidate;
+            if (!editable || !untracked.intersect(r, 0.0001, MAX_DOUBLE, candidate) || candidate.object != editable
+                || editable->materials[candidate.primitive]->is_emissive())
+                return -1;
+            return static_cast<ptrdiff_t>(candidate.primitive);
+        };
+
+        auto start_job = [&](const Camera<double>& c) {
+            live.restart();
+            return splitting ? Render_job<double>::start_split(target, background, c, settings)
+                : Render_job<double>::start(radiance, c, settings);
+        };
+        auto live_job = start_job(cam);
+        bool finished = false, latency_reported = true;
+        for (bool running = true; running;) {
+            if (!finished && live_job->completion().wait_for(std::chrono::milliseconds(5)) == std::future_status::ready) {
+                finished = true;
+                std::cerr << "Camera " << live.generation() << " done: " << live_job->progress().samples_done << " samples in "
+                    << live_job->progress().elapsed_seconds << "s\n";
+                if (!commands) break;
+            }
+            if (finished) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (!latency_reported && live.restart_latency() >= 0) {
+                std::cerr << "Camera " << live.generation() << ": first tile " << 1000 * live.restart_latency() << " ms after the command\n";
+                latency_reported = true;
+            }
+
+            std::string line;
+            while (running && commands && commands->next_line(line)) {
+                std::istringstream command(line);
+                std::string verb;
+                command >> verb;
+                Point3D from, at;
+                double vfov = 20, lens = aperture;
+                int i, j;
+                Vector3D edit;
+                if (verb == "quit") running = false;
+                else if (verb == "camera" && command >> from.x >> from.y >> from.z >> at.x >> at.y >> at.z) {
+                    double value;
+                    if (command >> value) vfov = value;
+                    if (command >> value) lens = value;
+                    live_job.reset();   // cancels, and returns once the tiles in flight are merged
+                    live_cam = Camera<double>(from, at, v_up, vfov, aspect_ratio, lens, (from - at).norm());
+                    live_job = start_job(live_cam);
+                    finished = false;
+                    latency_reported = false;
+                }
+                else if ((verb == "color" || verb == "move") && command >> i >> j >> edit.x >> edit.y >> edit.z) {
+                    const ptrdiff_t k = sphere_at(i, j);
+                    if (!settings.dependencies) {
+                        std::cerr << "sphere edits need the spheres packed or under --accel bvh, without --animate or --dispatch static\n";
+                        continue;
+                    }
+                    if (k < 0) {
+                        std::cerr << "no sphere to edit at pixel " << i << ' ' << j << '\n';
+                        continue;
+                    }
+                    live_job->cancel();
+                    live_job->wait();
+                    Framebuffer<double> previous = live_job->snapshot();
+                    live_job.reset();
+
+                    std::vector<char> dirty;
+                    dependencies.mark_tiles_seeing({ primitive_key(hit_candidate<double>{ 0, editable, static_cast<size_t>(k), nullptr }) }, dirty);
+                    if (verb == "color")
+                        editable->set(k, editable->centroid(k), editable->radii[k], make_shared<Lambertian<double>>(edit));
+                    else {
+                        editable->set(k, editable->centroid(k) + edit, editable->radii[k], editable->materials[k]);
+                        if (editable_bvh) editable_bvh->refit();
+                        dependencies.mark_tiles_covering(live_cam, editable->bounds(k), 1, dirty);
+                    }
+                    // Tiles the stopped render had not reached have recorded nothing to go by.
+                    if (finished) {
+                        std::cerr << "Sphere " << k << " edited: rendering " << std::count(dirty.begin(), dirty.end(), 1)
+                            << " of " << dirty.size() << " tiles again\n";
+                        live_job = Render_job<double>::rerender(radiance, live_cam, settings, std::move(previous), std::move(dirty));
+                    }
+                    else {
+                        std::cerr << "Sphere " << k << " edited before the render finished: starting over\n";
+                        live_job = start_job(live_cam);
+                    }
+                    finished = false;
+                }
+                else std::cerr << "unknown command \"" << line << "\"\n";
+            }
+        }
+        live_job->cancel();
+        live_job->wait();
+        live_job->snapshot().write_ppm(std::cout);
+        return 0;
+    }
+
+    auto job = splitting ? Render_job<double>::start_split(target, background, cam, settings, report_progress)
+        : Render_job<double>::start(radiance, cam, settings, report_progress);
+    job->wait();
+    const render_progress finished = job->progress();
+    auto image = job->snapshot();
+    image.write_ppm(std::cout);
+    if (!preview_name.empty())
+        std::cerr << "\nPreview (" << preview_name << "): " << settings.image_width << "x" << settings.image_height << ", "
+            << static_cast<double>(finished.samples_done) / image.samples.size() << " spp in " << 1000 * finished.elapsed_seconds << " ms";
+
+    if (settings.time_budget_seconds > 0) {
+        auto counts = std::minmax_element(image.samples.begin(), image.samples.end());
+        std::cerr << "\nSamples per pixel: min " << *counts.first << ", max " << *counts.second << ", mean "
+            << static_cast<double>(job->progress().samples_done) / image.samples.size();
+    }
+    if (splitting) {
+        const path_split_stats split = job->split_stats();
+        std::cerr << "\nPath splitting: " << split.paths << " paths from " << split.primary_traced << " traced and "
+            << split.primary_cached << " cached first hits for " << split.camera_samples << " samples; "
+            << 100 * split.saved() << "% of primary intersections saved"
+            << (job->caches_primary_hits() ? "" : " (first hits not cached between passes)");
+    }
+    if (arenas && arenas->numa_aware())
+        std::cerr << "\nNUMA: " << job->numa_placed_bytes() / (1024.0 * 1024.0) << " MiB of per-pixel state placed on the rendering nodes";
+    if (!sample_map_path.empty()) {
+        std::ofstream sample_map(sample_map_path);
+        image.write_sample_map(sample_map);
     }
 
     auto end = clock();
     std::cerr << "\nDone.\n";
     std::cerr << "time consumption: " << static_cast<double>(end - start) / CLOCKS_PER_SEC << "s\n";
+    std::cerr << "SIMD kernels: " << isa_name(simd().level) << '\n';
     
     //single-thread 2983.71s
     //multi-thread 430.159s
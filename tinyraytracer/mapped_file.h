@@ -0,0 +1,159 @@
+// this file holds read-only memory mapping of whole files, for loaders that parse large inputs in place
+
+#pragma once
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//! How a mapped file will be read: all of it front to back, or pieces of it on demand.
+enum class mapped_access { sequential, random };
+
+//! A file mapped into memory for reading. Pages are read in by the OS as they are touched, so the
+//! file never needs a buffer of its own and several threads can parse parts of it at once.
+class Mapped_file
+{
+public:
+    explicit Mapped_file(const std::string& path, mapped_access access = mapped_access::sequential)
+    {
+#if defined(_WIN32)
+        const DWORD hint = access == mapped_access::sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS;
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, hint, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open " + path);
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length))
+        {
+            CloseHandle(file);
+            throw std::runtime_error("cannot read the size of " + path);
+        }
+        bytes = static_cast<size_t>(length.QuadPart);
+        if (bytes == 0) return;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view)
+        {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            throw std::runtime_error("cannot map " + path);
+        }
+#else
+        descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) throw std::runtime_error("cannot open " + path);
+        struct stat status;
+        if (fstat(descriptor, &status) != 0)
+        {
+            close(descriptor);
+            throw std::runtime_error("cannot read the size of " + path);
+        }
+        bytes = static_cast<size_t>(status.st_size);
+        if (bytes == 0) return;
+
+        view = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (view == MAP_FAILED)
+        {
+            view = nullptr;
+            close(descriptor);
+            throw std::runtime_error("cannot map " + path);
+        }
+        // Read ahead all of a file that is parsed whole; for one read in pieces, only what is asked for.
+        madvise(view, bytes, access == mapped_access::sequential ? MADV_WILLNEED : MADV_RANDOM);
+#endif
+    }
+
+    ~Mapped_file()
+    {
+#if defined(_WIN32)
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        if (view) munmap(view, bytes);
+        close(descriptor);
+#endif
+    }
+
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+
+    const char* data() const { return static_cast<const char*>(view); }
+    size_t size() const { return bytes; }
+
+    //! Asks the OS to start reading [offset, offset + length) in the background.
+    void will_need(size_t offset, size_t length) const
+    {
+        if (!clamp_to_pages(offset, length)) return;
+#if defined(_WIN32)
+        WIN32_MEMORY_RANGE_ENTRY range{ static_cast<char*>(view) + offset, length };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+        madvise(static_cast<char*>(view) + offset, length, MADV_WILLNEED);
+#endif
+    }
+
+    //! Lets the OS drop the pages of [offset, offset + length) once their contents have been copied
+    //! out. They are read from the file again if touched later.
+    void release(size_t offset, size_t length) const
+    {
+        if (!clamp_to_pages(offset, length)) return;
+#if defined(_WIN32)
+        // Unlocking pages that are not locked takes them out of the working set.
+        VirtualUnlock(static_cast<char*>(view) + offset, length);
+#else
+        madvise(static_cast<char*>(view) + offset, length, MADV_DONTNEED);
+#endif
+    }
+
+private:
+    //! Widens the range to whole pages and cuts it at the end of the file.
+    bool clamp_to_pages(size_t& offset, size_t& length) const
+    {
+        if (!view || offset >= bytes) return false;
+        const size_t page = page_size();
+        const size_t end = std::min(offset + length, bytes);
+        offset -= offset % page;
+        length = end - offset;
+        return length > 0;
+    }
+
+    static size_t page_size()
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+    void* view = nullptr;
+    size_t bytes = 0;
+};
+
+#endif
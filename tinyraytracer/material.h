@@ -15,6 +15,25 @@ public:
     virtual bool scatter(
         const Ray<T>& r_in, const hit_record<T>& rec, Color<T>& attenuation, Ray<T>& scattered
     ) const = 0;
+
+    //! Radiance given off at the hit point; zero for everything but lights.
+    virtual Color<T> emitted(const hit_record<T>& /*rec*/) const { return Color<T>::zero(); }
+
+    virtual bool is_emissive() const { return false; }
+
+    //! True if scatter samples a lobe that eval and pdf describe, so direct light sampling
+    //! can be combined with it. Delta lobes (mirror, glass) return false.
+    virtual bool is_diffuse() const { return false; }
+
+    //! BSDF times the cosine to the normal for scattering into the unit vector direction.
+    virtual Color<T> eval(const hit_record<T>& /*rec*/, const Vector3<T>& /*direction*/) const { return Color<T>::zero(); }
+
+    //! Solid-angle density with which scatter picks the unit vector direction.
+    virtual T pdf(const hit_record<T>& /*rec*/, const Vector3<T>& /*direction*/) const { return 0; }
+
+    //! Color of the surface as previews show it: the fraction of light it reflects, white where
+    //! that depends on the angle, as for glass.
+    virtual Color<T> reflectance(const hit_record<T>& /*rec*/) const { return Color<T>(1, 1, 1); }
 };
 
 template<typename T>
@@ -24,7 +43,7 @@ public:
     Lambertian(const Color<T>& a) : albedo(a) {}
 
     virtual bool scatter(
-        const Ray<T>& r_in, const hit_record<T>& rec, Color<T>& attenuation, Ray<T>& scattered) const override
+        const Ray<T>& /*r_in*/, const hit_record<T>& rec, Color<T>& attenuation, Ray<T>& scattered) const override
     {
         auto scatter_direction = rec.normal + random_unit_vector<T>();
         
@@ -39,6 +58,21 @@ public:
         return true;
     }
 
+    virtual bool is_diffuse() const override { return true; }
+
+    virtual Color<T> eval(const hit_record<T>& rec, const Vector3<T>& direction) const override
+    {
+        return (std::fmax(rec.normal.dot(direction), T(0)) / pi<T>()) * albedo;
+    }
+
+    // normal + random_unit_vector() is cosine distributed around the normal.
+    virtual T pdf(const hit_record<T>& rec, const Vector3<T>& direction) const override
+    {
+        return std::fmax(rec.normal.dot(direction), T(0)) / pi<T>();
+    }
+
+    virtual Color<T> reflectance(const hit_record<T>& /*rec*/) const override { return albedo; }
+
 public:
     Color<T> albedo;
 };
@@ -59,6 +93,8 @@ public:
         return (scattered.direction().dot(rec.normal) > 0);
     }
 
+    virtual Color<T> reflectance(const hit_record<T>& /*rec*/) const override { return albedo; }
+
 public:
     Color<T> albedo;
     T fuzz; //ģϵ
@@ -109,4 +145,27 @@ private:
         return r0 + (1 - r0) * pow((1 - cosine), 5);
     }
 };
+template<typename T>
+class Diffuse_light : public Material<T>
+{
+public:
+    Diffuse_light(const Color<T>& c) : emit(c) {}
+
+    virtual bool scatter(
+        const Ray<T>& /*r_in*/, const hit_record<T>& /*rec*/, Color<T>& /*attenuation*/, Ray<T>& /*scattered*/) const override
+    {
+        return false;
+    }
+
+    // Only the outside of a light shines.
+    virtual Color<T> emitted(const hit_record<T>& rec) const override
+    {
+        return rec.front_face ? emit : Color<T>::zero();
+    }
+
+    virtual bool is_emissive() const override { return true; }
+
+public:
+    Color<T> emit;
+};
 #endif
\ No newline at end of file
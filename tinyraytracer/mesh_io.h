@@ -0,0 +1,504 @@
+// this file holds the OBJ and binary PLY loaders: files are memory mapped and parsed by several
+// threads at once into the buffers of a Triangle_mesh
+
+#pragma once
+#ifndef MESH_IO_H_
+#define MESH_IO_H_
+
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+//! Parses a decimal number such as -1.25e-3 at p and moves p past it. Returns false if p does not
+//! start with one. Exact to the last bit for up to 15 significant digits and small exponents, which
+//! is more than a float position needs.
+inline bool parse_number(const char*& p, const char* end, double& value)
+{
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+
+    double mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s, digits = true) mantissa = mantissa * 10 + (*s - '0');
+    if (s < end && *s == '.')
+        for (++s; s < end && *s >= '0' && *s <= '9'; ++s, digits = true, --exponent) mantissa = mantissa * 10 + (*s - '0');
+    if (!digits) return false;
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char* e = s + 1;
+        bool negative_exponent = false;
+        if (e < end && (*e == '-' || *e == '+')) negative_exponent = *e++ == '-';
+        int written = 0;
+        bool exponent_digits = false;
+        for (; e < end && *e >= '0' && *e <= '9'; ++e, exponent_digits = true) written = std::min(written * 10 + (*e - '0'), 100000);
+        if (exponent_digits)
+        {
+            exponent += negative_exponent ? -written : written;
+            s = e;
+        }
+    }
+
+    if (exponent >= 0) value = exponent <= 22 ? mantissa * powers[exponent] : mantissa * std::pow(10.0, exponent);
+    else value = exponent >= -22 ? mantissa / powers[-exponent] : mantissa * std::pow(10.0, exponent);
+    if (negative) value = -value;
+    p = s;
+    return true;
+}
+
+inline bool parse_integer(const char*& p, const char* end, long long& value)
+{
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) negative = *s++ == '-';
+    if (s == end || *s < '0' || *s > '9') return false;
+    long long v = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s) v = v * 10 + (*s - '0');
+    value = negative ? -v : v;
+    p = s;
+    return true;
+}
+
+inline void skip_blanks(const char*& p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+}
+
+//! Splits [begin, end) into pieces of about piece_size bytes that end just after a newline.
+inline std::vector<const char*> split_at_lines(const char* begin, const char* end, size_t piece_size)
+{
+    std::vector<const char*> bounds{ begin };
+    for (const char* p = begin + std::min(piece_size, static_cast<size_t>(end - begin)); p < end;)
+    {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!newline) break;
+        bounds.push_back(newline + 1);
+        p = newline + 1 + std::min(piece_size, static_cast<size_t>(end - newline - 1));
+    }
+    if (bounds.back() != end) bounds.push_back(end);
+    return bounds;
+}
+
+//! Calls vertex(first, end) for the numbers of every "v" line and face(first, end) for the corners of
+//! every "f" line in [p, end); everything else, texture coordinates and normals included, is skipped.
+template<typename F, typename G>
+void for_each_obj_line(const char* p, const char* end, F&& vertex, G&& face)
+{
+    while (p < end)
+    {
+        const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!line_end) line_end = end;
+        skip_blanks(p, line_end);
+        if (line_end - p >= 2 && (p[1] == ' ' || p[1] == '\t'))
+        {
+            if (p[0] == 'v') vertex(p + 2, line_end);
+            else if (p[0] == 'f') face(p + 2, line_end);
+        }
+        p = line_end + 1;
+    }
+}
+
+//! Reads the vertex numbers of a face's corners; "7", "7/2", "7//4" and "7/2/4" all give 7.
+template<typename F>
+size_t for_each_obj_corner(const char* p, const char* end, F&& corner)
+{
+    size_t corners = 0;
+    while (true)
+    {
+        skip_blanks(p, end);
+        long long index;
+        if (!parse_integer(p, end, index)) break;
+        corner(index);
+        ++corners;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') ++p;
+    }
+    return corners;
+}
+
+//! Loads the triangles of a Wavefront OBJ file; polygons are split into fans. The file is cut into
+//! pieces that are parsed in parallel twice: once to count the vertices and triangles of each piece,
+//! which gives every piece its place in the buffers, and once to fill them in.
+template<typename T>
+Triangle_mesh<T> load_obj(const std::string& path, shared_ptr<Material<T>> m)
+{
+    const Mapped_file file(path);
+    const char* data = file.data();
+    const std::vector<const char*> pieces = split_at_lines(data, data + file.size(), size_t(4) << 20);
+    const size_t piece_count = pieces.size() - 1;
+
+    std::vector<size_t> vertex_start(piece_count + 1, 0), triangle_start(piece_count + 1, 0);
+    tbb::parallel_for(size_t(0), piece_count, [&](size_t i)
+        {
+            size_t vertices = 0, triangles = 0;
+            for_each_obj_line(pieces[i], pieces[i + 1],
+                [&](const char*, const char*) { ++vertices; },
+                [&](const char* p, const char* end)
+                {
+                    const size_t corners = for_each_obj_corner(p, end, [](long long) {});
+                    if (corners >= 3) triangles += corners - 2;
+                });
+            vertex_start[i + 1] = vertices;
+            triangle_start[i + 1] = triangles;
+        });
+    for (size_t i = 0; i < piece_count; ++i)
+    {
+        vertex_start[i + 1] += vertex_start[i];
+        triangle_start[i + 1] += triangle_start[i];
+    }
+    const size_t vertex_count = vertex_start[piece_count];
+    if (vertex_count > 0xFFFFFFFFu) throw std::runtime_error(path + " has more vertices than 32-bit indices can address");
+
+    std::vector<float> positions(3 * vertex_count);
+    std::vector<std::uint32_t> indices(3 * triangle_start[piece_count]);
+    std::atomic<bool> bad_vertex(false), bad_index(false);
+    tbb::parallel_for(size_t(0), piece_count, [&](size_t i)
+        {
+            size_t v = vertex_start[i], t = triangle_start[i];
+            std::vector<long long> corners;
+            for_each_obj_line(pieces[i], pieces[i + 1],
+                [&](const char* p, const char* end)
+                {
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        skip_blanks(p, end);
+                        double x;
+                        if (!parse_number(p, end, x)) { bad_vertex = true; x = 0; }
+                        positions[3 * v + a] = static_cast<float>(x);
+                    }
+                    ++v;
+                },
+                [&](const char* p, const char* end)
+                {
+                    // Negative numbers count back from the last vertex read so far.
+                    corners.clear();
+                    for_each_obj_corner(p, end, [&](long long index)
+                        {
+                            const long long resolved = index < 0 ? static_cast<long long>(v) + index : index - 1;
+                            if (resolved < 0 || resolved >= static_cast<long long>(vertex_count)) bad_index = true;
+                            corners.push_back(resolved < 0 ? 0 : resolved);
+                        });
+                    for (size_t c = 2; c < corners.size(); ++c, ++t)
+                    {
+                        indices[3 * t] = static_cast<std::uint32_t>(corners[0]);
+                        indices[3 * t + 1] = static_cast<std::uint32_t>(corners[c - 1]);
+                        indices[3 * t + 2] = static_cast<std::uint32_t>(corners[c]);
+                    }
+                });
+        });
+    if (bad_vertex) throw std::runtime_error(path + " has a vertex without three coordinates");
+    if (bad_index) throw std::runtime_error(path + " has a face that refers to a missing vertex");
+
+    return Triangle_mesh<T>(std::move(positions), std::move(indices), std::move(m));
+}
+
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+struct ply_property
+{
+    std::string name;
+    ply_type type;          // of the value, or of the entries of a list
+    bool list = false;
+    ply_type count_type;    // of the length in front of a list
+};
+
+struct ply_element
+{
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+};
+
+inline size_t ply_size(ply_type type)
+{
+    switch (type)
+    {
+    case ply_type::int8: case ply_type::uint8: return 1;
+    case ply_type::int16: case ply_type::uint16: return 2;
+    case ply_type::float64: return 8;
+    default: return 4;
+    }
+}
+
+inline ply_type parse_ply_type(const std::string& name)
+{
+    if (name == "char" || name == "int8") return ply_type::int8;
+    if (name == "uchar" || name == "uint8") return ply_type::uint8;
+    if (name == "short" || name == "int16") return ply_type::int16;
+    if (name == "ushort" || name == "uint16") return ply_type::uint16;
+    if (name == "int" || name == "int32") return ply_type::int32;
+    if (name == "uint" || name == "uint32") return ply_type::uint32;
+    if (name == "float" || name == "float32") return ply_type::float32;
+    if (name == "double" || name == "float64") return ply_type::float64;
+    throw std::runtime_error("unknown PLY type " + name);
+}
+
+//! Reads one value stored with the given type, swapping the bytes if the file's order is not ours.
+inline double read_ply_value(const char* p, ply_type type, bool swap)
+{
+    unsigned char bytes[8];
+    const size_t n = ply_size(type);
+    std::memcpy(bytes, p, n);
+    if (swap) std::reverse(bytes, bytes + n);
+
+    switch (type)
+    {
+    case ply_type::int8: { std::int8_t v; std::memcpy(&v, bytes, 1); return v; }
+    case ply_type::uint8: return bytes[0];
+    case ply_type::int16: { std::int16_t v; std::memcpy(&v, bytes, 2); return v; }
+    case ply_type::uint16: { std::uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+    case ply_type::int32: { std::int32_t v; std::memcpy(&v, bytes, 4); return v; }
+    case ply_type::uint32: { std::uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+    case ply_type::float32: { float v; std::memcpy(&v, bytes, 4); return v; }
+    default: { double v; std::memcpy(&v, bytes, 8); return v; }
+    }
+}
+
+//! Loads a binary PLY file, little or big endian, with an element "vertex" holding x, y and z and an
+//! element "face" holding a list "vertex_indices" (or "vertex_index"); other elements and properties
+//! are skipped. Polygons are split into fans. Vertices have a fixed size and are decoded in parallel
+//! right away; faces vary in length, so one pass finds where each starts before they are decoded in parallel.
+template<typename T>
+Triangle_mesh<T> load_ply(const std::string& path, shared_ptr<Material<T>> m)
+{
+    const Mapped_file file(path);
+    const char* data = file.data();
+    const char* const end = data + file.size();
+
+    // Header: text lines up to end_header.
+    std::vector<ply_element> elements;
+    bool swap = false;
+    const char* p = data;
+    bool first_line = true;
+    while (true)
+    {
+        const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!line_end) throw std::runtime_error(path + " has no end_header");
+        std::istringstream line(std::string(p, line_end));
+        p = line_end + 1;
+
+        std::string keyword;
+        line >> keyword;
+        if (first_line)
+        {
+            if (keyword != "ply") throw std::runtime_error(path + " is not a PLY file");
+            first_line = false;
+        }
+        else if (keyword == "format")
+        {
+            std::string format;
+            line >> format;
+            const std::uint16_t probe = 1;
+            const bool little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+            if (format == "binary_little_endian") swap = !little;
+            else if (format == "binary_big_endian") swap = little;
+            else throw std::runtime_error(path + ": only binary PLY files are supported, not " + format);
+        }
+        else if (keyword == "element")
+        {
+            ply_element element;
+            line >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property")
+        {
+            if (elements.empty()) throw std::runtime_error(path + " has a property outside any element");
+            ply_property property;
+            std::string type;
+            line >> type;
+            if (type == "list")
+            {
+                std::string count_type, entry_type;
+                line >> count_type >> entry_type;
+                property.list = true;
+                property.count_type = parse_ply_type(count_type);
+                property.type = parse_ply_type(entry_type);
+            }
+            else
+            {
+                property.type = parse_ply_type(type);
+            }
+            line >> property.name;
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header")
+        {
+            break;
+        }
+    }
+
+    std::vector<float> positions;
+    std::vector<std::uint32_t> indices;
+    bool have_vertices = false, have_faces = false;
+    for (const ply_element& element : elements)
+    {
+        bool fixed = true;
+        size_t stride = 0;
+        for (const ply_property& property : element.properties)
+        {
+            fixed = fixed && !property.list;
+            stride += ply_size(property.type);
+        }
+
+        // Size of the record at q, reading the lengths of its lists; list_length gets the length of
+        // the list property number `wanted`.
+        auto record_size = [&](const char* q, size_t wanted, size_t& list_length)
+        {
+            size_t size = 0;
+            for (size_t i = 0; i < element.properties.size(); ++i)
+            {
+                const ply_property& property = element.properties[i];
+                if (!property.list)
+                {
+                    size += ply_size(property.type);
+                    continue;
+                }
+                if (q + size + ply_size(property.count_type) > end) throw std::runtime_error(path + " is truncated");
+                const size_t length = static_cast<size_t>(read_ply_value(q + size, property.count_type, swap));
+                if (i == wanted) list_length = length;
+                size += ply_size(property.count_type) + length * ply_size(property.type);
+            }
+            return size;
+        };
+
+        if (element.name == "vertex")
+        {
+            int axis_offset[3] = { -1, -1, -1 };
+            ply_type axis_type[3] = {};
+            size_t offset = 0;
+            for (const ply_property& property : element.properties)
+            {
+                const int a = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+                if (a >= 0 && !property.list)
+                {
+                    axis_offset[a] = static_cast<int>(offset);
+                    axis_type[a] = property.type;
+                }
+                offset += ply_size(property.type);
+            }
+            if (!fixed || axis_offset[0] < 0 || axis_offset[1] < 0 || axis_offset[2] < 0)
+                throw std::runtime_error(path + ": vertices need x, y and z and no lists");
+            if (element.count > 0xFFFFFFFFu) throw std::runtime_error(path + " has more vertices than 32-bit indices can address");
+            if (static_cast<size_t>(end - p) < element.count * stride) throw std::runtime_error(path + " is truncated");
+
+            positions.resize(3 * element.count);
+            const char* base = p;
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, element.count, 16384), [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t k = range.begin(); k != range.end(); ++k)
+                        for (int a = 0; a < 3; ++a)
+                            positions[3 * k + a] = static_cast<float>(read_ply_value(base + k * stride + axis_offset[a], axis_type[a], swap));
+                });
+            p += element.count * stride;
+            have_vertices = true;
+        }
+        else if (element.name == "face")
+        {
+            size_t list = element.properties.size(), list_offset = 0;
+            for (size_t i = 0, offset = 0; i < element.properties.size(); ++i)
+            {
+                const ply_property& property = element.properties[i];
+                if (property.list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                {
+                    list = i;
+                    list_offset = offset;
+                    break;
+                }
+                if (property.list) break;
+                offset += ply_size(property.type);
+            }
+            if (list == element.properties.size())
+                throw std::runtime_error(path + ": faces need a vertex_indices list, after any other lists");
+            const ply_property& corners = element.properties[list];
+
+            // Where every face starts, and where its triangles go.
+            std::vector<std::uint64_t> face_start(element.count);
+            std::vector<std::uint64_t> triangle_start(element.count + 1, 0);
+            size_t offset = 0;
+            for (size_t f = 0; f < element.count; ++f)
+            {
+                face_start[f] = offset;
+                size_t length = 0;
+                offset += record_size(p + offset, list, length);
+                triangle_start[f + 1] = triangle_start[f] + (length >= 3 ? length - 2 : 0);
+            }
+            if (static_cast<size_t>(end - p) < offset) throw std::runtime_error(path + " is truncated");
+
+            indices.resize(3 * triangle_start[element.count]);
+            const char* base = p;
+            const size_t count_size = ply_size(corners.count_type), entry_size = ply_size(corners.type);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, element.count, 16384), [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t f = range.begin(); f != range.end(); ++f)
+                    {
+                        const char* q = base + face_start[f] + list_offset + count_size;
+                        const size_t triangles = static_cast<size_t>(triangle_start[f + 1] - triangle_start[f]);
+                        // Negative indices wrap around to numbers past the vertices and are caught below.
+                        auto index = [&](size_t c) { return static_cast<std::uint32_t>(static_cast<long long>(read_ply_value(q + c * entry_size, corners.type, swap))); };
+                        // Faces of fewer than three corners have no triangles and may have no first index.
+                        if (triangles == 0) continue;
+                        const std::uint32_t first = index(0);
+                        for (size_t c = 0; c < triangles; ++c)
+                        {
+                            std::uint32_t* out = indices.data() + 3 * (triangle_start[f] + c);
+                            out[0] = first;
+                            out[1] = index(c + 1);
+                            out[2] = index(c + 2);
+                        }
+                    }
+                });
+            p += offset;
+            have_faces = true;
+        }
+        else if (fixed)
+        {
+            p += element.count * stride;
+        }
+        else
+        {
+            size_t unused;
+            for (size_t k = 0; k < element.count; ++k) p += record_size(p, element.properties.size(), unused);
+        }
+        if (p > end) throw std::runtime_error(path + " is truncated");
+    }
+    if (!have_vertices || !have_faces) throw std::runtime_error(path + " needs both vertex and face elements");
+
+    const size_t vertex_count = positions.size() / 3;
+    std::atomic<bool> bad_index(false);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, indices.size(), 65536), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+                if (indices[i] >= vertex_count) bad_index = true;
+        });
+    if (bad_index) throw std::runtime_error(path + " has a face that refers to a missing vertex");
+
+    return Triangle_mesh<T>(std::move(positions), std::move(indices), std::move(m));
+}
+
+//! Picks the loader by the file name's extension, .obj or .ply.
+template<typename T>
+Triangle_mesh<T> load_mesh(const std::string& path, shared_ptr<Material<T>> m)
+{
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (extension == "obj") return load_obj<T>(path, std::move(m));
+    if (extension == "ply") return load_ply<T>(path, std::move(m));
+    throw std::runtime_error("unknown mesh format " + path + ", expected .obj or .ply");
+}
+
+#endif
@@ -0,0 +1,601 @@
+// this file holds out-of-core sphere sets: spheres split into spatially compact chunks in a file that
+// is mapped and paged in a chunk at a time, with batched queries and a renderer that stream rays
+// through the chunks instead of fetching geometry per ray
+
+#pragma once
+#ifndef OUT_OF_CORE_H_
+#define OUT_OF_CORE_H_
+
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "geometry_cache.h"
+#include "integrator.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "ray_query.h"
+#include "render_job.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+// A chunk file holds, in the byte order of the machine that wrote it, a chunk_file_header, the table
+// of chunk_entry, and then every chunk on a page boundary of its own: its BVH nodes followed by its
+// spheres in leaf order.
+
+//! A sphere as stored in a chunk file. material numbers the palette the scene is opened with.
+struct chunk_sphere
+{
+    float center[3];
+    float radius;
+    std::uint32_t material;
+};
+static_assert(sizeof(chunk_sphere) == 20, "a stored sphere should take 20 bytes");
+
+//! A bvh_node as stored, with its bounds rounded outwards to float.
+struct chunk_node
+{
+    float minimum[3];
+    float maximum[3];
+    std::uint32_t offset;
+    std::uint16_t count;
+    std::uint8_t axis;
+    std::uint8_t unused;
+};
+static_assert(sizeof(chunk_node) == 32, "a stored node should take 32 bytes");
+
+struct chunk_entry
+{
+    float minimum[3];
+    float maximum[3];
+    std::uint64_t offset;           // of the chunk's nodes from the start of the file
+    std::uint64_t first_sphere;     // number of the chunk's first sphere in the whole set
+    std::uint32_t sphere_count;
+    std::uint32_t node_count;
+
+    size_t bytes() const { return node_count * sizeof(chunk_node) + sphere_count * sizeof(chunk_sphere); }
+};
+static_assert(sizeof(chunk_entry) == 48, "a chunk table entry should take 48 bytes");
+
+struct chunk_file_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t chunk_count;
+    std::uint64_t sphere_count;
+    std::uint32_t material_count;
+    std::uint32_t unused;
+};
+static_assert(sizeof(chunk_file_header) == 32, "the chunk file header should take 32 bytes");
+
+constexpr char chunk_file_magic[8] = { 'T', 'R', 'T', 'C', 'H', 'U', 'N', 'K' };
+constexpr std::uint32_t chunk_file_version = 1;
+constexpr size_t chunk_alignment = 4096;
+
+//! The nearest float at or below x, and at or above it.
+inline float float_below(double x)
+{
+    const float f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_above(double x)
+{
+    const float f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+inline Aabb<double> stored_bounds(const chunk_sphere& s)
+{
+    const double r = std::fabs(static_cast<double>(s.radius));
+    const Point3<double> c(s.center[0], s.center[1], s.center[2]);
+    return Aabb<double>(c - Vector3<double>(r, r, r), c + Vector3<double>(r, r, r));
+}
+
+//! Writes spheres as a chunk file. The set is halved at the median of its longest axis until every
+//! part holds at most spheres_per_chunk, so a chunk covers a compact piece of space, and every chunk
+//! gets a BVH of its own that is stored with it. The conversion itself holds all spheres in memory.
+inline void write_chunked_spheres(const std::string& path, std::vector<chunk_sphere> spheres, size_t spheres_per_chunk, std::uint32_t material_count)
+{
+    spheres_per_chunk = std::max<size_t>(spheres_per_chunk, 1);
+    if (spheres.size() / spheres_per_chunk >= std::numeric_limits<std::uint32_t>::max())
+        throw std::runtime_error("too many chunks for " + path);
+
+    std::vector<std::pair<size_t, size_t>> parts;
+    std::vector<std::pair<size_t, size_t>> pending{ { 0, spheres.size() } };
+    while (!pending.empty())
+    {
+        const std::pair<size_t, size_t> part = pending.back();
+        pending.pop_back();
+        if (part.second - part.first <= spheres_per_chunk)
+        {
+            if (part.second > part.first) parts.push_back(part);
+            continue;
+        }
+        Aabb<double> centers;
+        for (size_t k = part.first; k < part.second; ++k)
+            centers.expand(Point3<double>(spheres[k].center[0], spheres[k].center[1], spheres[k].center[2]));
+        const int axis = centers.longest_axis();
+        const size_t middle = part.first + (part.second - part.first) / 2;
+        std::nth_element(spheres.begin() + part.first, spheres.begin() + middle, spheres.begin() + part.second,
+            [axis](const chunk_sphere& a, const chunk_sphere& b) { return a.center[axis] < b.center[axis]; });
+        // Second half first, so the parts come out in the order of the split tree.
+        pending.push_back({ middle, part.second });
+        pending.push_back({ part.first, middle });
+    }
+
+    std::vector<chunk_entry> entries(parts.size());
+    std::vector<std::vector<chunk_node>> chunk_nodes(parts.size());
+    tbb::parallel_for(size_t(0), parts.size(), [&](size_t c)
+        {
+            const size_t first = parts[c].first, count = parts[c].second - parts[c].first;
+            std::vector<bvh_build_item<double>> items(count);
+            for (size_t k = 0; k < count; ++k)
+            {
+                const Aabb<double> box = stored_bounds(spheres[first + k]);
+                items[k] = bvh_build_item<double>{ box, box.center(), k };
+            }
+            std::vector<bvh_node<double>> nodes;
+            Sah_builder<double>(nodes, items, 4).build(0, count);
+
+            const std::vector<chunk_sphere> original(spheres.begin() + first, spheres.begin() + first + count);
+            for (size_t k = 0; k < count; ++k) spheres[first + k] = original[items[k].index];
+
+            chunk_nodes[c].resize(nodes.size());
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                chunk_node& stored = chunk_nodes[c][i];
+                for (int a = 0; a < 3; ++a)
+                {
+                    stored.minimum[a] = float_below(nodes[i].bounds.minimum[a]);
+                    stored.maximum[a] = float_above(nodes[i].bounds.maximum[a]);
+                }
+                stored.offset = nodes[i].offset;
+                stored.count = nodes[i].count;
+                stored.axis = nodes[i].axis;
+                stored.unused = 0;
+            }
+
+            chunk_entry& e = entries[c];
+            std::copy(chunk_nodes[c][0].minimum, chunk_nodes[c][0].minimum + 3, e.minimum);
+            std::copy(chunk_nodes[c][0].maximum, chunk_nodes[c][0].maximum + 3, e.maximum);
+            e.first_sphere = first;
+            e.sphere_count = static_cast<std::uint32_t>(count);
+            e.node_count = static_cast<std::uint32_t>(nodes.size());
+        });
+
+    auto aligned = [](std::uint64_t offset) { return (offset + chunk_alignment - 1) / chunk_alignment * chunk_alignment; };
+    std::uint64_t offset = aligned(sizeof(chunk_file_header) + entries.size() * sizeof(chunk_entry));
+    for (chunk_entry& e : entries)
+    {
+        e.offset = offset;
+        offset = aligned(offset + e.bytes());
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("cannot create " + path);
+    chunk_file_header header{};
+    std::copy(chunk_file_magic, chunk_file_magic + 8, header.magic);
+    header.version = chunk_file_version;
+    header.chunk_count = static_cast<std::uint32_t>(entries.size());
+    header.sphere_count = spheres.size();
+    header.material_count = material_count;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(chunk_entry));
+
+    const std::vector<char> padding(chunk_alignment, 0);
+    std::uint64_t written = sizeof(chunk_file_header) + entries.size() * sizeof(chunk_entry);
+    for (size_t c = 0; c < entries.size(); ++c)
+    {
+        out.write(padding.data(), static_cast<std::streamsize>(entries[c].offset - written));
+        out.write(reinterpret_cast<const char*>(chunk_nodes[c].data()), chunk_nodes[c].size() * sizeof(chunk_node));
+        out.write(reinterpret_cast<const char*>(spheres.data() + entries[c].first_sphere), entries[c].sphere_count * sizeof(chunk_sphere));
+        written = entries[c].offset + entries[c].bytes();
+    }
+    if (!out) throw std::runtime_error("cannot write " + path);
+}
+
+//! How rays were streamed through the chunks.
+struct streaming_stats
+{
+    size_t batches = 0;
+    size_t rays = 0;
+    size_t passes = 0;          // times a chunk was run over the rays waiting on it
+    size_t chunk_tests = 0;     // rays tested against a chunk's spheres
+};
+
+//! A chunk file opened for queries. Only the chunk table and a BVH over the chunk boxes stay resident;
+//! the spheres of a chunk are copied out of the mapped file, into a Geometry_cache that holds at most
+//! budget_bytes of them, when a batch of rays first needs it. Queries take whole batches: every ray
+//! lists the chunks it passes, nearest first, and waits in the queue of the next one it needs. A chunk
+//! is then fetched once for all the rays queued on it rather than once per ray. Queries change the
+//! cache, so one batch runs at a time, using all cores within it.
+template<typename T>
+class Out_of_core_scene
+{
+public:
+    Out_of_core_scene(const std::string& path, std::vector<shared_ptr<Material<T>>> palette, size_t budget_bytes)
+        : file(path, mapped_access::random), materials(std::move(palette)), cache(budget_bytes)
+    {
+        chunk_file_header header;
+        if (file.size() < sizeof(header)) throw std::runtime_error(path + " is not a chunk file");
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (!std::equal(chunk_file_magic, chunk_file_magic + 8, header.magic) || header.version != chunk_file_version)
+            throw std::runtime_error(path + " is not a chunk file of version " + std::to_string(chunk_file_version));
+        if (header.material_count > materials.size())
+            throw std::runtime_error(path + " uses " + std::to_string(header.material_count) + " materials, more than were given");
+        if (file.size() < sizeof(header) + header.chunk_count * sizeof(chunk_entry))
+            throw std::runtime_error(path + " is truncated");
+
+        spheres = header.sphere_count;
+        entries.resize(header.chunk_count);
+        std::memcpy(entries.data(), file.data() + sizeof(header), entries.size() * sizeof(chunk_entry));
+        boxes.resize(entries.size());
+        std::vector<bvh_build_item<T>> items(entries.size());
+        for (size_t c = 0; c < entries.size(); ++c)
+        {
+            const chunk_entry& e = entries[c];
+            if (e.offset + e.bytes() > file.size() || e.sphere_count == 0 || e.node_count == 0)
+                throw std::runtime_error(path + " has a broken chunk table");
+            boxes[c] = Aabb<T>(Point3<T>(e.minimum[0], e.minimum[1], e.minimum[2]), Point3<T>(e.maximum[0], e.maximum[1], e.maximum[2]));
+            items[c] = bvh_build_item<T>{ boxes[c], boxes[c].center(), c };
+        }
+        if (!entries.empty()) Sah_builder<T>(top_nodes, items, 1).build(0, items.size());
+        top_chunks.resize(items.size());
+        for (size_t i = 0; i < items.size(); ++i) top_chunks[i] = static_cast<std::uint32_t>(items[i].index);
+    }
+
+    size_t chunk_count() const { return entries.size(); }
+    size_t sphere_count() const { return spheres; }
+    size_t file_bytes() const { return file.size(); }
+
+    //! What stays resident whatever the budget: the chunk table and the BVH over the chunks.
+    size_t top_level_bytes() const
+    {
+        return entries.size() * (sizeof(chunk_entry) + sizeof(Aabb<T>) + sizeof(std::uint32_t)) + top_nodes.size() * sizeof(bvh_node<T>);
+    }
+
+    const shared_ptr<Material<T>>& material(std::int32_t id) const { return materials[id]; }
+
+    const geometry_cache_stats& cache_stats() const { return cache.stats(); }
+    const streaming_stats& stats() const { return counters; }
+    size_t budget_bytes() const { return cache.budget_bytes(); }
+
+    //! Nearest hit for every ray of the batch, as Ray_query_scene::closest_hit. Primitive ids number
+    //! the spheres in the order of the file.
+    void closest_hit(const ray_batch<T>& rays, query_hit<T>* hits)
+    {
+        std::vector<T> reach(rays.t_max, rays.t_max + rays.count);
+        for (size_t k = 0; k < rays.count; ++k)
+        {
+            hits[k].t = rays.t_max[k];
+            hits[k].primitive_id = -1;
+            hits[k].material_id = -1;
+            hits[k].normal = Vector3<T>::zero();
+        }
+
+        stream(rays, reach, [&](const resident_chunk& chunk, const chunk_entry& e, size_t k)
+            {
+                const Ray<T> r(rays.origins[k], rays.directions[k]);
+                hit_candidate<T> candidate;
+                if (!chunk.bvh.intersect(r, rays.t_min[k], reach[k], candidate)) return;
+
+                reach[k] = candidate.t;
+                query_hit<T>& h = hits[k];
+                h.t = candidate.t;
+                h.primitive_id = static_cast<std::int64_t>(e.first_sphere + candidate.primitive);
+                h.material_id = chunk.material_ids[candidate.primitive];
+                h.normal = chunk.bvh.primitives().outward_normal(static_cast<ptrdiff_t>(candidate.primitive), r.at(candidate.t));
+            });
+    }
+
+    //! occluded[k] is true if anything lies on ray k within its range.
+    void occluded(const ray_batch<T>& rays, bool* occluded)
+    {
+        std::vector<T> reach(rays.t_max, rays.t_max + rays.count);
+        std::fill(occluded, occluded + rays.count, false);
+        stream(rays, reach, [&](const resident_chunk& chunk, const chunk_entry&, size_t k)
+            {
+                const Ray<T> r(rays.origins[k], rays.directions[k]);
+                if (!chunk.bvh.occluded(r, rays.t_min[k], reach[k])) return;
+                occluded[k] = true;
+                reach[k] = std::numeric_limits<T>::lowest();
+            });
+    }
+
+private:
+    struct resident_chunk
+    {
+        resident_chunk(Bvh<T> bvh, std::vector<std::int32_t> material_ids) : bvh(std::move(bvh)), material_ids(std::move(material_ids)) {}
+
+        Bvh<T> bvh;
+        std::vector<std::int32_t> material_ids;
+    };
+
+    //! A chunk the ray passes, keyed by where it enters the chunk's box, rounded down.
+    struct chunk_visit
+    {
+        float t;
+        std::uint32_t chunk;
+    };
+
+    std::shared_ptr<const resident_chunk> load(std::uint32_t c, size_t& bytes) const
+    {
+        const chunk_entry& e = entries[c];
+        std::vector<chunk_node> stored(e.node_count);
+        std::vector<chunk_sphere> records(e.sphere_count);
+        std::memcpy(stored.data(), file.data() + e.offset, stored.size() * sizeof(chunk_node));
+        std::memcpy(records.data(), file.data() + e.offset + stored.size() * sizeof(chunk_node), records.size() * sizeof(chunk_sphere));
+        file.release(e.offset, e.bytes());
+
+        Sphere_set<T> set;
+        std::vector<std::int32_t> ids(records.size());
+        for (size_t k = 0; k < records.size(); ++k)
+        {
+            const chunk_sphere& s = records[k];
+            if (s.material >= materials.size()) throw std::runtime_error("a chunk uses an unknown material");
+            set.add(Point3<T>(s.center[0], s.center[1], s.center[2]), s.radius, materials[s.material]);
+            ids[k] = static_cast<std::int32_t>(s.material);
+        }
+
+        std::vector<bvh_node<T>> nodes(stored.size());
+        for (size_t i = 0; i < stored.size(); ++i)
+        {
+            const chunk_node& n = stored[i];
+            const bool leaf = n.count > 0;
+            if (leaf ? n.offset + n.count > records.size() : n.offset <= i || n.offset >= stored.size())
+                throw std::runtime_error("a chunk has a broken BVH");
+            nodes[i].bounds = Aabb<T>(Point3<T>(n.minimum[0], n.minimum[1], n.minimum[2]), Point3<T>(n.maximum[0], n.maximum[1], n.maximum[2]));
+            nodes[i].offset = n.offset;
+            nodes[i].count = n.count;
+            nodes[i].axis = n.axis;
+        }
+
+        bytes = set.memory_bytes() + nodes.size() * sizeof(bvh_node<T>) + ids.size() * sizeof(std::int32_t);
+        return std::make_shared<resident_chunk>(Bvh<T>(std::move(set), std::move(nodes)), std::move(ids));
+    }
+
+    //! Calls visit(chunk, t_entry) for every chunk whose box the ray passes within [t_min, t_max].
+    template<typename F>
+    void for_each_chunk_on(const Ray<T>& r, T t_min, T t_max, F&& visit) const
+    {
+        if (top_nodes.empty()) return;
+        const Vector3<T> inv_dir(1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z);
+        std::uint32_t stack[bvh_stack_size];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const std::uint32_t current = stack[--top];
+            const bvh_node<T>& node = top_nodes[current];
+            if (!node.bounds.hit(r.orig, inv_dir, t_min, t_max)) continue;
+            if (node.count == 0)
+            {
+                stack[top++] = node.offset;
+                stack[top++] = current + 1;
+                continue;
+            }
+            for (std::uint32_t i = node.offset; i < node.offset + node.count; ++i)
+            {
+                T t0 = t_min, t1 = t_max;
+                if (boxes[top_chunks[i]].clip(r.orig, inv_dir, t0, t1)) visit(top_chunks[i], t0);
+            }
+        }
+    }
+
+    //! Runs test(chunk, entry, k) for every ray k and every chunk on it, nearest first, until the ray's
+    //! reach, which test may shorten, ends before the next chunk.
+    template<typename Test>
+    void stream(const ray_batch<T>& rays, std::vector<T>& reach, Test&& test)
+    {
+        const size_t n = rays.count;
+        ++counters.batches;
+        counters.rays += n;
+
+        // Every ray's chunks in one array, counted first and then filled in.
+        std::vector<size_t> visit_start(n + 1, 0);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    size_t count = 0;
+                    for_each_chunk_on(Ray<T>(rays.origins[k], rays.directions[k]), rays.t_min[k], reach[k], [&](std::uint32_t, T) { ++count; });
+                    visit_start[k + 1] = count;
+                }
+            });
+        for (size_t k = 0; k < n; ++k) visit_start[k + 1] += visit_start[k];
+        std::vector<chunk_visit> visits(visit_start[n]);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    chunk_visit* next = visits.data() + visit_start[k];
+                    for_each_chunk_on(Ray<T>(rays.origins[k], rays.directions[k]), rays.t_min[k], reach[k],
+                        [&](std::uint32_t c, T t) { *next++ = chunk_visit{ float_below(t), c }; });
+                    std::sort(visits.data() + visit_start[k], next, [](const chunk_visit& a, const chunk_visit& b) { return a.t < b.t; });
+                }
+            });
+
+        // Every ray waits in the queue of the next chunk it needs.
+        std::vector<size_t> cursor(visit_start.begin(), visit_start.end() - 1);
+        std::vector<std::vector<std::uint32_t>> queues(entries.size());
+        size_t waiting = 0;
+        for (size_t k = 0; k < n; ++k)
+        {
+            if (visit_start[k] == visit_start[k + 1]) continue;
+            queues[visits[cursor[k]].chunk].push_back(static_cast<std::uint32_t>(k));
+            ++waiting;
+        }
+
+        std::vector<std::uint32_t> queue;
+        while (waiting > 0)
+        {
+            // Empty the queues of resident chunks before loading another, since rays that move on
+            // often need a neighbour that is still resident. Failing that, load the chunk most rays
+            // wait on and have the OS read ahead the one that would come after it.
+            const std::uint32_t none = std::numeric_limits<std::uint32_t>::max();
+            std::uint32_t c = none, runner_up = none;
+            for (std::uint32_t i = 0; i < entries.size(); ++i)
+            {
+                if (queues[i].empty()) continue;
+                if (cache.contains(i))
+                {
+                    c = i;
+                    runner_up = none;
+                    break;
+                }
+                if (c == none || queues[i].size() > queues[c].size())
+                {
+                    runner_up = c;
+                    c = i;
+                }
+                else if (runner_up == none || queues[i].size() > queues[runner_up].size())
+                {
+                    runner_up = i;
+                }
+            }
+            if (runner_up != none) file.will_need(entries[runner_up].offset, entries[runner_up].bytes());
+
+            ++counters.passes;
+            queue.clear();
+            queue.swap(queues[c]);
+            const std::shared_ptr<const resident_chunk> chunk = cache.get(c, [this](std::uint32_t key, size_t& bytes) { return load(key, bytes); });
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, queue.size(), 256), [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t q = range.begin(); q != range.end(); ++q) test(*chunk, entries[c], queue[q]);
+                });
+            counters.chunk_tests += queue.size();
+            waiting -= queue.size();
+
+            // Move on the rays that can still meet something before their reach.
+            for (std::uint32_t k : queue)
+            {
+                const size_t next = ++cursor[k];
+                if (next == visit_start[k + 1] || visits[next].t > reach[k]) continue;
+                queues[visits[next].chunk].push_back(k);
+                ++waiting;
+            }
+        }
+    }
+
+private:
+    Mapped_file file;
+    std::vector<shared_ptr<Material<T>>> materials;
+    size_t spheres = 0;
+    std::vector<chunk_entry> entries;
+    std::vector<Aabb<T>> boxes;
+    std::vector<bvh_node<T>> top_nodes;
+    std::vector<std::uint32_t> top_chunks;     // chunks in the leaf order of top_nodes
+    Geometry_cache<resident_chunk> cache;
+    streaming_stats counters;
+};
+
+//! Path traces an out-of-core scene a wavefront at a time: up to wavefront_size paths, taken from every
+//! sample of every pixel in turn, are extended together one bounce per closest_hit batch, and the paths
+//! that end are dropped from the wavefront before the next bounce. Shades as ray_color does.
+template<typename T>
+Framebuffer<T> render_out_of_core(Out_of_core_scene<T>& scene, const Camera<T>& cam, const render_settings& settings,
+    const background_fn<T>& background = &sky_background<T>, size_t wavefront_size = size_t(1) << 18)
+{
+    Framebuffer<T> image(settings.image_width, settings.image_height);
+    const size_t pixel_count = static_cast<size_t>(settings.image_width) * settings.image_height;
+    const size_t path_count = pixel_count * static_cast<size_t>(std::max(settings.samples_per_pixel, 0));
+
+    std::vector<Point3<T>> origins(wavefront_size);
+    std::vector<Vector3<T>> directions(wavefront_size);
+    std::vector<T> t_min(wavefront_size, static_cast<T>(0.0001)), t_max(wavefront_size, std::numeric_limits<T>::max());
+    std::vector<Color<T>> throughput(wavefront_size), radiance(wavefront_size);
+    std::vector<size_t> path(wavefront_size);
+    std::vector<char> extended(wavefront_size);
+    std::vector<query_hit<T>> hits(wavefront_size);
+
+    for (size_t first = 0; first < path_count; first += wavefront_size)
+    {
+        const size_t size = std::min(wavefront_size, path_count - first);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, size, 1024), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    const size_t pixel = (first + k) % pixel_count;
+                    const int i = static_cast<int>(pixel % settings.image_width), j = static_cast<int>(pixel / settings.image_width);
+                    const Ray<T> r = cam.get_ray((i + random_generate<T>()) / (settings.image_width - 1), (j + random_generate<T>()) / (settings.image_height - 1));
+                    origins[k] = r.orig;
+                    directions[k] = r.dir;
+                    throughput[k] = Color<T>(1, 1, 1);
+                    radiance[k] = Color<T>::zero();
+                    path[k] = k;
+                }
+            });
+
+        size_t alive = size;
+        for (int depth = 0; depth < settings.max_depth && alive > 0; ++depth)
+        {
+            scene.closest_hit(ray_batch<T>{ origins.data(), directions.data(), t_min.data(), t_max.data(), alive }, hits.data());
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, alive, 1024), [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t k = range.begin(); k != range.end(); ++k)
+                    {
+                        const Ray<T> r(origins[k], directions[k]);
+                        const query_hit<T>& h = hits[k];
+                        extended[k] = false;
+                        if (h.primitive_id < 0)
+                        {
+                            radiance[path[k]] += throughput[k] * background(r);
+                            continue;
+                        }
+
+                        hit_record<T> rec;
+                        rec.t = h.t;
+                        rec.p = r.at(h.t);
+                        rec.set_face_normal(r, h.normal);
+                        rec.mat_ptr = scene.material(h.material_id);
+                        radiance[path[k]] += throughput[k] * rec.mat_ptr->emitted(rec);
+
+                        Ray<T> scattered;
+                        Color<T> attenuation;
+                        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) continue;
+                        throughput[k] = throughput[k] * attenuation;
+                        origins[k] = scattered.orig;
+                        directions[k] = scattered.dir;
+                        extended[k] = true;
+                    }
+                });
+
+            size_t kept = 0;
+            for (size_t k = 0; k < alive; ++k)
+            {
+                if (!extended[k]) continue;
+                origins[kept] = origins[k];
+                directions[kept] = directions[k];
+                throughput[kept] = throughput[k];
+                path[kept] = path[k];
+                ++kept;
+            }
+            alive = kept;
+        }
+
+        // Several samples of a pixel may share the wavefront, so this part stays serial.
+        for (size_t k = 0; k < size; ++k)
+        {
+            const size_t pixel = (first + k) % pixel_count;
+            const int i = static_cast<int>(pixel % settings.image_width), j = static_cast<int>(pixel / settings.image_width);
+            image.color_at(i, j) += radiance[k];
+            image.luminance_squares_at(i, j) += luminance(radiance[k]) * luminance(radiance[k]);
+            ++image.samples_at(i, j);
+        }
+    }
+    return image;
+}
+
+#endif
@@ -0,0 +1,171 @@
+// this file holds the preview integrators: cheap stand-ins for ray_color that trace the same scene
+// from the same camera but stop at the first hit, or one bounce after it, for interactive feedback
+
+#pragma once
+#ifndef PREVIEW_H_
+#define PREVIEW_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "material.h"
+#include "lights.h"
+#include "integrator.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+
+enum class preview_mode { albedo, normal, depth, ambient_occlusion, direct };
+
+//! Parses "albedo", "normal", "depth", "ao" or "direct". Returns false for anything else.
+inline bool parse_preview_mode(const std::string& name, preview_mode& mode)
+{
+    if (name == "albedo") mode = preview_mode::albedo;
+    else if (name == "normal") mode = preview_mode::normal;
+    else if (name == "depth") mode = preview_mode::depth;
+    else if (name == "ao") mode = preview_mode::ambient_occlusion;
+    else if (name == "direct") mode = preview_mode::direct;
+    else return false;
+    return true;
+}
+
+template<typename T>
+struct preview_settings
+{
+    //! Occlusion rays per camera sample, and how far they look; nearer hits darken.
+    int ao_samples = 4;
+    T ao_radius = 1;
+
+    //! Distance shown black in the depth view; the camera is white.
+    T max_distance = 30;
+
+    //! Mirror and glass bounces the direct view follows before it gives up on a path.
+    int specular_depth = 4;
+};
+
+//! Surface color at the first hit, lights shown in their own color scaled to fit; the background
+//! where nothing is hit.
+template<typename T>
+Color<T> ray_albedo(const Ray<T>& r, const Hittable<T>& world, const background_fn<T>& background)
+{
+    hit_record<T> rec;
+    if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) return background(r);
+    if (rec.mat_ptr->is_emissive())
+    {
+        const Color<T> e = rec.mat_ptr->emitted(rec);
+        const T brightest = std::max(e.x, std::max(e.y, e.z));
+        return brightest > 1 ? e / brightest : e;
+    }
+    return rec.mat_ptr->reflectance(rec);
+}
+
+//! The shading normal at the first hit mapped from [-1, 1] to [0, 1] per axis; black for misses.
+template<typename T>
+Color<T> ray_normal(const Ray<T>& r, const Hittable<T>& world)
+{
+    hit_record<T> rec;
+    if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) return Color<T>::zero();
+    return (rec.normal + Color<T>(1, 1, 1)) * T(0.5);
+}
+
+//! Distance to the first hit as grey, white at the camera fading to black at max_distance. The
+//! display applies gamma 2, so the value is squared to keep the ramp linear on screen.
+template<typename T>
+Color<T> ray_depth(const Ray<T>& r, const Hittable<T>& world, T max_distance)
+{
+    hit_record<T> rec;
+    if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) return Color<T>::zero();
+    const T shade = clamp(T(1) - rec.t * r.direction().norm() / max_distance, T(0), T(1));
+    return Color<T>(1, 1, 1) * (shade * shade);
+}
+
+//! Ambient occlusion at the first hit: the fraction of samples cosine-distributed rays that
+//! reach radius without hitting anything, as grey. Misses show the background.
+template<typename T>
+Color<T> ray_ambient_occlusion(const Ray<T>& r, const Hittable<T>& world, int samples, T radius,
+    const background_fn<T>& background)
+{
+    hit_record<T> rec;
+    if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) return background(r);
+
+    int open = 0;
+    for (int s = 0; s < samples; ++s)
+    {
+        Vector3<T> direction = rec.normal + random_unit_vector<T>();
+        if (direction.is_similar(Vector3<T>::zero())) direction = rec.normal;
+        direction.normalize();
+        if (!world.occluded(Ray<T>(rec.p, direction), 0.0001, radius)) ++open;
+    }
+    return Color<T>(1, 1, 1) * (static_cast<T>(open) / std::max(samples, 1));
+}
+
+//! Light that reaches the camera after at most one diffuse bounce: emission, plus at the first
+//! diffuse hit one light sample and, unless the environment is among the lights, one cosine-sampled
+//! ray that counts if it escapes to the background. Mirrors and glass are followed up to
+//! specular_depth bounces so that they show what they reflect.
+template<typename T>
+Color<T> ray_direct(const Ray<T>& r_in, const Hittable<T>& world, const Light_list<T>& lights, int specular_depth,
+    const background_fn<T>& background)
+{
+    Color<T> throughput(1, 1, 1);
+    Ray<T> r = r_in;
+    for (int bounce = 0; bounce <= specular_depth; ++bounce)
+    {
+        hit_record<T> rec;
+        if (!world.hit(r, 0.0001, MAX_DOUBLE, rec)) return throughput * background(r);
+
+        const Material<T>& material = *rec.mat_ptr;
+        Color<T> radiance = material.emitted(rec);
+        if (material.is_diffuse())
+        {
+            light_sample<T> ls;
+            if (!lights.empty() && lights.sample(rec.p, ls) && ls.direction.dot(rec.normal) > 0 &&
+                !world.occluded(Ray<T>(rec.p, ls.direction), 0.0001, ls.distance - 0.0001))
+                radiance += material.eval(rec, ls.direction) * ls.emitted / ls.pdf;
+
+            if (!lights.has_environment())
+            {
+                Ray<T> scattered;
+                Color<T> attenuation;
+                if (material.scatter(r, rec, attenuation, scattered) && !world.occluded(scattered, 0.0001, MAX_DOUBLE))
+                    radiance += attenuation * background(scattered);
+            }
+            return throughput * radiance;
+        }
+
+        Ray<T> scattered;
+        Color<T> attenuation;
+        if (!material.scatter(r, rec, attenuation, scattered)) return throughput * radiance;
+        throughput = throughput * attenuation;
+        r = scattered;
+    }
+    return Color<T>::zero();
+}
+
+//! The preview integrator for mode, in the form Render_job takes. The depth argument is ignored.
+template<typename T>
+std::function<Color<T>(const Ray<T>&, int)> make_preview_integrator(preview_mode mode, const Hittable<T>& world,
+    const Light_list<T>& lights, const background_fn<T>& background, const preview_settings<T>& settings = preview_settings<T>())
+{
+    switch (mode)
+    {
+    case preview_mode::albedo:
+        return [&world, background](const Ray<T>& r, int) { return ray_albedo(r, world, background); };
+    case preview_mode::normal:
+        return [&world](const Ray<T>& r, int) { return ray_normal(r, world); };
+    case preview_mode::depth:
+        return [&world, settings](const Ray<T>& r, int) { return ray_depth(r, world, settings.max_distance); };
+    case preview_mode::ambient_occlusion:
+        return [&world, background, settings](const Ray<T>& r, int) {
+            return ray_ambient_occlusion(r, world, settings.ao_samples, settings.ao_radius, background);
+        };
+    default:
+        return [&world, &lights, background, settings](const Ray<T>& r, int) {
+            return ray_direct(r, world, lights, settings.specular_depth, background);
+        };
+    }
+}
+
+#endif
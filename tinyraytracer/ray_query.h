@@ -0,0 +1,109 @@
+#pragma once
+#ifndef RAY_QUERY_H_
+#define RAY_QUERY_H_
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_set.h"
+
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+//! A batch of rays given as parallel arrays; ray k runs from origins[k] along directions[k] over [t_min[k], t_max[k]].
+template<typename T>
+struct ray_batch
+{
+    const Point3<T>* origins;
+    const Vector3<T>* directions;
+    const T* t_min;
+    const T* t_max;
+    size_t count;
+};
+
+//! Result of a closest-hit query. primitive_id is -1 when the ray hit nothing.
+template<typename T>
+struct query_hit
+{
+    T t;
+    std::int64_t primitive_id;
+    std::int32_t material_id;
+    Vector3<T> normal; // outward unit normal
+};
+
+//! A scene prepared once for visibility and distance queries that need no shading.
+//! Primitive ids follow the order the spheres were found in the list, material ids
+//! number the distinct materials in order of first use.
+template<typename T>
+class Ray_query_scene
+{
+public:
+    explicit Ray_query_scene(const Hittable_list<T>& world)
+    {
+        std::map<const Material<T>*, std::int32_t> ids;
+        auto add = [&](const Point3<T>& center, T radius, const shared_ptr<Material<T>>& m)
+        {
+            auto found = ids.find(m.get());
+            if (found == ids.end())
+            {
+                found = ids.emplace(m.get(), static_cast<std::int32_t>(materials.size())).first;
+                materials.push_back(m);
+            }
+            material_ids.push_back(found->second);
+            spheres.add(center, radius, m);
+        };
+
+        for_each_sphere(world, add, [](const shared_ptr<Hittable<T>>&)
+            {
+                throw std::invalid_argument("Ray_query_scene supports only spheres");
+            });
+    }
+
+    size_t primitive_count() const { return spheres.size(); }
+    size_t material_count() const { return materials.size(); }
+    const shared_ptr<Material<T>>& material(std::int32_t id) const { return materials[id]; }
+
+    //! Nearest hit for every ray of the batch, written to hits[0 .. rays.count).
+    void closest_hit(const ray_batch<T>& rays, query_hit<T>* hits) const
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, rays.count, grain_size), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    const Ray<T> r(rays.origins[k], rays.directions[k]);
+                    query_hit<T>& h = hits[k];
+                    const ptrdiff_t id = spheres.closest(r, rays.t_min[k], rays.t_max[k], h.t);
+                    h.primitive_id = id;
+                    if (id < 0)
+                    {
+                        h.material_id = -1;
+                        h.normal = Vector3<T>::zero();
+                        continue;
+                    }
+                    h.material_id = material_ids[id];
+                    h.normal = spheres.outward_normal(id, r.at(h.t));
+                }
+            });
+    }
+
+    //! occluded[k] is true if anything lies on ray k within its range.
+    void occluded(const ray_batch<T>& rays, bool* occluded) const
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, rays.count, grain_size), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                    occluded[k] = spheres.any(Ray<T>(rays.origins[k], rays.directions[k]), rays.t_min[k], rays.t_max[k]);
+            });
+    }
+
+private:
+    static constexpr size_t grain_size = 256;
+
+    Sphere_set<T> spheres;
+    std::vector<std::int32_t> material_ids;
+    std::vector<shared_ptr<Material<T>>> materials;
+};
+
+#endif
@@ -0,0 +1,741 @@
+#pragma once
+#ifndef RENDER_JOB_H_
+#define RENDER_JOB_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "color.h"
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "concurrency.h"
+#include "live_view.h"
+#include "tile_dependencies.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+struct render_settings
+{
+    int image_width = 1200;
+    int image_height = 800;
+    int samples_per_pixel = 500;
+    int max_depth = 50;
+
+    //! Samples added to every pixel before the next pass starts.
+    int samples_per_pass = 8;
+
+    //! Edge length of the square tiles the image is split into.
+    int tile_size = 32;
+
+    //! Wall-clock budget in seconds. When positive, samples_per_pixel is ignored and the job
+    //! adapts the number of samples so that it stops at the deadline.
+    double time_budget_seconds = 0;
+
+    //! Path splitting, see Render_job::start_split: how many paths continue from one first hit on a
+    //! diffuse surface (specular hits continue one), and the side of the grid of fixed sub-pixel
+    //! strata whose first hits are traced.
+    int split_factor = 1;
+    int split_grid = 4;
+
+    //! Memory for keeping first hits between passes. With a pinhole camera every stratum is then
+    //! intersected once per render however often it is sampled; without one, or over budget, first
+    //! hits are traced anew on every visit.
+    size_t primary_cache_mib = 256;
+
+    //! Where the tiles are traced; null for TBB's default arena. With arenas on several NUMA nodes
+    //! each renders a band of tiles sized to its threads, into framebuffer rows placed on its node.
+    const Render_arenas* arenas = nullptr;
+
+    //! Where every merged tile is also published for viewers in other processes; null for nowhere.
+    Live_framebuffer* live = nullptr;
+
+    //! Where every tile records the primitives its paths hit, for Render_job::rerender; null for
+    //! nowhere. Only hits found through a Tracked_hittable are recorded, and the tile size must match.
+    Tile_dependencies* dependencies = nullptr;
+};
+
+//! Primary ray work of a render with path splitting.
+struct path_split_stats
+{
+    size_t camera_samples = 0;      // samples counted into the image, each a primary ray without splitting
+    size_t primary_traced = 0;      // primary rays intersected with the scene
+    size_t primary_cached = 0;      // first hits taken from the cache instead
+    size_t paths = 0;               // paths continued from first hits
+
+    //! Fraction of the primary intersections unsplit rendering would have done that were not needed.
+    double saved() const { return camera_samples ? 1.0 - static_cast<double>(primary_traced) / camera_samples : 0.0; }
+};
+
+//! Accumulated radiance and sample count of every pixel, row j = 0 is the bottom row.
+template<typename T>
+class Framebuffer
+{
+public:
+    Framebuffer() {}
+    Framebuffer(int w, int h) : width(w), height(h), pixels(static_cast<size_t>(w) * h),
+        luminance_squares(static_cast<size_t>(w) * h, 0), samples(static_cast<size_t>(w) * h, 0) {}
+
+    Color<T>& color_at(int i, int j) { return pixels[static_cast<size_t>(j) * width + i]; }
+    const Color<T>& color_at(int i, int j) const { return pixels[static_cast<size_t>(j) * width + i]; }
+
+    T& luminance_squares_at(int i, int j) { return luminance_squares[static_cast<size_t>(j) * width + i]; }
+    T luminance_squares_at(int i, int j) const { return luminance_squares[static_cast<size_t>(j) * width + i]; }
+
+    size_t& samples_at(int i, int j) { return samples[static_cast<size_t>(j) * width + i]; }
+    size_t samples_at(int i, int j) const { return samples[static_cast<size_t>(j) * width + i]; }
+
+    //! Standard error of the pixel's mean luminance relative to that mean, infinite below two samples.
+    T relative_error_at(int i, int j) const
+    {
+        const size_t n = samples_at(i, j);
+        if (n < 2) return std::numeric_limits<T>::infinity();
+        const T mean = luminance(color_at(i, j)) / n;
+        const T variance = std::max<T>(luminance_squares_at(i, j) / n - mean * mean, 0);
+        return std::sqrt(variance / n) / (mean + static_cast<T>(0.01));
+    }
+
+    //! Writes the image as plain PPM, normalizing every pixel by its own sample count.
+    void write_ppm(std::ostream& out) const
+    {
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (int j = height - 1; j >= 0; --j)
+            write_colors(out, &color_at(0, j), &samples[static_cast<size_t>(j) * width], width);
+    }
+
+    //! Writes the per-pixel sample counts as a plain PGM, scaled so the busiest pixel is white.
+    void write_sample_map(std::ostream& out) const
+    {
+        const size_t max_samples = std::max<size_t>(*std::max_element(samples.begin(), samples.end()), 1);
+        out << "P2\n" << width << ' ' << height << "\n255\n";
+        for (int j = height - 1; j >= 0; --j)
+            for (int i = 0; i < width; ++i)
+                out << 255 * samples_at(i, j) / max_samples << '\n';
+    }
+
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<Color<T>> pixels;
+    std::vector<T> luminance_squares;
+    std::vector<size_t> samples;
+};
+
+enum class render_status { completed, cancelled };
+
+struct render_progress
+{
+    size_t samples_done = 0;
+    size_t samples_total = 0;
+    double elapsed_seconds = 0;
+
+    //! Estimated seconds left, extrapolated from the throughput so far.
+    double eta_seconds = 0;
+
+    double fraction() const { return samples_total ? static_cast<double>(samples_done) / samples_total : 1.0; }
+};
+
+//! A render running in the background. Work is split into progressive passes over tiles,
+//! cancellation is checked before every tile, and the caller may read the partial image at any time.
+//! Whatever the integrator refers to must outlive the job; destroying a running job cancels it.
+template<typename T>
+class Render_job
+{
+public:
+    using progress_callback = std::function<void(const render_progress&)>;
+
+    //! Radiance arriving along a camera ray, given the maximum path depth.
+    using integrator = std::function<Color<T>(const Ray<T>&, int)>;
+
+    //! Starts rendering on a background thread and returns immediately.
+    //! \p on_progress is invoked from that thread once after every pass.
+    static std::unique_ptr<Render_job> start(integrator radiance, const Camera<T>& cam,
+        const render_settings& settings, progress_callback on_progress = nullptr)
+    {
+        return std::unique_ptr<Render_job>(new Render_job(std::move(radiance), cam, settings, std::move(on_progress)));
+    }
+
+    //! Starts rendering the world with the default path tracer, ray_color.
+    static std::unique_ptr<Render_job> start(const Hittable<T>& world, const Camera<T>& cam,
+        const render_settings& settings, progress_callback on_progress = nullptr)
+    {
+        return start([&world](const Ray<T>& r, int depth) { return ray_color(r, world, depth); }, cam, settings, std::move(on_progress));
+    }
+
+    //! Starts the default path tracer with path splitting. Every pixel has split_grid * split_grid fixed
+    //! sub-pixel strata that its samples visit in turn. Each visit traces the stratum's primary ray once
+    //! and, at a diffuse hit, continues split_factor paths from it with ray_color_from_hit, their mean
+    //! standing for split_factor samples; at other hits one path is continued and counts as many.
+    //! Pays off at high sample counts, where samples otherwise retrace nearly the same primary ray.
+    static std::unique_ptr<Render_job> start_split(const Hittable<T>& world, background_fn<T> background, const Camera<T>& cam,
+        const render_settings& settings, progress_callback on_progress = nullptr)
+    {
+        auto radiance = [&world, background](const Ray<T>& r, int depth) { return ray_color(r, world, depth, background); };
+        return std::unique_ptr<Render_job>(new Render_job(radiance, cam, settings, std::move(on_progress), &world, std::move(background)));
+    }
+
+    //! Renders again only the tiles marked in dirty, one char per tile in rows from the bottom, and
+    //! starts from previous, the framebuffer of an earlier render of the same size, for the others.
+    //! The marked tiles are cleared first, in the framebuffer and in settings.dependencies, and then
+    //! get samples_per_pixel samples or the whole time budget between them.
+    //! The result is an approximation: tiles that the dependencies show never hit an edited primitive
+    //! keep their old samples, even where it now appears along their paths for the first time, in a
+    //! mirror, through glass or as a new shadow. mark_tiles_covering catches where a moved primitive
+    //! is seen directly and the shadow around it.
+    static std::unique_ptr<Render_job> rerender(integrator radiance, const Camera<T>& cam, const render_settings& settings,
+        Framebuffer<T> previous, std::vector<char> dirty, progress_callback on_progress = nullptr)
+    {
+        if (previous.width != settings.image_width || previous.height != settings.image_height)
+            throw std::runtime_error("rerender: the previous framebuffer is not the size of the image");
+        return std::unique_ptr<Render_job>(new Render_job(std::move(radiance), cam, settings, std::move(on_progress),
+            nullptr, nullptr, std::move(previous), std::move(dirty)));
+    }
+
+    Render_job(const Render_job&) = delete;
+    Render_job& operator=(const Render_job&) = delete;
+
+    ~Render_job()
+    {
+        cancel();
+        if (worker.joinable()) worker.join();
+    }
+
+    //! Requests cooperative cancellation; tiles already being traced are finished first.
+    void cancel() { cancel_requested.store(true, std::memory_order_relaxed); }
+
+    bool is_cancel_requested() const { return cancel_requested.load(std::memory_order_relaxed); }
+
+    render_progress progress() const
+    {
+        render_progress p;
+        p.samples_done = samples_done.load(std::memory_order_relaxed);
+        p.elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        if (settings.time_budget_seconds > 0)
+        {
+            // The total is a projection of the current throughput over the whole budget.
+            p.eta_seconds = std::max(settings.time_budget_seconds - p.elapsed_seconds, 0.0);
+            p.samples_total = p.elapsed_seconds > 0
+                ? std::max(p.samples_done, static_cast<size_t>(p.samples_done * settings.time_budget_seconds / p.elapsed_seconds))
+                : 0;
+        }
+        else
+        {
+            p.samples_total = samples_total;
+            p.eta_seconds = p.samples_done ? p.elapsed_seconds * (p.samples_total - p.samples_done) / p.samples_done : 0;
+        }
+        return p;
+    }
+
+    //! Copy of the accumulation buffer as it is right now.
+    Framebuffer<T> snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(framebuffer_mutex);
+        return framebuffer;
+    }
+
+    //! Becomes ready when the worker has stopped, either finished or cancelled.
+    std::shared_future<render_status> completion() const { return done; }
+
+    render_status wait() const { return done.get(); }
+
+    //! Primary ray work so far of a job started with start_split.
+    path_split_stats split_stats() const
+    {
+        path_split_stats stats;
+        stats.camera_samples = samples_done.load(std::memory_order_relaxed);
+        stats.primary_traced = primary_traced.load(std::memory_order_relaxed);
+        stats.primary_cached = primary_cached.load(std::memory_order_relaxed);
+        stats.paths = split_paths.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    //! True if first hits are kept between passes.
+    bool caches_primary_hits() const { return !primary_cache.empty(); }
+
+    //! Bytes of per-pixel state moved to the NUMA node that renders those pixels.
+    size_t numa_placed_bytes() const { return placed_bytes; }
+
+private:
+    Render_job(integrator f, const Camera<T>& c, const render_settings& s, progress_callback cb,
+        const Hittable<T>* world = nullptr, background_fn<T> background = nullptr,
+        Framebuffer<T> previous = Framebuffer<T>(), std::vector<char> dirty = std::vector<char>())
+        : radiance(std::move(f)), cam(c), settings(s), on_progress(std::move(cb)),
+        split_world(world), split_background(std::move(background)), tile_mask(std::move(dirty)),
+        framebuffer(previous.width > 0 ? std::move(previous) : Framebuffer<T>(s.image_width, s.image_height)),
+        samples_total(pixels_to_render() * s.samples_per_pixel),
+        start_time(std::chrono::steady_clock::now()),
+        deadline(start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(s.time_budget_seconds)))
+    {
+        if (split_world) prepare_splitting();
+        if (!tile_mask.empty()) clear_masked_tiles();
+        else if (settings.dependencies) settings.dependencies->clear();
+        if (settings.arenas && settings.arenas->numa_aware()) place_per_pixel_state();
+        done = finished.get_future().share();
+        worker = std::thread([this] { run(); });
+    }
+
+    //! False for tiles a rerender keeps, including any past the end of a short mask.
+    bool tile_wanted(int tile) const
+    {
+        return tile_mask.empty() || (static_cast<size_t>(tile) < tile_mask.size() && tile_mask[tile]);
+    }
+
+    size_t pixels_to_render() const
+    {
+        size_t pixels = 0;
+        for (int tile = 0; tile < tiles_x() * tiles_y(); ++tile)
+            if (tile_wanted(tile)) pixels += tile_pixels(tile % tiles_x(), tile / tiles_x());
+        return pixels;
+    }
+
+    void clear_masked_tiles()
+    {
+        tile_mask.resize(static_cast<size_t>(tiles_x()) * tiles_y(), 0);
+        for (int tile = 0; tile < tiles_x() * tiles_y(); ++tile)
+        {
+            if (!tile_mask[tile]) continue;
+            if (settings.dependencies) settings.dependencies->clear(tile);
+            const int i0 = tile % tiles_x() * settings.tile_size, i1 = std::min(i0 + settings.tile_size, settings.image_width);
+            const int j0 = tile / tiles_x() * settings.tile_size, j1 = std::min(j0 + settings.tile_size, settings.image_height);
+            for (int j = j0; j < j1; ++j)
+                for (int i = i0; i < i1; ++i)
+                {
+                    framebuffer.color_at(i, j) = Color<T>(0, 0, 0);
+                    framebuffer.luminance_squares_at(i, j) = 0;
+                    framebuffer.samples_at(i, j) = 0;
+                }
+        }
+    }
+
+    size_t strata_per_pixel() const { return static_cast<size_t>(settings.split_grid) * settings.split_grid; }
+
+    void prepare_splitting()
+    {
+        settings.split_factor = std::max(settings.split_factor, 1);
+        settings.split_grid = clamp(settings.split_grid, 1, 255);   // strata numbered in 16 bits
+        // Passes of whole visits, so that a pass never cuts a split short.
+        settings.samples_per_pass = (std::max(settings.samples_per_pass, 1) + settings.split_factor - 1) / settings.split_factor * settings.split_factor;
+        const size_t pixels = static_cast<size_t>(settings.image_width) * settings.image_height;
+        stratum_cursor.assign(pixels, 0);
+
+        const size_t entries = pixels * strata_per_pixel();
+        const size_t bytes = entries * (sizeof(hit_candidate<T>) + sizeof(std::uint8_t));
+        if (cam.is_pinhole() && bytes <= (settings.primary_cache_mib << 20))
+        {
+            primary_cache.resize(entries);
+            primary_state.assign(entries, primary_unknown);
+        }
+    }
+
+    //! Moves the rows of every per-pixel array to the node of the arena whose band covers them,
+    //! as far as the bands of a uniform pass go; adaptive passes shift them a little.
+    void place_per_pixel_state()
+    {
+        const std::vector<int> bounds = tile_bands(uniform_tile_weights());
+        const size_t pixels = static_cast<size_t>(settings.image_width) * settings.image_height;
+        auto place = [&](const void* data, size_t bytes) {
+            for (size_t k = 0; k + 1 < bounds.size(); ++k)
+            {
+                const int j0 = std::min(bounds[k] / tiles_x() * settings.tile_size, settings.image_height);
+                const int j1 = k + 2 == bounds.size() ? settings.image_height
+                    : std::min(bounds[k + 1] / tiles_x() * settings.tile_size, settings.image_height);
+                const size_t first = static_cast<size_t>(j0) * settings.image_width, last = static_cast<size_t>(j1) * settings.image_width;
+                const size_t per_pixel = bytes / pixels;
+                if (last > first && settings.arenas->place(static_cast<const char*>(data) + first * per_pixel, (last - first) * per_pixel, k))
+                    placed_bytes += (last - first) * per_pixel;
+            }
+        };
+        place(framebuffer.pixels.data(), pixels * sizeof(Color<T>));
+        place(framebuffer.luminance_squares.data(), pixels * sizeof(T));
+        place(framebuffer.samples.data(), pixels * sizeof(size_t));
+        if (!stratum_cursor.empty()) place(stratum_cursor.data(), pixels * sizeof(std::uint16_t));
+        if (!primary_cache.empty())
+        {
+            place(primary_cache.data(), primary_cache.size() * sizeof(hit_candidate<T>));
+            place(primary_state.data(), primary_state.size());
+        }
+    }
+
+    //! Where in pixel (i, j) stratum s samples: a fixed point jittered inside its cell of the grid,
+    //! the same on every visit so that the stratum's first hit can be reused.
+    void stratum_position(int i, int j, size_t s, T& du, T& dv) const
+    {
+        std::uint64_t h = (static_cast<std::uint64_t>(j) * settings.image_width + i) * strata_per_pixel() + s;
+        h += 0x9e3779b97f4a7c15ull;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        h ^= h >> 31;
+        const T jitter_u = static_cast<T>(h & 0xffffffffu) / T(4294967296.0);
+        const T jitter_v = static_cast<T>(h >> 32) / T(4294967296.0);
+        const int grid = settings.split_grid;
+        du = (static_cast<T>(s % grid) + jitter_u) / grid;
+        dv = (static_cast<T>(s / grid) + jitter_v) / grid;
+    }
+
+    //! Counters of one tile, added to the job's once the tile is done.
+    struct split_counts
+    {
+        size_t traced = 0;
+        size_t cached = 0;
+        size_t paths = 0;
+    };
+
+    //! spp samples of pixel (i, j) by path splitting; adds their sum and squared luminances.
+    void trace_pixel_split(int i, int j, int spp, Color<T>& color, T& luminance_squares, split_counts& counts)
+    {
+        const size_t pixel = static_cast<size_t>(j) * settings.image_width + i;
+        for (int done = 0; done < spp;)
+        {
+            const int weight = std::min(settings.split_factor, spp - done);
+            const size_t s = stratum_cursor[pixel];
+            stratum_cursor[pixel] = static_cast<std::uint16_t>((s + 1) % strata_per_pixel());
+
+            T du, dv;
+            stratum_position(i, j, s, du, dv);
+            const Ray<T> r = cam.get_ray((i + du) / (settings.image_width - 1), (j + dv) / (settings.image_height - 1));
+
+            dependency_sink& sink = current_dependency_sink();
+            sink.remaining = 0;
+
+            hit_candidate<T> candidate;
+            bool hit;
+            const size_t entry = pixel * strata_per_pixel() + s;
+            if (!primary_cache.empty() && primary_state[entry] != primary_unknown)
+            {
+                hit = primary_state[entry] == primary_hit;
+                candidate = primary_cache[entry];
+                ++counts.cached;
+            }
+            else
+            {
+                hit = settings.max_depth > 0 && split_world->intersect(r, 0.0001, MAX_DOUBLE, candidate);
+                ++counts.traced;
+                if (!primary_cache.empty())
+                {
+                    primary_state[entry] = hit ? primary_hit : primary_miss;
+                    primary_cache[entry] = candidate;
+                }
+            }
+
+            if (!hit)
+            {
+                const Color<T> sample = settings.max_depth > 0 ? split_background(r) : Color<T>::zero();
+                color += sample * static_cast<T>(weight);
+                luminance_squares += weight * luminance(sample) * luminance(sample);
+            }
+            else
+            {
+                if (sink.dependencies) sink.dependencies->record(sink.tile, primitive_key(candidate));
+                hit_record<T> rec;
+                candidate.object->finalize(r, candidate, rec);
+                const int paths = rec.mat_ptr->is_diffuse() ? weight : 1;
+                Color<T> sum(0, 0, 0);
+                T squares = 0;
+                for (int k = 0; k < paths; ++k)
+                {
+                    sink.remaining = settings.max_depth;
+                    const Color<T> sample = ray_color_from_hit(r, rec, *split_world, settings.max_depth, split_background);
+                    sum += sample;
+                    squares += luminance(sample) * luminance(sample);
+                }
+                color += sum * (static_cast<T>(weight) / paths);
+                luminance_squares += squares * (static_cast<T>(weight) / paths);
+                counts.paths += paths;
+            }
+            done += weight;
+        }
+    }
+
+    void run()
+    {
+        try {
+            if (settings.time_budget_seconds > 0)
+                run_to_deadline();
+            else
+                run_fixed_samples();
+
+            finished.set_value(is_cancel_requested() ? render_status::cancelled : render_status::completed);
+        }
+        catch (...) {
+            finished.set_exception(std::current_exception());
+        }
+    }
+
+    int tiles_x() const { return (settings.image_width + settings.tile_size - 1) / settings.tile_size; }
+    int tiles_y() const { return (settings.image_height + settings.tile_size - 1) / settings.tile_size; }
+
+    bool deadline_passed() const
+    {
+        return settings.time_budget_seconds > 0 && std::chrono::steady_clock::now() >= deadline;
+    }
+
+    void run_fixed_samples()
+    {
+        const int tiles_x = this->tiles_x();
+        std::vector<double> tile_weights = uniform_tile_weights();
+        for (size_t tile = 0; tile < tile_weights.size(); ++tile)
+            if (!tile_wanted(static_cast<int>(tile))) tile_weights[tile] = 0;
+
+        int passes_spp = 0;
+        while (passes_spp < settings.samples_per_pixel && !is_cancel_requested())
+        {
+            const int pass_spp = std::min(settings.samples_per_pass, settings.samples_per_pixel - passes_spp);
+            for_each_tile(tile_weights, [&](int tile)
+                {
+                    if (is_cancel_requested()) return false;
+                    if (tile_wanted(tile)) render_tile(tile % tiles_x, tile / tiles_x, pass_spp);
+                    return true;
+                });
+            passes_spp += pass_spp;
+
+            if (on_progress) on_progress(progress());
+        }
+    }
+
+    // Two uniform 1 spp passes measure the throughput and give every pixel a variance estimate.
+    // After that each pass is sized to a fraction of the remaining time and its samples are
+    // spread over the tiles in proportion to their relative error. The first pass always completes,
+    // however short the budget, so that no pixel is left without a sample. Later passes check the
+    // deadline before every tile, so the job can overrun it by the time one worker takes for a tile
+    // already started: at most tile_size * tile_size pixels at samples_per_pass * 8 spp.
+    void run_to_deadline()
+    {
+        const int tiles_x = this->tiles_x();
+        const int tiles_y = this->tiles_y();
+        const int tile_count = tiles_x * tiles_y;
+        const int max_tile_spp = std::max(settings.samples_per_pass * 8, 1);
+
+        std::vector<int> tile_spp(tile_count, 1);
+        std::vector<T> tile_error(tile_count);
+        for (int tile = 0; tile < tile_count; ++tile)
+            if (!tile_wanted(tile)) tile_spp[tile] = 0;
+
+        for (int pass = 0; !is_cancel_requested() && (pass == 0 || !deadline_passed()); ++pass)
+        {
+            if (pass >= 2)
+            {
+                const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+                const double remaining = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+                const double throughput = samples_done.load(std::memory_order_relaxed) / elapsed;
+                const double pass_seconds = std::min(remaining, std::max(remaining / 4, 0.05));
+                const double pass_samples = throughput * pass_seconds;
+
+                T error_sum = 0;
+                for (int tile = 0; tile < tile_count; ++tile)
+                {
+                    tile_error[tile] = tile_wanted(tile) ? tile_relative_error(tile % tiles_x, tile / tiles_x) : 0;
+                    error_sum += tile_error[tile];
+                }
+
+                bool any_work = false;
+                for (int tile = 0; tile < tile_count; ++tile)
+                {
+                    if (!tile_wanted(tile)) continue;
+                    const double share = error_sum > 0 ? tile_error[tile] / error_sum : 1.0 / tile_count;
+                    const double spp = pass_samples * share / tile_pixels(tile % tiles_x, tile / tiles_x);
+                    tile_spp[tile] = std::min(static_cast<int>(spp + 0.5), max_tile_spp);
+                    any_work = any_work || tile_spp[tile] > 0;
+                }
+                if (!any_work)
+                    tile_spp[std::max_element(tile_error.begin(), tile_error.end()) - tile_error.begin()] = 1;
+            }
+
+            std::vector<double> tile_weights(tile_count);
+            for (int tile = 0; tile < tile_count; ++tile)
+                tile_weights[tile] = static_cast<double>(tile_spp[tile]) * tile_pixels(tile % tiles_x, tile / tiles_x);
+            for_each_tile(tile_weights, [&](int tile)
+                {
+                    if (is_cancel_requested() || (pass > 0 && deadline_passed())) return false;
+                    if (tile_spp[tile] > 0) render_tile(tile % tiles_x, tile / tiles_x, tile_spp[tile]);
+                    return true;
+                });
+
+            if (on_progress) on_progress(progress());
+        }
+    }
+
+    //! Calls body(tile) for every tile in parallel until it returns false. With arenas, arena k takes
+    //! the k-th of contiguous bands of tiles, each band's share of the weights its share of the threads.
+    template<typename F>
+    void for_each_tile(const std::vector<double>& weights, const F& body)
+    {
+        auto run = [&](int first, int last) {
+            tbb::parallel_for(tbb::blocked_range<int>(first, last, 1), [&](const tbb::blocked_range<int>& range)
+                {
+                    for (int tile = range.begin(); tile != range.end(); ++tile)
+                        if (!body(tile)) return;
+                });
+        };
+        if (!settings.arenas)
+        {
+            run(0, static_cast<int>(weights.size()));
+            return;
+        }
+        const std::vector<int> bounds = tile_bands(weights);
+        settings.arenas->run_all([&](size_t k) { run(bounds[k], bounds[k + 1]); });
+    }
+
+    //! First tile of every arena's band, and one past the last tile.
+    std::vector<int> tile_bands(const std::vector<double>& weights) const
+    {
+        const Render_arenas& arenas = *settings.arenas;
+        const int tile_count = static_cast<int>(weights.size());
+        double total = 0;
+        for (double w : weights) total += w;
+
+        std::vector<int> bounds(1, 0);
+        double target = 0, sum = 0;
+        int tile = 0;
+        for (size_t k = 0; k + 1 < arenas.size(); ++k)
+        {
+            target += total * arenas.threads(k) / arenas.threads();
+            while (tile < tile_count && sum + weights[tile] / 2 < target) sum += weights[tile++];
+            bounds.push_back(tile);
+        }
+        bounds.push_back(tile_count);
+        return bounds;
+    }
+
+    std::vector<double> uniform_tile_weights() const
+    {
+        std::vector<double> weights(static_cast<size_t>(tiles_x()) * tiles_y());
+        for (size_t tile = 0; tile < weights.size(); ++tile)
+            weights[tile] = tile_pixels(static_cast<int>(tile) % tiles_x(), static_cast<int>(tile) / tiles_x());
+        return weights;
+    }
+
+    int tile_pixels(int tile_x, int tile_y) const
+    {
+        const int i0 = tile_x * settings.tile_size, j0 = tile_y * settings.tile_size;
+        return (std::min(i0 + settings.tile_size, settings.image_width) - i0) * (std::min(j0 + settings.tile_size, settings.image_height) - j0);
+    }
+
+    //! Mean relative error of the pixels in a tile. Only called between passes.
+    T tile_relative_error(int tile_x, int tile_y) const
+    {
+        const int i0 = tile_x * settings.tile_size, i1 = std::min(i0 + settings.tile_size, settings.image_width);
+        const int j0 = tile_y * settings.tile_size, j1 = std::min(j0 + settings.tile_size, settings.image_height);
+
+        T sum = 0;
+        for (int j = j0; j < j1; ++j)
+            for (int i = i0; i < i1; ++i)
+                sum += std::min<T>(framebuffer.relative_error_at(i, j), 1e3);
+        return sum / ((i1 - i0) * (j1 - j0));
+    }
+
+    void render_tile(int tile_x, int tile_y, int spp)
+    {
+        const int i0 = tile_x * settings.tile_size, i1 = std::min(i0 + settings.tile_size, settings.image_width);
+        const int j0 = tile_y * settings.tile_size, j1 = std::min(j0 + settings.tile_size, settings.image_height);
+
+        std::vector<Color<T>> tile_colors;
+        std::vector<T> tile_luminance_squares;
+        tile_colors.reserve(static_cast<size_t>(i1 - i0) * (j1 - j0));
+        tile_luminance_squares.reserve(tile_colors.capacity());
+        split_counts counts;
+        dependency_sink& sink = current_dependency_sink();
+        sink.dependencies = settings.dependencies;
+        sink.tile = tile_y * tiles_x() + tile_x;
+        for (int j = j0; j < j1; ++j)
+        {
+            for (int i = i0; i < i1; ++i)
+            {
+                Color<T> pixel_color(0, 0, 0);
+                T pixel_luminance_squares = 0;
+                if (split_world) trace_pixel_split(i, j, spp, pixel_color, pixel_luminance_squares, counts);
+                else for (int s = 0; s < spp; ++s) {
+                    auto u = (i + random_generate<T>()) / (settings.image_width - 1);
+                    auto v = (j + random_generate<T>()) / (settings.image_height - 1);
+                    Ray<T> r = cam.get_ray(u, v);
+                    sink.remaining = settings.max_depth;
+                    Color<T> sample = radiance(r, settings.max_depth);
+                    pixel_color += sample;
+                    pixel_luminance_squares += luminance(sample) * luminance(sample);
+                }
+                tile_colors.push_back(pixel_color);
+                tile_luminance_squares.push_back(pixel_luminance_squares);
+            }
+        }
+        sink.dependencies = nullptr;
+
+        // The live view gets the tile's means, taken under the lock and published after it.
+        std::vector<float> tile_means;
+        if (settings.live) tile_means.reserve(tile_colors.size() * 3);
+        {
+            std::lock_guard<std::mutex> lock(framebuffer_mutex);
+            auto c = tile_colors.begin();
+            auto l = tile_luminance_squares.begin();
+            for (int j = j0; j < j1; ++j)
+            {
+                for (int i = i0; i < i1; ++i)
+                {
+                    Color<T>& color = framebuffer.color_at(i, j);
+                    color += *c++;
+                    framebuffer.luminance_squares_at(i, j) += *l++;
+                    const size_t samples = framebuffer.samples_at(i, j) += spp;
+                    if (!settings.live) continue;
+                    tile_means.push_back(static_cast<float>(color.x / samples));
+                    tile_means.push_back(static_cast<float>(color.y / samples));
+                    tile_means.push_back(static_cast<float>(color.z / samples));
+                }
+            }
+        }
+        samples_done.fetch_add(tile_colors.size() * spp, std::memory_order_relaxed);
+        if (settings.live) settings.live->publish_tile(tile_x, tile_y, tile_means.data(), tile_colors.size() * spp);
+        if (split_world)
+        {
+            primary_traced.fetch_add(counts.traced, std::memory_order_relaxed);
+            primary_cached.fetch_add(counts.cached, std::memory_order_relaxed);
+            split_paths.fetch_add(counts.paths, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    integrator radiance;
+    Camera<T> cam;
+    render_settings settings;
+    progress_callback on_progress;
+
+    // Path splitting, set by start_split only. Tiles are disjoint and every pass ends before the next
+    // starts, so the per-pixel state below is only ever touched by one thread at a time.
+    enum : std::uint8_t { primary_unknown, primary_hit, primary_miss };
+    const Hittable<T>* split_world = nullptr;
+    background_fn<T> split_background;
+    std::vector<std::uint16_t> stratum_cursor;      // next stratum of every pixel
+    std::vector<hit_candidate<T>> primary_cache;    // strata_per_pixel() entries per pixel, if caching
+    std::vector<std::uint8_t> primary_state;
+    std::atomic<size_t> primary_traced{ 0 };
+    std::atomic<size_t> primary_cached{ 0 };
+    std::atomic<size_t> split_paths{ 0 };
+    size_t placed_bytes = 0;
+
+    std::vector<char> tile_mask;    // tiles a rerender renders, empty for all
+
+    mutable std::mutex framebuffer_mutex;
+    Framebuffer<T> framebuffer;
+
+    const size_t samples_total;
+    std::atomic<size_t> samples_done{ 0 };
+    std::atomic<bool> cancel_requested{ false };
+    const std::chrono::steady_clock::time_point start_time;
+    const std::chrono::steady_clock::time_point deadline;
+
+    std::promise<render_status> finished;
+    std::shared_future<render_status> done;
+    std::thread worker;
+};
+
+#endif
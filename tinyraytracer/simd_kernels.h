@@ -0,0 +1,583 @@
+// this file holds the hot loops that are built once per instruction set level;
+// the variant matching the CPU is chosen on first use through simd()
+
+#pragma once
+#ifndef SIMD_KERNELS_H_
+#define SIMD_KERNELS_H_
+
+#include "cpu_features.h"
+#include "utilities.h"
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(TRT_X86)
+#include <immintrin.h>
+#endif
+
+//! Spheres stored as structure of arrays so several can be tested against one ray at once.
+template<typename T>
+struct sphere_soa
+{
+    const T* center_x;
+    const T* center_y;
+    const T* center_z;
+    const T* radius_squared;
+    size_t count;
+};
+
+//! Finds the nearest sphere hit by the ray with t in [t_min, t_max].
+//! Returns its index and writes t to t_hit, or returns -1 if nothing is hit.
+template<typename T>
+inline ptrdiff_t closest_sphere_hit_generic(const sphere_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max, T& t_hit)
+{
+    const T a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    ptrdiff_t closest = -1;
+    for (size_t k = 0; k < s.count; ++k)
+    {
+        const T ocx = o[0] - s.center_x[k], ocy = o[1] - s.center_y[k], ocz = o[2] - s.center_z[k];
+        const T half_b = ocx * d[0] + ocy * d[1] + ocz * d[2];
+        const T c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius_squared[k];
+        const T discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) continue;
+        const T sqrtd = std::sqrt(discriminant);
+
+        T root = (-half_b - sqrtd) / a;
+        if (root < t_min || t_max < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || t_max < root)
+                continue;
+        }
+        t_max = root;
+        closest = static_cast<ptrdiff_t>(k);
+    }
+    t_hit = t_max;
+    return closest;
+}
+
+//! Returns true as soon as any sphere is hit with t in [t_min, t_max].
+template<typename T>
+inline bool any_sphere_hit(const sphere_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max)
+{
+    const T a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    for (size_t k = 0; k < s.count; ++k)
+    {
+        const T ocx = o[0] - s.center_x[k], ocy = o[1] - s.center_y[k], ocz = o[2] - s.center_z[k];
+        const T half_b = ocx * d[0] + ocy * d[1] + ocz * d[2];
+        const T c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius_squared[k];
+        const T discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) continue;
+        const T sqrtd = std::sqrt(discriminant);
+
+        const T t_near = (-half_b - sqrtd) / a;
+        const T t_far = (-half_b + sqrtd) / a;
+        if ((t_near >= t_min && t_near <= t_max) || (t_far >= t_min && t_far <= t_max))
+            return true;
+    }
+    return false;
+}
+
+//! Triangles stored as structure of arrays: a corner v0 and the edges e1 = v1 - v0, e2 = v2 - v0,
+//! each split into x, y and z arrays.
+template<typename T>
+struct triangle_soa
+{
+    const T* v0[3];
+    const T* e1[3];
+    const T* e2[3];
+    size_t count;
+};
+
+//! Moller-Trumbore: finds the nearest triangle hit by the ray with t in [t_min, t_max].
+//! Returns its index and writes t to t_hit, or returns -1 if nothing is hit.
+template<typename T>
+inline ptrdiff_t closest_triangle_hit_generic(const triangle_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max, T& t_hit)
+{
+    ptrdiff_t closest = -1;
+    for (size_t k = 0; k < s.count; ++k)
+    {
+        const T e1x = s.e1[0][k], e1y = s.e1[1][k], e1z = s.e1[2][k];
+        const T e2x = s.e2[0][k], e2y = s.e2[1][k], e2z = s.e2[2][k];
+        const T px = d[1] * e2z - d[2] * e2y, py = d[2] * e2x - d[0] * e2z, pz = d[0] * e2y - d[1] * e2x;
+        const T det = e1x * px + e1y * py + e1z * pz;
+        if (det == 0) continue;
+        const T inv_det = 1 / det;
+
+        const T sx = o[0] - s.v0[0][k], sy = o[1] - s.v0[1][k], sz = o[2] - s.v0[2][k];
+        const T u = (sx * px + sy * py + sz * pz) * inv_det;
+        if (u < 0 || u > 1) continue;
+        const T qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+        const T v = (d[0] * qx + d[1] * qy + d[2] * qz) * inv_det;
+        if (v < 0 || u + v > 1) continue;
+        const T t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+        if (t < t_min || t > t_max) continue;
+
+        t_max = t;
+        closest = static_cast<ptrdiff_t>(k);
+    }
+    t_hit = t_max;
+    return closest;
+}
+
+//! Returns true as soon as any triangle is hit with t in [t_min, t_max].
+template<typename T>
+inline bool any_triangle_hit(const triangle_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max)
+{
+    for (size_t k = 0; k < s.count; ++k)
+    {
+        const T e1x = s.e1[0][k], e1y = s.e1[1][k], e1z = s.e1[2][k];
+        const T e2x = s.e2[0][k], e2y = s.e2[1][k], e2z = s.e2[2][k];
+        const T px = d[1] * e2z - d[2] * e2y, py = d[2] * e2x - d[0] * e2z, pz = d[0] * e2y - d[1] * e2x;
+        const T det = e1x * px + e1y * py + e1z * pz;
+        if (det == 0) continue;
+        const T inv_det = 1 / det;
+
+        const T sx = o[0] - s.v0[0][k], sy = o[1] - s.v0[1][k], sz = o[2] - s.v0[2][k];
+        const T u = (sx * px + sy * py + sz * pz) * inv_det;
+        if (u < 0 || u > 1) continue;
+        const T qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+        const T v = (d[0] * qx + d[1] * qy + d[2] * qz) * inv_det;
+        if (v < 0 || u + v > 1) continue;
+        const T t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+        if (t >= t_min && t <= t_max) return true;
+    }
+    return false;
+}
+
+//! Converts accumulated values to 8-bit: scale, gamma 2 and clamp, as write_color does.
+inline void tonemap_generic(const double* values, const double* scales, size_t n, int* out)
+{
+    for (size_t k = 0; k < n; ++k)
+        out[k] = static_cast<int>(256 * clamp(std::sqrt(scales[k] * values[k]), 0.0, 0.999));
+}
+
+#if defined(TRT_X86)
+
+// The vector variants keep the best t and index per lane, then reduce the lanes and
+// finish the remainder with the scalar loop, bounded by the best t found so far.
+
+TRT_TARGET("sse4.2")
+inline ptrdiff_t closest_sphere_hit_sse42(const sphere_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m128d ox = _mm_set1_pd(o[0]), oy = _mm_set1_pd(o[1]), oz = _mm_set1_pd(o[2]);
+    const __m128d dx = _mm_set1_pd(d[0]), dy = _mm_set1_pd(d[1]), dz = _mm_set1_pd(d[2]);
+    const __m128d a = _mm_set1_pd(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    const __m128d tmin = _mm_set1_pd(t_min), zero = _mm_setzero_pd();
+    __m128d best_t = _mm_set1_pd(t_max), best_i = _mm_set1_pd(-1);
+    __m128d index = _mm_set_pd(1, 0);
+    const __m128d step = _mm_set1_pd(2);
+
+    size_t k = 0;
+    for (; k + 2 <= s.count; k += 2, index = _mm_add_pd(index, step))
+    {
+        const __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(s.center_x + k));
+        const __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(s.center_y + k));
+        const __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(s.center_z + k));
+        const __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+        const __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+            _mm_loadu_pd(s.radius_squared + k));
+        const __m128d discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        const __m128d valid = _mm_cmpge_pd(discriminant, zero);
+        const __m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(discriminant, zero));
+
+        const __m128d t_near = _mm_div_pd(_mm_sub_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+        const __m128d t_far = _mm_div_pd(_mm_add_pd(_mm_sub_pd(zero, half_b), sqrtd), a);
+        const __m128d near_ok = _mm_and_pd(_mm_cmpge_pd(t_near, tmin), _mm_cmple_pd(t_near, best_t));
+        const __m128d far_ok = _mm_and_pd(_mm_cmpge_pd(t_far, tmin), _mm_cmple_pd(t_far, best_t));
+        const __m128d root = _mm_blendv_pd(t_far, t_near, near_ok);
+        const __m128d hit = _mm_and_pd(valid, _mm_or_pd(near_ok, far_ok));
+
+        best_t = _mm_blendv_pd(best_t, root, hit);
+        best_i = _mm_blendv_pd(best_i, index, hit);
+    }
+
+    alignas(16) double lane_t[2], lane_i[2];
+    _mm_store_pd(lane_t, best_t);
+    _mm_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 2; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const sphere_soa<double> tail{ s.center_x + k, s.center_y + k, s.center_z + k, s.radius_squared + k, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_sphere_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("avx2,fma")
+inline ptrdiff_t closest_sphere_hit_avx2(const sphere_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+    const __m256d dx = _mm256_set1_pd(d[0]), dy = _mm256_set1_pd(d[1]), dz = _mm256_set1_pd(d[2]);
+    const __m256d a = _mm256_set1_pd(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    const __m256d tmin = _mm256_set1_pd(t_min), zero = _mm256_setzero_pd();
+    __m256d best_t = _mm256_set1_pd(t_max), best_i = _mm256_set1_pd(-1);
+    __m256d index = _mm256_set_pd(3, 2, 1, 0);
+    const __m256d step = _mm256_set1_pd(4);
+
+    size_t k = 0;
+    for (; k + 4 <= s.count; k += 4, index = _mm256_add_pd(index, step))
+    {
+        const __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(s.center_x + k));
+        const __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(s.center_y + k));
+        const __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(s.center_z + k));
+        const __m256d half_b = _mm256_fmadd_pd(ocx, dx, _mm256_fmadd_pd(ocy, dy, _mm256_mul_pd(ocz, dz)));
+        const __m256d c = _mm256_fmadd_pd(ocx, ocx, _mm256_fmadd_pd(ocy, ocy,
+            _mm256_fmsub_pd(ocz, ocz, _mm256_loadu_pd(s.radius_squared + k))));
+        const __m256d discriminant = _mm256_fmsub_pd(half_b, half_b, _mm256_mul_pd(a, c));
+        const __m256d valid = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+        const __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+
+        const __m256d t_near = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+        const __m256d t_far = _mm256_div_pd(_mm256_add_pd(_mm256_sub_pd(zero, half_b), sqrtd), a);
+        const __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(t_near, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t_near, best_t, _CMP_LE_OQ));
+        const __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(t_far, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t_far, best_t, _CMP_LE_OQ));
+        const __m256d root = _mm256_blendv_pd(t_far, t_near, near_ok);
+        const __m256d hit = _mm256_and_pd(valid, _mm256_or_pd(near_ok, far_ok));
+
+        best_t = _mm256_blendv_pd(best_t, root, hit);
+        best_i = _mm256_blendv_pd(best_i, index, hit);
+    }
+
+    alignas(32) double lane_t[4], lane_i[4];
+    _mm256_store_pd(lane_t, best_t);
+    _mm256_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 4; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const sphere_soa<double> tail{ s.center_x + k, s.center_y + k, s.center_z + k, s.radius_squared + k, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_sphere_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("avx512f")
+inline ptrdiff_t closest_sphere_hit_avx512(const sphere_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m512d ox = _mm512_set1_pd(o[0]), oy = _mm512_set1_pd(o[1]), oz = _mm512_set1_pd(o[2]);
+    const __m512d dx = _mm512_set1_pd(d[0]), dy = _mm512_set1_pd(d[1]), dz = _mm512_set1_pd(d[2]);
+    const __m512d a = _mm512_set1_pd(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    const __m512d tmin = _mm512_set1_pd(t_min), zero = _mm512_setzero_pd();
+    __m512d best_t = _mm512_set1_pd(t_max), best_i = _mm512_set1_pd(-1);
+    __m512d index = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512d step = _mm512_set1_pd(8);
+
+    size_t k = 0;
+    for (; k + 8 <= s.count; k += 8, index = _mm512_add_pd(index, step))
+    {
+        const __m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(s.center_x + k));
+        const __m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(s.center_y + k));
+        const __m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(s.center_z + k));
+        const __m512d half_b = _mm512_fmadd_pd(ocx, dx, _mm512_fmadd_pd(ocy, dy, _mm512_mul_pd(ocz, dz)));
+        const __m512d c = _mm512_fmadd_pd(ocx, ocx, _mm512_fmadd_pd(ocy, ocy,
+            _mm512_fmsub_pd(ocz, ocz, _mm512_loadu_pd(s.radius_squared + k))));
+        const __m512d discriminant = _mm512_fmsub_pd(half_b, half_b, _mm512_mul_pd(a, c));
+        const __mmask8 valid = _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+        const __m512d sqrtd = _mm512_sqrt_pd(_mm512_max_pd(discriminant, zero));
+
+        const __m512d t_near = _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+        const __m512d t_far = _mm512_div_pd(_mm512_add_pd(_mm512_sub_pd(zero, half_b), sqrtd), a);
+        const __mmask8 near_ok = _mm512_cmp_pd_mask(t_near, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t_near, best_t, _CMP_LE_OQ);
+        const __mmask8 far_ok = _mm512_cmp_pd_mask(t_far, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t_far, best_t, _CMP_LE_OQ);
+        const __m512d root = _mm512_mask_blend_pd(near_ok, t_far, t_near);
+        const __mmask8 hit = valid & (near_ok | far_ok);
+
+        best_t = _mm512_mask_blend_pd(hit, best_t, root);
+        best_i = _mm512_mask_blend_pd(hit, best_i, index);
+    }
+
+    alignas(64) double lane_t[8], lane_i[8];
+    _mm512_store_pd(lane_t, best_t);
+    _mm512_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 8; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const sphere_soa<double> tail{ s.center_x + k, s.center_y + k, s.center_z + k, s.radius_squared + k, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_sphere_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("sse4.2")
+inline ptrdiff_t closest_triangle_hit_sse42(const triangle_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m128d ox = _mm_set1_pd(o[0]), oy = _mm_set1_pd(o[1]), oz = _mm_set1_pd(o[2]);
+    const __m128d dx = _mm_set1_pd(d[0]), dy = _mm_set1_pd(d[1]), dz = _mm_set1_pd(d[2]);
+    const __m128d tmin = _mm_set1_pd(t_min), zero = _mm_set1_pd(0), one = _mm_set1_pd(1);
+    __m128d best_t = _mm_set1_pd(t_max), best_i = _mm_set1_pd(-1);
+    __m128d index = _mm_set_pd(1, 0);
+    const __m128d step = _mm_set1_pd(2);
+
+    size_t k = 0;
+    for (; k + 2 <= s.count; k += 2, index = _mm_add_pd(index, step))
+    {
+        const __m128d e1x = _mm_loadu_pd(s.e1[0] + k), e1y = _mm_loadu_pd(s.e1[1] + k), e1z = _mm_loadu_pd(s.e1[2] + k);
+        const __m128d e2x = _mm_loadu_pd(s.e2[0] + k), e2y = _mm_loadu_pd(s.e2[1] + k), e2z = _mm_loadu_pd(s.e2[2] + k);
+        const __m128d px = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        const __m128d py = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        const __m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        const __m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, px), _mm_mul_pd(e1y, py)), _mm_mul_pd(e1z, pz));
+        const __m128d inv_det = _mm_div_pd(one, det);
+
+        const __m128d sx = _mm_sub_pd(ox, _mm_loadu_pd(s.v0[0] + k)), sy = _mm_sub_pd(oy, _mm_loadu_pd(s.v0[1] + k)), sz = _mm_sub_pd(oz, _mm_loadu_pd(s.v0[2] + k));
+        const __m128d u = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, px), _mm_mul_pd(sy, py)), _mm_mul_pd(sz, pz)), inv_det);
+        const __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        const __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        const __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        const __m128d v = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)), inv_det);
+        const __m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)), inv_det);
+
+        const __m128d inside = _mm_and_pd(_mm_and_pd(_mm_cmpneq_pd(det, zero), _mm_and_pd(_mm_cmpge_pd(u, zero), _mm_cmpge_pd(v, zero))), _mm_cmple_pd(_mm_add_pd(u, v), one));
+        const __m128d hit = _mm_and_pd(inside, _mm_and_pd(_mm_cmpge_pd(t, tmin), _mm_cmple_pd(t, best_t)));
+        best_t = _mm_blendv_pd(best_t, t, hit);
+        best_i = _mm_blendv_pd(best_i, index, hit);
+    }
+
+    alignas(16) double lane_t[2], lane_i[2];
+    _mm_store_pd(lane_t, best_t);
+    _mm_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 2; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const triangle_soa<double> tail{ { s.v0[0] + k, s.v0[1] + k, s.v0[2] + k }, { s.e1[0] + k, s.e1[1] + k, s.e1[2] + k },
+        { s.e2[0] + k, s.e2[1] + k, s.e2[2] + k }, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_triangle_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("avx2,fma")
+inline ptrdiff_t closest_triangle_hit_avx2(const triangle_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+    const __m256d dx = _mm256_set1_pd(d[0]), dy = _mm256_set1_pd(d[1]), dz = _mm256_set1_pd(d[2]);
+    const __m256d tmin = _mm256_set1_pd(t_min), zero = _mm256_set1_pd(0), one = _mm256_set1_pd(1);
+    __m256d best_t = _mm256_set1_pd(t_max), best_i = _mm256_set1_pd(-1);
+    __m256d index = _mm256_set_pd(3, 2, 1, 0);
+    const __m256d step = _mm256_set1_pd(4);
+
+    size_t k = 0;
+    for (; k + 4 <= s.count; k += 4, index = _mm256_add_pd(index, step))
+    {
+        const __m256d e1x = _mm256_loadu_pd(s.e1[0] + k), e1y = _mm256_loadu_pd(s.e1[1] + k), e1z = _mm256_loadu_pd(s.e1[2] + k);
+        const __m256d e2x = _mm256_loadu_pd(s.e2[0] + k), e2y = _mm256_loadu_pd(s.e2[1] + k), e2z = _mm256_loadu_pd(s.e2[2] + k);
+        const __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        const __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        const __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        const __m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)), _mm256_mul_pd(e1z, pz));
+        const __m256d inv_det = _mm256_div_pd(one, det);
+
+        const __m256d sx = _mm256_sub_pd(ox, _mm256_loadu_pd(s.v0[0] + k)), sy = _mm256_sub_pd(oy, _mm256_loadu_pd(s.v0[1] + k)), sz = _mm256_sub_pd(oz, _mm256_loadu_pd(s.v0[2] + k));
+        const __m256d u = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)), _mm256_mul_pd(sz, pz)), inv_det);
+        const __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+        const __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+        const __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+        const __m256d v = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)), inv_det);
+        const __m256d t = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)), inv_det);
+
+        const __m256d inside = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(det, zero, _CMP_NEQ_OQ), _mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_GE_OQ), _mm256_cmp_pd(v, zero, _CMP_GE_OQ))), _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ));
+        const __m256d hit = _mm256_and_pd(inside, _mm256_and_pd(_mm256_cmp_pd(t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t, best_t, _CMP_LE_OQ)));
+        best_t = _mm256_blendv_pd(best_t, t, hit);
+        best_i = _mm256_blendv_pd(best_i, index, hit);
+    }
+
+    alignas(32) double lane_t[4], lane_i[4];
+    _mm256_store_pd(lane_t, best_t);
+    _mm256_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 4; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const triangle_soa<double> tail{ { s.v0[0] + k, s.v0[1] + k, s.v0[2] + k }, { s.e1[0] + k, s.e1[1] + k, s.e1[2] + k },
+        { s.e2[0] + k, s.e2[1] + k, s.e2[2] + k }, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_triangle_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("avx512f")
+inline ptrdiff_t closest_triangle_hit_avx512(const triangle_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    const __m512d ox = _mm512_set1_pd(o[0]), oy = _mm512_set1_pd(o[1]), oz = _mm512_set1_pd(o[2]);
+    const __m512d dx = _mm512_set1_pd(d[0]), dy = _mm512_set1_pd(d[1]), dz = _mm512_set1_pd(d[2]);
+    const __m512d tmin = _mm512_set1_pd(t_min), zero = _mm512_set1_pd(0), one = _mm512_set1_pd(1);
+    __m512d best_t = _mm512_set1_pd(t_max), best_i = _mm512_set1_pd(-1);
+    __m512d index = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512d step = _mm512_set1_pd(8);
+
+    size_t k = 0;
+    for (; k + 8 <= s.count; k += 8, index = _mm512_add_pd(index, step))
+    {
+        const __m512d e1x = _mm512_loadu_pd(s.e1[0] + k), e1y = _mm512_loadu_pd(s.e1[1] + k), e1z = _mm512_loadu_pd(s.e1[2] + k);
+        const __m512d e2x = _mm512_loadu_pd(s.e2[0] + k), e2y = _mm512_loadu_pd(s.e2[1] + k), e2z = _mm512_loadu_pd(s.e2[2] + k);
+        const __m512d px = _mm512_sub_pd(_mm512_mul_pd(dy, e2z), _mm512_mul_pd(dz, e2y));
+        const __m512d py = _mm512_sub_pd(_mm512_mul_pd(dz, e2x), _mm512_mul_pd(dx, e2z));
+        const __m512d pz = _mm512_sub_pd(_mm512_mul_pd(dx, e2y), _mm512_mul_pd(dy, e2x));
+        const __m512d det = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e1x, px), _mm512_mul_pd(e1y, py)), _mm512_mul_pd(e1z, pz));
+        const __m512d inv_det = _mm512_div_pd(one, det);
+
+        const __m512d sx = _mm512_sub_pd(ox, _mm512_loadu_pd(s.v0[0] + k)), sy = _mm512_sub_pd(oy, _mm512_loadu_pd(s.v0[1] + k)), sz = _mm512_sub_pd(oz, _mm512_loadu_pd(s.v0[2] + k));
+        const __m512d u = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(sx, px), _mm512_mul_pd(sy, py)), _mm512_mul_pd(sz, pz)), inv_det);
+        const __m512d qx = _mm512_sub_pd(_mm512_mul_pd(sy, e1z), _mm512_mul_pd(sz, e1y));
+        const __m512d qy = _mm512_sub_pd(_mm512_mul_pd(sz, e1x), _mm512_mul_pd(sx, e1z));
+        const __m512d qz = _mm512_sub_pd(_mm512_mul_pd(sx, e1y), _mm512_mul_pd(sy, e1x));
+        const __m512d v = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, qx), _mm512_mul_pd(dy, qy)), _mm512_mul_pd(dz, qz)), inv_det);
+        const __m512d t = _mm512_mul_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e2x, qx), _mm512_mul_pd(e2y, qy)), _mm512_mul_pd(e2z, qz)), inv_det);
+
+        const __mmask8 inside = ((_mm512_cmp_pd_mask(det, zero, _CMP_NEQ_OQ) & (_mm512_cmp_pd_mask(u, zero, _CMP_GE_OQ) & _mm512_cmp_pd_mask(v, zero, _CMP_GE_OQ))) & _mm512_cmp_pd_mask(_mm512_add_pd(u, v), one, _CMP_LE_OQ));
+        const __mmask8 hit = (inside & (_mm512_cmp_pd_mask(t, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t, best_t, _CMP_LE_OQ)));
+        best_t = _mm512_mask_blend_pd(hit, best_t, t);
+        best_i = _mm512_mask_blend_pd(hit, best_i, index);
+    }
+
+    alignas(64) double lane_t[8], lane_i[8];
+    _mm512_store_pd(lane_t, best_t);
+    _mm512_store_pd(lane_i, best_i);
+    ptrdiff_t closest = -1;
+    for (int l = 0; l < 8; ++l)
+    {
+        if (lane_i[l] >= 0 && lane_t[l] <= t_max) { t_max = lane_t[l]; closest = static_cast<ptrdiff_t>(lane_i[l]); }
+    }
+
+    const triangle_soa<double> tail{ { s.v0[0] + k, s.v0[1] + k, s.v0[2] + k }, { s.e1[0] + k, s.e1[1] + k, s.e1[2] + k },
+        { s.e2[0] + k, s.e2[1] + k, s.e2[2] + k }, s.count - k };
+    double t_tail;
+    const ptrdiff_t tail_hit = closest_triangle_hit_generic(tail, o, d, t_min, t_max, t_tail);
+    if (tail_hit >= 0) { t_max = t_tail; closest = static_cast<ptrdiff_t>(k) + tail_hit; }
+
+    t_hit = t_max;
+    return closest;
+}
+
+TRT_TARGET("sse4.2")
+inline void tonemap_sse42(const double* values, const double* scales, size_t n, int* out)
+{
+    const __m128d lo = _mm_setzero_pd(), hi = _mm_set1_pd(0.999), full = _mm_set1_pd(256);
+    size_t k = 0;
+    for (; k + 2 <= n; k += 2)
+    {
+        __m128d v = _mm_sqrt_pd(_mm_mul_pd(_mm_loadu_pd(scales + k), _mm_loadu_pd(values + k)));
+        v = _mm_mul_pd(full, _mm_min_pd(_mm_max_pd(v, lo), hi));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + k), _mm_cvttpd_epi32(v));
+    }
+    tonemap_generic(values + k, scales + k, n - k, out + k);
+}
+
+TRT_TARGET("avx2")
+inline void tonemap_avx2(const double* values, const double* scales, size_t n, int* out)
+{
+    const __m256d lo = _mm256_setzero_pd(), hi = _mm256_set1_pd(0.999), full = _mm256_set1_pd(256);
+    size_t k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        __m256d v = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_loadu_pd(scales + k), _mm256_loadu_pd(values + k)));
+        v = _mm256_mul_pd(full, _mm256_min_pd(_mm256_max_pd(v, lo), hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + k), _mm256_cvttpd_epi32(v));
+    }
+    tonemap_generic(values + k, scales + k, n - k, out + k);
+}
+
+TRT_TARGET("avx512f")
+inline void tonemap_avx512(const double* values, const double* scales, size_t n, int* out)
+{
+    const __m512d lo = _mm512_setzero_pd(), hi = _mm512_set1_pd(0.999), full = _mm512_set1_pd(256);
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8)
+    {
+        __m512d v = _mm512_sqrt_pd(_mm512_mul_pd(_mm512_loadu_pd(scales + k), _mm512_loadu_pd(values + k)));
+        v = _mm512_mul_pd(full, _mm512_min_pd(_mm512_max_pd(v, lo), hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), _mm512_cvttpd_epi32(v));
+    }
+    tonemap_generic(values + k, scales + k, n - k, out + k);
+}
+
+#endif
+
+//! Kernel table for the active instruction set level.
+struct simd_dispatch
+{
+    isa_level level;
+    ptrdiff_t (*closest_sphere_hit)(const sphere_soa<double>&, const double[3], const double[3], double, double, double&);
+    ptrdiff_t (*closest_triangle_hit)(const triangle_soa<double>&, const double[3], const double[3], double, double, double&);
+    void (*tonemap)(const double*, const double*, size_t, int*);
+};
+
+inline const simd_dispatch& simd()
+{
+    static const simd_dispatch table = [] {
+        simd_dispatch t{ isa_level::generic, &closest_sphere_hit_generic<double>, &closest_triangle_hit_generic<double>, &tonemap_generic };
+#if defined(TRT_X86)
+        switch (active_isa()) {
+        case isa_level::avx512:
+            t = { isa_level::avx512, &closest_sphere_hit_avx512, &closest_triangle_hit_avx512, &tonemap_avx512 };
+            break;
+        case isa_level::avx2:
+            t = { isa_level::avx2, &closest_sphere_hit_avx2, &closest_triangle_hit_avx2, &tonemap_avx2 };
+            break;
+        case isa_level::sse42:
+            t = { isa_level::sse42, &closest_sphere_hit_sse42, &closest_triangle_hit_sse42, &tonemap_sse42 };
+            break;
+        default:
+            break;
+        }
+#endif
+        return t;
+    }();
+    return table;
+}
+
+//! Nearest sphere hit, generic for any T.
+template<typename T>
+inline ptrdiff_t closest_sphere_hit(const sphere_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max, T& t_hit)
+{
+    return closest_sphere_hit_generic(s, o, d, t_min, t_max, t_hit);
+}
+
+//! Nearest sphere hit for doubles, through the dispatched kernel.
+inline ptrdiff_t closest_sphere_hit(const sphere_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    return simd().closest_sphere_hit(s, o, d, t_min, t_max, t_hit);
+}
+
+//! Nearest triangle hit, generic for any T.
+template<typename T>
+inline ptrdiff_t closest_triangle_hit(const triangle_soa<T>& s, const T o[3], const T d[3], T t_min, T t_max, T& t_hit)
+{
+    return closest_triangle_hit_generic(s, o, d, t_min, t_max, t_hit);
+}
+
+//! Nearest triangle hit for doubles, through the dispatched kernel.
+inline ptrdiff_t closest_triangle_hit(const triangle_soa<double>& s, const double o[3], const double d[3], double t_min, double t_max, double& t_hit)
+{
+    return simd().closest_triangle_hit(s, o, d, t_min, t_max, t_hit);
+}
+
+#endif
@@ -0,0 +1,606 @@
+// this file holds lane types: a few values of one type side by side, handled with one instruction
+// per operation, for kernels that work on several rays or primitives at once
+
+#pragma once
+#ifndef SIMD_LANES_H_
+#define SIMD_LANES_H_
+
+#include "cpu_features.h"
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(TRT_X86)
+#include <immintrin.h>
+#endif
+
+// Every lane type P offers value_type, mask_type and lanes; a constructor that broadcasts one value;
+// load and store of lanes consecutive values; the arithmetic operators; sqrt, abs, min and max;
+// comparisons that give a mask; and select(mask, a, b). Masks combine with &, |, ^ and ~ and are
+// read with any, all, none and bits. The x86 types only run on a CPU with their instruction set, so
+// code using them is reached through active_isa(), and its kernels are marked TRT_TARGET and TRT_FLATTEN.
+
+template<size_t N>
+struct generic_mask
+{
+    bool set[N];
+
+    static constexpr size_t lanes = N;
+};
+
+template<size_t N>
+inline generic_mask<N> operator&(const generic_mask<N>& a, const generic_mask<N>& b)
+{
+    generic_mask<N> m;
+    for (size_t i = 0; i < N; ++i) m.set[i] = a.set[i] && b.set[i];
+    return m;
+}
+
+template<size_t N>
+inline generic_mask<N> operator|(const generic_mask<N>& a, const generic_mask<N>& b)
+{
+    generic_mask<N> m;
+    for (size_t i = 0; i < N; ++i) m.set[i] = a.set[i] || b.set[i];
+    return m;
+}
+
+template<size_t N>
+inline generic_mask<N> operator^(const generic_mask<N>& a, const generic_mask<N>& b)
+{
+    generic_mask<N> m;
+    for (size_t i = 0; i < N; ++i) m.set[i] = a.set[i] != b.set[i];
+    return m;
+}
+
+template<size_t N>
+inline generic_mask<N> operator~(const generic_mask<N>& a)
+{
+    generic_mask<N> m;
+    for (size_t i = 0; i < N; ++i) m.set[i] = !a.set[i];
+    return m;
+}
+
+template<size_t N>
+inline int bits(const generic_mask<N>& m)
+{
+    int b = 0;
+    for (size_t i = 0; i < N; ++i) b |= static_cast<int>(m.set[i]) << i;
+    return b;
+}
+
+template<size_t N>
+inline bool any(const generic_mask<N>& m) { return bits(m) != 0; }
+
+template<size_t N>
+inline bool all(const generic_mask<N>& m) { return bits(m) == (1 << N) - 1; }
+
+template<size_t N>
+inline bool none(const generic_mask<N>& m) { return bits(m) == 0; }
+
+//! N values in plain arrays, for CPUs without the instruction sets below. The loops are simple
+//! enough for the compiler to vectorize for whatever target it builds for.
+template<typename T, size_t N>
+struct generic_lanes
+{
+    using value_type = T;
+    using mask_type = generic_mask<N>;
+    static constexpr size_t lanes = N;
+
+    T v[N];
+
+    generic_lanes() : v() {}
+    generic_lanes(T s) { for (size_t i = 0; i < N; ++i) v[i] = s; }
+
+    static generic_lanes load(const T* p)
+    {
+        generic_lanes a;
+        for (size_t i = 0; i < N; ++i) a.v[i] = p[i];
+        return a;
+    }
+
+    void store(T* p) const { for (size_t i = 0; i < N; ++i) p[i] = v[i]; }
+
+    T operator[](size_t i) const { return v[i]; }
+
+    generic_lanes& operator+=(const generic_lanes& b) { for (size_t i = 0; i < N; ++i) v[i] += b.v[i]; return *this; }
+    generic_lanes& operator-=(const generic_lanes& b) { for (size_t i = 0; i < N; ++i) v[i] -= b.v[i]; return *this; }
+    generic_lanes& operator*=(const generic_lanes& b) { for (size_t i = 0; i < N; ++i) v[i] *= b.v[i]; return *this; }
+    generic_lanes& operator/=(const generic_lanes& b) { for (size_t i = 0; i < N; ++i) v[i] /= b.v[i]; return *this; }
+
+    //! f applied to every lane, or to every pair of lanes of this and b.
+    template<typename F>
+    generic_lanes map(F f) const
+    {
+        generic_lanes a;
+        for (size_t i = 0; i < N; ++i) a.v[i] = f(v[i]);
+        return a;
+    }
+
+    template<typename F>
+    generic_lanes zip(const generic_lanes& b, F f) const
+    {
+        generic_lanes a;
+        for (size_t i = 0; i < N; ++i) a.v[i] = f(v[i], b.v[i]);
+        return a;
+    }
+
+    template<typename F>
+    mask_type compare(const generic_lanes& b, F f) const
+    {
+        mask_type m;
+        for (size_t i = 0; i < N; ++i) m.set[i] = f(v[i], b.v[i]);
+        return m;
+    }
+};
+
+template<typename T, size_t N>
+inline generic_lanes<T, N> operator+(generic_lanes<T, N> a, const generic_lanes<T, N>& b) { return a += b; }
+template<typename T, size_t N>
+inline generic_lanes<T, N> operator-(generic_lanes<T, N> a, const generic_lanes<T, N>& b) { return a -= b; }
+template<typename T, size_t N>
+inline generic_lanes<T, N> operator*(generic_lanes<T, N> a, const generic_lanes<T, N>& b) { return a *= b; }
+template<typename T, size_t N>
+inline generic_lanes<T, N> operator/(generic_lanes<T, N> a, const generic_lanes<T, N>& b) { return a /= b; }
+template<typename T, size_t N>
+inline generic_lanes<T, N> operator-(const generic_lanes<T, N>& a) { return a.map([](T x) { return -x; }); }
+
+template<typename T, size_t N>
+inline generic_lanes<T, N> sqrt(const generic_lanes<T, N>& a) { return a.map([](T x) { return std::sqrt(x); }); }
+template<typename T, size_t N>
+inline generic_lanes<T, N> abs(const generic_lanes<T, N>& a) { return a.map([](T x) { return std::fabs(x); }); }
+template<typename T, size_t N>
+inline generic_lanes<T, N> min(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.zip(b, [](T x, T y) { return y < x ? y : x; }); }
+template<typename T, size_t N>
+inline generic_lanes<T, N> max(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.zip(b, [](T x, T y) { return x < y ? y : x; }); }
+
+template<typename T, size_t N>
+inline generic_mask<N> operator<(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x < y; }); }
+template<typename T, size_t N>
+inline generic_mask<N> operator<=(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x <= y; }); }
+template<typename T, size_t N>
+inline generic_mask<N> operator>(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x > y; }); }
+template<typename T, size_t N>
+inline generic_mask<N> operator>=(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x >= y; }); }
+template<typename T, size_t N>
+inline generic_mask<N> operator==(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x == y; }); }
+template<typename T, size_t N>
+inline generic_mask<N> operator!=(const generic_lanes<T, N>& a, const generic_lanes<T, N>& b) { return a.compare(b, [](T x, T y) { return x != y; }); }
+
+//! a where m is set, b elsewhere.
+template<typename T, size_t N>
+inline generic_lanes<T, N> select(const generic_mask<N>& m, const generic_lanes<T, N>& a, const generic_lanes<T, N>& b)
+{
+    generic_lanes<T, N> r;
+    for (size_t i = 0; i < N; ++i) r.v[i] = m.set[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+#if defined(TRT_X86)
+
+// 4 floats in one SSE4.2 register.
+struct f32x4_mask
+{
+    __m128 v;
+
+    static constexpr size_t lanes = 4;
+};
+
+TRT_TARGET("sse4.2") inline f32x4_mask operator&(const f32x4_mask& a, const f32x4_mask& b) { return f32x4_mask{ _mm_and_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator|(const f32x4_mask& a, const f32x4_mask& b) { return f32x4_mask{ _mm_or_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator^(const f32x4_mask& a, const f32x4_mask& b) { return f32x4_mask{ _mm_xor_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator~(const f32x4_mask& a) { return f32x4_mask{ _mm_xor_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(-1))) }; }
+TRT_TARGET("sse4.2") inline int bits(const f32x4_mask& m) { return _mm_movemask_ps(m.v); }
+
+inline bool any(const f32x4_mask& m) { return bits(m) != 0; }
+inline bool all(const f32x4_mask& m) { return bits(m) == 0xf; }
+inline bool none(const f32x4_mask& m) { return bits(m) == 0; }
+
+struct f32x4
+{
+    using value_type = float;
+    using mask_type = f32x4_mask;
+    static constexpr size_t lanes = 4;
+
+    __m128 v;
+
+    TRT_TARGET("sse4.2") f32x4() : v(_mm_setzero_ps()) {}
+    TRT_TARGET("sse4.2") f32x4(float s) : v(_mm_set1_ps(s)) {}
+    TRT_TARGET("sse4.2") explicit f32x4(__m128 v) : v(v) {}
+
+    TRT_TARGET("sse4.2") static f32x4 load(const float* p) { return f32x4(_mm_loadu_ps(p)); }
+    TRT_TARGET("sse4.2") void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    TRT_TARGET("sse4.2") float operator[](size_t i) const
+    {
+        alignas(16) float values[4];
+        _mm_store_ps(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("sse4.2") f32x4& operator+=(const f32x4& b) { v = _mm_add_ps(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f32x4& operator-=(const f32x4& b) { v = _mm_sub_ps(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f32x4& operator*=(const f32x4& b) { v = _mm_mul_ps(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f32x4& operator/=(const f32x4& b) { v = _mm_div_ps(v, b.v); return *this; }
+};
+
+TRT_TARGET("sse4.2") inline f32x4 operator+(const f32x4& a, const f32x4& b) { return f32x4(_mm_add_ps(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f32x4 operator-(const f32x4& a, const f32x4& b) { return f32x4(_mm_sub_ps(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f32x4 operator*(const f32x4& a, const f32x4& b) { return f32x4(_mm_mul_ps(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f32x4 operator/(const f32x4& a, const f32x4& b) { return f32x4(_mm_div_ps(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f32x4 operator-(const f32x4& a) { return f32x4(_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))); }
+
+TRT_TARGET("sse4.2") inline f32x4 sqrt(const f32x4& a) { return f32x4(_mm_sqrt_ps(a.v)); }
+TRT_TARGET("sse4.2") inline f32x4 abs(const f32x4& a) { return f32x4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)); }
+TRT_TARGET("sse4.2") inline f32x4 min(const f32x4& a, const f32x4& b) { return f32x4(_mm_min_ps(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f32x4 max(const f32x4& a, const f32x4& b) { return f32x4(_mm_max_ps(a.v, b.v)); }
+
+TRT_TARGET("sse4.2") inline f32x4_mask operator<(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmplt_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator<=(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmple_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator>(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmpgt_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator>=(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmpge_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator==(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmpeq_ps(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f32x4_mask operator!=(const f32x4& a, const f32x4& b) { return f32x4_mask{ _mm_cmpneq_ps(a.v, b.v) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("sse4.2") inline f32x4 select(const f32x4_mask& m, const f32x4& a, const f32x4& b) { return f32x4(_mm_blendv_ps(b.v, a.v, m.v)); }
+
+// 2 doubles in one SSE4.2 register.
+struct f64x2_mask
+{
+    __m128d v;
+
+    static constexpr size_t lanes = 2;
+};
+
+TRT_TARGET("sse4.2") inline f64x2_mask operator&(const f64x2_mask& a, const f64x2_mask& b) { return f64x2_mask{ _mm_and_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator|(const f64x2_mask& a, const f64x2_mask& b) { return f64x2_mask{ _mm_or_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator^(const f64x2_mask& a, const f64x2_mask& b) { return f64x2_mask{ _mm_xor_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator~(const f64x2_mask& a) { return f64x2_mask{ _mm_xor_pd(a.v, _mm_castsi128_pd(_mm_set1_epi32(-1))) }; }
+TRT_TARGET("sse4.2") inline int bits(const f64x2_mask& m) { return _mm_movemask_pd(m.v); }
+
+inline bool any(const f64x2_mask& m) { return bits(m) != 0; }
+inline bool all(const f64x2_mask& m) { return bits(m) == 0x3; }
+inline bool none(const f64x2_mask& m) { return bits(m) == 0; }
+
+struct f64x2
+{
+    using value_type = double;
+    using mask_type = f64x2_mask;
+    static constexpr size_t lanes = 2;
+
+    __m128d v;
+
+    TRT_TARGET("sse4.2") f64x2() : v(_mm_setzero_pd()) {}
+    TRT_TARGET("sse4.2") f64x2(double s) : v(_mm_set1_pd(s)) {}
+    TRT_TARGET("sse4.2") explicit f64x2(__m128d v) : v(v) {}
+
+    TRT_TARGET("sse4.2") static f64x2 load(const double* p) { return f64x2(_mm_loadu_pd(p)); }
+    TRT_TARGET("sse4.2") void store(double* p) const { _mm_storeu_pd(p, v); }
+
+    TRT_TARGET("sse4.2") double operator[](size_t i) const
+    {
+        alignas(16) double values[2];
+        _mm_store_pd(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("sse4.2") f64x2& operator+=(const f64x2& b) { v = _mm_add_pd(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f64x2& operator-=(const f64x2& b) { v = _mm_sub_pd(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f64x2& operator*=(const f64x2& b) { v = _mm_mul_pd(v, b.v); return *this; }
+    TRT_TARGET("sse4.2") f64x2& operator/=(const f64x2& b) { v = _mm_div_pd(v, b.v); return *this; }
+};
+
+TRT_TARGET("sse4.2") inline f64x2 operator+(const f64x2& a, const f64x2& b) { return f64x2(_mm_add_pd(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f64x2 operator-(const f64x2& a, const f64x2& b) { return f64x2(_mm_sub_pd(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f64x2 operator*(const f64x2& a, const f64x2& b) { return f64x2(_mm_mul_pd(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f64x2 operator/(const f64x2& a, const f64x2& b) { return f64x2(_mm_div_pd(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f64x2 operator-(const f64x2& a) { return f64x2(_mm_xor_pd(a.v, _mm_set1_pd(-0.0))); }
+
+TRT_TARGET("sse4.2") inline f64x2 sqrt(const f64x2& a) { return f64x2(_mm_sqrt_pd(a.v)); }
+TRT_TARGET("sse4.2") inline f64x2 abs(const f64x2& a) { return f64x2(_mm_andnot_pd(_mm_set1_pd(-0.0), a.v)); }
+TRT_TARGET("sse4.2") inline f64x2 min(const f64x2& a, const f64x2& b) { return f64x2(_mm_min_pd(a.v, b.v)); }
+TRT_TARGET("sse4.2") inline f64x2 max(const f64x2& a, const f64x2& b) { return f64x2(_mm_max_pd(a.v, b.v)); }
+
+TRT_TARGET("sse4.2") inline f64x2_mask operator<(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmplt_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator<=(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmple_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator>(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmpgt_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator>=(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmpge_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator==(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmpeq_pd(a.v, b.v) }; }
+TRT_TARGET("sse4.2") inline f64x2_mask operator!=(const f64x2& a, const f64x2& b) { return f64x2_mask{ _mm_cmpneq_pd(a.v, b.v) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("sse4.2") inline f64x2 select(const f64x2_mask& m, const f64x2& a, const f64x2& b) { return f64x2(_mm_blendv_pd(b.v, a.v, m.v)); }
+
+// 8 floats in one AVX2 register.
+struct f32x8_mask
+{
+    __m256 v;
+
+    static constexpr size_t lanes = 8;
+};
+
+TRT_TARGET("avx2,fma") inline f32x8_mask operator&(const f32x8_mask& a, const f32x8_mask& b) { return f32x8_mask{ _mm256_and_ps(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator|(const f32x8_mask& a, const f32x8_mask& b) { return f32x8_mask{ _mm256_or_ps(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator^(const f32x8_mask& a, const f32x8_mask& b) { return f32x8_mask{ _mm256_xor_ps(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator~(const f32x8_mask& a) { return f32x8_mask{ _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+TRT_TARGET("avx2,fma") inline int bits(const f32x8_mask& m) { return _mm256_movemask_ps(m.v); }
+
+inline bool any(const f32x8_mask& m) { return bits(m) != 0; }
+inline bool all(const f32x8_mask& m) { return bits(m) == 0xff; }
+inline bool none(const f32x8_mask& m) { return bits(m) == 0; }
+
+struct f32x8
+{
+    using value_type = float;
+    using mask_type = f32x8_mask;
+    static constexpr size_t lanes = 8;
+
+    __m256 v;
+
+    TRT_TARGET("avx2,fma") f32x8() : v(_mm256_setzero_ps()) {}
+    TRT_TARGET("avx2,fma") f32x8(float s) : v(_mm256_set1_ps(s)) {}
+    TRT_TARGET("avx2,fma") explicit f32x8(__m256 v) : v(v) {}
+
+    TRT_TARGET("avx2,fma") static f32x8 load(const float* p) { return f32x8(_mm256_loadu_ps(p)); }
+    TRT_TARGET("avx2,fma") void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    TRT_TARGET("avx2,fma") float operator[](size_t i) const
+    {
+        alignas(32) float values[8];
+        _mm256_store_ps(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("avx2,fma") f32x8& operator+=(const f32x8& b) { v = _mm256_add_ps(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f32x8& operator-=(const f32x8& b) { v = _mm256_sub_ps(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f32x8& operator*=(const f32x8& b) { v = _mm256_mul_ps(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f32x8& operator/=(const f32x8& b) { v = _mm256_div_ps(v, b.v); return *this; }
+};
+
+TRT_TARGET("avx2,fma") inline f32x8 operator+(const f32x8& a, const f32x8& b) { return f32x8(_mm256_add_ps(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 operator-(const f32x8& a, const f32x8& b) { return f32x8(_mm256_sub_ps(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 operator*(const f32x8& a, const f32x8& b) { return f32x8(_mm256_mul_ps(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 operator/(const f32x8& a, const f32x8& b) { return f32x8(_mm256_div_ps(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 operator-(const f32x8& a) { return f32x8(_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))); }
+
+TRT_TARGET("avx2,fma") inline f32x8 sqrt(const f32x8& a) { return f32x8(_mm256_sqrt_ps(a.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 abs(const f32x8& a) { return f32x8(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 min(const f32x8& a, const f32x8& b) { return f32x8(_mm256_min_ps(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f32x8 max(const f32x8& a, const f32x8& b) { return f32x8(_mm256_max_ps(a.v, b.v)); }
+
+TRT_TARGET("avx2,fma") inline f32x8_mask operator<(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator<=(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator>(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator>=(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator==(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+TRT_TARGET("avx2,fma") inline f32x8_mask operator!=(const f32x8& a, const f32x8& b) { return f32x8_mask{ _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("avx2,fma") inline f32x8 select(const f32x8_mask& m, const f32x8& a, const f32x8& b) { return f32x8(_mm256_blendv_ps(b.v, a.v, m.v)); }
+
+// 4 doubles in one AVX2 register.
+struct f64x4_mask
+{
+    __m256d v;
+
+    static constexpr size_t lanes = 4;
+};
+
+TRT_TARGET("avx2,fma") inline f64x4_mask operator&(const f64x4_mask& a, const f64x4_mask& b) { return f64x4_mask{ _mm256_and_pd(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator|(const f64x4_mask& a, const f64x4_mask& b) { return f64x4_mask{ _mm256_or_pd(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator^(const f64x4_mask& a, const f64x4_mask& b) { return f64x4_mask{ _mm256_xor_pd(a.v, b.v) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator~(const f64x4_mask& a) { return f64x4_mask{ _mm256_xor_pd(a.v, _mm256_castsi256_pd(_mm256_set1_epi32(-1))) }; }
+TRT_TARGET("avx2,fma") inline int bits(const f64x4_mask& m) { return _mm256_movemask_pd(m.v); }
+
+inline bool any(const f64x4_mask& m) { return bits(m) != 0; }
+inline bool all(const f64x4_mask& m) { return bits(m) == 0xf; }
+inline bool none(const f64x4_mask& m) { return bits(m) == 0; }
+
+struct f64x4
+{
+    using value_type = double;
+    using mask_type = f64x4_mask;
+    static constexpr size_t lanes = 4;
+
+    __m256d v;
+
+    TRT_TARGET("avx2,fma") f64x4() : v(_mm256_setzero_pd()) {}
+    TRT_TARGET("avx2,fma") f64x4(double s) : v(_mm256_set1_pd(s)) {}
+    TRT_TARGET("avx2,fma") explicit f64x4(__m256d v) : v(v) {}
+
+    TRT_TARGET("avx2,fma") static f64x4 load(const double* p) { return f64x4(_mm256_loadu_pd(p)); }
+    TRT_TARGET("avx2,fma") void store(double* p) const { _mm256_storeu_pd(p, v); }
+
+    TRT_TARGET("avx2,fma") double operator[](size_t i) const
+    {
+        alignas(32) double values[4];
+        _mm256_store_pd(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("avx2,fma") f64x4& operator+=(const f64x4& b) { v = _mm256_add_pd(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f64x4& operator-=(const f64x4& b) { v = _mm256_sub_pd(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f64x4& operator*=(const f64x4& b) { v = _mm256_mul_pd(v, b.v); return *this; }
+    TRT_TARGET("avx2,fma") f64x4& operator/=(const f64x4& b) { v = _mm256_div_pd(v, b.v); return *this; }
+};
+
+TRT_TARGET("avx2,fma") inline f64x4 operator+(const f64x4& a, const f64x4& b) { return f64x4(_mm256_add_pd(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 operator-(const f64x4& a, const f64x4& b) { return f64x4(_mm256_sub_pd(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 operator*(const f64x4& a, const f64x4& b) { return f64x4(_mm256_mul_pd(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 operator/(const f64x4& a, const f64x4& b) { return f64x4(_mm256_div_pd(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 operator-(const f64x4& a) { return f64x4(_mm256_xor_pd(a.v, _mm256_set1_pd(-0.0))); }
+
+TRT_TARGET("avx2,fma") inline f64x4 sqrt(const f64x4& a) { return f64x4(_mm256_sqrt_pd(a.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 abs(const f64x4& a) { return f64x4(_mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 min(const f64x4& a, const f64x4& b) { return f64x4(_mm256_min_pd(a.v, b.v)); }
+TRT_TARGET("avx2,fma") inline f64x4 max(const f64x4& a, const f64x4& b) { return f64x4(_mm256_max_pd(a.v, b.v)); }
+
+TRT_TARGET("avx2,fma") inline f64x4_mask operator<(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator<=(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator>(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator>=(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator==(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_EQ_OQ) }; }
+TRT_TARGET("avx2,fma") inline f64x4_mask operator!=(const f64x4& a, const f64x4& b) { return f64x4_mask{ _mm256_cmp_pd(a.v, b.v, _CMP_NEQ_UQ) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("avx2,fma") inline f64x4 select(const f64x4_mask& m, const f64x4& a, const f64x4& b) { return f64x4(_mm256_blendv_pd(b.v, a.v, m.v)); }
+
+// 16 floats in one AVX-512 register.
+struct f32x16_mask
+{
+    __mmask16 bits;
+
+    static constexpr size_t lanes = 16;
+};
+
+inline f32x16_mask operator&(const f32x16_mask& a, const f32x16_mask& b) { return f32x16_mask{ static_cast<__mmask16>(a.bits & b.bits) }; }
+inline f32x16_mask operator|(const f32x16_mask& a, const f32x16_mask& b) { return f32x16_mask{ static_cast<__mmask16>(a.bits | b.bits) }; }
+inline f32x16_mask operator^(const f32x16_mask& a, const f32x16_mask& b) { return f32x16_mask{ static_cast<__mmask16>(a.bits ^ b.bits) }; }
+inline f32x16_mask operator~(const f32x16_mask& a) { return f32x16_mask{ static_cast<__mmask16>(~a.bits) }; }
+inline int bits(const f32x16_mask& m) { return m.bits; }
+
+inline bool any(const f32x16_mask& m) { return bits(m) != 0; }
+inline bool all(const f32x16_mask& m) { return bits(m) == 0xffff; }
+inline bool none(const f32x16_mask& m) { return bits(m) == 0; }
+
+struct f32x16
+{
+    using value_type = float;
+    using mask_type = f32x16_mask;
+    static constexpr size_t lanes = 16;
+
+    __m512 v;
+
+    TRT_TARGET("avx512f") f32x16() : v(_mm512_setzero_ps()) {}
+    TRT_TARGET("avx512f") f32x16(float s) : v(_mm512_set1_ps(s)) {}
+    TRT_TARGET("avx512f") explicit f32x16(__m512 v) : v(v) {}
+
+    TRT_TARGET("avx512f") static f32x16 load(const float* p) { return f32x16(_mm512_loadu_ps(p)); }
+    TRT_TARGET("avx512f") void store(float* p) const { _mm512_storeu_ps(p, v); }
+
+    TRT_TARGET("avx512f") float operator[](size_t i) const
+    {
+        alignas(64) float values[16];
+        _mm512_store_ps(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("avx512f") f32x16& operator+=(const f32x16& b) { v = _mm512_add_ps(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f32x16& operator-=(const f32x16& b) { v = _mm512_sub_ps(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f32x16& operator*=(const f32x16& b) { v = _mm512_mul_ps(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f32x16& operator/=(const f32x16& b) { v = _mm512_div_ps(v, b.v); return *this; }
+};
+
+TRT_TARGET("avx512f") inline f32x16 operator+(const f32x16& a, const f32x16& b) { return f32x16(_mm512_add_ps(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f32x16 operator-(const f32x16& a, const f32x16& b) { return f32x16(_mm512_sub_ps(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f32x16 operator*(const f32x16& a, const f32x16& b) { return f32x16(_mm512_mul_ps(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f32x16 operator/(const f32x16& a, const f32x16& b) { return f32x16(_mm512_div_ps(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f32x16 operator-(const f32x16& a) { return f32x16(_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_set1_epi32(0x80000000)))); }
+
+TRT_TARGET("avx512f") inline f32x16 sqrt(const f32x16& a) { return f32x16(_mm512_sqrt_ps(a.v)); }
+TRT_TARGET("avx512f") inline f32x16 abs(const f32x16& a) { return f32x16(_mm512_abs_ps(a.v)); }
+TRT_TARGET("avx512f") inline f32x16 min(const f32x16& a, const f32x16& b) { return f32x16(_mm512_min_ps(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f32x16 max(const f32x16& a, const f32x16& b) { return f32x16(_mm512_max_ps(a.v, b.v)); }
+
+TRT_TARGET("avx512f") inline f32x16_mask operator<(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+TRT_TARGET("avx512f") inline f32x16_mask operator<=(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+TRT_TARGET("avx512f") inline f32x16_mask operator>(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+TRT_TARGET("avx512f") inline f32x16_mask operator>=(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+TRT_TARGET("avx512f") inline f32x16_mask operator==(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ) }; }
+TRT_TARGET("avx512f") inline f32x16_mask operator!=(const f32x16& a, const f32x16& b) { return f32x16_mask{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("avx512f") inline f32x16 select(const f32x16_mask& m, const f32x16& a, const f32x16& b) { return f32x16(_mm512_mask_blend_ps(m.bits, b.v, a.v)); }
+
+// 8 doubles in one AVX-512 register.
+struct f64x8_mask
+{
+    __mmask8 bits;
+
+    static constexpr size_t lanes = 8;
+};
+
+inline f64x8_mask operator&(const f64x8_mask& a, const f64x8_mask& b) { return f64x8_mask{ static_cast<__mmask8>(a.bits & b.bits) }; }
+inline f64x8_mask operator|(const f64x8_mask& a, const f64x8_mask& b) { return f64x8_mask{ static_cast<__mmask8>(a.bits | b.bits) }; }
+inline f64x8_mask operator^(const f64x8_mask& a, const f64x8_mask& b) { return f64x8_mask{ static_cast<__mmask8>(a.bits ^ b.bits) }; }
+inline f64x8_mask operator~(const f64x8_mask& a) { return f64x8_mask{ static_cast<__mmask8>(~a.bits) }; }
+inline int bits(const f64x8_mask& m) { return m.bits; }
+
+inline bool any(const f64x8_mask& m) { return bits(m) != 0; }
+inline bool all(const f64x8_mask& m) { return bits(m) == 0xff; }
+inline bool none(const f64x8_mask& m) { return bits(m) == 0; }
+
+struct f64x8
+{
+    using value_type = double;
+    using mask_type = f64x8_mask;
+    static constexpr size_t lanes = 8;
+
+    __m512d v;
+
+    TRT_TARGET("avx512f") f64x8() : v(_mm512_setzero_pd()) {}
+    TRT_TARGET("avx512f") f64x8(double s) : v(_mm512_set1_pd(s)) {}
+    TRT_TARGET("avx512f") explicit f64x8(__m512d v) : v(v) {}
+
+    TRT_TARGET("avx512f") static f64x8 load(const double* p) { return f64x8(_mm512_loadu_pd(p)); }
+    TRT_TARGET("avx512f") void store(double* p) const { _mm512_storeu_pd(p, v); }
+
+    TRT_TARGET("avx512f") double operator[](size_t i) const
+    {
+        alignas(64) double values[8];
+        _mm512_store_pd(values, v);
+        return values[i];
+    }
+
+    TRT_TARGET("avx512f") f64x8& operator+=(const f64x8& b) { v = _mm512_add_pd(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f64x8& operator-=(const f64x8& b) { v = _mm512_sub_pd(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f64x8& operator*=(const f64x8& b) { v = _mm512_mul_pd(v, b.v); return *this; }
+    TRT_TARGET("avx512f") f64x8& operator/=(const f64x8& b) { v = _mm512_div_pd(v, b.v); return *this; }
+};
+
+TRT_TARGET("avx512f") inline f64x8 operator+(const f64x8& a, const f64x8& b) { return f64x8(_mm512_add_pd(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f64x8 operator-(const f64x8& a, const f64x8& b) { return f64x8(_mm512_sub_pd(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f64x8 operator*(const f64x8& a, const f64x8& b) { return f64x8(_mm512_mul_pd(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f64x8 operator/(const f64x8& a, const f64x8& b) { return f64x8(_mm512_div_pd(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f64x8 operator-(const f64x8& a) { return f64x8(_mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a.v), _mm512_set1_epi64(static_cast<long long>(0x8000000000000000ull))))); }
+
+TRT_TARGET("avx512f") inline f64x8 sqrt(const f64x8& a) { return f64x8(_mm512_sqrt_pd(a.v)); }
+TRT_TARGET("avx512f") inline f64x8 abs(const f64x8& a) { return f64x8(_mm512_abs_pd(a.v)); }
+TRT_TARGET("avx512f") inline f64x8 min(const f64x8& a, const f64x8& b) { return f64x8(_mm512_min_pd(a.v, b.v)); }
+TRT_TARGET("avx512f") inline f64x8 max(const f64x8& a, const f64x8& b) { return f64x8(_mm512_max_pd(a.v, b.v)); }
+
+TRT_TARGET("avx512f") inline f64x8_mask operator<(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ) }; }
+TRT_TARGET("avx512f") inline f64x8_mask operator<=(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ) }; }
+TRT_TARGET("avx512f") inline f64x8_mask operator>(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ) }; }
+TRT_TARGET("avx512f") inline f64x8_mask operator>=(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_GE_OQ) }; }
+TRT_TARGET("avx512f") inline f64x8_mask operator==(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_EQ_OQ) }; }
+TRT_TARGET("avx512f") inline f64x8_mask operator!=(const f64x8& a, const f64x8& b) { return f64x8_mask{ _mm512_cmp_pd_mask(a.v, b.v, _CMP_NEQ_UQ) }; }
+
+//! a where m is set, b elsewhere.
+TRT_TARGET("avx512f") inline f64x8 select(const f64x8_mask& m, const f64x8& a, const f64x8& b) { return f64x8(_mm512_mask_blend_pd(m.bits, b.v, a.v)); }
+
+//! The widest lane type of T at level L, for code templated over the instruction set.
+template<typename T, isa_level L>
+struct native_lanes
+{
+    using type = generic_lanes<T, 4>;
+};
+
+template<> struct native_lanes<float, isa_level::sse42> { using type = f32x4; };
+template<> struct native_lanes<double, isa_level::sse42> { using type = f64x2; };
+template<> struct native_lanes<float, isa_level::avx2> { using type = f32x8; };
+template<> struct native_lanes<double, isa_level::avx2> { using type = f64x4; };
+template<> struct native_lanes<float, isa_level::avx512> { using type = f32x16; };
+template<> struct native_lanes<double, isa_level::avx512> { using type = f64x8; };
+
+#else
+
+template<typename T, isa_level L>
+struct native_lanes
+{
+    using type = generic_lanes<T, 4>;
+};
+
+#endif
+
+#endif
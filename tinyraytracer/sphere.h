@@ -6,6 +6,7 @@
 #include "vector3.h"
 #include <cmath>
 #include "material.h"
+#include "keyframes.h"
 
 template<typename T>
 class Sphere : public Hittable<T>
@@ -14,19 +15,37 @@ public:
     Sphere() {}
     Sphere(const Point3<T>& cen, T r, shared_ptr<Material<T>> m) : center(cen), radius(r), mat_ptr(m) {};
 
-    virtual bool hit(
-        const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const override;
+    virtual bool intersect(
+        const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override;
+
+    virtual void finalize(
+        const Ray<T>& r, const hit_candidate<T>& candidate, hit_record<T>& rec) const override;
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override;
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        const Vector3<T> extent(std::fabs(radius), std::fabs(radius), std::fabs(radius));
+        box = Aabb<T>(center - extent, center + extent);
+        return true;
+    }
+
+    //! Where the center is at time: center itself unless motion is keyframed.
+    Point3<T> center_at(T time) const { return motion ? motion->at(time) : center; }
 
 public:
     Point3<T> center;
     T radius;
 
+    //! Keyframed path of the center, followed when the sphere is rendered through Animated_scene.
+    shared_ptr<const Keyframe_track<T>> motion;
+
     //SphereĲ
     shared_ptr<Material<T>> mat_ptr; //Ϊ˲̬ʵʹһSphereʱӦָĳMaterialMetal<T>
 };
 
 template<typename T>
-bool Sphere<T>::hit(const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const 
+bool Sphere<T>::intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const 
 {
     Vector3<T> oc = r.origin() - center;
     auto a = r.direction().norm_squared();
@@ -45,14 +64,38 @@ bool Sphere<T>::hit(const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec) const
             return false;
     }
 
-    rec.t = root;
-    rec.p = r.at(root);
+    candidate.t = root;
+    candidate.object = this;
+    candidate.primitive = 0;
+    return true;
+}
+
+template<typename T>
+void Sphere<T>::finalize(const Ray<T>& r, const hit_candidate<T>& candidate, hit_record<T>& rec) const
+{
+    rec.t = candidate.t;
+    rec.p = r.at(candidate.t);
     Vector3<T> outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mat_ptr;
+}
 
+template<typename T>
+bool Sphere<T>::occluded(const Ray<T>& r, T t_min, T t_max) const
+{
+    Vector3<T> oc = r.origin() - center;
+    auto a = r.direction().norm_squared();
+    auto half_b = oc.dot(r.direction());
+    auto c = oc.norm_squared() - radius * radius;
 
-    return true;
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = std::sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (t_min <= root && root <= t_max) return true;
+    root = (-half_b + sqrtd) / a;
+    return t_min <= root && root <= t_max;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,263 @@
+#pragma once
+#ifndef SPHERE_SET_H_
+#define SPHERE_SET_H_
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "keyframes.h"
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+//! Many spheres in one Hittable, stored as structure of arrays and intersected with the SIMD kernels.
+template<typename T>
+class Sphere_set : public Hittable<T>
+{
+public:
+    Sphere_set() {}
+
+    void add(const Point3<T>& center, T radius, shared_ptr<Material<T>> m)
+    {
+        center_x.push_back(center.x);
+        center_y.push_back(center.y);
+        center_z.push_back(center.z);
+        radii.push_back(radius);
+        radius_squared.push_back(radius * radius);
+        materials.push_back(m);
+    }
+
+    //! Adds a sphere whose center follows track over time, see set_time.
+    void add(const Point3<T>& center, T radius, shared_ptr<Material<T>> m, shared_ptr<const Keyframe_track<T>> track)
+    {
+        add(center, radius, m);
+        if (!track && tracks.empty()) return;
+        tracks.resize(size());
+        tracks.back() = std::move(track);
+    }
+
+    size_t size() const { return radii.size(); }
+
+    bool animated() const { return !tracks.empty(); }
+
+    size_t memory_bytes() const
+    {
+        return size() * (5 * sizeof(T) + sizeof(shared_ptr<Material<T>>)) + tracks.size() * sizeof(shared_ptr<const Keyframe_track<T>>);
+    }
+
+    //! Moves every sphere with a track to where it is at time.
+    void set_time(T time)
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, tracks.size(), 4096), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                {
+                    if (!tracks[k]) continue;
+                    const Point3<T> center = tracks[k]->at(time);
+                    center_x[k] = center.x;
+                    center_y[k] = center.y;
+                    center_z[k] = center.z;
+                }
+            });
+    }
+
+    //! Resizes the set so that spheres can be filled in with set(), from several threads at once.
+    void resize(size_t n)
+    {
+        center_x.resize(n);
+        center_y.resize(n);
+        center_z.resize(n);
+        radii.resize(n);
+        radius_squared.resize(n);
+        materials.resize(n);
+        if (!tracks.empty()) tracks.resize(n);
+    }
+
+    void set(size_t k, const Point3<T>& center, T radius, shared_ptr<Material<T>> m)
+    {
+        center_x[k] = center.x;
+        center_y[k] = center.y;
+        center_z[k] = center.z;
+        radii[k] = radius;
+        radius_squared[k] = radius * radius;
+        materials[k] = std::move(m);
+    }
+
+    //! Index of the nearest sphere hit in [t_min, t_max] with its t, or -1.
+    ptrdiff_t closest(const Ray<T>& r, T t_min, T t_max, T& t_hit) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        return closest_sphere_hit(soa(), o, d, t_min, t_max, t_hit);
+    }
+
+    //! True if any sphere is hit in [t_min, t_max]; stops at the first one found.
+    bool any(const Ray<T>& r, T t_min, T t_max) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        return any_sphere_hit(soa(), o, d, t_min, t_max);
+    }
+
+    //! Outward unit normal of sphere k at point p.
+    Vector3<T> outward_normal(ptrdiff_t k, const Point3<T>& p) const
+    {
+        return (p - Point3<T>(center_x[k], center_y[k], center_z[k])) / radii[k];
+    }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        T root;
+        const ptrdiff_t k = closest(r, t_min, t_max, root);
+        if (k < 0) return false;
+
+        candidate.t = root;
+        candidate.object = this;
+        candidate.primitive = static_cast<size_t>(k);
+        return true;
+    }
+
+    virtual void finalize(const Ray<T>& r, const hit_candidate<T>& candidate, hit_record<T>& rec) const override
+    {
+        rec.t = candidate.t;
+        rec.p = r.at(candidate.t);
+        rec.set_face_normal(r, outward_normal(candidate.primitive, rec.p));
+        rec.mat_ptr = materials[candidate.primitive];
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        return any(r, t_min, t_max);
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = Aabb<T>();
+        for (size_t k = 0; k < size(); ++k) box.expand(bounds(k));
+        return size() > 0;
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        for (const std::vector<T>* array : { &center_x, &center_y, &center_z, &radii, &radius_squared })
+            f(array->data(), array->size() * sizeof(T));
+        f(materials.data(), materials.size() * sizeof(shared_ptr<Material<T>>));
+    }
+
+    sphere_soa<T> soa() const
+    {
+        return soa(0, size());
+    }
+
+    //! The spheres [first, first + count) as their own arrays.
+    sphere_soa<T> soa(size_t first, size_t count) const
+    {
+        return sphere_soa<T>{ center_x.data() + first, center_y.data() + first, center_z.data() + first, radius_squared.data() + first, count };
+    }
+
+    // The primitive interface the acceleration structures are built over.
+
+    Aabb<T> bounds(size_t k) const
+    {
+        const T r = std::fabs(radii[k]);
+        return Aabb<T>(Point3<T>(center_x[k] - r, center_y[k] - r, center_z[k] - r), Point3<T>(center_x[k] + r, center_y[k] + r, center_z[k] + r));
+    }
+
+    Point3<T> centroid(size_t k) const { return Point3<T>(center_x[k], center_y[k], center_z[k]); }
+
+    //! Nearest hit among the spheres [first, first + count), reported with its index in the whole set.
+    bool intersect_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        T root;
+        const ptrdiff_t k = closest_sphere_hit(soa(first, count), o, d, t_min, t_max, root);
+        if (k < 0) return false;
+
+        candidate.t = root;
+        candidate.object = this;
+        candidate.primitive = first + static_cast<size_t>(k);
+        return true;
+    }
+
+    bool occluded_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        return any_sphere_hit(soa(first, count), o, d, t_min, t_max);
+    }
+
+    //! Reorders the spheres so that the new sphere k is the old sphere order[k].
+    void permute(const std::vector<size_t>& order)
+    {
+        auto apply = [&](auto& values)
+        {
+            std::remove_reference_t<decltype(values)> sorted(values.size());
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, order.size(), 4096), [&](const tbb::blocked_range<size_t>& range)
+                {
+                    for (size_t k = range.begin(); k != range.end(); ++k) sorted[k] = std::move(values[order[k]]);
+                });
+            values.swap(sorted);
+        };
+        apply(center_x);
+        apply(center_y);
+        apply(center_z);
+        apply(radii);
+        apply(radius_squared);
+        apply(materials);
+        if (!tracks.empty())
+        {
+            tracks.resize(size());
+            apply(tracks);
+        }
+    }
+
+public:
+    std::vector<T> center_x, center_y, center_z;
+    std::vector<T> radii, radius_squared;
+    std::vector<shared_ptr<Material<T>>> materials;
+    std::vector<shared_ptr<const Keyframe_track<T>>> tracks;    // empty unless some sphere moves
+};
+
+//! Calls sphere(center, radius, material) for every Sphere of the list and every member of a
+//! Sphere_set in it, and other(object) for anything else.
+template<typename T, typename F, typename G>
+void for_each_sphere(const Hittable_list<T>& list, F&& sphere, G&& other)
+{
+    for (const auto& object : list.objects)
+    {
+        if (auto s = std::dynamic_pointer_cast<Sphere<T>>(object))
+        {
+            sphere(s->center, s->radius, s->mat_ptr);
+        }
+        else if (auto set = std::dynamic_pointer_cast<Sphere_set<T>>(object))
+        {
+            for (size_t k = 0; k < set->size(); ++k)
+                sphere(Point3<T>(set->center_x[k], set->center_y[k], set->center_z[k]), set->radii[k], set->materials[k]);
+        }
+        else
+        {
+            other(object);
+        }
+    }
+}
+
+//! Moves every sphere of the list into one Sphere_set; other objects are kept as they are.
+template<typename T>
+Hittable_list<T> pack_spheres(const Hittable_list<T>& list)
+{
+    auto spheres = make_shared<Sphere_set<T>>();
+    Hittable_list<T> packed;
+    for_each_sphere(list,
+        [&](const Point3<T>& center, T radius, const shared_ptr<Material<T>>& m) { spheres->add(center, radius, m); },
+        [&](const shared_ptr<Hittable<T>>& object) { packed.add(object); });
+    if (spheres->size() > 0) packed.add(spheres);
+    return packed;
+}
+
+#endif
@@ -0,0 +1,221 @@
+// this file holds Static_scene, a scene whose primitive and material types are fixed at compile time,
+// so that finding the closest hit and shading it need no virtual calls and no shared_ptr copies
+
+#pragma once
+#ifndef STATIC_SCENE_H_
+#define STATIC_SCENE_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "integrator.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+//! A sphere that holds its material by value. M is the concrete material class; its members are
+//! called qualified, M::scatter rather than through the vtable, so the compiler binds and can
+//! inline them. Anything with the same four members can stand in a Static_scene beside it.
+template<typename T, typename M>
+struct Static_sphere
+{
+    using material_type = M;
+
+    Point3<T> center;
+    T radius;
+    M material;
+
+    Static_sphere(const Point3<T>& c, T r, const M& m) : center(c), radius(r), material(m) {}
+
+    //! The nearest root within [t_min, t_max], as Sphere::intersect finds it.
+    bool intersect(const Ray<T>& r, T t_min, T t_max, T& t) const
+    {
+        const Vector3<T> oc = r.origin() - center;
+        const T a = r.direction().norm_squared();
+        const T half_b = oc.dot(r.direction());
+        const T c = oc.norm_squared() - radius * radius;
+
+        const T discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) return false;
+        const T sqrtd = std::sqrt(discriminant);
+
+        T root = (-half_b - sqrtd) / a;
+        if (root < t_min || t_max < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || t_max < root)
+                return false;
+        }
+        t = root;
+        return true;
+    }
+
+    //! Fills everything of rec but mat_ptr, which static shading never reads.
+    void finalize(const Ray<T>& r, T t, hit_record<T>& rec) const
+    {
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, (rec.p - center) / radius);
+    }
+
+    bool scatter(const Ray<T>& r_in, const hit_record<T>& rec, Color<T>& attenuation, Ray<T>& scattered) const
+    {
+        return material.M::scatter(r_in, rec, attenuation, scattered);
+    }
+
+    Color<T> emitted(const hit_record<T>& rec) const { return material.M::emitted(rec); }
+};
+
+//! Which primitive a Static_scene hit: the array it is in and its place there.
+struct static_hit
+{
+    size_t kind;
+    size_t index;
+};
+
+//! Primitives kept in one std::vector per type, the types given as Primitives. Each needs
+//! intersect(r, t_min, t_max, t), finalize(r, t, rec), scatter and emitted as Static_sphere has them.
+//! The closest-hit search runs a plain loop over each array in turn, and shading picks the array
+//! by a switch the compiler generates, so nothing in the path is virtual.
+template<typename T, typename... Primitives>
+class Static_scene
+{
+public:
+    static constexpr size_t kinds = sizeof...(Primitives);
+
+    //! Adds p to the array of its type.
+    template<typename P>
+    void add(const P& p) { std::get<std::vector<P>>(arrays).push_back(p); }
+
+    template<typename P>
+    const std::vector<P>& primitives() const { return std::get<std::vector<P>>(arrays); }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for_each_array([&](const auto& array, size_t) { total += array.size(); });
+        return total;
+    }
+
+    //! Closest hit within [t_min, t_max] with its shading data, and which primitive it was.
+    bool hit(const Ray<T>& r, T t_min, T t_max, hit_record<T>& rec, static_hit& which) const
+    {
+        bool hit_anything = false;
+        T closest_so_far = t_max;
+        for_each_array([&](const auto& array, size_t kind) {
+            for (size_t i = 0; i < array.size(); ++i) {
+                T t;
+                if (array[i].intersect(r, t_min, closest_so_far, t)) {
+                    hit_anything = true;
+                    closest_so_far = t;
+                    which = static_hit{ kind, i };
+                }
+            }
+        });
+        if (hit_anything) visit(which, [&](const auto& p) { p.finalize(r, closest_so_far, rec); });
+        return hit_anything;
+    }
+
+    //! Returns f(p) for the primitive which names.
+    template<typename F>
+    auto visit(const static_hit& which, F&& f) const -> decltype(f(std::declval<const typename std::tuple_element<0, std::tuple<Primitives...>>::type&>()))
+    {
+        return visit_from(which, f, std::integral_constant<size_t, 0>());
+    }
+
+private:
+    template<typename F>
+    void for_each_array(F&& f) const { for_each_array(f, std::index_sequence_for<Primitives...>()); }
+
+    template<typename F, size_t... I>
+    void for_each_array(F& f, std::index_sequence<I...>) const
+    {
+        const int expand[] = { 0, (f(std::get<I>(arrays), I), 0)... };
+        (void)expand;
+    }
+
+    template<typename F, size_t I>
+    auto visit_from(const static_hit& which, F& f, std::integral_constant<size_t, I>) const
+        -> decltype(f(std::get<I>(std::declval<const std::tuple<std::vector<Primitives>...>&>())[0]))
+    {
+        if (which.kind == I) return f(std::get<I>(arrays)[which.index]);
+        return visit_from(which, f, std::integral_constant<size_t, I + 1>());
+    }
+
+    template<typename F>
+    auto visit_from(const static_hit& which, F& f, std::integral_constant<size_t, kinds - 1>) const
+        -> decltype(f(std::get<kinds - 1>(std::declval<const std::tuple<std::vector<Primitives>...>&>())[0]))
+    {
+        return f(std::get<kinds - 1>(arrays)[which.index]);
+    }
+
+private:
+    std::tuple<std::vector<Primitives>...> arrays;
+};
+
+//! The spheres of random_scene() and its variants: one array per material class.
+template<typename T>
+using Static_sphere_scene = Static_scene<T,
+    Static_sphere<T, Lambertian<T>>, Static_sphere<T, Metal<T>>, Static_sphere<T, Dielectric<T>>, Static_sphere<T, Diffuse_light<T>>>;
+
+//! Copies the spheres of list into a Static_sphere_scene. Throws std::runtime_error for anything
+//! the static scene has no array for: other objects, moving spheres, or materials of other classes.
+template<typename T>
+Static_sphere_scene<T> make_static_scene(const Hittable_list<T>& list)
+{
+    Static_sphere_scene<T> scene;
+    for (const auto& object : list.objects) {
+        auto sphere = std::dynamic_pointer_cast<Sphere<T>>(object);
+        if (!sphere || sphere->motion)
+            throw std::runtime_error("static scene: only unmoving spheres are supported");
+
+        const Material<T>& m = *sphere->mat_ptr;
+        if (typeid(m) == typeid(Lambertian<T>))
+            scene.add(Static_sphere<T, Lambertian<T>>(sphere->center, sphere->radius, static_cast<const Lambertian<T>&>(m)));
+        else if (typeid(m) == typeid(Metal<T>))
+            scene.add(Static_sphere<T, Metal<T>>(sphere->center, sphere->radius, static_cast<const Metal<T>&>(m)));
+        else if (typeid(m) == typeid(Dielectric<T>))
+            scene.add(Static_sphere<T, Dielectric<T>>(sphere->center, sphere->radius, static_cast<const Dielectric<T>&>(m)));
+        else if (typeid(m) == typeid(Diffuse_light<T>))
+            scene.add(Static_sphere<T, Diffuse_light<T>>(sphere->center, sphere->radius, static_cast<const Diffuse_light<T>&>(m)));
+        else
+            throw std::runtime_error(std::string("static scene: unsupported material ") + typeid(m).name());
+    }
+    return scene;
+}
+
+//! ray_color over a Static_scene: the same path tracer, with every call inside it resolved at
+//! compile time. Overload resolution picks it wherever ray_color is called with a static scene.
+template<typename T, typename... Primitives>
+Color<T> ray_color(const Ray<T>& r, const Static_scene<T, Primitives...>& world, int depth,
+    const background_fn<T>& background = &sky_background<T>)
+{
+    if (depth <= 0) return Color<T>::zero();
+
+    hit_record<T> rec;
+    static_hit which;
+    if (world.hit(r, 0.0001, MAX_DOUBLE, rec, which)) {
+        Ray<T> scattered;
+        Color<T> attenuation;
+        Color<T> emitted;
+        const bool scatters = world.visit(which, [&](const auto& p) {
+            emitted = p.emitted(rec);
+            return p.scatter(r, rec, attenuation, scattered);
+        });
+        if (scatters)
+            return emitted + attenuation * ray_color(scattered, world, depth - 1, background);
+        return emitted;
+    }
+    return background(r);
+}
+
+#endif
@@ -0,0 +1,189 @@
+// this file holds the per-tile record of which primitives a render saw, so that after a scene edit
+// only the tiles the edit can change are rendered again
+
+#pragma once
+#ifndef TILE_DEPENDENCIES_H_
+#define TILE_DEPENDENCIES_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "aabb.h"
+#include "camera.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+//! Identity of the primitive a candidate names, the same every time intersect reports it. inner is
+//! left out, being set only by Instance; primitives of different objects in one instance may share
+//! a key, which costs no more than a false positive of the filters below.
+template<typename T>
+std::uint64_t primitive_key(const hit_candidate<T>& candidate)
+{
+    std::uint64_t h = reinterpret_cast<std::uintptr_t>(candidate.object) ^ (static_cast<std::uint64_t>(candidate.primitive) << 20);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+//! One Bloom filter per tile over the keys of the primitives hit anywhere along the paths of its
+//! samples. A filter never misses a recorded primitive; it may claim one it has not seen, which only
+//! costs a tile rendered again for nothing. Render_job fills it when render_settings::dependencies
+//! points here and the integrator traces a Tracked_hittable.
+class Tile_dependencies
+{
+public:
+    //! filter_bits is rounded up to a power of two of at least 64.
+    Tile_dependencies(int width, int height, int tile_size, size_t filter_bits = 2048)
+        : width(width), height(height), tile_size(tile_size),
+        tiles_x((width + tile_size - 1) / tile_size), tiles_y((height + tile_size - 1) / tile_size)
+    {
+        words_per_tile = 1;
+        while (words_per_tile * 64 < filter_bits) words_per_tile *= 2;
+        words.assign(static_cast<size_t>(tile_count()) * words_per_tile, 0);
+    }
+
+    int tile_count() const { return tiles_x * tiles_y; }
+
+    //! Tiles in a row; tile k is column k % tiles_across(), row k / tiles_across() from the bottom.
+    int tiles_across() const { return tiles_x; }
+
+    size_t memory_bytes() const { return words.size() * sizeof(std::uint64_t); }
+
+    void clear() { std::fill(words.begin(), words.end(), 0); }
+
+    void clear(int tile) { std::fill_n(words.begin() + tile * words_per_tile, words_per_tile, 0); }
+
+    //! Only one thread may record into a tile at a time; Render_job renders every tile on one thread.
+    void record(int tile, std::uint64_t key)
+    {
+        std::uint64_t* filter = &words[tile * words_per_tile];
+        for_each_bit(key, [&](size_t bit) { filter[bit / 64] |= std::uint64_t(1) << (bit % 64); });
+    }
+
+    bool may_contain(int tile, std::uint64_t key) const
+    {
+        const std::uint64_t* filter = &words[tile * words_per_tile];
+        bool all = true;
+        for_each_bit(key, [&](size_t bit) { all = all && (filter[bit / 64] >> (bit % 64) & 1); });
+        return all;
+    }
+
+    //! Mean fraction of set bits; with k hashes about fill^k of absent keys are claimed by a tile.
+    double fill() const
+    {
+        size_t set = 0;
+        for (std::uint64_t w : words)
+            for (; w; w &= w - 1) ++set;
+        return words.empty() ? 0 : static_cast<double>(set) / (words.size() * 64);
+    }
+
+    //! Marks the tiles any of keys may have been seen in.
+    void mark_tiles_seeing(const std::vector<std::uint64_t>& keys, std::vector<char>& tiles) const
+    {
+        tiles.resize(tile_count(), 0);
+        for (int tile = 0; tile < tile_count(); ++tile)
+            for (std::uint64_t key : keys)
+                if (!tiles[tile] && may_contain(tile, key)) tiles[tile] = 1;
+    }
+
+    //! Marks the tiles the projection of box covers, grown by margin tiles on every side for the shadow
+    //! and defocus blur around it. A box reaching behind the camera marks every tile.
+    template<typename T>
+    void mark_tiles_covering(const Camera<T>& cam, const Aabb<T>& box, int margin, std::vector<char>& tiles) const
+    {
+        tiles.resize(tile_count(), 0);
+        T s_min = std::numeric_limits<T>::max(), s_max = std::numeric_limits<T>::lowest();
+        T t_min = s_min, t_max = s_max;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const Point3<T> p(corner & 1 ? box.maximum.x : box.minimum.x, corner & 2 ? box.maximum.y : box.minimum.y,
+                corner & 4 ? box.maximum.z : box.minimum.z);
+            T s, t;
+            if (!cam.project(p, s, t))
+            {
+                std::fill(tiles.begin(), tiles.end(), 1);
+                return;
+            }
+            s_min = std::min(s_min, s); s_max = std::max(s_max, s);
+            t_min = std::min(t_min, t); t_max = std::max(t_max, t);
+        }
+        // Pixel i samples s in [i, i + 1) / (width - 1), see Render_job::render_tile.
+        auto tile_of = [&](T coordinate, int pixels, int tiles) {
+            const T pixel = std::floor(coordinate * (pixels - 1));
+            return static_cast<int>(clamp(pixel / tile_size, T(-1), static_cast<T>(tiles)));
+        };
+        const int x0 = std::max(tile_of(s_min, width, tiles_x) - margin, 0), x1 = std::min(tile_of(s_max, width, tiles_x) + margin, tiles_x - 1);
+        const int y0 = std::max(tile_of(t_min, height, tiles_y) - margin, 0), y1 = std::min(tile_of(t_max, height, tiles_y) + margin, tiles_y - 1);
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x)
+                tiles[y * tiles_x + x] = 1;
+    }
+
+private:
+    // Three bits from two halves of the key by double hashing.
+    template<typename F>
+    void for_each_bit(std::uint64_t key, const F& f) const
+    {
+        const size_t bits = words_per_tile * 64;
+        const std::uint64_t step = (key >> 32) | 1;
+        for (int k = 0; k < 3; ++k)
+            f(static_cast<size_t>(key + k * step) & (bits - 1));
+    }
+
+    int width, height, tile_size;
+    int tiles_x, tiles_y;
+    size_t words_per_tile;
+    std::vector<std::uint64_t> words;
+};
+
+//! Where the intersections of the current thread are recorded: the tile being rendered and how many
+//! more closest-hit searches count. Render_job allows every vertex of a path, max_depth per camera
+//! sample; shadow rays use occluded and are never recorded.
+struct dependency_sink
+{
+    Tile_dependencies* dependencies = nullptr;
+    int tile = 0;
+    int remaining = 0;
+};
+
+inline dependency_sink& current_dependency_sink()
+{
+    thread_local dependency_sink sink;
+    return sink;
+}
+
+//! A world whose closest hits are recorded into the current thread's dependency_sink. Everything
+//! else is passed through to the wrapped object, which must outlive the wrapper.
+template<typename T>
+class Tracked_hittable : public Hittable<T>
+{
+public:
+    explicit Tracked_hittable(const Hittable<T>& world) : world(world) {}
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        if (!world.intersect(r, t_min, t_max, candidate)) return false;
+        dependency_sink& sink = current_dependency_sink();
+        if (sink.dependencies && sink.remaining > 0)
+        {
+            --sink.remaining;
+            sink.dependencies->record(sink.tile, primitive_key(candidate));
+        }
+        return true;
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override { return world.occluded(r, t_min, t_max); }
+
+    virtual bool bounding_box(Aabb<T>& box) const override { return world.bounding_box(box); }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override { world.memory_blocks(f); }
+
+private:
+    const Hittable<T>& world;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#pragma once
+#ifndef TRANSFORM_H_
+#define TRANSFORM_H_
+
+#include "utilities.h"
+#include "vector3.h"
+#include "aabb.h"
+
+#include <cmath>
+
+//! x -> M x + offset, with M an invertible 3x3 matrix.
+template<typename T>
+class Affine_transform
+{
+public:
+    Affine_transform() : offset(0, 0, 0)
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j) m[i][j] = i == j ? T(1) : T(0);
+    }
+
+    static Affine_transform translation(const Vector3<T>& v)
+    {
+        Affine_transform a;
+        a.offset = v;
+        return a;
+    }
+
+    static Affine_transform scaling(T sx, T sy, T sz)
+    {
+        Affine_transform a;
+        a.m[0][0] = sx;
+        a.m[1][1] = sy;
+        a.m[2][2] = sz;
+        return a;
+    }
+
+    static Affine_transform scaling(T s) { return scaling(s, s, s); }
+
+    //! Rotation by degrees counterclockwise about axis, looking against it.
+    static Affine_transform rotation(const Vector3<T>& axis, T degrees)
+    {
+        const Vector3<T> u = axis.normalized();
+        const T theta = degrees_to_radians<T>(degrees);
+        const T c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+
+        Affine_transform a;
+        a.m[0][0] = c + u.x * u.x * k;       a.m[0][1] = u.x * u.y * k - u.z * s; a.m[0][2] = u.x * u.z * k + u.y * s;
+        a.m[1][0] = u.y * u.x * k + u.z * s; a.m[1][1] = c + u.y * u.y * k;       a.m[1][2] = u.y * u.z * k - u.x * s;
+        a.m[2][0] = u.z * u.x * k - u.y * s; a.m[2][1] = u.z * u.y * k + u.x * s; a.m[2][2] = c + u.z * u.z * k;
+        return a;
+    }
+
+    //! The transform that applies rhs first, then this.
+    Affine_transform operator*(const Affine_transform& rhs) const
+    {
+        Affine_transform a;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                a.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j];
+        a.offset = vector(rhs.offset) + offset;
+        return a;
+    }
+
+    Affine_transform inverse() const
+    {
+        Affine_transform a;
+        const T det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        const T inv_det = 1 / det;
+        a.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        a.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        a.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        a.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        a.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        a.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        a.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        a.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        a.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+        a.offset = -a.vector(offset);
+        return a;
+    }
+
+    Point3<T> point(const Point3<T>& p) const { return vector(p) + offset; }
+
+    Vector3<T> vector(const Vector3<T>& v) const
+    {
+        return Vector3<T>(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    //! Maps a normal by the transposed matrix. Called on the inverse transform, this carries normals
+    //! the same way point() of the forward transform carries points.
+    Vector3<T> transposed_vector(const Vector3<T>& n) const
+    {
+        return Vector3<T>(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+            m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+            m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+
+    //! Tightest box around the transformed box, taking the extremes of each matrix entry's term (Arvo).
+    Aabb<T> bounds(const Aabb<T>& box) const
+    {
+        Aabb<T> result(offset, offset);
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                const T a = m[i][j] * box.minimum[j];
+                const T b = m[i][j] * box.maximum[j];
+                result.minimum[i] += std::fmin(a, b);
+                result.maximum[i] += std::fmax(a, b);
+            }
+        }
+        return result;
+    }
+
+public:
+    T m[3][3];
+    Vector3<T> offset;
+};
+
+#endif
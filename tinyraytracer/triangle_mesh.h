@@ -0,0 +1,186 @@
+// this file holds the indexed triangle mesh, the primitive set for loaded assets
+
+#pragma once
+#ifndef TRIANGLE_MESH_H_
+#define TRIANGLE_MESH_H_
+
+#include "aabb.h"
+#include "hittable.h"
+#include "simd_kernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+//! Triangles as three indices each into a vertex buffer of float positions. Both buffers are held
+//! through shared pointers, so copies of a mesh, such as the one a Wide_bvh keeps, share the vertices
+//! and only get indices of their own once permute() reorders them. Costs 12 bytes per triangle plus
+//! 12 per vertex; normals are the geometric ones of the triangles.
+template<typename T>
+class Triangle_mesh : public Hittable<T>
+{
+public:
+    //! Triangles at most tested per kernel call; a Bvh leaf never holds more.
+    static constexpr size_t batch_size = 16;
+
+    Triangle_mesh() : positions(std::make_shared<std::vector<float>>()), indices(std::make_shared<std::vector<std::uint32_t>>()) {}
+
+    //! positions holds x, y, z per vertex and indices three vertex numbers per triangle.
+    Triangle_mesh(std::vector<float> positions, std::vector<std::uint32_t> indices, shared_ptr<Material<T>> m)
+        : positions(std::make_shared<std::vector<float>>(std::move(positions))),
+        indices(std::make_shared<std::vector<std::uint32_t>>(std::move(indices))), material(std::move(m))
+    {}
+
+    size_t size() const { return indices->size() / 3; }
+    size_t vertex_count() const { return positions->size() / 3; }
+
+    const std::vector<float>& vertex_buffer() const { return *positions; }
+    const std::vector<std::uint32_t>& index_buffer() const { return *indices; }
+
+    void set_material(shared_ptr<Material<T>> m) { material = std::move(m); }
+
+    size_t memory_bytes() const
+    {
+        return positions->size() * sizeof(float) + indices->size() * sizeof(std::uint32_t);
+    }
+
+    Point3<T> vertex(std::uint32_t v) const
+    {
+        const float* p = positions->data() + 3 * static_cast<size_t>(v);
+        return Point3<T>(p[0], p[1], p[2]);
+    }
+
+    Point3<T> corner(size_t k, int c) const { return vertex((*indices)[3 * k + c]); }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        return intersect_range(0, size(), r, t_min, t_max, candidate);
+    }
+
+    virtual void finalize(const Ray<T>& r, const hit_candidate<T>& candidate, hit_record<T>& rec) const override
+    {
+        const Point3<T> v0 = corner(candidate.primitive, 0);
+        const Vector3<T> n = (corner(candidate.primitive, 1) - v0).cross(corner(candidate.primitive, 2) - v0);
+        rec.t = candidate.t;
+        rec.p = r.at(candidate.t);
+        rec.set_face_normal(r, n.normalized());
+        rec.mat_ptr = material;
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        return occluded_range(0, size(), r, t_min, t_max);
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        box = Aabb<T>();
+        for (size_t v = 0; v < vertex_count(); ++v) box.expand(vertex(static_cast<std::uint32_t>(v)));
+        return size() > 0;
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        f(positions->data(), positions->size() * sizeof(float));
+        f(indices->data(), indices->size() * sizeof(std::uint32_t));
+    }
+
+    // The primitive interface the acceleration structures are built over.
+
+    Aabb<T> bounds(size_t k) const
+    {
+        Aabb<T> box;
+        for (int c = 0; c < 3; ++c) box.expand(corner(k, c));
+        return box;
+    }
+
+    Point3<T> centroid(size_t k) const { return bounds(k).center(); }
+
+    //! Nearest hit among the triangles [first, first + count). The triangles are gathered from the
+    //! buffers into structure of arrays, batch_size at a time, for the SIMD kernel.
+    bool intersect_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        bool hit_anything = false;
+        for (size_t begin = first; begin < first + count; begin += batch_size)
+        {
+            const size_t n = std::min(batch_size, first + count - begin);
+            batch b;
+            gather(begin, n, b);
+            T t;
+            const ptrdiff_t k = closest_triangle_hit(b.soa(n), o, d, t_min, t_max, t);
+            if (k < 0) continue;
+
+            hit_anything = true;
+            t_max = t;
+            candidate.t = t;
+            candidate.object = this;
+            candidate.primitive = begin + static_cast<size_t>(k);
+        }
+        return hit_anything;
+    }
+
+    //! Whether any of the triangles [first, first + count) is hit, stopping at the first one found.
+    bool occluded_range(size_t first, size_t count, const Ray<T>& r, T t_min, T t_max) const
+    {
+        const T o[3] = { r.orig.x, r.orig.y, r.orig.z };
+        const T d[3] = { r.dir.x, r.dir.y, r.dir.z };
+        for (size_t begin = first; begin < first + count; begin += batch_size)
+        {
+            const size_t n = std::min(batch_size, first + count - begin);
+            batch b;
+            gather(begin, n, b);
+            if (any_triangle_hit(b.soa(n), o, d, t_min, t_max)) return true;
+        }
+        return false;
+    }
+
+    //! Reorders the triangles so that the new triangle k is the old triangle order[k]. The vertex
+    //! buffer stays as it is and shared.
+    void permute(const std::vector<size_t>& order)
+    {
+        const std::vector<std::uint32_t>& old = *indices;
+        auto sorted = std::make_shared<std::vector<std::uint32_t>>(old.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, order.size(), 4096), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t k = range.begin(); k != range.end(); ++k)
+                    for (int c = 0; c < 3; ++c) (*sorted)[3 * k + c] = old[3 * order[k] + c];
+            });
+        indices = std::move(sorted);
+    }
+
+private:
+    struct batch
+    {
+        T v0[3][batch_size], e1[3][batch_size], e2[3][batch_size];
+
+        triangle_soa<T> soa(size_t n) const
+        {
+            return triangle_soa<T>{ { v0[0], v0[1], v0[2] }, { e1[0], e1[1], e1[2] }, { e2[0], e2[1], e2[2] }, n };
+        }
+    };
+
+    void gather(size_t first, size_t n, batch& b) const
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            const Point3<T> p0 = corner(first + i, 0), p1 = corner(first + i, 1), p2 = corner(first + i, 2);
+            for (int a = 0; a < 3; ++a)
+            {
+                b.v0[a][i] = p0[a];
+                b.e1[a][i] = p1[a] - p0[a];
+                b.e2[a][i] = p2[a] - p0[a];
+            }
+        }
+    }
+
+private:
+    std::shared_ptr<const std::vector<float>> positions;
+    std::shared_ptr<const std::vector<std::uint32_t>> indices;
+    shared_ptr<Material<T>> material;
+};
+
+#endif
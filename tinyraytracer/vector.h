@@ -5,10 +5,132 @@
 #include<array>
 #include<cmath>
 #include<cassert>
+#include<functional>
+#include<initializer_list>
 #include<iostream>
+#include<limits>
+#include<type_traits>
+#include<utility>
 
 template <typename T, std::size_t N>
-class Vector final
+class Vector;
+
+// Element i of an expression reads only element i of its operands, so the loop assigning one to a
+// vector carries no dependence even when that vector is also an operand. Saying so lets the compiler
+// vectorize the loop without first checking the operands for overlap.
+#if defined(__clang__)
+#define TRT_IVDEP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define TRT_IVDEP _Pragma("GCC ivdep")
+#elif defined(_MSC_VER)
+#define TRT_IVDEP __pragma(loop(ivdep))
+#else
+#define TRT_IVDEP
+#endif
+
+//! Base of everything that gives N values of T one index at a time: Vector itself and the unevaluated
+//! results of its operators. E is the class deriving from it. An expression such as a * s + b - c is a
+//! tree of these holding its operands; nothing is computed until it is assigned to a Vector, which
+//! then runs a single loop asking the tree for each element in turn, with no temporary vectors.
+//!
+//! Operand vectors are held by reference, so an expression must not outlive them: store results
+//! in a Vector rather than in auto when the operands are temporaries.
+template <typename T, std::size_t N, typename E>
+class Vector_expression
+{
+public:
+	//! Returns the size of the vector.
+	static constexpr size_t size() { return N; }
+
+	//! Returns the \p i -th element.
+	constexpr T operator[](size_t i) const { return static_cast<const E&>(*this)[i]; }
+
+	//! Returns the actual expression.
+	constexpr const E& operator()() const { return static_cast<const E&>(*this); }
+};
+
+//! How an expression keeps an operand: vectors by reference, the small expression nodes by value, so
+//! that the nodes a compound expression builds for its parts can be temporaries.
+template <typename E>
+struct vector_operand
+{
+	using type = const E;
+};
+
+template <typename T, std::size_t N>
+struct vector_operand<Vector<T, N>>
+{
+	using type = const Vector<T, N>&;
+};
+
+//! Op applied to every element of an expression.
+template <typename T, std::size_t N, typename E, typename Op>
+class Vector_unary_op : public Vector_expression<T, N, Vector_unary_op<T, N, E, Op>>
+{
+public:
+	constexpr explicit Vector_unary_op(const E& u) : _u(u) {}
+
+	constexpr T operator[](size_t i) const { return Op()(_u[i]); }
+
+private:
+	typename vector_operand<E>::type _u;
+};
+
+//! Op applied to the elements of two expressions pairwise.
+template <typename T, std::size_t N, typename E1, typename E2, typename Op>
+class Vector_binary_op : public Vector_expression<T, N, Vector_binary_op<T, N, E1, E2, Op>>
+{
+public:
+	constexpr Vector_binary_op(const E1& u, const E2& v) : _u(u), _v(v) {}
+
+	constexpr T operator[](size_t i) const { return Op()(_u[i], _v[i]); }
+
+private:
+	typename vector_operand<E1>::type _u;
+	typename vector_operand<E2>::type _v;
+};
+
+//! Op applied to every element of an expression and a scalar, the element first.
+template <typename T, std::size_t N, typename E, typename Op>
+class Vector_scalar_op : public Vector_expression<T, N, Vector_scalar_op<T, N, E, Op>>
+{
+public:
+	constexpr Vector_scalar_op(const E& u, const T& s) : _u(u), _s(s) {}
+
+	constexpr T operator[](size_t i) const { return Op()(_u[i], _s); }
+
+private:
+	typename vector_operand<E>::type _u;
+	T _s;
+};
+
+//! Op applied to a scalar and every element of an expression, the scalar first.
+template <typename T, std::size_t N, typename E, typename Op>
+class Scalar_vector_op : public Vector_expression<T, N, Scalar_vector_op<T, N, E, Op>>
+{
+public:
+	constexpr Scalar_vector_op(const T& s, const E& u) : _s(s), _u(u) {}
+
+	constexpr T operator[](size_t i) const { return Op()(_s, _u[i]); }
+
+private:
+	T _s;
+	typename vector_operand<E>::type _u;
+};
+
+//! True when every type in Params is arithmetic.
+template <typename... Params>
+struct all_arithmetic : std::true_type {};
+
+template <typename P, typename... Params>
+struct all_arithmetic<P, Params...>
+	: std::integral_constant<bool, std::is_arithmetic<P>::value && all_arithmetic<Params...>::value> {};
+
+//! Static-sized vector of N elements. Used for the quantities that are not three components, such as
+//! spectral samples and accumulated AOVs; the arithmetic operators build Vector_expression trees, see
+//! above, so sums of scaled vectors compile to one loop over the elements.
+template <typename T, std::size_t N>
+class Vector final : public Vector_expression<T, N, Vector<T, N>>
 {
 public:
 	static_assert(
@@ -19,11 +141,16 @@ public:
 		"Vector only can be instantiated with floating point types");
 
 	//! Construct a vector with zeros.
-	Vector();
+	constexpr Vector() : _elements{} {}
 
 	//! Construct vector instance with parameters.
-	template <typename... Params>
-	explicit Vector(Params... params);
+	template <typename... Params,
+		typename = typename std::enable_if<sizeof...(Params) == N && all_arithmetic<Params...>::value>::type>
+	constexpr explicit Vector(Params... params) : _elements{ { static_cast<T>(params)... } } {}
+
+	//! Construct vector instance by evaluating expression e.
+	template <typename E>
+	constexpr Vector(const Vector_expression<T, N, E>& e) : Vector(e(), std::make_index_sequence<N>()) {}
 
 	//! Set all elements to  s.
 	void set(const T& s);
@@ -37,7 +164,7 @@ public:
 	void set(const std::initializer_list<U>& lst);
 
 	//! Copy constructor.
-	Vector(const Vector& other);
+	constexpr Vector(const Vector& other) : _elements(other._elements) {}
 
 	//! Swaps the content of the vector with \p other vector.
 	void swap(Vector& other);
@@ -46,10 +173,10 @@ public:
 	void setZero();
 
 	//! Returns the size of the vector.
-	constexpr size_t size() const;
+	static constexpr size_t size() { return N; }
 
 	//! Returns the const reference to the \p i -th element.
-	const T& operator[](size_t i) const;
+	constexpr const T& operator[](size_t i) const;
 
 	//! Returns the reference to the \p i -th element.
 	T& operator[](size_t i);
@@ -58,28 +185,30 @@ public:
 	T* data();
 
 	//! Returns the const raw pointer to the vector data.
-	const T* const data() const;
+	const T* data() const;
 
 	//! Set vector instance with initializer list.
 	template <typename U>
 	Vector& operator=(const std::initializer_list<U>& lst);
 
-	//! Set vector with expression template.
 	Vector& operator=(const Vector& other);
 
-	Vector operator+(const Vector& other) const;
-	Vector operator-(const Vector& other) const;
-	
-	Vector& operator+=(const Vector& other);
-	Vector& operator-=(const Vector& other);
+	//! Set vector with expression template: one pass over the elements.
+	template <typename E>
+	Vector& operator=(const Vector_expression<T, N, E>& e);
+
+	template <typename E>
+	Vector& operator+=(const Vector_expression<T, N, E>& e);
+	template <typename E>
+	Vector& operator-=(const Vector_expression<T, N, E>& e);
+	template <typename E>
+	Vector& operator*=(const Vector_expression<T, N, E>& e);
+	template <typename E>
+	Vector& operator/=(const Vector_expression<T, N, E>& e);
 
 	//! Compute dot product.
-	T dot(const Vector& v) const;
-	
-	Vector operator+(const T& s) const;
-	Vector operator-(const T& s) const;
-	Vector operator*(const T& s) const;
-	Vector operator/(const T& s) const;
+	template <typename E>
+	constexpr T dot(const Vector_expression<T, N, E>& v) const;
 
 	Vector& operator+=(const T& s);
 	Vector& operator-=(const T& s);
@@ -96,7 +225,7 @@ public:
 
 	//! Compute norm and square of norm.
 	T norm() const;
-	T norm_squared() const;
+	constexpr T norm_squared() const;
 
 	//! Normalizes this vector.
 	void normalize();
@@ -112,34 +241,13 @@ public:
 private:
 	std::array<T, N> _elements;
 
-	template <typename... Params>
-	void setAt(size_t i, T v, Params... params);
-	
-	void setAt(size_t i, T v);
+	template <typename E, std::size_t... I>
+	constexpr Vector(const E& e, std::index_sequence<I...>) : _elements{ { e[I]... } } {}
 };
 
 
 
 
-template<typename T, std::size_t N>
-inline Vector<T, N>::Vector()
-{
-	std::cout << "construct with 0\n";
-	for (auto& elem : _elements)
-	{
-		elem = static_cast<T>(0);
-	}
-}
-
-template<typename T, std::size_t N>
-template<typename ...Params>
-inline Vector<T, N>::Vector(Params ...params)
-{
-	static_assert(sizeof...(params) == N, "Invalid number of parameters.");
-
-	setAt(0, params...);
-}
-
 template<typename T, std::size_t N>
 inline void Vector<T, N>::set(const T& s)
 {
@@ -151,7 +259,6 @@ template<typename T, std::size_t N>
 template<typename U>
 inline Vector<T, N>::Vector(const std::initializer_list<U>& lst)
 {
-	std::cout << "construct with initializer list\n";
 	set(lst);
 }
 
@@ -162,18 +269,13 @@ inline void Vector<T, N>::set(const std::initializer_list<U>& lst)
 	assert(lst.size() >= N);
 
 	size_t i = 0;
-	for (const auto& inputElem : lst) 
+	for (const auto& inputElem : lst)
 	{
 		_elements[i] = static_cast<T>(inputElem);
 		++i;
 	}
 }
 
-template<typename T, std::size_t N>
-inline Vector<T, N>::Vector(const Vector& other): _elements(other._elements)
-{
-}
-
 template<typename T, std::size_t N>
 inline void Vector<T, N>::swap(Vector& other)
 {
@@ -187,22 +289,14 @@ inline void Vector<T, N>::setZero()
 }
 
 template<typename T, std::size_t N>
-inline constexpr size_t Vector<T, N>::size() const
+inline constexpr const T& Vector<T, N>::operator[](size_t i) const
 {
-	return N;
-}
-
-template<typename T, std::size_t N>
-inline const T& Vector<T, N>::operator[](size_t i) const
-{
-	// TODO: ڴ˴ return 
 	return _elements[i];
 }
 
 template<typename T, std::size_t N>
 inline T& Vector<T, N>::operator[](size_t i)
 {
-	// TODO: ڴ˴ return 
 	return _elements[i];
 }
 
@@ -213,7 +307,7 @@ inline T* Vector<T, N>::data()
 }
 
 template<typename T, std::size_t N>
-inline const T* const Vector<T, N>::data() const
+inline const T* Vector<T, N>::data() const
 {
 	return _elements.data();
 }
@@ -222,7 +316,6 @@ template<typename T, std::size_t N>
 template<typename U>
 inline Vector<T, N>& Vector<T, N>::operator=(const std::initializer_list<U>& lst)
 {
-	// TODO: ڴ˴ return 
 	assert(lst.size() == N);
 
 	set(lst);
@@ -232,129 +325,85 @@ inline Vector<T, N>& Vector<T, N>::operator=(const std::initializer_list<U>& lst
 template<typename T, std::size_t N>
 inline Vector<T,N>& Vector<T, N>::operator=(const Vector& other)
 {
-	// TODO: ڴ˴ return 
-	assert(other.size() == N);
-
-	for (std::size_t i=0; i<N; i++)
-	{
-		_elements[i] = other._elements[i];
-	}
+	_elements = other._elements;
 	return *this;
 }
 
+// Every element i of the result reads only element i of each operand, so assigning an expression
+// that uses this vector itself, as in a = b - a, is safe without a temporary.
 template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator+(const Vector& other) const
-{
-	assert(other.size() == N);
-	
-	Vector result(other);
-	for (std::size_t i =0; i < N; i++)
-	{
-		result._elements[i] += _elements[i];
-	}
-
-	return result;
-}
-
-template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator-(const Vector& other) const
-{
-	assert(other.size() == N);
-
-	Vector result(other);
-	for (std::size_t i = 0; i < N; i++)
-	{
-		result._elements[i] -= _elements[i];
-	}
-
-	return result;
-}
-
-template<typename T, std::size_t N>
-inline Vector<T,N>& Vector<T, N>::operator+=(const Vector& other)
+template<typename E>
+inline Vector<T, N>& Vector<T, N>::operator=(const Vector_expression<T, N, E>& e)
 {
-	// TODO: ڴ˴ return 
-	assert(other.size() == N);
-
+	const E& expression = e();
+	TRT_IVDEP
 	for (std::size_t i = 0; i < N; ++i)
 	{
-		_elements[i] += other[i];
+		_elements[i] = expression[i];
 	}
-
 	return *this;
 }
 
 template<typename T, std::size_t N>
-inline Vector<T,N>& Vector<T, N>::operator-=(const Vector& other)
+template<typename E>
+inline Vector<T, N>& Vector<T, N>::operator+=(const Vector_expression<T, N, E>& e)
 {
-	// TODO: ڴ˴ return 
-	assert(other.size() == N);
-
+	const E& expression = e();
+	TRT_IVDEP
 	for (std::size_t i = 0; i < N; ++i)
 	{
-		_elements[i] -= other[i];
+		_elements[i] += expression[i];
 	}
-
 	return *this;
 }
 
 template<typename T, std::size_t N>
-inline T Vector<T, N>::dot(const Vector& v) const
-{
-	assert(v.size() == N);
-
-	T result = 0;
-	for (std::size_t i = 0; i < N; i++)
-	{
-		result += (_elements[i] * v[i]);
-	}
-
-	return result;
-}
-
-template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator+(const T& s) const
+template<typename E>
+inline Vector<T, N>& Vector<T, N>::operator-=(const Vector_expression<T, N, E>& e)
 {
-	Vector result(*this);
-	for (std::size_t i = 0; i < N; i++)
+	const E& expression = e();
+	TRT_IVDEP
+	for (std::size_t i = 0; i < N; ++i)
 	{
-		result[i] += s;
+		_elements[i] -= expression[i];
 	}
-
-	return result;
+	return *this;
 }
 
 template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator-(const T& s) const
+template<typename E>
+inline Vector<T, N>& Vector<T, N>::operator*=(const Vector_expression<T, N, E>& e)
 {
-	Vector result(*this);
-	for (std::size_t i = 0; i < N; i++)
+	const E& expression = e();
+	TRT_IVDEP
+	for (std::size_t i = 0; i < N; ++i)
 	{
-		result[i] -= s;
+		_elements[i] *= expression[i];
 	}
-
-	return result;
+	return *this;
 }
 
 template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator*(const T& s) const
+template<typename E>
+inline Vector<T, N>& Vector<T, N>::operator/=(const Vector_expression<T, N, E>& e)
 {
-	Vector result(*this);
-	for (std::size_t i = 0; i < N; i++)
+	const E& expression = e();
+	TRT_IVDEP
+	for (std::size_t i = 0; i < N; ++i)
 	{
-		result[i] *= s;
+		_elements[i] /= expression[i];
 	}
-
-	return result;
+	return *this;
 }
 
 template<typename T, std::size_t N>
-inline Vector<T,N> Vector<T, N>::operator/(const T& s) const
+template<typename E>
+inline constexpr T Vector<T, N>::dot(const Vector_expression<T, N, E>& v) const
 {
-	Vector result(*this);
+	T result = 0;
 	for (std::size_t i = 0; i < N; i++)
 	{
-		result[i] /= s;
+		result += (_elements[i] * v()[i]);
 	}
 
 	return result;
@@ -363,7 +412,6 @@ inline Vector<T,N> Vector<T, N>::operator/(const T& s) const
 template<typename T, std::size_t N>
 inline Vector<T,N>& Vector<T, N>::operator+=(const T& s)
 {
-	// TODO: ڴ˴ return 
 	for (std::size_t i = 0; i < N; ++i)
 	{
 		_elements[i] += s;
@@ -375,7 +423,6 @@ inline Vector<T,N>& Vector<T, N>::operator+=(const T& s)
 template<typename T, std::size_t N>
 inline Vector<T,N>& Vector<T, N>::operator-=(const T& s)
 {
-	// TODO: ڴ˴ return 
 	for (std::size_t i = 0; i < N; ++i)
 	{
 		_elements[i] -= s;
@@ -387,7 +434,6 @@ inline Vector<T,N>& Vector<T, N>::operator-=(const T& s)
 template<typename T, std::size_t N>
 inline Vector<T,N>& Vector<T, N>::operator*=(const T& s)
 {
-	// TODO: ڴ˴ return 
 	for (std::size_t i = 0; i < N; ++i)
 	{
 		_elements[i] *= s;
@@ -399,7 +445,6 @@ inline Vector<T,N>& Vector<T, N>::operator*=(const T& s)
 template<typename T, std::size_t N>
 inline Vector<T,N>& Vector<T, N>::operator/=(const T& s)
 {
-	// TODO: ڴ˴ return 
 	for (std::size_t i = 0; i < N; ++i)
 	{
 		_elements[i] /= s;
@@ -415,7 +460,7 @@ inline T Vector<T, N>::norm() const
 }
 
 template<typename T, std::size_t N>
-inline T Vector<T, N>::norm_squared() const
+inline constexpr T Vector<T, N>::norm_squared() const
 {
 	return dot(*this);
 }
@@ -429,25 +474,19 @@ inline void Vector<T, N>::normalize()
 template<typename T, std::size_t N>
 inline Vector<T,N> Vector<T, N>::normalized() const
 {
-	return Vector(*this) / this->norm();
-}
-
-template<typename T, std::size_t N>
-inline void Vector<T, N>::setAt(size_t i, T v)
-{
-	_elements[i] = v;
+	return *this / norm();
 }
 
 template<typename T, std::size_t N>
 template<typename E>
 inline bool Vector<T, N>::operator==(const E& other) const
 {
-	if (N != other.size()) 
+	if (N != other.size())
 	{
 		return false;
 	}
 
-	for (size_t i = 0; i < N; ++i) 
+	for (size_t i = 0; i < N; ++i)
 	{
 		if (_elements[i] != other[i])
 		{
@@ -468,12 +507,12 @@ template<typename T, std::size_t N>
 template<typename E>
 inline bool Vector<T, N>::is_similar(const E& other, T epsilon) const
 {
-	if (N != other.size()) 
+	if (N != other.size())
 	{
 		return false;
 	}
 
-	for (size_t i = 0; i < N; ++i) 
+	for (size_t i = 0; i < N; ++i)
 	{
 		if (std::fabs(_elements[i] - other[i]) > epsilon) {
 			return false;
@@ -483,37 +522,95 @@ inline bool Vector<T, N>::is_similar(const E& other, T epsilon) const
 }
 
 
-template<typename T, std::size_t N>
-template<typename ...Params>
-inline void Vector<T, N>::setAt(size_t i, T v, Params ...params)
+// Operators on expressions. Each returns the unevaluated node for its operation; scalars are taken
+// as T whatever their type, so v * 2 works for a vector of double.
+
+template<typename T>
+struct vector_scalar
+{
+	using type = T;
+};
+
+//! Negative sign operator.
+template<typename T, std::size_t N, typename E>
+inline constexpr Vector_unary_op<T, N, E, std::negate<T>> operator-(const Vector_expression<T, N, E>& u)
+{
+	return Vector_unary_op<T, N, E, std::negate<T>>(u());
+}
+
+template<typename T, std::size_t N, typename E1, typename E2>
+inline constexpr Vector_binary_op<T, N, E1, E2, std::plus<T>> operator+(const Vector_expression<T, N, E1>& u, const Vector_expression<T, N, E2>& v)
+{
+	return Vector_binary_op<T, N, E1, E2, std::plus<T>>(u(), v());
+}
+
+template<typename T, std::size_t N, typename E1, typename E2>
+inline constexpr Vector_binary_op<T, N, E1, E2, std::minus<T>> operator-(const Vector_expression<T, N, E1>& u, const Vector_expression<T, N, E2>& v)
+{
+	return Vector_binary_op<T, N, E1, E2, std::minus<T>>(u(), v());
+}
+
+//! Element-wise product.
+template<typename T, std::size_t N, typename E1, typename E2>
+inline constexpr Vector_binary_op<T, N, E1, E2, std::multiplies<T>> operator*(const Vector_expression<T, N, E1>& u, const Vector_expression<T, N, E2>& v)
+{
+	return Vector_binary_op<T, N, E1, E2, std::multiplies<T>>(u(), v());
+}
+
+//! Element-wise quotient.
+template<typename T, std::size_t N, typename E1, typename E2>
+inline constexpr Vector_binary_op<T, N, E1, E2, std::divides<T>> operator/(const Vector_expression<T, N, E1>& u, const Vector_expression<T, N, E2>& v)
 {
-	_elements[i] = v;
-	setAt(i + 1, params...);
+	return Vector_binary_op<T, N, E1, E2, std::divides<T>>(u(), v());
 }
 
 template<typename T, std::size_t N, typename E>
-inline Vector<T, N> operator+(const E& s, const Vector<T,N>& v)
+inline constexpr Vector_scalar_op<T, N, E, std::plus<T>> operator+(const Vector_expression<T, N, E>& u, const typename vector_scalar<T>::type& s)
 {
-	return v + static_cast<T>(s);
+	return Vector_scalar_op<T, N, E, std::plus<T>>(u(), s);
 }
 
 template<typename T, std::size_t N, typename E>
-inline Vector<T, N> operator-(const T& s, const Vector<T, N>& v)
+inline constexpr Vector_scalar_op<T, N, E, std::minus<T>> operator-(const Vector_expression<T, N, E>& u, const typename vector_scalar<T>::type& s)
 {
-	return v - static_cast<T>(s);
+	return Vector_scalar_op<T, N, E, std::minus<T>>(u(), s);
 }
 
-template<typename T, std::size_t N,typename E>
-inline Vector<T, N> operator*(const T& s, const Vector<T, N>& v)
+template<typename T, std::size_t N, typename E>
+inline constexpr Vector_scalar_op<T, N, E, std::multiplies<T>> operator*(const Vector_expression<T, N, E>& u, const typename vector_scalar<T>::type& s)
+{
+	return Vector_scalar_op<T, N, E, std::multiplies<T>>(u(), s);
+}
+
+template<typename T, std::size_t N, typename E>
+inline constexpr Vector_scalar_op<T, N, E, std::divides<T>> operator/(const Vector_expression<T, N, E>& u, const typename vector_scalar<T>::type& s)
+{
+	return Vector_scalar_op<T, N, E, std::divides<T>>(u(), s);
+}
+
+template<typename T, std::size_t N, typename E>
+inline constexpr Scalar_vector_op<T, N, E, std::plus<T>> operator+(const typename vector_scalar<T>::type& s, const Vector_expression<T, N, E>& u)
+{
+	return Scalar_vector_op<T, N, E, std::plus<T>>(s, u());
+}
+
+template<typename T, std::size_t N, typename E>
+inline constexpr Scalar_vector_op<T, N, E, std::minus<T>> operator-(const typename vector_scalar<T>::type& s, const Vector_expression<T, N, E>& u)
+{
+	return Scalar_vector_op<T, N, E, std::minus<T>>(s, u());
+}
+
+template<typename T, std::size_t N, typename E>
+inline constexpr Scalar_vector_op<T, N, E, std::multiplies<T>> operator*(const typename vector_scalar<T>::type& s, const Vector_expression<T, N, E>& u)
 {
-	return v * static_cast<T>(s);
+	return Scalar_vector_op<T, N, E, std::multiplies<T>>(s, u());
 }
 
 template<typename T, std::size_t N, typename E>
-inline Vector<T, N> operator/(const T& s, const Vector<T, N>& v)
+inline constexpr Scalar_vector_op<T, N, E, std::divides<T>> operator/(const typename vector_scalar<T>::type& s, const Vector_expression<T, N, E>& u)
 {
-	return v / static_cast<T>(s);
+	return Scalar_vector_op<T, N, E, std::divides<T>>(s, u());
 }
 
 
-#endif
\ No newline at end of file
+#endif
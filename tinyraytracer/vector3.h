@@ -5,6 +5,7 @@
 
 #include "vector.h"
 #include "vector2.h"
+#include "vector3_aligned.h"
 #include <algorithm>
 #include <tuple>
 #include "utilities.h"
@@ -366,9 +367,9 @@ template<typename T>
 inline Vector<T, 3> Vector<T, 3>::refract(const Vector<T, 3>& n, T eta_over_eta1)
 {
     // ䷽ֽΪֱˮƽֱ㣬
-    auto cos_theta = fmin(dot(-n), 1.0);
+    T cos_theta = std::fmin(dot(-n), T(1));
     Vector<T, 3> r_out_perp = eta_over_eta1 * (*this + cos_theta * n);
-    Vector<T, 3> r_out_parallel = -std::sqrt(fabs(1.0 - r_out_perp.norm_squared())) * n;
+    Vector<T, 3> r_out_parallel = -std::sqrt(std::fabs(T(1) - r_out_perp.norm_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
@@ -380,27 +381,73 @@ inline Vector<T, 3> Vector<T, 3>::normalized() const
 }
 
 
+//! Negative sign operator.
+template <typename T>
+inline Vector<T, 3> operator-(const Vector<T, 3>& a)
+{
+    return Vector<T, 3>(-a.x, -a.y, -a.z);
+}
+
+template <typename T>
+inline Vector<T, 3> operator+(const T& a, const Vector<T, 3>& b)
+{
+    return Vector<T, 3>(a + b.x, a + b.y, a + b.z);
+}
+
+template <typename T>
+inline Vector<T, 3> operator-(const T& a, const Vector<T, 3>& b)
+{
+    return Vector<T, 3>(a - b.x, a - b.y, a - b.z);
+}
+
+template <typename T>
+inline Vector<T, 3> operator*(const T& a, const Vector<T, 3>& b)
+{
+    return Vector<T, 3>(a * b.x, a * b.y, a * b.z);
+}
+
+//! Type alias for three dimensional vector, and so for the points, directions and colors of the
+//! renderer. Building with TRT_ALIGNED_VECTOR3 defined swaps in the padded, aligned layout of
+//! vector3_aligned.h everywhere at once: Ray, Camera, Sphere and the rest only name this alias.
+#if defined(TRT_ALIGNED_VECTOR3)
+template <typename T>
+using Vector3 = Vector3_aligned<T>;
+#else
+template <typename T>
+using Vector3 = Vector<T, 3>;
+#endif
+
+//! Name of the layout Vector3 stands for in this build.
+inline const char* vector3_layout_name()
+{
+#if defined(TRT_ALIGNED_VECTOR3)
+    return "Vector3_aligned";
+#else
+    return "Vector<T, 3>";
+#endif
+}
+
 template<typename T>
-inline Vector<T, 3> random_in_unit_sphere()
+inline Vector3<T> random_in_unit_sphere()
 {
     while (true)
     {
-        auto p = Vector<T, 3>::random(-1, 1);
+        auto p = Vector3<T>::random(-1, 1);
         if (p.norm_squared() >= 1) continue;
         return p;
     }
 }
 
 template<typename T>
-inline Vector<T, 3> random_unit_vector()
+inline Vector3<T> random_unit_vector()
 {
     return random_in_unit_sphere<T>().normalized();
 }
 
 template<typename T>
-inline Vector<T, 3> random_in_hemisphere(const Vector<T,3>& normal)
+inline Vector3<T> random_in_hemisphere(const Vector3<T>& normal)
 {
-    Vector<T,3> in_unit_sphere (random_in_unit_sphere<T>());
+    Vector3<T> in_unit_sphere (random_in_unit_sphere<T>());
     if (in_unit_sphere.dot(normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -408,46 +455,16 @@ inline Vector<T, 3> random_in_hemisphere(const Vector<T,3>& normal)
 }
 
 template<typename T>
-inline Vector<T, 3> random_in_unit_disk()
+inline Vector3<T> random_in_unit_disk()
 {
     while (true)
     {
-        auto p = Vector<T, 3>(random_generate<T>(-1, 1), random_generate<T>(-1, 1), 0);
+        auto p = Vector3<T>(random_generate<T>(-1, 1), random_generate<T>(-1, 1), 0);
         if (p.norm_squared() >= 1) continue;
         return p;
     }
 }
 
-
-//! Type alias for two dimensional vector.
-template <typename T>
-using Vector3 = Vector<T, 3>;
-
-//! Negative sign operator.
-template <typename T>
-inline Vector3<T> operator-(const Vector3<T>& a)
-{
-    return Vector3<T>(-a.x, -a.y, -a.z);
-}
-
-template <typename T>
-inline Vector3<T> operator+(const T& a, const Vector3<T>& b)
-{
-    return Vector3<T>(a + b.x, a + b.y, a + b.z);
-}
-
-template <typename T>
-inline Vector3<T> operator-(const T& a, const Vector3<T>& b)
-{
-    return Vector3<T>(a - b.x, a - b.y, a - b.z);
-}
-
-template <typename T>
-inline Vector3<T> operator*(const T& a, const Vector3<T>& b)
-{
-    return Vector3<T>(a * b.x, a * b.y, a * b.z);
-}
-
 //! Float-type 3D vector.
 typedef Vector3<float> Vector3F;
 
@@ -0,0 +1,285 @@
+// this file holds Vector3_aligned, a 3D vector padded to four components and aligned to their size,
+// so that its arithmetic is one SSE or AVX instruction per operation instead of three scalar ones
+
+#pragma once
+#ifndef VECTOR3_ALIGNED_H_
+#define VECTOR3_ALIGNED_H_
+
+#include "vector.h"
+#include "utilities.h"
+
+#include <cassert>
+#include <cmath>
+#include <initializer_list>
+#include <limits>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//! Four lanes of T in one register where the compiler's target has one that wide: float in SSE, which
+//! every x86-64 build has, and double in AVX when the build enables it (/arch:AVX, -mavx or higher),
+//! else in two SSE2 registers. Anything else falls back to loops over four values.
+template<typename T, typename Enable = void>
+struct packed4
+{
+    struct type { T v[4]; };
+
+    static type load(const T* p) { return type{ { p[0], p[1], p[2], p[3] } }; }
+    static void store(T* p, const type& a) { for (int i = 0; i < 4; ++i) p[i] = a.v[i]; }
+    static type splat(T s) { return type{ { s, s, s, s } }; }
+
+    static type add(const type& a, const type& b) { type r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+    static type sub(const type& a, const type& b) { type r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+    static type mul(const type& a, const type& b) { type r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+    static type div(const type& a, const type& b) { type r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+};
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+template<>
+struct packed4<float>
+{
+    using type = __m128;
+
+    static type load(const float* p) { return _mm_load_ps(p); }
+    static void store(float* p, type a) { _mm_store_ps(p, a); }
+    static type splat(float s) { return _mm_set1_ps(s); }
+
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm_div_ps(a, b); }
+};
+#endif
+
+#if defined(__AVX__)
+template<>
+struct packed4<double>
+{
+    using type = __m256d;
+
+    static type load(const double* p) { return _mm256_load_pd(p); }
+    static void store(double* p, type a) { _mm256_store_pd(p, a); }
+    static type splat(double s) { return _mm256_set1_pd(s); }
+
+    static type add(type a, type b) { return _mm256_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm256_div_pd(a, b); }
+};
+#elif defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+template<>
+struct packed4<double>
+{
+    struct type { __m128d lo, hi; };
+
+    static type load(const double* p) { return type{ _mm_load_pd(p), _mm_load_pd(p + 2) }; }
+    static void store(double* p, type a) { _mm_store_pd(p, a.lo); _mm_store_pd(p + 2, a.hi); }
+    static type splat(double s) { return type{ _mm_set1_pd(s), _mm_set1_pd(s) }; }
+
+    static type add(type a, type b) { return type{ _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+    static type sub(type a, type b) { return type{ _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+    static type mul(type a, type b) { return type{ _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) }; }
+    static type div(type a, type b) { return type{ _mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi) }; }
+};
+#endif
+
+//! A drop-in replacement for Vector<T, 3> with the same members and interface, padded with a fourth
+//! component w and aligned to 4 * sizeof(T): 16 bytes for float, 32 for double. Element-wise arithmetic
+//! runs on all four components at once. w is padding that rides along: it is zero for vectors built
+//! from three components, and whatever the arithmetic leaves in it otherwise, since nothing that
+//! reduces over the components (dot, norms, comparisons) reads it.
+//!
+//! Arrays of these take a third (float: 16 bytes instead of 12) more memory than Vector<T, 3>; the
+//! gain is in code that keeps a few vectors in registers, like shading, not in code streaming many.
+template <typename T>
+class Vector3_aligned final
+{
+    using pack = packed4<T>;
+
+public:
+    static_assert(std::is_floating_point<T>::value,
+        "Vector only can be instantiated with floating point types");
+
+    //! X (or the first) component of the vector.
+    alignas(4 * sizeof(T)) T x;
+
+    //! Y (or the second) component of the vector.
+    T y;
+
+    //! Z (or the third) component of the vector.
+    T z;
+
+    //! Padding lane, never read as part of the vector.
+    T w;
+
+    //! Constructs default vector (0, 0, 0).
+    constexpr Vector3_aligned() : x(0), y(0), z(0), w(0) {}
+
+    //! Constructs vector with given parameters x_, y_ and z_.
+    constexpr Vector3_aligned(T x_, T y_, T z_) : x(x_), y(y_), z(z_), w(0) {}
+
+    //! Converts from and to the unpadded layout.
+    explicit Vector3_aligned(const Vector<T, 3>& v) : x(v.x), y(v.y), z(v.z), w(0) {}
+    Vector<T, 3> unpadded() const { return Vector<T, 3>(x, y, z); }
+
+    static constexpr Vector3_aligned zero() { return Vector3_aligned(); }
+
+    //! Constructs vector with initializer list.
+    template <typename U>
+    Vector3_aligned(const std::initializer_list<U>& lst) : w(0) { set(lst); }
+
+    //! Copy constructor.
+    constexpr Vector3_aligned(const Vector3_aligned& v) = default;
+
+    //! Set x, y and z components to s.
+    void set(T s) { x = y = z = s; }
+
+    //! Set x, y and z components with given parameters.
+    void set(T newX, T newY, T newZ) { x = newX; y = newY; z = newZ; }
+
+    //! Set x, y and z components with given initializer list.
+    template <typename U>
+    void set(const std::initializer_list<U>& lst)
+    {
+        assert(lst.size() == 3);
+        auto inputElem = lst.begin();
+        x = static_cast<T>(*inputElem);
+        y = static_cast<T>(*(++inputElem));
+        z = static_cast<T>(*(++inputElem));
+    }
+
+    //! Set x, y and z with other vector pt.
+    void set(const Vector3_aligned& pt) { *this = pt; }
+
+    //! Set x, y and z to zero.
+    void setZero() { *this = Vector3_aligned(); }
+
+    //! Returns reference to the \p i -th element of the vector.
+    T& operator[](size_t i) { assert(i < 3); return (&x)[i]; }
+
+    //! Returns const reference to the \p i -th element of the vector.
+    const T& operator[](size_t i) const { assert(i < 3); return (&x)[i]; }
+
+    //! Set x, y and z components with given initializer list.
+    template <typename U>
+    Vector3_aligned& operator=(const std::initializer_list<U>& lst) { set(lst); return *this; }
+
+    Vector3_aligned& operator=(const Vector3_aligned& v) = default;
+
+    Vector3_aligned operator+(const Vector3_aligned& other) const { return from(pack::add(packed(), other.packed())); }
+    Vector3_aligned operator-(const Vector3_aligned& other) const { return from(pack::sub(packed(), other.packed())); }
+    Vector3_aligned operator*(const Vector3_aligned& other) const { return from(pack::mul(packed(), other.packed())); }
+    Vector3_aligned operator/(const Vector3_aligned& other) const { return from(pack::div(packed(), other.packed())); }
+
+    Vector3_aligned& operator+=(const Vector3_aligned& other) { return *this = *this + other; }
+    Vector3_aligned& operator-=(const Vector3_aligned& other) { return *this = *this - other; }
+
+    Vector3_aligned operator+(const T& s) const { return from(pack::add(packed(), pack::splat(s))); }
+    Vector3_aligned operator-(const T& s) const { return from(pack::sub(packed(), pack::splat(s))); }
+    Vector3_aligned operator*(const T& s) const { return from(pack::mul(packed(), pack::splat(s))); }
+    Vector3_aligned operator/(const T& s) const { return from(pack::div(packed(), pack::splat(s))); }
+
+    Vector3_aligned& operator+=(const T& s) { return *this = *this + s; }
+    Vector3_aligned& operator-=(const T& s) { return *this = *this - s; }
+    Vector3_aligned& operator*=(const T& s) { return *this = *this * s; }
+    Vector3_aligned& operator/=(const T& s) { return *this = *this / s; }
+
+    //! Compute dot product: one packed multiply, then the same sum Vector<T, 3> forms.
+    T dot(const Vector3_aligned& v) const
+    {
+        const Vector3_aligned p = *this * v;
+        return p.x + p.y + p.z;
+    }
+
+    //! Compute the cross product.
+    Vector3_aligned cross(const Vector3_aligned& v) const
+    {
+        return Vector3_aligned(y * v.z - v.y * z, z * v.x - v.z * x, x * v.y - v.x * y);
+    }
+
+    //! Returns true if other is the same as this vector.
+    bool operator==(const Vector3_aligned& other) const { return x == other.x && y == other.y && z == other.z; }
+
+    //! Returns true if other is not the same as this vector.
+    bool operator!=(const Vector3_aligned& other) const { return !(*this == other); }
+
+    //! Compute norm and square of norm.
+    T norm() const { return std::sqrt(norm_squared()); }
+    T norm_squared() const { return dot(*this); }
+
+    //! Normalizes this vector.
+    void normalize() { *this /= norm(); }
+
+    //! Return normalized vector.
+    Vector3_aligned normalized() const { return *this / norm(); }
+
+    //! Returns true if other is similar to this vector.
+    bool is_similar(const Vector3_aligned& other,
+        T epsilon = std::numeric_limits<T>::epsilon()) const
+    {
+        return (std::fabs(x - other.x) < epsilon) &&
+            (std::fabs(y - other.y) < epsilon) &&
+            (std::fabs(z - other.z) < epsilon);
+    }
+
+    //! Mirror reflection, n is the unit normal.
+    Vector3_aligned reflect(const Vector3_aligned& n) { return *this - n * (2 * dot(n)); }
+
+    //! Refraction, n is the unit normal; split into the parts across and along n as Vector<T, 3> does.
+    Vector3_aligned refract(const Vector3_aligned& n, T eta_over_eta1)
+    {
+        T cos_theta = std::fmin(-dot(n), T(1));
+        Vector3_aligned r_out_perp = (*this + n * cos_theta) * eta_over_eta1;
+        Vector3_aligned r_out_parallel = n * -std::sqrt(std::fabs(T(1) - r_out_perp.norm_squared()));
+        return r_out_perp + r_out_parallel;
+    }
+
+    inline static Vector3_aligned random()
+    {
+        return Vector3_aligned(random_generate<T>(), random_generate<T>(), random_generate<T>());
+    }
+
+    inline static Vector3_aligned random(T min, T max)
+    {
+        return Vector3_aligned(random_generate(min, max), random_generate(min, max), random_generate(min, max));
+    }
+
+private:
+    typename pack::type packed() const { return pack::load(&x); }
+
+    static Vector3_aligned from(const typename pack::type& p)
+    {
+        Vector3_aligned r;
+        pack::store(&r.x, p);
+        return r;
+    }
+};
+
+//! Negative sign operator.
+template <typename T>
+inline Vector3_aligned<T> operator-(const Vector3_aligned<T>& a)
+{
+    return a * T(-1);
+}
+
+template <typename T>
+inline Vector3_aligned<T> operator+(const T& a, const Vector3_aligned<T>& b)
+{
+    return b + a;
+}
+
+template <typename T>
+inline Vector3_aligned<T> operator-(const T& a, const Vector3_aligned<T>& b)
+{
+    return -b + a;
+}
+
+template <typename T>
+inline Vector3_aligned<T> operator*(const T& a, const Vector3_aligned<T>& b)
+{
+    return b * a;
+}
+
+#endif
@@ -0,0 +1,174 @@
+// this file holds Vector3_lanes, several 3D vectors stored as one lane type per component, with the
+// operations of Vector<T, 3> done on all of them at once
+
+#pragma once
+#ifndef VECTOR3_LANES_H_
+#define VECTOR3_LANES_H_
+
+#include "simd_lanes.h"
+#include "vector3.h"
+
+#include <cstddef>
+#include <limits>
+
+//! P::lanes vectors as structure of arrays: x holds the x components of all of them, and so on. The
+//! interface follows Vector<T, 3>, with P in place of T wherever a vector gives one value per vector,
+//! so code written against that interface compiles for either. Comparisons give P::mask_type, and
+//! select(mask, a, b) picks whole vectors per lane where scalar code would branch.
+template<typename P>
+class Vector3_lanes
+{
+public:
+    using lanes_type = P;
+    using value_type = typename P::value_type;
+    using mask_type = typename P::mask_type;
+    static constexpr size_t lanes = P::lanes;
+
+    P x;
+    P y;
+    P z;
+
+    //! Constructs zero vectors.
+    Vector3_lanes() {}
+
+    Vector3_lanes(const P& x_, const P& y_, const P& z_) : x(x_), y(y_), z(z_) {}
+
+    //! v in every lane.
+    explicit Vector3_lanes(const Vector3<value_type>& v) : x(v.x), y(v.y), z(v.z) {}
+
+    static Vector3_lanes zero() { return Vector3_lanes(); }
+
+    //! Loads lanes vectors from separate component arrays.
+    static Vector3_lanes load(const value_type* xs, const value_type* ys, const value_type* zs)
+    {
+        return Vector3_lanes(P::load(xs), P::load(ys), P::load(zs));
+    }
+
+    //! Loads lanes vectors stored one after another, as a std::vector<Vector3<T>> holds them.
+    static Vector3_lanes gather(const Vector3<value_type>* vectors)
+    {
+        value_type xs[lanes], ys[lanes], zs[lanes];
+        for (size_t i = 0; i < lanes; ++i)
+        {
+            xs[i] = vectors[i].x;
+            ys[i] = vectors[i].y;
+            zs[i] = vectors[i].z;
+        }
+        return load(xs, ys, zs);
+    }
+
+    void store(value_type* xs, value_type* ys, value_type* zs) const
+    {
+        x.store(xs);
+        y.store(ys);
+        z.store(zs);
+    }
+
+    void scatter(Vector3<value_type>* vectors) const
+    {
+        value_type xs[lanes], ys[lanes], zs[lanes];
+        store(xs, ys, zs);
+        for (size_t i = 0; i < lanes; ++i) vectors[i] = Vector3<value_type>(xs[i], ys[i], zs[i]);
+    }
+
+    //! The vector in lane i.
+    Vector3<value_type> lane(size_t i) const { return Vector3<value_type>(x[i], y[i], z[i]); }
+
+    Vector3_lanes operator+(const Vector3_lanes& v) const { return Vector3_lanes(x + v.x, y + v.y, z + v.z); }
+    Vector3_lanes operator-(const Vector3_lanes& v) const { return Vector3_lanes(x - v.x, y - v.y, z - v.z); }
+    Vector3_lanes operator*(const Vector3_lanes& v) const { return Vector3_lanes(x * v.x, y * v.y, z * v.z); }
+    Vector3_lanes operator/(const Vector3_lanes& v) const { return Vector3_lanes(x / v.x, y / v.y, z / v.z); }
+
+    Vector3_lanes& operator+=(const Vector3_lanes& v) { x += v.x; y += v.y; z += v.z; return *this; }
+    Vector3_lanes& operator-=(const Vector3_lanes& v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+
+    Vector3_lanes operator+(const P& s) const { return Vector3_lanes(x + s, y + s, z + s); }
+    Vector3_lanes operator-(const P& s) const { return Vector3_lanes(x - s, y - s, z - s); }
+    Vector3_lanes operator*(const P& s) const { return Vector3_lanes(x * s, y * s, z * s); }
+    Vector3_lanes operator/(const P& s) const { return Vector3_lanes(x / s, y / s, z / s); }
+
+    Vector3_lanes& operator+=(const P& s) { x += s; y += s; z += s; return *this; }
+    Vector3_lanes& operator-=(const P& s) { x -= s; y -= s; z -= s; return *this; }
+    Vector3_lanes& operator*=(const P& s) { x *= s; y *= s; z *= s; return *this; }
+    Vector3_lanes& operator/=(const P& s) { x /= s; y /= s; z /= s; return *this; }
+
+    //! Compute dot product.
+    P dot(const Vector3_lanes& v) const { return x * v.x + y * v.y + z * v.z; }
+
+    //! Compute the cross product.
+    Vector3_lanes cross(const Vector3_lanes& v) const
+    {
+        return Vector3_lanes(y * v.z - v.y * z, z * v.x - v.z * x, x * v.y - v.x * y);
+    }
+
+    mask_type operator==(const Vector3_lanes& v) const { return (x == v.x) & (y == v.y) & (z == v.z); }
+    mask_type operator!=(const Vector3_lanes& v) const { return ~(*this == v); }
+
+    //! Compute norm and square of norm.
+    P norm() const { return sqrt(norm_squared()); }
+    P norm_squared() const { return x * x + y * y + z * z; }
+
+    //! Normalizes these vectors.
+    void normalize() { *this /= norm(); }
+
+    //! Return normalized vectors.
+    Vector3_lanes normalized() const { return *this / norm(); }
+
+    //! Lanes where other is within epsilon of this vector in every component.
+    mask_type is_similar(const Vector3_lanes& other, value_type epsilon = std::numeric_limits<value_type>::epsilon()) const
+    {
+        const P e(epsilon);
+        return (abs(x - other.x) < e) & (abs(y - other.y) < e) & (abs(z - other.z) < e);
+    }
+
+    //! Mirror reflection, n is the unit normal.
+    Vector3_lanes reflect(const Vector3_lanes& n) const { return *this - n * (P(2) * dot(n)); }
+
+    //! Refraction, n is the unit normal; split into the parts across and along n as Vector<T, 3> does.
+    Vector3_lanes refract(const Vector3_lanes& n, const P& eta_over_eta1) const
+    {
+        const P cos_theta = min(-dot(n), P(1));
+        const Vector3_lanes r_out_perp = (*this + n * cos_theta) * eta_over_eta1;
+        const Vector3_lanes r_out_parallel = n * -sqrt(abs(P(1) - r_out_perp.norm_squared()));
+        return r_out_perp + r_out_parallel;
+    }
+};
+
+//! Negative sign operator.
+template<typename P>
+inline Vector3_lanes<P> operator-(const Vector3_lanes<P>& a)
+{
+    return Vector3_lanes<P>(-a.x, -a.y, -a.z);
+}
+
+template<typename P>
+inline Vector3_lanes<P> operator*(const P& a, const Vector3_lanes<P>& b)
+{
+    return b * a;
+}
+
+//! a where m is set, b elsewhere, lane by lane.
+template<typename P>
+inline Vector3_lanes<P> select(const typename P::mask_type& m, const Vector3_lanes<P>& a, const Vector3_lanes<P>& b)
+{
+    return Vector3_lanes<P>(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+}
+
+//! The same choice for a single vector, so code written for both compiles for Vector<T, 3> too.
+template<typename T>
+inline Vector3<T> select(bool m, const Vector3<T>& a, const Vector3<T>& b)
+{
+    return m ? a : b;
+}
+
+#if defined(TRT_X86)
+// Float and double vectors per instruction set. Each is used only at or above its level, see simd_lanes.h.
+using Vector3x4F = Vector3_lanes<f32x4>;        // SSE4.2
+using Vector3x2D = Vector3_lanes<f64x2>;        // SSE4.2
+using Vector3x8F = Vector3_lanes<f32x8>;        // AVX2
+using Vector3x4D = Vector3_lanes<f64x4>;        // AVX2
+using Vector3x16F = Vector3_lanes<f32x16>;      // AVX-512
+using Vector3x8D = Vector3_lanes<f64x8>;        // AVX-512
+#endif
+
+#endif
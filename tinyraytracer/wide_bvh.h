@@ -0,0 +1,365 @@
+// this file holds the 4-wide BVH with quantized child boxes, one node per cache line,
+// collapsed from the binary Bvh and traversed four boxes at a time
+
+#pragma once
+#ifndef WIDE_BVH_H_
+#define WIDE_BVH_H_
+
+#include "cpu_features.h"
+#include "aabb.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <tbb/cache_aligned_allocator.h>
+
+#if defined(TRT_X86)
+#include <immintrin.h>
+#endif
+
+//! Four children in 64 bytes. Child i's box along axis a is origin[a] + [lo, hi] * scale[a], where the
+//! origin is the node's own minimum rounded down to float and the scale is a power of two, so the eight
+//! bit grid covers the node and rounds every child box outwards.
+struct alignas(64) wide_bvh_node
+{
+    float origin[3];
+    float scale[3];
+    std::uint8_t lo_x[4], lo_y[4], lo_z[4];
+    std::uint8_t hi_x[4], hi_y[4], hi_z[4];
+    std::uint32_t child[4];     // see Wide_bvh for the encoding
+};
+static_assert(sizeof(wide_bvh_node) == 64, "a wide BVH node must fill exactly one cache line");
+
+//! BVH4 collapsed from a binary Bvh. Shares its primitive order, so leaves are ranges of the same
+//! Primitives; a node's children are either nodes or leaves of up to 16 primitives.
+template<typename T, typename Primitives = Sphere_set<T>>
+class Wide_bvh : public Accelerator<T>
+{
+public:
+    static constexpr int width = 4;
+
+    // A child is empty_child, the index of a node, or leaf_flag | (count - 1) << 27 | first primitive.
+    static constexpr std::uint32_t empty_child = 0xFFFFFFFFu;
+    static constexpr std::uint32_t leaf_flag = 0x80000000u;
+    static constexpr std::uint32_t offset_mask = 0x07FFFFFFu;
+
+    explicit Wide_bvh(const Bvh<T, Primitives>& binary)
+        : prims(binary.primitives())
+    {
+        const auto& source = binary.node_array();
+        if (source.empty()) return;
+        if (prims.size() > offset_mask - 16)
+            throw std::length_error("Wide_bvh holds at most 2^27 primitives");
+
+        root_bounds = source[0].bounds;
+        nodes.emplace_back();
+        collapse(source, 0, 0);
+    }
+
+    const Primitives& primitives() const { return prims; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    virtual const char* name() const override { return "BVH4 (8-bit)"; }
+    virtual size_t memory_bytes() const override { return nodes.size() * sizeof(wide_bvh_node); }
+
+    virtual bool intersect(const Ray<T>& r, T t_min, T t_max, hit_candidate<T>& candidate) const override
+    {
+        if (nodes.empty()) return false;
+
+        const ray_lanes ray(r);
+        stack_entry stack[stack_size];
+        int top = 0;
+        stack[top++] = stack_entry{ 0, static_cast<float>(t_min) };
+
+        bool hit_anything = false;
+        while (top > 0)
+        {
+            const stack_entry entry = stack[--top];
+            if (entry.t_near > t_max) continue;
+
+            if (entry.ref & leaf_flag)
+            {
+                if (prims.intersect_range(leaf_offset(entry.ref), leaf_count(entry.ref), r, t_min, t_max, candidate))
+                {
+                    hit_anything = true;
+                    t_max = candidate.t;
+                }
+                continue;
+            }
+
+            const wide_bvh_node& node = nodes[entry.ref];
+            float t_near[width];
+            int mask = intersect_children(node, ray, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+
+            // Push the hit children farthest first, so the nearest one is visited next.
+            stack_entry hits[width];
+            int hit_count = 0;
+            for (; mask; mask &= mask - 1)
+            {
+                const int i = lowest_bit(mask);
+                stack_entry e{ node.child[i], t_near[i] };
+                int j = hit_count++;
+                for (; j > 0 && hits[j - 1].t_near < e.t_near; --j) hits[j] = hits[j - 1];
+                hits[j] = e;
+            }
+            for (int i = 0; i < hit_count; ++i) stack[top++] = hits[i];
+        }
+        return hit_anything;
+    }
+
+    virtual bool bounding_box(Aabb<T>& box) const override
+    {
+        if (nodes.empty()) return false;
+        box = root_bounds;
+        return true;
+    }
+
+    virtual void memory_blocks(const memory_block_fn& f) const override
+    {
+        f(nodes.data(), nodes.size() * sizeof(wide_bvh_node));
+        prims.memory_blocks(f);
+    }
+
+    virtual bool occluded(const Ray<T>& r, T t_min, T t_max) const override
+    {
+        if (nodes.empty()) return false;
+
+        const ray_lanes ray(r);
+        std::uint32_t stack[stack_size];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0)
+        {
+            const std::uint32_t ref = stack[--top];
+            if (ref & leaf_flag)
+            {
+                if (prims.occluded_range(leaf_offset(ref), leaf_count(ref), r, t_min, t_max)) return true;
+                continue;
+            }
+
+            const wide_bvh_node& node = nodes[ref];
+            float t_near[width];
+            for (int mask = intersect_children(node, ray, static_cast<float>(t_min), static_cast<float>(t_max), t_near); mask; mask &= mask - 1)
+                stack[top++] = node.child[lowest_bit(mask)];
+        }
+        return false;
+    }
+
+private:
+    // Every level of the binary tree adds at most width - 1 entries; collapsing never deepens it.
+    static constexpr int stack_size = bvh_max_depth * (width - 1) + 1;
+
+    struct stack_entry
+    {
+        std::uint32_t ref;
+        float t_near;
+    };
+
+    //! The ray in single precision, as the node boxes are tested.
+    struct ray_lanes
+    {
+        explicit ray_lanes(const Ray<T>& r)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                origin[a] = static_cast<float>(r.orig[a]);
+                inv_direction[a] = 1.0f / static_cast<float>(r.dir[a]);
+            }
+        }
+
+        float origin[3];
+        float inv_direction[3];
+    };
+
+    // Widens the far distance a little, so that float rounding never culls a box the ray touches.
+    static constexpr float far_slack = 1.0f + 4.0f * 1.2e-7f;
+
+    static std::uint32_t leaf_offset(std::uint32_t ref) { return ref & offset_mask; }
+    static std::uint32_t leaf_count(std::uint32_t ref) { return ((ref >> 27) & 15u) + 1; }
+
+    static int lowest_bit(int mask)
+    {
+        int i = 0;
+        while (!(mask & (1 << i))) ++i;
+        return i;
+    }
+
+    //! Bit i of the result is set if the ray enters child i's box within [t_min, t_max];
+    //! t_near[i] is where it does.
+    static int intersect_children(const wide_bvh_node& node, const ray_lanes& ray, float t_min, float t_max, float t_near[width])
+    {
+        int valid = 0;
+        for (int i = 0; i < width; ++i)
+            if (node.child[i] != empty_child) valid |= 1 << i;
+
+#if defined(TRT_X86)
+        const __m128i zero = _mm_setzero_si128();
+        auto widen = [&](const std::uint8_t* q)
+        {
+            std::int32_t packed;
+            std::memcpy(&packed, q, sizeof(packed));
+            const __m128i bytes = _mm_cvtsi32_si128(packed);
+            return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+        };
+
+        __m128 near_t = _mm_set1_ps(t_min);
+        __m128 far_t = _mm_set1_ps(t_max);
+        const std::uint8_t* lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+        const std::uint8_t* hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+        for (int a = 0; a < 3; ++a)
+        {
+            const __m128 origin = _mm_set1_ps(node.origin[a]);
+            const __m128 scale = _mm_set1_ps(node.scale[a]);
+            const __m128 ray_origin = _mm_set1_ps(ray.origin[a]);
+            const __m128 inv = _mm_set1_ps(ray.inv_direction[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(widen(lo[a]), scale)), ray_origin), inv);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(widen(hi[a]), scale)), ray_origin), inv);
+            near_t = _mm_max_ps(near_t, _mm_min_ps(t0, t1));
+            far_t = _mm_min_ps(far_t, _mm_max_ps(t0, t1));
+        }
+        far_t = _mm_mul_ps(far_t, _mm_set1_ps(far_slack));
+        _mm_storeu_ps(t_near, near_t);
+        return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t)) & valid;
+#else
+        const std::uint8_t* lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+        const std::uint8_t* hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+        int mask = 0;
+        for (int i = 0; i < width; ++i)
+        {
+            float near_t = t_min, far_t = t_max;
+            for (int a = 0; a < 3; ++a)
+            {
+                const float t0 = (node.origin[a] + lo[a][i] * node.scale[a] - ray.origin[a]) * ray.inv_direction[a];
+                const float t1 = (node.origin[a] + hi[a][i] * node.scale[a] - ray.origin[a]) * ray.inv_direction[a];
+                near_t = std::fmax(near_t, std::fmin(t0, t1));
+                far_t = std::fmin(far_t, std::fmax(t0, t1));
+            }
+            t_near[i] = near_t;
+            if (near_t <= far_t * far_slack) mask |= 1 << i;
+        }
+        return mask & valid;
+#endif
+    }
+
+    //! Fills node wide_index with the children of binary node binary_index, opening the interior child
+    //! with the largest surface area until there are four, then recurses into the interior ones.
+    void collapse(const std::vector<bvh_node<T>>& source, std::uint32_t binary_index, std::uint32_t wide_index)
+    {
+        std::uint32_t picked[width];
+        int count = 0;
+        const bvh_node<T>& root = source[binary_index];
+        if (root.count > 0)
+        {
+            picked[count++] = binary_index;
+        }
+        else
+        {
+            picked[count++] = binary_index + 1;
+            picked[count++] = root.offset;
+        }
+
+        while (count < width)
+        {
+            int largest = -1;
+            T largest_area = -1;
+            for (int i = 0; i < count; ++i)
+            {
+                const bvh_node<T>& candidate = source[picked[i]];
+                if (candidate.count == 0 && candidate.bounds.surface_area() > largest_area)
+                {
+                    largest = i;
+                    largest_area = candidate.bounds.surface_area();
+                }
+            }
+            if (largest < 0) break;
+
+            const std::uint32_t opened = picked[largest];
+            picked[largest] = opened + 1;
+            picked[count++] = source[opened].offset;
+        }
+
+        // Push each face out by a few float ulps of its coordinate, which covers the rounding of
+        // origin + q * scale and of the ray's origin when the boxes are decoded in float.
+        Aabb<T> padded[width];
+        Aabb<T> bounds;
+        for (int i = 0; i < count; ++i)
+        {
+            const Aabb<T>& child = source[picked[i]].bounds;
+            for (int a = 0; a < 3; ++a)
+            {
+                padded[i].minimum[a] = child.minimum[a] - std::fabs(child.minimum[a]) * T(4.8e-7);
+                padded[i].maximum[a] = child.maximum[a] + std::fabs(child.maximum[a]) * T(4.8e-7);
+            }
+            bounds.expand(padded[i]);
+        }
+
+        wide_bvh_node node;
+        std::uint8_t* lo[3] = { node.lo_x, node.lo_y, node.lo_z };
+        std::uint8_t* hi[3] = { node.hi_x, node.hi_y, node.hi_z };
+        for (int a = 0; a < 3; ++a)
+        {
+            float origin = static_cast<float>(bounds.minimum[a]);
+            if (origin > bounds.minimum[a]) origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+            int exponent;
+            std::frexp((bounds.maximum[a] - origin) / 255, &exponent);
+            const float scale = std::ldexp(1.0f, std::min(std::max(exponent, -126), 127));
+            node.origin[a] = origin;
+            node.scale[a] = scale;
+
+            for (int i = 0; i < width; ++i)
+            {
+                if (i >= count)
+                {
+                    lo[a][i] = hi[a][i] = 0;
+                    continue;
+                }
+                const T q_lo = std::floor((padded[i].minimum[a] - origin) / scale);
+                const T q_hi = std::ceil((padded[i].maximum[a] - origin) / scale);
+                lo[a][i] = static_cast<std::uint8_t>(std::min(std::max(q_lo, T(0)), T(255)));
+                hi[a][i] = static_cast<std::uint8_t>(std::min(std::max(q_hi, T(0)), T(255)));
+            }
+        }
+
+        std::uint32_t interior[width];
+        int interior_count = 0;
+        for (int i = 0; i < width; ++i)
+        {
+            if (i >= count)
+            {
+                node.child[i] = empty_child;
+                continue;
+            }
+            const bvh_node<T>& child = source[picked[i]];
+            if (child.count > 0)
+            {
+                node.child[i] = leaf_flag | static_cast<std::uint32_t>(child.count - 1) << 27 | child.offset;
+            }
+            else
+            {
+                node.child[i] = static_cast<std::uint32_t>(nodes.size());
+                interior[interior_count++] = picked[i];
+                nodes.emplace_back();
+            }
+        }
+        nodes[wide_index] = node;
+
+        for (int i = 0, next = 0; i < width; ++i)
+            if (node.child[i] != empty_child && !(node.child[i] & leaf_flag))
+                collapse(source, interior[next++], node.child[i]);
+    }
+
+private:
+    Primitives prims;
+    Aabb<T> root_bounds;
+    std::vector<wide_bvh_node, tbb::cache_aligned_allocator<wide_bvh_node>> nodes;
+};
+
+#endif